@@ -0,0 +1,1956 @@
+// flv_parser.h
+// ------------
+// FLV demuxer and AVCC to Annex B conversion, shared by the Linux and Windows implementations (main_linux.cpp and main_windows.cpp).
+// There is no I/O here: the functions parse bytes that are already in memory, and CFlvParser is fed with whatever bytes a read returned.
+// Each platform implements the I/O layer (CSubprocess) - PIPEs with read/write and epoll on Linux, and overlapped named pipes
+// with I/O completion port on Windows - and passes the bytes to the shared parser.
+// Detailed documentation is included in main_linux.cpp file.
+
+#ifndef FLV_PARSER_H
+#define FLV_PARSER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX        // std::min and std::max (instead of the min and max macros of windows.h)
+#endif
+#include <windows.h>
+#include <malloc.h>     //Used for _aligned_malloc
+#else
+#include <unistd.h>     //Used for sysconf
+#endif
+
+
+// Size of FLV file header, FLV packet (tag) header, and AVC packet header.
+#define FLV_FILE_HEADER_SIZE    (5 + 4)
+#define FLV_PACKET_HEADER_SIZE  (4 + 1 + 3 + 3 + 1 + 3)
+#define AVC_PACKET_HEADER_SIZE  5
+
+// Enhanced FLV (E-RTMP): when the upper bit of the first byte of the video tag is set, the tag starts with ExVideoTagHeader -
+// [1 bit IsExHeader | 3 bits VideoFrameType | 4 bits VideoPacketType] [4 bytes FourCC] ([3 bytes composition time] of CodedFrames only).
+// The packet types 0, 1 and 2 have the same values as the AVC packet types of the legacy header.
+#define FLV_EX_HEADER_FLAG              0x80
+#define FLV_PACKET_TYPE_SEQUENCE_START  0
+#define FLV_PACKET_TYPE_CODED_FRAMES    1       // The NAL units follow 3 bytes composition time.
+#define FLV_PACKET_TYPE_SEQUENCE_END    2
+#define FLV_PACKET_TYPE_CODED_FRAMES_X  3       // Composition time is 0 (omitted).
+#define FLV_MAX_VIDEO_HEADER_SIZE       8       // ExVideoTagHeader of CodedFrames.
+
+
+// Parse the 15 bytes header of FLV packet (already in memory) and return FLV payload size
+// After the header, the file is split into packets called "FLV tags",
+// which have 15 - byte packet headers.
+// The first four bytes denote the size of the previous packet / tag
+// (including the header without the first field), and aid in seeking backward
+static inline int ParseFlvPacketHeader(const unsigned char *buf)
+{
+    //size_of_previous_packet = f.read(4)  # For first packet set to NULL(uint32 big - endian)
+    //packet_type = f.read(1)  # For first packet set to AMF Metadata
+    //flv_payload_size = f.read(3)  # For first packet set to AMF Metadata(uint24 big - endian)
+    //timestamp_lower = f.read(3)  # For first packet set to NULL(uint24 big - endian)
+    //timestamp_upper = f.read(1)  # Extension to create a uint32_be value(0)
+    //stream_id = f.read(3)  # For first stream of same type set to NULL(uint24 big - endian)
+    //if len(flv_payload_size) < 3: return 0  # End of file.
+
+    int flv_payload_size = ((int)buf[5] << 16) + ((int)buf[6] << 8) + (int)buf[7];
+
+    // Convert uint24 big - endian to integer value
+    return flv_payload_size;
+}
+
+
+// Parse the timestamp of FLV packet header (already in memory) - milliseconds.
+// The timestamp is uint24 big-endian (timestamp_lower), extended by timestamp_upper byte as the most significant byte.
+// For video, the timestamp is the decoding timestamp (DTS) - the presentation timestamp is DTS + composition time.
+static inline int ParseFlvTimestamp(const unsigned char *buf)
+{
+    return (int)(((uint32_t)buf[11] << 24) + ((uint32_t)buf[8] << 16) + ((uint32_t)buf[9] << 8) + (uint32_t)buf[10]);
+}
+
+
+// Parse the FLV file header (9 bytes, already in memory) - verify signature, version and flags.
+// Return false if the header is not a valid header of FLV stream with video only.
+static inline bool ParseFlvFileHeader(const unsigned char *hdr)
+{
+    // https ://en.wikipedia.org/wiki/Flash_Video
+    // FLV signature, version, flag byte and 4 bytes "used to skip a newer expanded header".
+    if (((char)hdr[0] != 'F') || ((char)hdr[1] != 'L') || ((char)hdr[2] != 'V'))
+    {
+        // FLV file must start with "FLV" letters.
+        fprintf(stderr, "Bad signature: FLV stream doesn't start with FLV letters\n");
+        return false;
+    }
+
+    unsigned char version_byte = hdr[3];
+
+    if (version_byte != 1)
+    {
+        // Version byte must be 1
+        fprintf(stderr, "Bad version: FLV version is not 1\n");
+        return false;
+    }
+
+    unsigned char flags_byte = hdr[4];
+
+    if (flags_byte != 1)
+    {
+        fprintf(stderr, "Bad flag byte: flags_byte = %d ... Bitmask: 0x04 is audio, 0x01 is video (so 0x05 is audio+video), but we expect video only\n", (int)flags_byte);
+        return false;
+    }
+
+    return true;
+}
+
+
+// Annex B start codes (0x00000001, and 0x000001 is the last 3 bytes of it).
+static const unsigned char g_start_code[4] = { 0, 0, 0, 1 };
+
+
+// Start codes of the Annex B stream of each encoder - FFmpeg writes the stream of the encoder as is ("-f h264"), and the encoders differ in the number of leading zeros.
+// The converted stream uses the convention of the encoder, so it is the same (bit exact) as the Annex B stream of the same encoder.
+enum EStartCodeConvention
+{
+    START_CODES_LIBX264,    // 3 bytes before IDR slices and SEI, 4 bytes before the other NAL units.
+    START_CODES_QSV,        // 3 bytes before the coded slices (IDR and non-IDR), 4 bytes before the other NAL units (Intel Quick Sync Video).
+    START_CODES_ALL_LONG,   // 4 bytes before all the NAL units (NVENC, and VAAPI - each packed header of FFmpeg starts with 4 bytes start code).
+    START_CODES_X265        // HEVC: 4 bytes before the parameter sets and the first NAL unit of the access unit, 3 bytes before the others (libx265).
+};
+
+
+// Maximum total size of SPS and PPS NAL units in the AVC sequence header (typical size is few tens of bytes).
+#define MAX_PARAM_SETS_SIZE 4096
+#define MAX_PARAM_SETS      32
+
+// AVC decoder configuration - parsed from the AVCDecoderConfigurationRecord in the first FLV payload (AVC sequence header).
+// ISO/IEC 14496-15, section 5.2.4.1 (the same record as the "extradata" of FFmpeg).
+// The SPS and PPS NAL units are stored in Annex B format (with 4 bytes start codes), ready to be injected before IDR frames.
+// The same structure keeps the HEVC decoder configuration (the VPS, SPS and PPS of the HEVCDecoderConfigurationRecord - see ParseHevcDecoderConfig).
+struct CAvcDecoderConfig
+{
+    int nal_length_size = 4;                                // Size of the AVCC NAL unit length field (lengthSizeMinusOne + 1) - 1, 2 or 4 bytes.
+    EStartCodeConvention start_codes = START_CODES_LIBX264; // Start codes of the encoder (not in the record - set by the application).
+    unsigned char annexb_params[MAX_PARAM_SETS_SIZE];       // [start code][SPS]...[start code][PPS]...
+    int annexb_params_len = 0;
+    int param_offsets[MAX_PARAM_SETS];                      // Offset of each NAL unit in annexb_params (after the start code).
+    int param_lens[MAX_PARAM_SETS];
+    int n_params = 0;                                       // Number of SPS and PPS NAL units.
+};
+
+
+// Parse AVCDecoderConfigurationRecord (<record_size> bytes already in memory, after the 5 bytes AVC packet header).
+// The record structure:
+// [configurationVersion][AVCProfileIndication][profile_compatibility][AVCLevelIndication][6 bits reserved | lengthSizeMinusOne]
+// [3 bits reserved | numOfSequenceParameterSets] ([16 bits length][SPS]...) [numOfPictureParameterSets] ([16 bits length][PPS]...)
+// There may be more bytes following the PPS (High profiles chroma format and bit depth information - ignored).
+// Return false if the record is not valid.
+static inline bool ParseAvcDecoderConfig(const unsigned char *record, const int record_size, CAvcDecoderConfig *cfg)
+{
+    cfg->annexb_params_len = 0;
+    cfg->n_params = 0;
+
+    if ((record_size < 7) || (record[0] != 1))
+    {
+        fprintf(stderr, "Error: bad AVCDecoderConfigurationRecord (size = %d, version = %d)\n", record_size, (record_size > 0) ? (int)record[0] : (-1));
+        return false;
+    }
+
+    cfg->nal_length_size = (record[4] & 0x3) + 1;
+
+    if (cfg->nal_length_size == 3)
+    {
+        fprintf(stderr, "Error: AVCDecoderConfigurationRecord lengthSizeMinusOne = 2 is not allowed\n");
+        return false;
+    }
+
+    int idx = 5;
+
+    // Two lists: SPS list (the count is the 5 lower bits), and PPS list (the count is a whole byte).
+    for (int list = 0; list < 2; list++)
+    {
+        if (idx >= record_size)
+        {
+            fprintf(stderr, "Error: truncated AVCDecoderConfigurationRecord\n");
+            return false;
+        }
+
+        int n = (list == 0) ? (record[idx] & 0x1F) : (int)record[idx];
+        idx++;
+
+        for (int k = 0; k < n; k++)
+        {
+            if (idx + 2 > record_size)
+            {
+                fprintf(stderr, "Error: truncated AVCDecoderConfigurationRecord\n");
+                return false;
+            }
+
+            int len = ((int)record[idx] << 8) + (int)record[idx + 1];
+            idx += 2;
+
+            if ((len == 0) || (idx + len > record_size) || (cfg->n_params >= MAX_PARAM_SETS) ||
+                (cfg->annexb_params_len + 4 + len > MAX_PARAM_SETS_SIZE))
+            {
+                fprintf(stderr, "Error: bad parameter set in AVCDecoderConfigurationRecord (len = %d)\n", len);
+                return false;
+            }
+
+            // SPS and PPS NAL units are preceded by 4 bytes start code (like libx264 Annex B stream).
+            memcpy(&cfg->annexb_params[cfg->annexb_params_len], g_start_code, 4);
+            memcpy(&cfg->annexb_params[cfg->annexb_params_len + 4], &record[idx], len);
+            cfg->param_offsets[cfg->n_params] = cfg->annexb_params_len + 4;
+            cfg->param_lens[cfg->n_params] = len;
+            cfg->annexb_params_len += 4 + len;
+            cfg->n_params++;
+            idx += len;
+        }
+    }
+
+    return true;
+}
+
+
+// Parse HEVCDecoderConfigurationRecord (<record_size> bytes already in memory, after the Enhanced FLV video header) - ISO/IEC 14496-15, section 8.3.3.1.
+// The record structure: 22 bytes of profile, tier, level and format information, where the 2 lower bits of the last byte are lengthSizeMinusOne,
+// then [numOfArrays] ([1 bit completeness | 1 bit reserved | 6 bits NAL_unit_type] [16 bits numNalus] ([16 bits length][NAL unit])...)...
+// The VPS, SPS and PPS are kept (in that order - the order of the arrays), and the other arrays (SEI) are ignored.
+// Return false if the record is not valid.
+static inline bool ParseHevcDecoderConfig(const unsigned char *record, const int record_size, CAvcDecoderConfig *cfg)
+{
+    cfg->annexb_params_len = 0;
+    cfg->n_params = 0;
+
+    if ((record_size < 23) || (record[0] != 1))
+    {
+        fprintf(stderr, "Error: bad HEVCDecoderConfigurationRecord (size = %d, version = %d)\n", record_size, (record_size > 0) ? (int)record[0] : (-1));
+        return false;
+    }
+
+    cfg->nal_length_size = (record[21] & 0x3) + 1;
+
+    if (cfg->nal_length_size == 3)
+    {
+        fprintf(stderr, "Error: HEVCDecoderConfigurationRecord lengthSizeMinusOne = 2 is not allowed\n");
+        return false;
+    }
+
+    const int n_arrays = (int)record[22];
+    int idx = 23;
+
+    for (int a = 0; a < n_arrays; a++)
+    {
+        if (idx + 3 > record_size)
+        {
+            fprintf(stderr, "Error: truncated HEVCDecoderConfigurationRecord\n");
+            return false;
+        }
+
+        const int nal_type = record[idx] & 0x3F;
+        const int n = ((int)record[idx + 1] << 8) + (int)record[idx + 2];
+        const bool is_param_set = (nal_type >= 32) && (nal_type <= 34);    // VPS, SPS or PPS.
+        idx += 3;
+
+        for (int k = 0; k < n; k++)
+        {
+            if (idx + 2 > record_size)
+            {
+                fprintf(stderr, "Error: truncated HEVCDecoderConfigurationRecord\n");
+                return false;
+            }
+
+            int len = ((int)record[idx] << 8) + (int)record[idx + 1];
+            idx += 2;
+
+            if ((len == 0) || (idx + len > record_size))
+            {
+                fprintf(stderr, "Error: bad NAL unit in HEVCDecoderConfigurationRecord (len = %d)\n", len);
+                return false;
+            }
+
+            if (is_param_set)
+            {
+                if ((cfg->n_params >= MAX_PARAM_SETS) || (cfg->annexb_params_len + 4 + len > MAX_PARAM_SETS_SIZE))
+                {
+                    fprintf(stderr, "Error: too many parameter sets in HEVCDecoderConfigurationRecord\n");
+                    return false;
+                }
+
+                // Parameter sets are preceded by 4 bytes start code (like libx265 Annex B stream).
+                memcpy(&cfg->annexb_params[cfg->annexb_params_len], g_start_code, 4);
+                memcpy(&cfg->annexb_params[cfg->annexb_params_len + 4], &record[idx], len);
+                cfg->param_offsets[cfg->n_params] = cfg->annexb_params_len + 4;
+                cfg->param_lens[cfg->n_params] = len;
+                cfg->annexb_params_len += 4 + len;
+                cfg->n_params++;
+            }
+
+            idx += len;
+        }
+    }
+
+    return true;
+}
+
+
+// Parse the 5 bytes of FLV packet header (already in memory), and return codec_id
+// https://www.adobe.com/content/dam/acom/en/devnet/flv/video_file_format_spec_v10.pdf
+// Return -1 in case of an error.
+// Return Codec ID if success.
+static inline int ParsePacket5BytesHeader(const unsigned char *buf)
+{
+    // "frame_type and _codec_id" byte and avc_packet_type and composition_time.
+    // According to video_file_format_spec_v10.pdf, if codec_id = 7, next comes AVCVIDEOPACKET
+    int codec_id = (int)buf[0] & 0xF;   // The frame_type is parsed by ParseIsKeyframe.
+
+    if (codec_id != 7)
+    {
+        fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", (int)codec_id);
+        return -1;
+    }
+    
+    unsigned char avc_packet_type = buf[1]; //# 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
+
+    if (avc_packet_type != 1)
+    {
+        fprintf(stderr, "Bad packet type: avc_packet_type = %d instead of 1\n", (int)avc_packet_type);
+        return -1;
+    }
+
+    return codec_id;
+}
+
+
+// Return true if the 5 bytes AVC packet header (already in memory) marks a keyframe - an IDR frame for AVC (the start of a GOP).
+static inline bool ParseIsKeyframe(const unsigned char *buf)
+{
+    int frame_type = (int)buf[0] >> 4;  // 1 - keyframe, 2 - inter frame
+
+    return frame_type == 1;
+}
+
+
+// Parse the composition time of the 5 bytes AVC packet header (already in memory) - PTS minus DTS in milliseconds.
+// The composition time is signed int24 big-endian (positive when B-frames reorder the frames).
+static inline int ParseCompositionTime(const unsigned char *buf)
+{
+    int composition_time = ((int)buf[2] << 16) + ((int)buf[3] << 8) + (int)buf[4];
+
+    return (composition_time >= 0x800000) ? (composition_time - 0x1000000) : composition_time;
+}
+
+
+// Maximum number of NAL units in one FLV payload.
+// Typical "access unit" is [SPS][PPS][SEI][Coded slice] (or a single coded slice), so 128 is far more than needed.
+#define MAX_NALS_PER_ACCESS_UNIT 128
+
+// View of one NAL unit in Annex B format: [start code][NAL unit].
+// No data is copied - start_code points g_start_code, and nal points the NAL unit inside the FLV payload buffer.
+struct CNalView
+{
+    const unsigned char *start_code;
+    int start_code_len;     // 3 or 4
+    const unsigned char *nal;
+    int nal_len;
+};
+
+// List of NAL units of one access unit (the list applies one FLV payload).
+struct CNalList
+{
+    CNalView nals[MAX_NALS_PER_ACCESS_UNIT];
+    int n_nals = 0;
+    int annexb_len = 0;     // Total size of the access unit in Annex B format (start codes and NAL units).
+};
+
+
+// Return the length of the Annex B start code (3 or 4) that precedes a NAL unit with NAL header byte <nal_header>.
+// The number of leading zeros(2 or 3) has minor differences between encoders(the implementation matches the encoder by <start_codes>).
+static inline int AnnexBStartCodeLen(const unsigned char nal_header, const EStartCodeConvention start_codes = START_CODES_LIBX264)
+{
+    if (start_codes == START_CODES_ALL_LONG)
+    {
+        return 4;
+    }
+
+    if (start_codes == START_CODES_QSV)
+    {
+        // Coded slices (IDR and non-IDR) begin with only 2 zeros when encoding with Quick Sync Video.
+        return (((nal_header & 0x1F) == 5) || ((nal_header & 0x1F) == 1)) ? 3 : 4;
+    }
+
+    if (((nal_header & 0x1F) == 5) || ((nal_header & 0x1F) == 6))
+    {
+        // Coded slice of an IDR picture(for some reason begins with only 2 zeros when encoding with libx264)
+        // SEI NAL unit(nal_data[0] == 6) is also begin with only 2 zeros.
+        return 3;
+    }
+
+    // Other NAL units begins with 0 0 0 0 1 (for matching FFmpeg Annex B encoded stream)
+    return 4;
+}
+
+
+// Codec policies: the codec specific logic of the NAL unit headers and of the FLV video tag header.
+// The policy is a template argument (resolved at compile time), so the H.264 path has no branches on the codec.
+
+// H.264 (AVC): 1 byte NAL header (5 bits NAL unit type), legacy FLV video tag header (codec_id = 7), and AVCDecoderConfigurationRecord.
+struct CAvcCodec
+{
+    static inline int NalType(const unsigned char *nal) { return nal[0] & 0x1F; }
+    static inline bool IsVcl(const int nal_type) { return (nal_type >= 1) && (nal_type <= 5); }
+    static inline bool IsIrap(const int nal_type) { return nal_type == 5; }     // Coded slice of an IDR picture.
+    static inline bool IsParameterSet(const int nal_type) { return (nal_type == 7) || (nal_type == 8); }
+
+    // Return true if the NAL unit at <nal> (<nal_len> bytes) begins a new access unit, assuming the current access unit already has a VCL NAL unit
+    // (ITU-T H.264 section 7.4.1.2.3, simplified): AUD, SEI, SPS, PPS and the prefix NAL units, and a slice with first_mb_in_slice = 0.
+    static inline bool IsFirstNalOfAccessUnit(const unsigned char *nal, const int nal_len)
+    {
+        const int nal_type = NalType(nal);
+
+        if (IsVcl(nal_type))
+        {
+            // first_mb_in_slice is the first ue(v) of the slice header - the value 0 is coded as a single '1' bit.
+            return (nal_len > 1) && ((nal[1] & 0x80) != 0);
+        }
+
+        return (nal_type == 6) || (nal_type == 7) || (nal_type == 8) || (nal_type == 9) || ((nal_type >= 14) && (nal_type <= 18));
+    }
+
+    // Start code length of the NAL unit <nal> (at index <nal_index> of the access unit).
+    static inline int StartCodeLen(const unsigned char *nal, const int nal_index, const EStartCodeConvention start_codes)
+    {
+        (void)nal_index;
+        return AnnexBStartCodeLen(nal[0], start_codes);
+    }
+
+    // Called after the NAL units of an access unit are split (nothing depends on the other NAL units).
+    static inline void FinishAccessUnit(CNalList *nal_list)
+    {
+        (void)nal_list;
+    }
+
+    // Size of the video tag header that starts with <first_byte>.
+    static inline int VideoHeaderSize(const unsigned char first_byte)
+    {
+        (void)first_byte;
+        return AVC_PACKET_HEADER_SIZE;
+    }
+
+    // Parse the video tag header <buf> (VideoHeaderSize bytes already in memory).
+    // <packet_type> - Output: FLV_PACKET_TYPE_SEQUENCE_START, FLV_PACKET_TYPE_CODED_FRAMES or FLV_PACKET_TYPE_SEQUENCE_END.
+    // Return false if it's not a video tag of the codec.
+    static inline bool ParseVideoHeader(const unsigned char *buf, int *packet_type, int *composition_time, bool *is_keyframe)
+    {
+        const int codec_id = (int)buf[0] & 0xF;
+
+        if (codec_id != 7)
+        {
+            fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", codec_id);
+            return false;
+        }
+
+        *packet_type = (int)buf[1];     // 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
+        *composition_time = ParseCompositionTime(buf);
+        *is_keyframe = ParseIsKeyframe(buf);
+
+        return true;
+    }
+
+    static inline bool ParseDecoderConfig(const unsigned char *record, const int record_size, CAvcDecoderConfig *cfg)
+    {
+        return ParseAvcDecoderConfig(record, record_size, cfg);
+    }
+};
+
+
+// H.265 (HEVC): 2 bytes NAL header (6 bits NAL unit type after the forbidden bit), Enhanced FLV video tag header (FourCC hvc1),
+// and HEVCDecoderConfigurationRecord.
+struct CHevcCodec
+{
+    static inline int NalType(const unsigned char *nal) { return (nal[0] >> 1) & 0x3F; }
+    static inline bool IsVcl(const int nal_type) { return nal_type <= 31; }
+    static inline bool IsIrap(const int nal_type) { return (nal_type >= 16) && (nal_type <= 23); }  // BLA, IDR and CRA pictures.
+    static inline bool IsParameterSet(const int nal_type) { return (nal_type >= 32) && (nal_type <= 34); }  // VPS, SPS and PPS.
+
+    // ITU-T H.265 section 7.4.2.4.4 (simplified): VPS, SPS, PPS, AUD, prefix SEI and the reserved prefix types, and a slice segment
+    // with first_slice_segment_in_pic_flag = 1 (the first bit after the NAL header).
+    static inline bool IsFirstNalOfAccessUnit(const unsigned char *nal, const int nal_len)
+    {
+        const int nal_type = NalType(nal);
+
+        if (IsVcl(nal_type))
+        {
+            return (nal_len > 2) && ((nal[2] & 0x80) != 0);
+        }
+
+        return ((nal_type >= 32) && (nal_type <= 35)) || (nal_type == 39) || ((nal_type >= 41) && (nal_type <= 44)) || ((nal_type >= 48) && (nal_type <= 55));
+    }
+
+    static inline int StartCodeLen(const unsigned char *nal, const int nal_index, const EStartCodeConvention start_codes)
+    {
+        if (start_codes == START_CODES_ALL_LONG)
+        {
+            return 4;
+        }
+
+        return ((nal_index == 0) || IsParameterSet(NalType(nal))) ? 4 : 3;
+    }
+
+    // The parameter sets are injected before an IRAP picture without VPS - the first NAL unit of the FLV payload is not the first of the access unit.
+    static inline void FinishAccessUnit(CNalList *nal_list)
+    {
+        bool is_irap = false;
+        bool has_param_sets = false;
+
+        for (int k = 0; k < nal_list->n_nals; k++)
+        {
+            const int nal_type = NalType(nal_list->nals[k].nal);
+            is_irap = is_irap || IsIrap(nal_type);
+            has_param_sets = has_param_sets || IsParameterSet(nal_type);
+        }
+
+        CNalView *v = &nal_list->nals[0];
+
+        if (is_irap && (!has_param_sets) && (nal_list->n_nals > 0) && (v->start_code_len == 4))
+        {
+            v->start_code_len = 3;
+            v->start_code++;
+            nal_list->annexb_len--;
+        }
+    }
+
+    static inline int VideoHeaderSize(const unsigned char first_byte)
+    {
+        return ((first_byte & 0xF) == FLV_PACKET_TYPE_CODED_FRAMES) ? FLV_MAX_VIDEO_HEADER_SIZE : 5;
+    }
+
+    static inline bool ParseVideoHeader(const unsigned char *buf, int *packet_type, int *composition_time, bool *is_keyframe)
+    {
+        if (((buf[0] & FLV_EX_HEADER_FLAG) == 0) || (memcmp(&buf[1], "hvc1", 4) != 0))
+        {
+            fprintf(stderr, "Bad video header: Enhanced FLV header with FourCC hvc1 is expected (first byte = 0x%02X)\n", (int)buf[0]);
+            return false;
+        }
+
+        *packet_type = buf[0] & 0xF;
+        *composition_time = 0;
+        *is_keyframe = (((buf[0] >> 4) & 0x7) == 1);
+
+        if (*packet_type == FLV_PACKET_TYPE_CODED_FRAMES)
+        {
+            *composition_time = ParseCompositionTime(&buf[3]);     // SI24 at buf[5] (ParseCompositionTime parses the 3 bytes at offset 2).
+        }
+        else if (*packet_type == FLV_PACKET_TYPE_CODED_FRAMES_X)
+        {
+            *packet_type = FLV_PACKET_TYPE_CODED_FRAMES;
+        }
+
+        return true;
+    }
+
+    static inline bool ParseDecoderConfig(const unsigned char *record, const int record_size, CAvcDecoderConfig *cfg)
+    {
+        return ParseHevcDecoderConfig(record, record_size, cfg);
+    }
+};
+
+
+// Split AVCC payload (<flv_payload_size> bytes already in memory) to a list of Annex B NAL units views (without copying the data).
+// Verify that the lengths are within the payload (the payload may come from a PIPE, a socket or a file).
+// <nal_list> - Output: list of NAL units views (pointing <flv_payload_buf>).
+// <nal_length_size> - Size of the AVCC length field: 1, 2 or 4 bytes (lengthSizeMinusOne + 1 of the AVC sequence header).
+// <start_codes> - Start codes convention of the encoder (see CAvcDecoderConfig).
+// <Codec> - Codec policy (CAvcCodec or CHevcCodec - the HEVC payload has the same length prefixed format).
+// Return -1 in case of an error.
+// Return Annex B payload size if success.
+template <class Codec = CAvcCodec>
+static inline int ParseAvccNalUnits(const unsigned char *flv_payload_buf, const int flv_payload_size, CNalList *nal_list, const int nal_length_size = 4,
+                                    const EStartCodeConvention start_codes = START_CODES_LIBX264)
+{
+    nal_list->n_nals = 0;
+    nal_list->annexb_len = 0;
+
+    // Split the payload to NAL units (and verify that the lengths are within the payload).
+    int idx = 0;
+
+    while (idx < flv_payload_size)
+    {
+        if ((nal_list->n_nals >= MAX_NALS_PER_ACCESS_UNIT) || (idx + nal_length_size > flv_payload_size))
+        {
+            fprintf(stderr, "Error: bad AVCC payload (too many NAL units, or truncated NAL unit length)\n");
+            return -1;
+        }
+
+        const unsigned char *nal_len_bytes = &flv_payload_buf[idx];
+
+        // Convert big - endian length (uint32 when nal_length_size = 4) to integer value
+        unsigned int nal_size = 0;
+
+        for (int b = 0; b < nal_length_size; b++)
+        {
+            nal_size = (nal_size << 8) + (unsigned int)nal_len_bytes[b];
+        }
+
+        if ((nal_size == 0) || (nal_size > (unsigned int)(flv_payload_size - idx - nal_length_size)))
+        {
+            fprintf(stderr, "Error: bad AVCC payload (NAL unit size %u exceeds the FLV payload)\n", nal_size);
+            return -1;
+        }
+
+        CNalView *v = &nal_list->nals[nal_list->n_nals];
+        v->nal              = &flv_payload_buf[idx + nal_length_size];
+        v->nal_len          = (int)nal_size;
+        v->start_code_len   = Codec::StartCodeLen(v->nal, nal_list->n_nals, start_codes);
+        v->start_code       = &g_start_code[4 - v->start_code_len];
+
+        nal_list->n_nals++;
+        nal_list->annexb_len += v->start_code_len + v->nal_len;
+        idx += nal_length_size + (int)nal_size;
+    }
+
+    Codec::FinishAccessUnit(nal_list);
+
+    return nal_list->annexb_len;
+}
+
+
+// Copy the NAL units of <nal_list> to <annexb_payload_buf> as one contiguous Annex B payload.
+// <annexb_payload_buf> - Pointer to output buffer - must be at least nal_list->annexb_len bytes.
+// Return Annex B payload size.
+static inline int CopyNalListToAnnexB(const CNalList *nal_list, unsigned char *annexb_payload_buf)
+{
+    int annexb_payload_idx = 0; // Index in annexb_payload_buf
+
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        const CNalView *v = &nal_list->nals[k];
+
+        memcpy(&annexb_payload_buf[annexb_payload_idx], v->start_code, v->start_code_len);
+        annexb_payload_idx += v->start_code_len;
+
+        // Concatenate NAL data in Annex B format to annexb_payload
+        memcpy(&annexb_payload_buf[annexb_payload_idx], v->nal, v->nal_len);
+        annexb_payload_idx += v->nal_len; // Advance index by nal_size bytes.
+    }
+
+    // The value of annexb_payload_idx equals the number of bytes copied to annexb_payload_buf.
+    return annexb_payload_idx;
+}
+
+
+// Update the views of <nal_list> to point the Annex B payload built by CopyNalListToAnnexB in <annexb_payload_buf>.
+// Keeps the views valid after the source buffer is released (the list is used by the consumer of the access unit).
+static inline void RebaseNalList(CNalList *nal_list, const unsigned char *annexb_payload_buf)
+{
+    int annexb_payload_idx = 0; // Index in annexb_payload_buf
+
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        CNalView *v = &nal_list->nals[k];
+
+        v->start_code = &annexb_payload_buf[annexb_payload_idx];
+        v->nal = &annexb_payload_buf[annexb_payload_idx + v->start_code_len];
+        annexb_payload_idx += v->start_code_len + v->nal_len;
+    }
+}
+
+
+// Convert the FLV payload in <flv_payload_buf> (listed by <nal_list>) from AVCC to Annex B format "in place" (no copy of the NAL units data).
+// The AVCC 4 bytes length of each NAL unit is replaced with 4 bytes start code (0x00000001) - same size, so nothing moves.
+// A NAL unit that starts with 3 bytes start code (0x000001) leaves one spare byte, so the preceding NAL units must be shifted by one byte:
+// The NAL units are processed from the last to the first, so the output ends where the FLV payload ends, and the beginning of the output is shifted.
+// The large coded slice is the last NAL unit of the access unit, so only the few bytes of SPS, PPS and SEI are moved.
+// The views in <nal_list> are updated to the new locations of the NAL units.
+// Length fields shorter than the start codes (nal_length_size of 1 or 2 bytes) make the output larger than the input:
+// The NAL units are processed from the first to the last, and the output starts before flv_payload_buf - the caller must reserve
+// (4 - nal_length_size) bytes per NAL unit before flv_payload_buf (see AccessUnitHeadroom).
+// <annexb_payload_offset> - Output: offset of the first Annex B byte relative to <flv_payload_buf> (negative in case of short length fields).
+// Return Annex B payload size (the Annex B payload starts at flv_payload_buf + *annexb_payload_offset).
+static inline int ConvertNalListToAnnexBInPlace(CNalList *nal_list, unsigned char *flv_payload_buf, int *annexb_payload_offset)
+{
+    if (nal_list->n_nals == 0)
+    {
+        *annexb_payload_offset = 0;
+        return 0;
+    }
+
+    // The length field size is the distance between the first NAL unit and the beginning of the payload.
+    const int nal_length_size = (int)(nal_list->nals[0].nal - flv_payload_buf);
+
+    if (nal_length_size < 3)
+    {
+        // Output is larger than the input - process forward, the output ends where the FLV payload ends.
+        const CNalView *last = &nal_list->nals[nal_list->n_nals - 1];
+        const int flv_payload_size = (int)(last->nal + last->nal_len - flv_payload_buf);
+        unsigned char *out = flv_payload_buf + (flv_payload_size - nal_list->annexb_len);
+
+        *annexb_payload_offset = (int)(out - flv_payload_buf);
+
+        for (int k = 0; k < nal_list->n_nals; k++)
+        {
+            CNalView *v = &nal_list->nals[k];
+            unsigned char *nal = out + v->start_code_len;
+
+            memmove(nal, v->nal, v->nal_len);   // Moved backward (the destination is never after the source).
+            memcpy(out, v->start_code, v->start_code_len);
+
+            v->nal = nal;
+            v->start_code = out;
+            out = nal + v->nal_len;
+        }
+
+        return nal_list->annexb_len;
+    }
+
+    // <shift> is the number of spare bytes accumulated so far (the NAL units before the spare bytes are moved forward by <shift> bytes).
+    int shift = 0;
+
+    for (int k = nal_list->n_nals - 1; k >= 0; k--)
+    {
+        CNalView *v = &nal_list->nals[k];
+        unsigned char *nal = &flv_payload_buf[v->nal - flv_payload_buf];   // The same as v->nal, but not const.
+
+        if (shift > 0)
+        {
+            memmove(nal + shift, nal, v->nal_len);  // Small NAL unit (SPS / PPS / SEI) - just few bytes.
+            nal += shift;
+        }
+
+        // Write the start code right before the NAL unit (over the AVCC length).
+        memcpy(nal - v->start_code_len, v->start_code, v->start_code_len);
+
+        shift += nal_length_size - v->start_code_len;  // One spare byte for 3 bytes start code (and 4 bytes length).
+
+        v->nal = nal;
+        v->start_code = nal - v->start_code_len;
+    }
+
+    *annexb_payload_offset = shift;
+
+    return nal_list->annexb_len;
+}
+
+
+// Number of bytes to reserve before the AVCC NAL units data in the access unit buffer:
+// room for the SPS and PPS (injected before IDR frames), and room for growing the payload when the length fields are shorter than the start codes.
+static inline int AccessUnitHeadroom(const CAvcDecoderConfig *cfg)
+{
+    return cfg->annexb_params_len + ((cfg->nal_length_size < 4) ? (4 - cfg->nal_length_size) * MAX_NALS_PER_ACCESS_UNIT : 0);
+}
+
+
+// Return true if the SPS and PPS of <cfg> must be injected before the NAL units of <nal_list> (IDR frame without parameter sets).
+// <Codec> - Codec policy (for HEVC, the VPS, SPS and PPS are injected before IRAP pictures).
+template <class Codec = CAvcCodec>
+static inline bool IsParameterSetsInjectionNeeded(const CAvcDecoderConfig *cfg, const CNalList *nal_list)
+{
+    bool is_idr = false;
+    bool has_sps = false;
+
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        int nal_type = Codec::NalType(nal_list->nals[k].nal);
+        is_idr = is_idr || Codec::IsIrap(nal_type);
+        has_sps = has_sps || Codec::IsParameterSet(nal_type);
+    }
+
+    // Not an IDR frame, or FFmpeg already repeats the SPS and PPS (dump_extra).
+    return is_idr && (!has_sps) && (cfg->n_params > 0);
+}
+
+
+// Inject the SPS and PPS of <cfg> before an IDR frame that doesn't include SPS (replaces the "-bsf:v dump_extra" FFmpeg bitstream filter).
+// The parameter sets are copied right before the Annex B payload (at buf + *annexb_payload_offset - cfg->annexb_params_len),
+// so the payload stays contiguous, and views of the parameter sets are inserted at the beginning of <nal_list>.
+// The buffer must have cfg->annexb_params_len bytes of headroom before the payload (see AccessUnitHeadroom).
+// <annexb_payload_offset> - Input/Output: offset of the Annex B payload in <buf> (updated if the parameter sets are injected).
+// Return -1 in case of an error.
+// Return Annex B payload size (with the injected parameter sets) if success.
+template <class Codec = CAvcCodec>
+static inline int InjectParameterSets(const CAvcDecoderConfig *cfg, CNalList *nal_list, unsigned char *buf, int *annexb_payload_offset)
+{
+    if (!IsParameterSetsInjectionNeeded<Codec>(cfg, nal_list))
+    {
+        return nal_list->annexb_len;
+    }
+
+    if ((nal_list->n_nals + cfg->n_params > MAX_NALS_PER_ACCESS_UNIT) || (*annexb_payload_offset < cfg->annexb_params_len))
+    {
+        fprintf(stderr, "Error: no room for injecting SPS and PPS\n");
+        return -1;
+    }
+
+    *annexb_payload_offset -= cfg->annexb_params_len;
+    unsigned char *params = &buf[*annexb_payload_offset];
+    memcpy(params, cfg->annexb_params, cfg->annexb_params_len);
+
+    memmove(&nal_list->nals[cfg->n_params], &nal_list->nals[0], nal_list->n_nals * sizeof(CNalView));
+
+    for (int k = 0; k < cfg->n_params; k++)
+    {
+        CNalView *v = &nal_list->nals[k];
+        v->nal              = &params[cfg->param_offsets[k]];
+        v->nal_len          = cfg->param_lens[k];
+        v->start_code       = v->nal - 4;
+        v->start_code_len   = 4;
+    }
+
+    nal_list->n_nals += cfg->n_params;
+    nal_list->annexb_len += cfg->annexb_params_len;
+
+    return nal_list->annexb_len;
+}
+
+
+// Inject views of the SPS and PPS of <cfg> before an IDR frame that doesn't include SPS (like InjectParameterSets, without copying).
+// The views point cfg->annexb_params, so the Annex B payload is not contiguous - it is written as a list of NAL units (writev).
+// Used when the AVCC NAL units are read-only (mapped FLV file), and there is no buffer to copy the parameter sets to.
+// Return -1 in case of an error.
+// Return Annex B payload size (with the injected parameter sets) if success.
+template <class Codec = CAvcCodec>
+static inline int InjectParameterSetViews(const CAvcDecoderConfig *cfg, CNalList *nal_list)
+{
+    if (!IsParameterSetsInjectionNeeded<Codec>(cfg, nal_list))
+    {
+        return nal_list->annexb_len;
+    }
+
+    if (nal_list->n_nals + cfg->n_params > MAX_NALS_PER_ACCESS_UNIT)
+    {
+        fprintf(stderr, "Error: no room for injecting SPS and PPS\n");
+        return -1;
+    }
+
+    memmove(&nal_list->nals[cfg->n_params], &nal_list->nals[0], nal_list->n_nals * sizeof(CNalView));
+
+    for (int k = 0; k < cfg->n_params; k++)
+    {
+        CNalView *v = &nal_list->nals[k];
+        v->nal              = &cfg->annexb_params[cfg->param_offsets[k]];
+        v->nal_len          = cfg->param_lens[k];
+        v->start_code       = v->nal - 4;
+        v->start_code_len   = 4;
+    }
+
+    nal_list->n_nals += cfg->n_params;
+    nal_list->annexb_len += cfg->annexb_params_len;
+
+    return nal_list->annexb_len;
+}
+
+
+// Upper bound of the size of the SEI NAL unit built by BuildSeiUserDataUnregistered (with the worst case of emulation prevention bytes).
+static inline int MaxSeiNalSize(const int user_data_len)
+{
+    const int payload_size = 16 + user_data_len;
+    const int rbsp_size = 1 + (payload_size / 255 + 1) + payload_size + 1;    // payload type, payload size, payload, rbsp trailing bits
+
+    return 1 + rbsp_size + rbsp_size / 2;   // NAL header, and one emulation prevention byte for each 2 bytes (at most).
+}
+
+
+// Append RBSP byte <b> to the NAL unit at <nal> (index <*idx>), and insert emulation prevention byte (0x03) when needed.
+// <n_zeros> - Input/Output: number of successive zero bytes before <b>.
+static inline void PutRbspByte(unsigned char *nal, int *idx, int *n_zeros, const unsigned char b)
+{
+    // 0x000000, 0x000001, 0x000002 and 0x000003 must not appear inside a NAL unit (ITU-T H.264 section 7.4.1).
+    if ((*n_zeros >= 2) && (b <= 3))
+    {
+        nal[(*idx)++] = 3;
+        *n_zeros = 0;
+    }
+
+    nal[(*idx)++] = b;
+    *n_zeros = (b == 0) ? (*n_zeros + 1) : 0;
+}
+
+
+// Build SEI NAL unit with one user_data_unregistered message (ITU-T H.264 section D.1.6): 16 bytes <uuid> followed by <user_data>.
+// Decoders that don't know the UUID ignore the message, so the SEI may carry any metadata of the frame.
+// <sei_nal_capacity> - Size of <sei_nal> (must be at least MaxSeiNalSize(user_data_len) bytes).
+// Return -1 in case of an error.
+// Return the size of the NAL unit in <sei_nal> (the first byte is the NAL header) if success.
+static inline int BuildSeiUserDataUnregistered(const unsigned char *uuid, const unsigned char *user_data, const int user_data_len,
+                                               unsigned char *sei_nal, const int sei_nal_capacity)
+{
+    if ((user_data_len < 0) || (sei_nal_capacity < MaxSeiNalSize(user_data_len)))
+    {
+        fprintf(stderr, "Error: no room for SEI NAL unit with %d bytes of user data\n", user_data_len);
+        return -1;
+    }
+
+    int idx = 0;
+    int n_zeros = 0;
+
+    sei_nal[idx++] = 0x06;  // forbidden_zero_bit = 0, nal_ref_idc = 0, nal_unit_type = 6 (SEI)
+
+    PutRbspByte(sei_nal, &idx, &n_zeros, 5);    // last_payload_type_byte = 5 (user_data_unregistered)
+
+    // payload size is coded as 0xFF bytes, and the remainder.
+    int payload_size = 16 + user_data_len;
+
+    while (payload_size >= 255)
+    {
+        PutRbspByte(sei_nal, &idx, &n_zeros, 0xFF);
+        payload_size -= 255;
+    }
+
+    PutRbspByte(sei_nal, &idx, &n_zeros, (unsigned char)payload_size);
+
+    for (int k = 0; k < 16; k++)
+    {
+        PutRbspByte(sei_nal, &idx, &n_zeros, uuid[k]);
+    }
+
+    for (int k = 0; k < user_data_len; k++)
+    {
+        PutRbspByte(sei_nal, &idx, &n_zeros, user_data[k]);
+    }
+
+    PutRbspByte(sei_nal, &idx, &n_zeros, 0x80);     // rbsp_trailing_bits (stop bit and alignment)
+
+    return idx;
+}
+
+
+// Get the next RBSP byte of the NAL unit at <nal> of <nal_len> bytes (index <*idx>), and skip emulation prevention byte (0x03) when needed.
+// <n_zeros> - Input/Output: number of successive zero bytes before the byte.
+// Return -1 at the end of the NAL unit.
+static inline int GetRbspByte(const unsigned char *nal, const int nal_len, int *idx, int *n_zeros)
+{
+    if ((*n_zeros >= 2) && (*idx < nal_len) && (nal[*idx] == 3))
+    {
+        (*idx)++;   // Emulation prevention byte (the inverse of PutRbspByte).
+        *n_zeros = 0;
+    }
+
+    if (*idx >= nal_len)
+    {
+        return -1;
+    }
+
+    const unsigned char b = nal[(*idx)++];
+    *n_zeros = (b == 0) ? (*n_zeros + 1) : 0;
+
+    return (int)b;
+}
+
+
+// Parse SEI NAL unit that starts with a user_data_unregistered message of <uuid> (the inverse of BuildSeiUserDataUnregistered).
+// <sei_nal> - The NAL unit (the first byte is the NAL header) of <sei_nal_len> bytes.
+// <user_data_capacity> - Size of <user_data>.
+// Return -1 if the NAL unit is not such SEI (or it's truncated, or the user data exceeds <user_data_capacity>).
+// Return the size of the user data copied to <user_data> if success.
+static inline int ParseSeiUserDataUnregistered(const unsigned char *sei_nal, const int sei_nal_len, const unsigned char *uuid,
+                                               unsigned char *user_data, const int user_data_capacity)
+{
+    if ((sei_nal_len < 1) || ((sei_nal[0] & 0x1F) != 6))
+    {
+        return -1;  // Not SEI NAL unit.
+    }
+
+    int idx = 1;
+    int n_zeros = 0;
+    int b = 0;
+
+    // payload type and payload size are coded as 0xFF bytes, and the remainder.
+    int payload_type = 0;
+
+    while ((b = GetRbspByte(sei_nal, sei_nal_len, &idx, &n_zeros)) == 0xFF)
+    {
+        payload_type += 255;
+    }
+
+    if ((b < 0) || (payload_type + b != 5))
+    {
+        return -1;  // Not user_data_unregistered.
+    }
+
+    int payload_size = 0;
+
+    while ((b = GetRbspByte(sei_nal, sei_nal_len, &idx, &n_zeros)) == 0xFF)
+    {
+        payload_size += 255;
+    }
+
+    payload_size += b;
+
+    if ((b < 0) || (payload_size < 16) || (payload_size - 16 > user_data_capacity))
+    {
+        return -1;
+    }
+
+    for (int k = 0; k < 16; k++)
+    {
+        if (GetRbspByte(sei_nal, sei_nal_len, &idx, &n_zeros) != (int)uuid[k])
+        {
+            return -1;  // Other UUID (or truncated).
+        }
+    }
+
+    const int user_data_len = payload_size - 16;
+
+    for (int k = 0; k < user_data_len; k++)
+    {
+        if ((b = GetRbspByte(sei_nal, sei_nal_len, &idx, &n_zeros)) < 0)
+        {
+            return -1;  // Truncated.
+        }
+
+        user_data[k] = (unsigned char)b;
+    }
+
+    return user_data_len;
+}
+
+
+// Insert a view of the NAL unit at <nal> (<nal_len> bytes) to <nal_list>, before the first VCL NAL unit (coded slice).
+// SEI must precede the coded slices of the access unit (ITU-T H.264 section 7.4.1.2.3), and may follow the SPS and PPS.
+// The NAL unit is not copied - the data must be valid until the access unit is written.
+// <start_codes> - Start codes convention of the encoder of the access unit.
+// <Codec> - Codec policy (the VCL NAL unit types, and the start code of the inserted NAL unit).
+// Return false if <nal_list> is full.
+template <class Codec = CAvcCodec>
+static inline bool InsertNalViewBeforeSlices(CNalList *nal_list, const unsigned char *nal, const int nal_len,
+                                             const EStartCodeConvention start_codes = START_CODES_LIBX264)
+{
+    if (nal_list->n_nals >= MAX_NALS_PER_ACCESS_UNIT)
+    {
+        fprintf(stderr, "Error: no room for inserting NAL unit\n");
+        return false;
+    }
+
+    int pos = 0;
+
+    while (pos < nal_list->n_nals)
+    {
+        if (Codec::IsVcl(Codec::NalType(nal_list->nals[pos].nal)))
+        {
+            break;
+        }
+
+        pos++;
+    }
+
+    memmove(&nal_list->nals[pos + 1], &nal_list->nals[pos], (nal_list->n_nals - pos) * sizeof(CNalView));
+
+    CNalView *v = &nal_list->nals[pos];
+    v->start_code_len   = Codec::StartCodeLen(nal, pos, start_codes);
+    v->start_code       = &g_start_code[4 - v->start_code_len];
+    v->nal              = nal;
+    v->nal_len          = nal_len;
+
+    nal_list->n_nals++;
+    nal_list->annexb_len += v->start_code_len + nal_len;
+
+    return true;
+}
+
+
+// Allocate <size> bytes aligned to <alignment> (power of 2) - release with AlignedFree.
+// Return nullptr in case of failure.
+static inline void *AlignedAlloc(const size_t alignment, const size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void *mem = nullptr;
+
+    return (posix_memalign(&mem, alignment, size) == 0) ? mem : nullptr;
+#endif
+}
+
+
+static inline void AlignedFree(void *mem)
+{
+#ifdef _WIN32
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
+
+
+// Size of memory page in bytes (usually 4KB).
+static inline size_t SystemPageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    return (size_t)si.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+
+class CBufferPool;
+
+// Reference counted buffer, allocated from CBufferPool (the reference count of an acquired buffer is 1).
+// Each additional user of the buffer calls addRef(), and each user calls release() when done with the buffer.
+// The last release() returns the buffer to the pool (release() may be called from any thread).
+class CPooledBuffer
+{
+    friend class CBufferPool;
+
+private:
+    CBufferPool *m_pool         = nullptr;
+    int m_size_class            = 0;
+    std::atomic<int> m_ref_count;
+    CPooledBuffer *m_next_free  = nullptr;	// Next buffer in the free list of the size class.
+
+public:
+    unsigned char *data = nullptr;
+    int capacity        = 0;
+
+    CPooledBuffer() : m_ref_count(0)
+    {
+    }
+
+    void addRef()
+    {
+        m_ref_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void release();
+};
+
+
+// Pool of access unit buffers (replaces allocating few width*height*3 buffers "for the worst case").
+// The buffers are arranged in size classes (4KB, 6KB, 8KB, 12KB, 16KB ... steps of x1.5 and x1.333).
+// A buffer of the smallest class that fits the observed FLV payload size is used, so the memory follows the actual frame sizes:
+// a stream of 20KB P frames and 200KB IDR frames uses only buffers of 24KB and 256KB classes (at most 33% more than needed).
+// The buffers of a size class are allocated in slabs (up to 256KB of buffers per allocation), only when the class has no free buffer.
+// After the first few frames of each type, there are no more heap allocations (the released buffers are reused).
+// The total allocated memory is bounded by <max_total_bytes>. When the bound is reached, the slabs of other size classes whose buffers are all free
+// are freed to make room (the frame sizes drift - the memory of the class that is not used any more is reclaimed), or else a free buffer of the smallest
+// larger class is used. acquire() returns nullptr only if neither is possible (try again after buffers are released).
+// Thread safety:
+// acquire() must be called by only one thread (the reader thread of the stream), release() may be called by any thread.
+// The free list of each class is a lock-free stack - with a single "popping" thread there is no ABA problem.
+class CBufferPool
+{
+private:
+    static const int MAX_SIZE_CLASSES = 64;
+    static const int MIN_CLASS_SIZE = 4096;
+    static const int SLAB_BYTES = 262144;   // Small buffers are allocated 256KB at a time (large buffers are allocated one by one).
+    static const int MAX_BUFFERS_PER_SLAB = 16;
+
+    // Slab of buffers (all the buffers of a slab have the same size class).
+    struct CSlab
+    {
+        unsigned char *mem = nullptr;
+        CPooledBuffer *buffers = nullptr;
+        int size_class = 0;
+        int n_buffers = 0;
+        size_t bytes = 0;
+        CSlab *next = nullptr;
+    };
+
+    int m_class_size[MAX_SIZE_CLASSES];
+    int m_n_classes = 0;
+    std::atomic<CPooledBuffer*> m_free_list[MAX_SIZE_CLASSES];
+
+    CSlab *m_slabs = nullptr;
+    size_t m_total_bytes = 0;       // Total size of all the slabs (modified only by the acquiring thread).
+    size_t m_max_total_bytes = 0;
+    size_t m_page_size = 0;         // Page size if the buffers are page aligned (0 if not aligned).
+
+    std::atomic<uint64_t> m_n_put_back;    // Number of buffers pushed to the free lists (any thread) - the acquiring thread waits for it to change.
+
+    // Statistics (modified only by the acquiring thread).
+    uint64_t m_n_acquired[MAX_SIZE_CLASSES];
+    int m_n_slabs = 0;
+    int m_n_reclaimed_slabs = 0;
+    int m_n_larger_class = 0;   // Number of buffers acquired from a larger size class (the class of the size has no free buffer).
+    int m_max_requested_size = 0;
+
+    // Constructor is private.
+    // Object can only be created by executing Create (static member function).
+    CBufferPool() : m_n_put_back(0)
+    {
+    }
+
+    ~CBufferPool()
+    {
+        while (m_slabs != nullptr)
+        {
+            CSlab *slab = m_slabs;
+            m_slabs = slab->next;
+            freeSlab(slab);
+        }
+    }
+
+    void freeSlab(CSlab *slab)
+    {
+        if (m_page_size > 0)
+        {
+            AlignedFree(slab->mem);
+        }
+        else
+        {
+            delete[] slab->mem;
+        }
+
+        delete[] slab->buffers;
+        delete slab;
+    }
+
+    // Return index of the smallest size class that fits <size> bytes (or -1 if <size> is larger than the largest class).
+    int sizeClassOf(const int size) const
+    {
+        for (int c = 0; c < m_n_classes; c++)
+        {
+            if (size <= m_class_size[c])
+            {
+                return c;
+            }
+        }
+
+        return -1;
+    }
+
+    // Allocate a new slab of size class <c>, and add its buffers to the free list.
+    // Return false if the slab exceeds the memory bound.
+    bool addSlab(const int c)
+    {
+        int n_buffers = SLAB_BYTES / m_class_size[c];
+        n_buffers = (n_buffers < 1) ? 1 : (n_buffers > MAX_BUFFERS_PER_SLAB) ? MAX_BUFFERS_PER_SLAB : n_buffers;
+
+        // Page aligned buffers start at page boundary (the distance between buffers is rounded up to whole pages).
+        const size_t stride = (m_page_size > 0) ? ((m_class_size[c] + m_page_size - 1) / m_page_size) * m_page_size : (size_t)m_class_size[c];
+        const size_t slab_bytes = stride * n_buffers;
+
+        if (m_total_bytes + slab_bytes > m_max_total_bytes)
+        {
+            return false;
+        }
+
+        CSlab *slab = new CSlab();
+
+        if (m_page_size > 0)
+        {
+            void *mem = AlignedAlloc(m_page_size, slab_bytes);
+
+            if (mem == nullptr)
+            {
+                delete slab;
+                return false;
+            }
+
+            slab->mem = (unsigned char*)mem;
+        }
+        else
+        {
+            slab->mem = new unsigned char[slab_bytes];
+        }
+        slab->buffers = new CPooledBuffer[n_buffers];
+        slab->size_class = c;
+        slab->n_buffers = n_buffers;
+        slab->bytes = slab_bytes;
+        slab->next = m_slabs;
+        m_slabs = slab;
+        m_total_bytes += slab_bytes;
+        m_n_slabs++;
+
+        for (int k = 0; k < n_buffers; k++)
+        {
+            CPooledBuffer *b = &slab->buffers[k];
+            b->m_pool       = this;
+            b->m_size_class = c;
+            b->data         = &slab->mem[(size_t)k * stride];
+            b->capacity     = m_class_size[c];
+            putBack(b);
+        }
+
+        return true;
+    }
+
+    // Size in bytes of a new slab of size class <c> (see addSlab).
+    size_t slabBytes(const int c) const
+    {
+        int n_buffers = SLAB_BYTES / m_class_size[c];
+        n_buffers = (n_buffers < 1) ? 1 : (n_buffers > MAX_BUFFERS_PER_SLAB) ? MAX_BUFFERS_PER_SLAB : n_buffers;
+        const size_t stride = (m_page_size > 0) ? ((m_class_size[c] + m_page_size - 1) / m_page_size) * m_page_size : (size_t)m_class_size[c];
+
+        return stride * n_buffers;
+    }
+
+    // Free the slabs of size classes other than <c> whose buffers are all free, until a new slab of class <c> fits the memory bound.
+    // Only this thread pops the free lists, so it may take a whole free list: the list is searched for the buffers of idle slabs,
+    // and the rest is pushed back (the buffers released meanwhile are pushed to the empty list - their slabs are not idle).
+    // Return true if a slab of class <c> fits the memory bound.
+    bool reclaimIdleSlabs(const int c)
+    {
+        const size_t needed_bytes = slabBytes(c);
+
+        for (int k = 0; (k < m_n_classes) && (m_total_bytes + needed_bytes > m_max_total_bytes); k++)
+        {
+            CPooledBuffer *free_buffers = (k == c) ? nullptr : m_free_list[k].exchange(nullptr, std::memory_order_acquire);
+
+            if (free_buffers == nullptr)
+            {
+                continue;
+            }
+
+            CSlab **link = &m_slabs;
+
+            while ((*link != nullptr) && (m_total_bytes + needed_bytes > m_max_total_bytes))
+            {
+                CSlab *slab = *link;
+                int n_free = 0;
+
+                for (CPooledBuffer *b = free_buffers; (b != nullptr) && (slab->size_class == k); b = b->m_next_free)
+                {
+                    n_free += ((b >= slab->buffers) && (b < slab->buffers + slab->n_buffers)) ? 1 : 0;
+                }
+
+                if ((slab->size_class != k) || (n_free < slab->n_buffers))
+                {
+                    link = &slab->next;
+                    continue;
+                }
+
+                // Unlink the buffers of the idle slab from the free list, and free the slab.
+                CPooledBuffer **b_link = &free_buffers;
+
+                while (*b_link != nullptr)
+                {
+                    if ((*b_link >= slab->buffers) && (*b_link < slab->buffers + slab->n_buffers))
+                    {
+                        *b_link = (*b_link)->m_next_free;
+                    }
+                    else
+                    {
+                        b_link = &(*b_link)->m_next_free;
+                    }
+                }
+
+                *link = slab->next;
+                m_total_bytes -= slab->bytes;
+                m_n_slabs--;
+                m_n_reclaimed_slabs++;
+                freeSlab(slab);
+            }
+
+            // Push the rest of the free buffers back (in front of the buffers released meanwhile).
+            if (free_buffers != nullptr)
+            {
+                CPooledBuffer *last = free_buffers;
+
+                while (last->m_next_free != nullptr)
+                {
+                    last = last->m_next_free;
+                }
+
+                last->m_next_free = m_free_list[k].load(std::memory_order_relaxed);
+
+                while (!m_free_list[k].compare_exchange_weak(last->m_next_free, free_buffers, std::memory_order_release, std::memory_order_relaxed))
+                {
+                }
+            }
+        }
+
+        return (m_total_bytes + needed_bytes <= m_max_total_bytes);
+    }
+
+    // Pop a buffer from the free list of size class <c> (only this thread pops, other threads may push concurrently).
+    // Return nullptr if the class has no free buffer.
+    CPooledBuffer *popFree(const int c)
+    {
+        CPooledBuffer *b = m_free_list[c].load(std::memory_order_acquire);
+
+        while ((b != nullptr) && (!m_free_list[c].compare_exchange_weak(b, b->m_next_free, std::memory_order_acquire, std::memory_order_acquire)))
+        {
+        }
+
+        return b;
+    }
+
+public:
+    // Create a buffer pool.
+    // max_buffer_size - the largest buffer that may be acquired (width*height*3 is more than enough for any encoded frame).
+    // max_total_bytes - bound of the total allocated memory (must be at least max_buffer_size).
+    // is_page_aligned - allocate page aligned buffers (required for mapping the buffers into a PIPE with vmsplice).
+    // Return pointer to CBufferPool object in case of success, and nullptr in case of failure.
+    static CBufferPool *Create(const int max_buffer_size, const size_t max_total_bytes, const bool is_page_aligned = false)
+    {
+        CBufferPool *pool = new CBufferPool();
+
+        pool->m_max_total_bytes = max_total_bytes;
+        pool->m_page_size = is_page_aligned ? SystemPageSize() : 0;
+
+        // Build the list of size classes: 4KB, 6KB, 8KB, 12KB, 16KB, 24KB ... until max_buffer_size.
+        int size = MIN_CLASS_SIZE;
+
+        while (pool->m_n_classes < MAX_SIZE_CLASSES)
+        {
+            pool->m_class_size[pool->m_n_classes] = std::min(size, max_buffer_size);
+            pool->m_free_list[pool->m_n_classes].store(nullptr);
+            pool->m_n_acquired[pool->m_n_classes] = 0;
+            pool->m_n_classes++;
+
+            if (size >= max_buffer_size)
+            {
+                break;
+            }
+
+            // Alternate between x1.5 and x1.333 (size is always a multiple of 2KB).
+            size = ((pool->m_n_classes % 2) == 1) ? (size / 2) * 3 : (size / 3) * 4;
+        }
+
+        if ((pool->m_class_size[pool->m_n_classes - 1] < max_buffer_size) ||
+            ((size_t)max_buffer_size > max_total_bytes))
+        {
+            fprintf(stderr, "Error: CBufferPool::Create - max_buffer_size = %d is too large (or max_total_bytes is too small).\n", max_buffer_size);
+            delete pool;
+            return nullptr;
+        }
+
+        return pool;
+    }
+
+    // Delete the pool (all the acquired buffers must be released before).
+    static void DeleteObj(CBufferPool *pool)
+    {
+        delete pool;
+    }
+
+    // Largest buffer size that may be acquired.
+    int maxBufferSize() const
+    {
+        return m_class_size[m_n_classes - 1];
+    }
+
+    // Acquire a buffer of at least <size> bytes (the reference count of the returned buffer is 1).
+    // When the memory bound is reached, idle slabs of other classes are reclaimed, or else a free buffer of the smallest larger class is used.
+    // Return nullptr if all the memory is in buffers that are not released (try again after buffers are released), or if <size> exceeds maxBufferSize().
+    CPooledBuffer *acquire(const int size)
+    {
+        const int c = sizeClassOf(size);
+
+        if (c < 0)
+        {
+            return nullptr;
+        }
+
+        m_max_requested_size = std::max(m_max_requested_size, size);
+
+        CPooledBuffer *b = popFree(c);
+
+        if ((b == nullptr) && (addSlab(c) || (reclaimIdleSlabs(c) && addSlab(c))))
+        {
+            b = popFree(c);
+        }
+
+        for (int k = c + 1; (b == nullptr) && (k < m_n_classes); k++)
+        {
+            b = popFree(k);
+            m_n_larger_class += (b != nullptr) ? 1 : 0;
+        }
+
+        if (b == nullptr)
+        {
+            return nullptr;
+        }
+
+        b->m_ref_count.store(1, std::memory_order_relaxed);
+        m_n_acquired[b->m_size_class]++;
+
+        return b;
+    }
+
+    // Number of buffers pushed to the free lists so far - a waiting acquirer checks whether buffers are released at all.
+    uint64_t putBackCount() const
+    {
+        return m_n_put_back.load(std::memory_order_acquire);
+    }
+
+    // Push <b> to the free list of its size class (may be called by any thread).
+    void putBack(CPooledBuffer *b)
+    {
+        std::atomic<CPooledBuffer*> &head = m_free_list[b->m_size_class];
+        b->m_next_free = head.load(std::memory_order_relaxed);
+
+        while (!head.compare_exchange_weak(b->m_next_free, b, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+
+        m_n_put_back.fetch_add(1, std::memory_order_release);
+    }
+
+    // Print memory usage and the number of acquired buffers of each size class (for testing).
+    void printStatistics() const
+    {
+        fprintf(stderr, "Buffer pool: %d slabs, %d KB allocated (bound %d KB), largest request %d bytes, %d slabs reclaimed, %d buffers of a larger class.\n",
+                m_n_slabs, (int)(m_total_bytes / 1024), (int)(m_max_total_bytes / 1024), m_max_requested_size, m_n_reclaimed_slabs, m_n_larger_class);
+
+        for (int c = 0; c < m_n_classes; c++)
+        {
+            if (m_n_acquired[c] > 0)
+            {
+                fprintf(stderr, "    size class %7d bytes: acquired %d times.\n", m_class_size[c], (int)m_n_acquired[c]);
+            }
+        }
+    }
+};
+
+
+// Decrement the reference count, and return the buffer to the pool when the count reaches zero.
+inline void CPooledBuffer::release()
+{
+    if (m_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        m_pool->putBack(this);
+    }
+}
+
+
+// Encoded video frame ("access unit") in Annex B format, passed from the reader thread to the output through CSpscRing.
+// The ring slot holds a reference to a pooled buffer (the consumer releases the buffer when done).
+struct CAccessUnit
+{
+    CPooledBuffer *buffer = nullptr;                // Buffer (acquired from CBufferPool) that holds the Annex B payload.
+    int annexb_payload_offset = 0;                  // The Annex B payload starts at buffer->data + annexb_payload_offset.
+    int annexb_payload_len = 0;
+    CNalList nal_list;                              // Views of the NAL units in buffer->data (used by DO_WRITE_NAL_UNITS_WITH_WRITEV and by the RTP sender).
+    int pts_ms = 0;                                 // Presentation timestamp (FLV timestamp + composition time) - identifies the source frame.
+    int dts_ms = 0;                                 // Decoding timestamp (FLV timestamp) - increases in output order (used for pacing the network output).
+    bool is_keyframe = false;                       // FLV frame_type is keyframe (IDR frame) - starts a GOP (a late subscriber may start from it).
+};
+
+
+// Receiver of the events of CFlvParser.
+class CFlvParserListener
+{
+public:
+    virtual ~CFlvParserListener() {}
+
+    // Complete access unit (converted to Annex B "in place" - the NAL units views point the Annex B NAL units).
+    // The listener becomes the owner of <au>->buffer (and must release it).
+    // Return false for stopping the parsing (the parser enters "failed" state).
+    virtual bool onAccessUnit(CAccessUnit *au) = 0;
+};
+
+
+// Push based (resumable) FLV parser.
+// The parser doesn't read - the caller feeds it with whatever bytes a read returned (part of a header, part of a payload, or few FLV tags).
+// The parsing state is kept across calls, so the parser may be used with non-blocking PIPEs, sockets, asynchronous I/O or files.
+// The FLV payload is collected in a buffer acquired from the pool (right-sized - the payload size is known after the FLV tag header).
+// The caller may read the rest of the current payload directly to the pooled buffer (see directWritePtr), for avoiding a copy.
+// The first FLV tag is the AVC sequence header: the SPS and PPS are kept (injected before IDR frames), and so is the size of the AVCC length fields.
+// <Codec> - Codec policy (CAvcCodec, or CHevcCodec for the Enhanced FLV video tags and the HEVC sequence start with the VPS, SPS and PPS).
+template <class Codec = CAvcCodec>
+class CFlvParser
+{
+private:
+    enum EParseState
+    {
+        PARSE_FILE_HEADER,  // Collecting the 9 bytes FLV file header.
+        PARSE_TAG_HEADER,   // Collecting the 15 bytes FLV packet header.
+        PARSE_TAG_PAYLOAD,  // Collecting the FLV payload (in a pooled buffer).
+        PARSE_FAILED        // Parsing error (all the following bytes are ignored).
+    };
+
+    CBufferPool *m_pool             = nullptr;
+    CFlvParserListener *m_listener  = nullptr;
+
+    EParseState m_state             = PARSE_FILE_HEADER;
+    unsigned char m_hdr[FLV_PACKET_HEADER_SIZE];
+    int m_hdr_len                   = 0;        // Number of header bytes collected so far.
+    CPooledBuffer *m_payload        = nullptr;
+    int m_payload_size              = 0;
+    int m_payload_len               = 0;        // Number of payload bytes collected so far.
+    int m_timestamp_ms              = 0;        // FLV timestamp of the current tag.
+    bool m_is_first_tag             = true;
+    int m_n_access_units            = 0;
+    CAvcDecoderConfig m_config;                 // Parsed from the AVC sequence header (the first FLV tag).
+    int m_headroom                  = 0;        // The payload is collected at m_payload->data + m_headroom (see AccessUnitHeadroom).
+
+    // Enter "failed" state (release the payload buffer).
+    bool fail()
+    {
+        if (m_payload != nullptr)
+        {
+            m_payload->release();
+            m_payload = nullptr;
+        }
+
+        m_state = PARSE_FAILED;
+
+        return false;
+    }
+
+    // Handle the header after it is complete (m_hdr holds the whole header).
+    bool headerComplete()
+    {
+        m_hdr_len = 0;
+
+        if (m_state == PARSE_FILE_HEADER)
+        {
+            if (!ParseFlvFileHeader(m_hdr))
+            {
+                return fail();
+            }
+
+            m_state = PARSE_TAG_HEADER;
+
+            return true;
+        }
+
+        m_payload_size = ParseFlvPacketHeader(m_hdr);
+        m_timestamp_ms = ParseFlvTimestamp(m_hdr);
+        m_payload_len = 0;
+
+        if (m_payload_size < 1)
+        {
+            fprintf(stderr, "CFlvParser: empty FLV payload\n");
+            return fail();
+        }
+
+        m_payload = m_pool->acquire(m_headroom + m_payload_size);
+
+        if (m_payload == nullptr)
+        {
+            fprintf(stderr, "CFlvParser: failed to acquire buffer for FLV payload of %d bytes\n", m_payload_size);
+            return fail();
+        }
+
+        m_state = PARSE_TAG_PAYLOAD;
+
+        return true;
+    }
+
+    // Handle the payload after it is complete (m_payload holds m_payload_size bytes).
+    bool payloadComplete()
+    {
+        CPooledBuffer *payload = m_payload;
+        m_payload = nullptr;
+        m_state = PARSE_TAG_HEADER;
+
+        unsigned char *data = &payload->data[m_headroom];
+
+        // The video packet header is parsed first - the SPS and PPS injected before an IDR frame may overwrite it.
+        const int header_size = Codec::VideoHeaderSize(data[0]);
+        int packet_type = 0;
+        int composition_time = 0;
+        bool is_keyframe = false;
+
+        if ((m_payload_size < std::max(header_size, AVC_PACKET_HEADER_SIZE)) || !Codec::ParseVideoHeader(data, &packet_type, &composition_time, &is_keyframe))
+        {
+            fprintf(stderr, "CFlvParser: bad video packet header\n");
+            payload->release();
+            return fail();
+        }
+
+        if (m_is_first_tag)
+        {
+            // The first payload is the sequence header (AVC sequence header, or HEVC sequence start).
+            m_is_first_tag = false;
+
+            bool success = (packet_type == FLV_PACKET_TYPE_SEQUENCE_START) &&
+                           Codec::ParseDecoderConfig(&data[header_size], m_payload_size - header_size, &m_config);
+            payload->release();
+
+            if (!success)
+            {
+                fprintf(stderr, "CFlvParser: bad sequence header\n");
+                return fail();
+            }
+
+            m_headroom = AccessUnitHeadroom(&m_config);
+
+            return true;
+        }
+
+        if (packet_type != FLV_PACKET_TYPE_CODED_FRAMES)
+        {
+            fprintf(stderr, "CFlvParser: packet type = %d instead of %d (coded frames)\n", packet_type, FLV_PACKET_TYPE_CODED_FRAMES);
+            payload->release();
+            return fail();
+        }
+
+        CAccessUnit au;
+        unsigned char *nal_data = &data[header_size];
+
+        au.pts_ms = m_timestamp_ms + composition_time;
+        au.dts_ms = m_timestamp_ms;
+        au.is_keyframe = is_keyframe;
+
+        if (ParseAvccNalUnits<Codec>(nal_data, m_payload_size - header_size, &au.nal_list, m_config.nal_length_size, m_config.start_codes) < 0)
+        {
+            fprintf(stderr, "CFlvParser: ParseAvccNalUnits failed\n");
+            payload->release();
+            return fail();
+        }
+
+        // The annexb offset is relative to buffer->data (the headroom and the video packet header are skipped).
+        ConvertNalListToAnnexBInPlace(&au.nal_list, nal_data, &au.annexb_payload_offset);
+        au.annexb_payload_offset += m_headroom + header_size;
+        au.annexb_payload_len = InjectParameterSets<Codec>(&m_config, &au.nal_list, payload->data, &au.annexb_payload_offset);
+
+        if (au.annexb_payload_len < 0)
+        {
+            payload->release();
+            return fail();
+        }
+
+        au.buffer = payload;
+        m_n_access_units++;
+
+        if (!m_listener->onAccessUnit(&au))
+        {
+            return fail();
+        }
+
+        return true;
+    }
+
+public:
+    // <pool> - Pool of the payload buffers (the maximum FLV payload size is pool->maxBufferSize()).
+    // <listener> - Receiver of the access units.
+    // <start_codes> - Start codes convention of the encoder of the stream.
+    CFlvParser(CBufferPool *pool, CFlvParserListener *listener, const EStartCodeConvention start_codes = START_CODES_LIBX264) :
+        m_pool(pool), m_listener(listener)
+    {
+        m_config.start_codes = start_codes;
+    }
+
+    ~CFlvParser()
+    {
+        if (m_payload != nullptr)
+        {
+            m_payload->release();
+        }
+    }
+
+    CFlvParser(const CFlvParser&) = delete;
+    CFlvParser &operator=(const CFlvParser&) = delete;
+
+    bool isFailed() const { return m_state == PARSE_FAILED; }
+    int accessUnitsCount() const { return m_n_access_units; }
+
+    // Return true if the stream may end here: after complete FLV tag and the trailing 4 bytes "previous packet size" footer.
+    bool isAtValidEnd() const
+    {
+        return (m_state == PARSE_TAG_HEADER) && (m_hdr_len == 4);
+    }
+
+    // Feed <len> bytes to the parser (the bytes are copied - <data> may be reused after returning).
+    // Return false in case of parsing error (or if the listener stopped the parsing).
+    bool feed(const unsigned char *data, int len)
+    {
+        while ((len > 0) && (m_state != PARSE_FAILED))
+        {
+            if (m_state == PARSE_TAG_PAYLOAD)
+            {
+                int n = std::min(len, m_payload_size - m_payload_len);
+                memcpy(&m_payload->data[m_headroom + m_payload_len], data, n);
+                data += n;
+                len -= n;
+
+                if (!commitDirectWrite(n))
+                {
+                    return false;
+                }
+
+                continue;
+            }
+
+            const int hdr_size = (m_state == PARSE_FILE_HEADER) ? FLV_FILE_HEADER_SIZE : FLV_PACKET_HEADER_SIZE;
+            int n = std::min(len, hdr_size - m_hdr_len);
+            memcpy(&m_hdr[m_hdr_len], data, n);
+            m_hdr_len += n;
+            data += n;
+            len -= n;
+
+            if ((m_hdr_len == hdr_size) && (!headerComplete()))
+            {
+                return false;
+            }
+        }
+
+        return m_state != PARSE_FAILED;
+    }
+
+    // Return pointer for reading the rest of the current FLV payload directly to the payload buffer (no copy).
+    // <len> returns the number of missing payload bytes.
+    // Return nullptr (and *len = 0) when the parser is not in the middle of a payload.
+    unsigned char *directWritePtr(int *len)
+    {
+        if (m_state != PARSE_TAG_PAYLOAD)
+        {
+            *len = 0;
+            return nullptr;
+        }
+
+        *len = m_payload_size - m_payload_len;
+
+        return &m_payload->data[m_headroom + m_payload_len];
+    }
+
+    // Commit <n> bytes written to the pointer returned by directWritePtr (n <= len).
+    bool commitDirectWrite(const int n)
+    {
+        if (m_state != PARSE_TAG_PAYLOAD)
+        {
+            return n == 0;
+        }
+
+        m_payload_len += n;
+
+        if (m_payload_len == m_payload_size)
+        {
+            return payloadComplete();
+        }
+
+        return true;
+    }
+};
+
+// Zero copy parser of FLV stream in memory (a mapped FLV recording, or a whole stream in a buffer).
+// The access units are returned as NAL units views pointing into the memory: the start codes point g_start_code,
+// and the injected SPS and PPS point the copy in the decoder configuration (see InjectParameterSetViews).
+// No byte of the FLV payload is copied or modified, so the memory may be read-only (mmap with PROT_READ).
+// Unlike the PIPE stream, a recording may have script data (onMetaData), audio, a new AVC sequence header and end of sequence tags:
+// audio and script data tags are skipped, and a new sequence header replaces the configuration.
+// A truncated last tag (a recording that was stopped) ends the stream with a warning.
+// <Codec> - Codec policy (CAvcCodec, or CHevcCodec for Enhanced FLV recordings).
+template <class Codec = CAvcCodec>
+class CFlvMemoryParser
+{
+private:
+    const unsigned char *m_data     = nullptr;
+    size_t m_size                   = 0;
+    size_t m_pos                    = 0;        // Offset of the next FLV packet header (the "previous tag size" field).
+    bool m_is_header_parsed         = false;
+    int m_n_access_units            = 0;
+    EStartCodeConvention m_start_codes = START_CODES_LIBX264;
+
+    // The views of injected parameter sets point the configuration that was valid for the access unit,
+    // so the configurations are kept until the parser is destroyed (std::deque doesn't move the elements when growing).
+    std::deque<CAvcDecoderConfig> m_configs;
+
+public:
+    // <data> - FLV stream of <size> bytes (must be valid as long as the views of the access units are used).
+    // <start_codes> - Start codes convention of the encoder of the recording.
+    CFlvMemoryParser(const unsigned char *data, const size_t size, const EStartCodeConvention start_codes = START_CODES_LIBX264) :
+        m_data(data), m_size(size), m_start_codes(start_codes)
+    {
+    }
+
+    CFlvMemoryParser(const CFlvMemoryParser&) = delete;
+    CFlvMemoryParser &operator=(const CFlvMemoryParser&) = delete;
+
+    int accessUnitsCount() const { return m_n_access_units; }
+    size_t position() const { return m_pos; }
+
+    // Get the next access unit: au->nal_list, au->pts_ms and au->dts_ms are set (au->buffer is nullptr - the views point the memory).
+    // Return 1 if an access unit is returned, 0 at the end of the stream, and -1 in case of an error.
+    int nextAccessUnit(CAccessUnit *au)
+    {
+        if (!m_is_header_parsed)
+        {
+            if ((m_size < FLV_FILE_HEADER_SIZE) || (!ParseFlvFileHeader(m_data)))
+            {
+                fprintf(stderr, "CFlvMemoryParser: bad FLV file header\n");
+                return -1;
+            }
+
+            // The header size field (DataOffset) is 9 for FLV version 1.
+            m_pos = FLV_FILE_HEADER_SIZE;
+            m_is_header_parsed = true;
+        }
+
+        while (m_size - m_pos >= FLV_PACKET_HEADER_SIZE)
+        {
+            const unsigned char *hdr = &m_data[m_pos];
+            const int payload_size = ParseFlvPacketHeader(hdr);
+            const int tag_type = hdr[4] & 0x1F;     // 8 - audio, 9 - video, 18 - script data (the upper bits are reserved / filter flag).
+
+            if ((size_t)payload_size > m_size - m_pos - FLV_PACKET_HEADER_SIZE)
+            {
+                fprintf(stderr, "CFlvMemoryParser: warning - truncated FLV tag at offset %zu (the stream ends)\n", m_pos);
+                m_pos = m_size;
+                return 0;
+            }
+
+            const unsigned char *data = &hdr[FLV_PACKET_HEADER_SIZE];
+            const int timestamp_ms = ParseFlvTimestamp(hdr);
+            m_pos += FLV_PACKET_HEADER_SIZE + (size_t)payload_size;
+
+            if ((tag_type != 9) || (payload_size < 2))
+            {
+                continue;   // Not a video tag (or a video tag without data).
+            }
+
+            const int header_size = Codec::VideoHeaderSize(data[0]);
+            int packet_type = 0;
+            int composition_time = 0;
+            bool is_keyframe = false;
+
+            if ((payload_size < std::max(header_size, AVC_PACKET_HEADER_SIZE)) || !Codec::ParseVideoHeader(data, &packet_type, &composition_time, &is_keyframe))
+            {
+                fprintf(stderr, "CFlvMemoryParser: bad video packet header\n");
+                return -1;
+            }
+
+            if (packet_type == FLV_PACKET_TYPE_SEQUENCE_START)
+            {
+                // Sequence header (the first video tag, and again if the encoder parameters changed).
+                m_configs.emplace_back();
+                m_configs.back().start_codes = m_start_codes;
+
+                if (!Codec::ParseDecoderConfig(&data[header_size], payload_size - header_size, &m_configs.back()))
+                {
+                    fprintf(stderr, "CFlvMemoryParser: bad sequence header\n");
+                    return -1;
+                }
+
+                continue;
+            }
+
+            if (packet_type != FLV_PACKET_TYPE_CODED_FRAMES)
+            {
+                continue;   // End of sequence (or Enhanced FLV metadata).
+            }
+
+            if (m_configs.empty())
+            {
+                fprintf(stderr, "CFlvMemoryParser: NAL units before the sequence header\n");
+                return -1;
+            }
+
+            const CAvcDecoderConfig *cfg = &m_configs.back();
+
+            if ((ParseAvccNalUnits<Codec>(&data[header_size], payload_size - header_size, &au->nal_list, cfg->nal_length_size, cfg->start_codes) < 0) ||
+                (InjectParameterSetViews<Codec>(cfg, &au->nal_list) < 0))
+            {
+                fprintf(stderr, "CFlvMemoryParser: bad NAL units at offset %zu\n", (size_t)(hdr - m_data));
+                return -1;
+            }
+
+            au->buffer = nullptr;
+            au->annexb_payload_offset = 0;
+            au->annexb_payload_len = au->nal_list.annexb_len;
+            au->pts_ms = timestamp_ms + composition_time;
+            au->dts_ms = timestamp_ms;
+            au->is_keyframe = is_keyframe;
+            m_n_access_units++;
+
+            return 1;
+        }
+
+        // The last 4 bytes are the size of the last tag (FFmpeg puts it as a footer).
+        return 0;
+    }
+};
+
+
+#endif // FLV_PARSER_H
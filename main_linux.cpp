@@ -25,7 +25,8 @@ The described concept is useful when:
    
 Requirements:
 The following implementation is compatible with Linux (tested under Ubuntu 18.04 64-bit).
-[Windows implementation can be found in main.cpp (merging the implementations is relatively simple)].
+[Windows implementation can be found in main_windows.cpp - the FLV parser and the AVCC to Annex B conversion are shared (flv_parser.h),
+ and each file implements the I/O layer of its platform (Windows uses overlapped named pipes and I/O completion port)].
 The implementation was tested with FFmpeg version 4.3-static.
 A static build of FFmpeg may be downloaded from: https://johnvansickle.com/ffmpeg/
 For testing, place the ffmpeg executable in the same path as the application (same directory as the ".out" file).
@@ -36,7 +37,7 @@ Installing OpenCV with C++ libraries: sudo apt install libopencv-dev (see: https
 Building:
 [I am using Console Application (Linux) project under Visual Studio 2017 (using SSH protocol with Ubuntu 18.04 installed in Virtual Box)]
 You may use the following command-line for building main_linux.cpp (the output is an executable file: pipe_flv2annexb_linux.out):
-g++ -o "pipe_flv2annexb_linux.out" "main_linux.cpp" -lopencv_core -lopencv_imgproc -lopencv_highgui -std=c++11 -Wall -fexceptions
+g++ -o "pipe_flv2annexb_linux.out" "main_linux.cpp" -lopencv_core -lopencv_imgproc -lopencv_highgui -std=c++11 -pthread -Wall -fexceptions
 
 Why FFmpeg?
 1. FFmpeg is free, and open sourced (LGPL 3.0 license, but ffmpeg static build is GPL 3.0).
@@ -64,7 +65,7 @@ And: https://batchloaf.wordpress.com/2017/02/12/a-simple-way-to-read-and-write-a
 Why H.264 (AVC)?
 1. In most cases, H.264 format is a system requirement.
 2. Most platforms supports H.264 hardware acceleration.
-   [Unfortunately FFmpeg does not support H.265 encoded FLV].
+   [FFmpeg 6.1 and later writes H.265 in Enhanced FLV (FourCC hvc1) - see DO_ENCODE_HEVC and CHevcCodec].
    
 Why FLV container?
 1. FLV container is simple, and well documented.
@@ -115,12 +116,13 @@ Adjusting stream format by setting FFmpeg flags:
 The following FFmpeg flags are used for removing some irrelevant data:
 	"-flvflags +no_sequence_end+no_metadata+no_duration_filesize"
 	The flags removes the file "footer" and some irrelevant metadata.
-The following FFmpeg flags are used for adding additional data: "-bsf:v dump_extra"
-	The "dump_extra" flag, forces the repetition of SPS and PPS NAL units for every key frame.
+The SPS and PPS NAL units are repeated before every key frame (IDR frame).
 	(Opposed to placing the SPS and PPS only once at the beginning of the file).
 	When using a file, there is no need to duplicate the SPS and PPS information.
 	When using a stream (i.e UDP streaming), there is no guarantee that the receiver 
 	receives the beginning of the stream (it needs to re-sync on next key frame).       
+	The "-bsf:v dump_extra" FFmpeg flag is not used: the SPS and PPS are taken from the AVC sequence header (the first FLV payload),
+	and injected before each IDR frame by the reader (the AVC sequence header also tells the size of the AVCC length fields).
 
 FLV (Flash Video) container format:    
 FLV stream begins with three letters "FLV" (we may use it for "sanity check").
@@ -165,14 +167,38 @@ Tested using FFmpeg 4.3-static under Ubuntu 18.04 64-bit
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/uio.h>    //Used for readv and writev
 #include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>   //Used for getrusage (benchmark)
+#include <sys/socket.h>     //Used for sendmmsg (RTP sender)
+#include <netinet/in.h>
+#include <netinet/udp.h>    //Used for UDP_SEGMENT (UDP GSO)
+#include <arpa/inet.h>
+#include <poll.h>
+#include <spawn.h>          //Used for posix_spawn
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <error.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <fcntl.h> //Used for setting PIPE buffer size
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <new>      //Used for constructing the shard rings in aligned memory (placement new)
+#include <cassert>
+
+#include "flv_parser.h" // FLV parser and AVCC to Annex B conversion (shared with main_windows.cpp)
 
 #include "opencv2/opencv.hpp"
 #include "opencv2/highgui.hpp"
@@ -182,6 +208,126 @@ extern int errno;
 //#define DO_TEST_ZERO_LATENCY  // Enable for testing FFmpeg with zero frames latency (raw frame in, encoded out...)
 #undef DO_TEST_ZERO_LATENCY     // Allow latency of multiple frames (first encoded frame is ready after multiple input raw video frames enters).
 
+#define DO_CONVERT_ANNEXB_IN_PLACE   // Enable for reading the FLV payload directly to the output buffer, and replacing the AVCC lengths with start codes "in place".
+//#undef DO_CONVERT_ANNEXB_IN_PLACE  // Read each NAL unit to a sketch buffer, and copy it to the output buffer (after the start code).
+
+//#define DO_WRITE_NAL_UNITS_WITH_WRITEV  // Enable for writing the NAL units views with writev (no contiguous Annex B payload at all) - overrides DO_CONVERT_ANNEXB_IN_PLACE.
+#undef DO_WRITE_NAL_UNITS_WITH_WRITEV     // Write contiguous Annex B payload with fwrite.
+
+//#define DO_TEST_MULTI_STREAM_FARM   // Enable for testing multiple concurrent FFmpeg processes, multiplexed by epoll event loops (CEncoderFarm).
+#undef DO_TEST_MULTI_STREAM_FARM      // Single stream (writer thread and reader thread).
+
+//#define DO_WRITE_RAW_FRAMES_WITH_VMSPLICE  // Enable for mapping the pages of the raw frames into stdin PIPE with vmsplice (the kernel doesn't copy the frames).
+#undef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE     // Write the raw frames to stdin PIPE (write copies each frame into the PIPE buffer).
+
+#define DO_MEASURE_LATENCY    // Enable for measuring the latency of each frame (printed as histograms at the end).
+//#undef DO_MEASURE_LATENCY   // No instrumentation.
+
+//#define DO_CONVERT_BGR_TO_YUV   // Enable for converting the synthetic BGR frames to planar YUV in process (SIMD kernels) - FFmpeg gets native raw input, and skips swscale.
+#undef DO_CONVERT_BGR_TO_YUV      // Write BGR frames (FFmpeg converts the pixels to yuv444p with swscale).
+
+#define DO_CONVERT_TO_YUV420P     // With DO_CONVERT_BGR_TO_YUV: convert to yuv420p (half the bytes per frame in the PIPE, the encoded video is 4:2:0).
+//#undef DO_CONVERT_TO_YUV420P    // With DO_CONVERT_BGR_TO_YUV: convert to yuv444p (the encoded video is 4:4:4, as with swscale conversion).
+
+// Trade-off: posix_spawn is faster with a large parent (many buffer pools and sessions), but it can't set PR_SET_PDEATHSIG - an orphan FFmpeg
+// ends only when it reads the end of stdin, or writes to the closed stdout PIPE (a child that is stuck, or that doesn't use the pipes, is left running).
+//#define DO_SPAWN_WITH_POSIX_SPAWN   // Enable for executing FFmpeg with posix_spawn (vfork semantics - the page tables of the parent are not copied).
+#undef DO_SPAWN_WITH_POSIX_SPAWN      // Execute FFmpeg with fork and execvp (the child asks for SIGTERM when the parent dies - no orphan FFmpeg processes).
+
+#define DO_USE_FFMPEG_WORKER_POOL     // With DO_TEST_MULTI_STREAM_FARM: the sessions lease pre-spawned FFmpeg workers (CFfmpegWorkerPool).
+//#undef DO_USE_FFMPEG_WORKER_POOL    // With DO_TEST_MULTI_STREAM_FARM: each session executes FFmpeg when it's created.
+
+//#define DO_RUN_BENCHMARK  // Enable for running the benchmark sweep (resolutions, frame counts, streams, PIPE sizes and read strategies) - one JSON line per run in stdout.
+#undef DO_RUN_BENCHMARK     // Encode the test video, and compare it to the reference (out.264).
+
+//#define DO_VERIFY_ACCESS_UNITS    // Enable for verifying the output in process: hash the Annex B access units, and compare them to the existing reference (out.264) - no reference FFmpeg process.
+#undef DO_VERIFY_ACCESS_UNITS       // Encode the reference (out.264) by a second FFmpeg process in each run (compare out.264 and out_avcc.264 after execution).
+
+//#define DO_SEND_RTP   // Enable for sending the access units over UDP to RTP_DEST_IP:RTP_DEST_PORT (RFC 6184 packetization, sendmmsg batches, paced by the FLV timestamps).
+#undef DO_SEND_RTP      // No network output (the access units are written only to the output file).
+
+#define DO_USE_UDP_GSO      // With DO_SEND_RTP: pass the FU-A fragments of a large NAL unit as one UDP GSO message (the kernel splits it to datagrams).
+//#undef DO_USE_UDP_GSO     // With DO_SEND_RTP: one message per RTP packet.
+
+//#define DO_ATTACH_FRAME_METADATA  // Enable for attaching metadata to each raw frame, and emitting it as SEI NAL unit with the matching access unit (the output differs from out.264).
+#undef DO_ATTACH_FRAME_METADATA     // The output is the encoded stream as is.
+
+//#define DO_TEST_LATE_SUBSCRIBER   // Enable for testing a subscriber that joins mid-stream: it starts from the latest IDR frame of the GOP cache (CGopCache), and writes out_late.264.
+#undef DO_TEST_LATE_SUBSCRIBER      // No GOP cache.
+
+//#define DO_TEST_CONVERT_FLV_FILES   // Enable for testing the file mode: record the stream to out.flv once, and convert mapped copies of it to Annex B in parallel (one thread per core).
+#undef DO_TEST_CONVERT_FLV_FILES      // Convert the stdout PIPE of FFmpeg (live stream).
+
+//#define DO_TEST_SHARDED_ENCODER     // Enable for testing one feed split by GOPs across several FFmpeg processes (merged in order to out_sharded.264).
+#undef DO_TEST_SHARDED_ENCODER        // One FFmpeg process encodes the whole feed.
+
+//#define DO_TEST_RATE_ADAPTATION     // Enable for testing the rate adaptive encoder: a link budget below the bitrate of the best level swaps FFmpeg workers of higher CRF at GOP boundaries (out_adaptive.264).
+#undef DO_TEST_RATE_ADAPTATION        // Fixed rate control (crf 10).
+
+//#define DO_EXPORT_METRICS   // Enable for exporting the metrics of the FFmpeg sessions (PIPEs traffic, blocked time, fill level, FLV tag sizes, child health) on http://METRICS_IP:METRICS_PORT/metrics.
+#undef DO_EXPORT_METRICS      // No metrics (the statistics are printed at the end).
+
+//#define DO_TEST_CRASH_RECOVERY  // Enable for testing crash recovery of the farm sessions: FFmpeg is killed mid-stream, respawned, and the output continues from the next IDR frame (out_recovered_<k>.264).
+#undef DO_TEST_CRASH_RECOVERY     // A session fails when FFmpeg ends unexpectedly.
+
+//#define DO_TEST_PARSER_BENCHMARK  // Enable for measuring the FLV parsers in isolation: out.flv is parsed from memory by 1 and N threads (GB/s and ns per NAL unit), and mutations of it are fuzzed (build with -fsanitize=address for catching out of bounds access).
+#undef DO_TEST_PARSER_BENCHMARK     // The FLV stream is parsed as it is read from FFmpeg.
+
+//#define DO_TEST_BUFFER_POOL   // Enable for testing CBufferPool at its memory bound: one size class holds all the memory, and the other classes are acquired (no FFmpeg).
+#undef DO_TEST_BUFFER_POOL      // The pool is tested by the stream.
+
+// Destination of the RTP stream (DO_SEND_RTP), and the maximum size of RTP packet (UDP payload - 1400 bytes leave room for tunnels headers in 1500 bytes MTU).
+#define RTP_DEST_IP         "127.0.0.1"
+#define RTP_DEST_PORT       5004
+#define RTP_MAX_PACKET_SIZE 1400
+
+// Metrics endpoint (DO_EXPORT_METRICS) - Prometheus text format (9464 is the default port of the Prometheus exporters of OpenTelemetry).
+#define METRICS_IP          "127.0.0.1"
+#define METRICS_PORT        9464
+
+// Encoder of the FFmpeg processes (see g_encoder_profiles): ENCODER_LIBX264 (ENCODER_LIBX265 with DO_ENCODE_HEVC).
+#define ENCODER_PROFILE     ENCODER_LIBX264
+
+//#define DO_USE_EXPERIMENTAL_ENCODER   // Enable for encoding with a hardware encoder (EXPERIMENTAL_ENCODER_PROFILE) - not verified on the hardware.
+#undef DO_USE_EXPERIMENTAL_ENCODER      // Encoder of the verified profiles (ENCODER_PROFILE).
+
+// Hardware encoder (see g_experimental_encoder_profiles): EXPERIMENTAL_ENCODER_NVENC (NVIDIA), EXPERIMENTAL_ENCODER_QSV (Intel Quick Sync Video)
+// or EXPERIMENTAL_ENCODER_VAAPI. The hardware encoders offload the encoding from the CPU - many more streams per machine (the CPU only converts
+// the pixels and the streams) - but their arguments and start codes conventions were never run on the hardware.
+#define EXPERIMENTAL_ENCODER_PROFILE    EXPERIMENTAL_ENCODER_NVENC
+
+//#define DO_ENCODE_HEVC    // Enable for encoding H.265 (ENCODER_LIBX265 - about 40% fewer bytes at the same quality): Enhanced FLV (FourCC hvc1) is converted to HEVC Annex B.
+#undef DO_ENCODE_HEVC       // H.264 (ENCODER_PROFILE).
+
+#if defined(DO_USE_EXPERIMENTAL_ENCODER) && defined(DO_ENCODE_HEVC)
+#error "The experimental hardware encoders are H.264 only - DO_USE_EXPERIMENTAL_ENCODER is not supported with DO_ENCODE_HEVC"
+#endif
+
+#if defined(DO_USE_EXPERIMENTAL_ENCODER) && defined(DO_RUN_BENCHMARK)
+#error "The benchmark sweep measures the verified encoders only - DO_USE_EXPERIMENTAL_ENCODER is not supported with DO_RUN_BENCHMARK"
+#endif
+
+#if defined(DO_ENCODE_HEVC) && defined(DO_SEND_RTP)
+#error "The RTP packetizer is H.264 only (RFC 6184) - DO_SEND_RTP is not supported with DO_ENCODE_HEVC"
+#endif
+
+#if defined(DO_ENCODE_HEVC) && defined(DO_ATTACH_FRAME_METADATA)
+#error "The metadata SEI is built as H.264 SEI NAL unit - DO_ATTACH_FRAME_METADATA is not supported with DO_ENCODE_HEVC"
+#endif
+
+#include <sys/mman.h>         // Used for mapping FLV recordings
+#include <sys/stat.h>         // Used for the size of FLV recordings (fstat)
+#include <sys/ioctl.h>        // Used for FIONREAD (PIPE fill level metrics)
+#include <sys/syscall.h>      // Used for pidfd_open (child process health metrics)
+
+#ifdef DO_CONVERT_BGR_TO_YUV
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>      // SSE4.1 and AVX2 intrinsics (the kernels are selected at runtime)
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+
 
 // Build synthetic "raw BGR" image for testing, image data is stored in <raw_img_bytes> output data buffer.
 // The synthetic video frame includes sequential numbering (as text).
@@ -201,733 +347,8629 @@ static void MakeRawFrameAsBytes(int width, int height, int i, unsigned char raw_
 }
 
 
-// Print error message and exits from the application.
-void ErrorExit(const char *error_essage)
+// Pixel format of the raw frames written to FFmpeg stdin (the "-pixel_format" of the rawvideo input), and the pixel format of the encoded video.
+#if defined(DO_CONVERT_BGR_TO_YUV) && defined(DO_CONVERT_TO_YUV420P)
+static const char *const g_raw_pixel_format = "yuv420p";
+static const char *const g_encoded_pixel_format = "yuv420p";
+#elif defined(DO_CONVERT_BGR_TO_YUV)
+static const char *const g_raw_pixel_format = "yuv444p";
+static const char *const g_encoded_pixel_format = "yuv444p";
+#else
+static const char *const g_raw_pixel_format = "bgr24";
+static const char *const g_encoded_pixel_format = "yuv444p";    // FFmpeg converts the pixels with swscale.
+#endif
+
+
+// Encoder profile: the FFmpeg encoder, its arguments, and the start codes of its Annex B stream (the converted stream matches the encoder bit exact).
+struct CEncoderProfile
 {
-    fprintf(stderr, "%s\n", error_essage);
-    exit(1);
+    const char *codec;              // FFmpeg encoder (-vcodec).
+    const char *annexb_format;      // FFmpeg muxer of the Annex B reference stream (-f of out.264).
+    const char *device_arg;         // Initialization of the hardware device (before the input), "" for none.
+    const char *filter_arg;         // Upload of the raw frames to the hardware frames (-vf), "" for none.
+    const char *pixel_format;       // Encoded pixel format (-pix_fmt), nullptr for g_encoded_pixel_format, "" for the format of the filter.
+    const char *low_latency_arg;    // Zero frames latency tuning (DO_TEST_ZERO_LATENCY): no B-frames, no lookahead, no frames queued in the encoder.
+    const char *default_arg;        // Tuning that allows latency of multiple frames.
+    int default_depth;              // Encoder pipeline depth in frames with default_arg (checked by DO_MEASURE_LATENCY), -1 if not known.
+    const char *quality_arg;        // Constant quality rate control - format of the quality level (the CRF of libx264, the QP of the hardware encoders).
+    const char *fixed_gop_arg;      // No scene cut detection - IDR frame every GOP size frames exactly.
+    EStartCodeConvention start_codes;   // Verified against the Annex B stream of the encoder in each run (see VerifyStartCodeConvention).
+};
+
+enum EEncoderProfile
+{
+    ENCODER_LIBX264,
+    ENCODER_LIBX265     // HEVC (DO_ENCODE_HEVC).
+};
+
+// Profiles verified against the encoder: the bit exact conversion, the start codes conventions and the pipeline depth.
+static const CEncoderProfile g_encoder_profiles[] =
+{
+    // libx264 (software).
+    { "libx264", "h264", "", "", nullptr,
+      "-x264-params bframes=0:force-cfr=1:no-mbtree=1:sync-lookahead=0:sliced-threads=1:rc-lookahead=0 ",
+      "-bf 3 ",
+      37,   // x264 holds max(bframes, rc-lookahead) = 40 frames (mb-tree, rc-lookahead 40 of preset medium), and the anchor frame of each
+            // mini-GOP is encoded before its 3 B-frames - it leaves the encoder 3 frames before its source frame position (the minimum).
+      "-crf %d ",
+      "-sc_threshold 0 ",
+      START_CODES_LIBX264 },
+
+    // libx265 (software HEVC) - the FLV muxer of FFmpeg 6.1 and later writes HEVC as Enhanced FLV.
+    { "libx265", "hevc", "", "", nullptr,
+      "-preset ultrafast -tune zerolatency ",
+      "-bf 3 ",
+      -1,   // Depends on the frame threads and the lookahead slices of x265 (the number of cores).
+      "-crf %d ",
+      "-x265-params scenecut=0 ",
+      START_CODES_X265 }
+};
+
+#ifdef DO_USE_EXPERIMENTAL_ENCODER
+enum EExperimentalEncoderProfile
+{
+    EXPERIMENTAL_ENCODER_NVENC,
+    EXPERIMENTAL_ENCODER_QSV,
+    EXPERIMENTAL_ENCODER_VAAPI
+};
+
+// Experimental: the arguments and the start codes conventions of NVENC, Quick Sync and VAAPI are taken from the FFmpeg documentation, and were
+// never run on the hardware - VerifyStartCodeConvention reports the NAL units of out.264 that don't match the convention of the profile.
+// They are kept out of g_encoder_profiles (and the benchmark sweep) until they are verified.
+static const CEncoderProfile g_experimental_encoder_profiles[] =
+{
+    // NVIDIA NVENC (the raw frames are uploaded by the encoder - yuv444p is encoded in High 4:4:4 profile).
+    { "h264_nvenc", "h264", "", "", nullptr,
+      "-preset p1 -tune ull -zerolatency 1 -delay 0 -bf 0 -rc-lookahead 0 ",
+      "-preset p4 -tune ll ",
+      -1,
+      "-rc constqp -qp %d ",
+      "-no-scenecut 1 -strict_gop 1 ",
+      START_CODES_ALL_LONG },
+
+    // Intel Quick Sync Video (system memory NV12 frames are uploaded by the encoder).
+    { "h264_qsv", "h264", "-init_hw_device qsv=hw -filter_hw_device hw ", "", "nv12",
+      "-preset veryfast -async_depth 1 -look_ahead 0 -bf 0 ",
+      "-preset medium ",
+      -1,
+      "-global_quality %d ",
+      "-adaptive_i 0 -adaptive_b 0 ",
+      START_CODES_QSV },
+
+    // VAAPI (Intel and AMD GPUs) - the frames are converted to NV12 and uploaded by the filter.
+    // There is no scene cut detection, and every I-frame is an IDR frame with idr_interval 0 (the default, set explicitly for the fixed GOP).
+    { "h264_vaapi", "h264", "-vaapi_device /dev/dri/renderD128 ", "-vf format=nv12,hwupload ", "",
+      "-async_depth 1 -bf 0 ",
+      "-bf 2 ",
+      -1,
+      "-rc_mode CQP -qp %d ",
+      "-idr_interval 0 ",
+      START_CODES_ALL_LONG }
+};
+#endif
+
+// Encoder profile selected by ENCODER_PROFILE (or DO_ENCODE_HEVC, DO_USE_EXPERIMENTAL_ENCODER), and the codec policy of its stream (see CAvcCodec).
+#ifdef DO_ENCODE_HEVC
+typedef CHevcCodec CVideoCodec;
+static const CEncoderProfile *const g_encoder_profile = &g_encoder_profiles[ENCODER_LIBX265];
+#elif defined(DO_USE_EXPERIMENTAL_ENCODER)
+typedef CAvcCodec CVideoCodec;
+static const CEncoderProfile *const g_encoder_profile = &g_experimental_encoder_profiles[EXPERIMENTAL_ENCODER_PROFILE];
+#else
+typedef CAvcCodec CVideoCodec;
+static const CEncoderProfile *const g_encoder_profile = &g_encoder_profiles[ENCODER_PROFILE];
+#endif
+
+
+// Return the size in bytes of a raw frame written to FFmpeg stdin (in g_raw_pixel_format).
+static int RawFrameSize(const int width, const int height)
+{
+#if defined(DO_CONVERT_BGR_TO_YUV) && defined(DO_CONVERT_TO_YUV420P)
+    return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);    // Full resolution Y plane, and half resolution U and V planes.
+#elif defined(DO_CONVERT_BGR_TO_YUV)
+    return width * height * 3;  // Three full resolution planes.
+#else
+    return width * height * 3;  // 3 bytes per pixel.
+#endif
 }
 
 
-// https://stackoverflow.com/questions/6171552/popen-simultaneous-read-and-write
-// As already answered, popen works in one direction.
-// If you need to read and write, You can create a pipe with pipe(), 
-// span a new process by fork() and exec functions and then redirect its input and outputs with dup2().
+#ifdef DO_CONVERT_BGR_TO_YUV
+// BGR to planar YUV conversion - BT.601 limited range ("TV range"), the 8 bits fixed point coefficients of FFmpeg swscale.
+// All the kernels compute exactly the same values (16 bits integer arithmetic, no intermediate rounding differences).
+// Y = ((66*R + 129*G + 25*B + 128) >> 8) + 16
+// U = ((-38*R - 74*G + 112*B + 128) >> 8) + 128
+// V = ((112*R - 94*G - 18*B + 128) >> 8) + 128
+// The 4:2:0 chroma is computed from the average (rounded) of the B, G, R values of each 2x2 block.
+static inline unsigned char BgrToY(const int b, const int g, const int r) { return (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16); }
+static inline unsigned char BgrToU(const int b, const int g, const int r) { return (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128); }
+static inline unsigned char BgrToV(const int b, const int g, const int r) { return (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128); }
 
-// CSubprocess executes a child process with stdin and stdout pipes.
-class CSubprocess
+
+// Row kernel: convert <width> BGR pixels to Y, U and V (full resolution) - <u> and <v> may be nullptr (Y only, for 4:2:0).
+typedef void (*BgrRowToYuv444Func)(const unsigned char *bgr, unsigned char *y, unsigned char *u, unsigned char *v, const int width);
+
+// Row kernel: convert two BGR rows of <width> pixels to (width + 1) / 2 U and V samples (4:2:0 chroma).
+typedef void (*BgrRowsToUv420Func)(const unsigned char *bgr0, const unsigned char *bgr1, unsigned char *u, unsigned char *v, const int width);
+
+
+// Scalar kernels (also used for the pixels remaining after the SIMD kernels).
+static void BgrRowToYuv444Scalar(const unsigned char *bgr, unsigned char *y, unsigned char *u, unsigned char *v, const int width)
 {
-private:
-    pid_t m_pid = 0;
-    int m_inpipefd[2] = { 0, 0 };	// m_inpipefd applies stdin pipe of the child process.
-    int m_outpipefd[2] = { 0, 0 };	// m_outpipefd applies stdout pipe of the child process.
+    for (int x = 0; x < width; x++)
+    {
+        const int b = bgr[3 * x], g = bgr[3 * x + 1], r = bgr[3 * x + 2];
 
-    char *m_args_as_char        = nullptr;	// Holds command arguments as charter array (array is modified by strtok function).
-    const char **m_args_list    = nullptr;	// Array of pointers to command arguments (each pointer points different argument).
-    bool m_is_stdin_pipe        = false;	// true if stdin pipe is configured to be opened.
-    bool m_is_stdout_pipe       = false;	// true if stdout pipe is configured to be opened.
+        y[x] = BgrToY(b, g, r);
 
-	// Constructor is private.
-	// Object can only be created by executing Popen (static member function).
-	// Note: using a function that returns an object and returns a pointer is safer (because there is a high probability for the object creation to fail)
-    CSubprocess()
+        if (u != nullptr)
+        {
+            u[x] = BgrToU(b, g, r);
+            v[x] = BgrToV(b, g, r);
+        }
+    }
+}
+
+static void BgrRowsToUv420Scalar(const unsigned char *bgr0, const unsigned char *bgr1, unsigned char *u, unsigned char *v, const int width)
+{
+    for (int x = 0; x < width; x += 2)
     {
+        const int x1 = std::min(x + 1, width - 1);  // The last column is repeated when the width is odd.
+        const int b = (bgr0[3 * x]     + bgr0[3 * x1]     + bgr1[3 * x]     + bgr1[3 * x1]     + 2) >> 2;
+        const int g = (bgr0[3 * x + 1] + bgr0[3 * x1 + 1] + bgr1[3 * x + 1] + bgr1[3 * x1 + 1] + 2) >> 2;
+        const int r = (bgr0[3 * x + 2] + bgr0[3 * x1 + 2] + bgr1[3 * x + 2] + bgr1[3 * x1 + 2] + 2) >> 2;
+
+        u[x / 2] = BgrToU(b, g, r);
+        v[x / 2] = BgrToV(b, g, r);
     }
+}
 
-    ~CSubprocess()
+
+#if defined(__x86_64__) || defined(__i386__)
+// x86 kernels - compiled with target attributes, and selected at runtime (the build doesn't need -msse4.1 or -mavx2).
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+
+// Deinterleave 16 BGR pixels (48 bytes) to 16 B, 16 G and 16 R bytes (pshufb of each of the three 16 bytes parts).
+static inline SIMD_TARGET_SSE41 void Deinterleave16Bgr(const unsigned char *bgr, __m128i *b, __m128i *g, __m128i *r)
+{
+    const __m128i p0 = _mm_loadu_si128((const __m128i*)bgr);
+    const __m128i p1 = _mm_loadu_si128((const __m128i*)(bgr + 16));
+    const __m128i p2 = _mm_loadu_si128((const __m128i*)(bgr + 32));
+
+    *b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                   _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+                                   _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    *g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                   _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+                                   _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    *r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                   _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+                                   _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Y, U and V of 8 pixels (16 bits lanes) - the sum of Y is up to 56228, so it is shifted as unsigned.
+static inline SIMD_TARGET_SSE41 __m128i BgrToY8(const __m128i b, const __m128i g, const __m128i r)
+{
+    __m128i s = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                              _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(s, 8), _mm_set1_epi16(16));
+}
+
+static inline SIMD_TARGET_SSE41 __m128i BgrToU8(const __m128i b, const __m128i g, const __m128i r)
+{
+    __m128i s = _mm_add_epi16(_mm_sub_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)), _mm_mullo_epi16(r, _mm_set1_epi16(38))),
+                              _mm_sub_epi16(_mm_set1_epi16(128), _mm_mullo_epi16(g, _mm_set1_epi16(74))));
+    return _mm_add_epi16(_mm_srai_epi16(s, 8), _mm_set1_epi16(128));
+}
+
+static inline SIMD_TARGET_SSE41 __m128i BgrToV8(const __m128i b, const __m128i g, const __m128i r)
+{
+    __m128i s = _mm_add_epi16(_mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)), _mm_mullo_epi16(g, _mm_set1_epi16(94))),
+                              _mm_sub_epi16(_mm_set1_epi16(128), _mm_mullo_epi16(b, _mm_set1_epi16(18))));
+    return _mm_add_epi16(_mm_srai_epi16(s, 8), _mm_set1_epi16(128));
+}
+
+// Average of each 2x2 block of 16x2 bytes (8 results in 16 bits lanes): (sum + 2) >> 2.
+static inline SIMD_TARGET_SSE41 __m128i Average2x2(const __m128i row0, const __m128i row1)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    __m128i s = _mm_add_epi16(_mm_maddubs_epi16(row0, ones), _mm_maddubs_epi16(row1, ones));    // Sums of horizontal pairs.
+    return _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2);
+}
+
+static SIMD_TARGET_SSE41 void BgrRowToYuv444Sse41(const unsigned char *bgr, unsigned char *y, unsigned char *u, unsigned char *v, const int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
     {
-        if (m_args_list != nullptr)
-        {
-            delete[] m_args_list;	// Free allocated memory
-        }
+        __m128i b, g, r;
+        Deinterleave16Bgr(&bgr[3 * x], &b, &g, &r);
 
-        if (m_args_as_char != nullptr)
+        const __m128i b_lo = _mm_cvtepu8_epi16(b), b_hi = _mm_unpackhi_epi8(b, zero);
+        const __m128i g_lo = _mm_cvtepu8_epi16(g), g_hi = _mm_unpackhi_epi8(g, zero);
+        const __m128i r_lo = _mm_cvtepu8_epi16(r), r_hi = _mm_unpackhi_epi8(r, zero);
+
+        _mm_storeu_si128((__m128i*)&y[x], _mm_packus_epi16(BgrToY8(b_lo, g_lo, r_lo), BgrToY8(b_hi, g_hi, r_hi)));
+
+        if (u != nullptr)
         {
-            delete[] m_args_as_char;	// Free allocated memory
+            _mm_storeu_si128((__m128i*)&u[x], _mm_packus_epi16(BgrToU8(b_lo, g_lo, r_lo), BgrToU8(b_hi, g_hi, r_hi)));
+            _mm_storeu_si128((__m128i*)&v[x], _mm_packus_epi16(BgrToV8(b_lo, g_lo, r_lo), BgrToV8(b_hi, g_hi, r_hi)));
         }
     }
 
+    BgrRowToYuv444Scalar(&bgr[3 * x], &y[x], (u != nullptr) ? &u[x] : nullptr, (v != nullptr) ? &v[x] : nullptr, width - x);
+}
 
-public:
-    // Executes child process with (optional) stdin and stdout pipes.
-	// Return pointer to CSubprocess object in case of success, and nullptr in case of failure.
-    // https://stackoverflow.com/questions/12596839/how-to-call-execl-in-c-with-the-proper-arguments
-    // cmd - may be full path (like "/usr/bin/ffmpeg").
-    // process_name - Process name applies argv[0] (like "ffmpeg").
-    // cmd_args - command arguments separated by spaces (like "-g 10 -pix_fmt yuv444p -crf 10").
-	// Note: arguments with spaces (like "my video file.264") are not supported by current implementation.
-    static CSubprocess *Popen(const std::string cmd, 
-                              const std::string process_name,
-                              const std::string cmd_args,
-                              const bool is_stdin_pipe = false, const bool is_stdout_pipe = false, const int buf_size = 0)
+static SIMD_TARGET_SSE41 void BgrRowsToUv420Sse41(const unsigned char *bgr0, const unsigned char *bgr1, unsigned char *u, unsigned char *v, const int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
     {
-        CSubprocess *sp = new CSubprocess();	// A CSubprocess object is created.
+        __m128i b0, g0, r0, b1, g1, r1;
+        Deinterleave16Bgr(&bgr0[3 * x], &b0, &g0, &r0);
+        Deinterleave16Bgr(&bgr1[3 * x], &b1, &g1, &r1);
 
-        int sts;
+        const __m128i b = Average2x2(b0, b1), g = Average2x2(g0, g1), r = Average2x2(r0, r1);
 
-        sp->m_args_as_char = new char[cmd_args.length() + 1];
-        strcpy(sp->m_args_as_char, cmd_args.c_str());	//Copy cmd_args from std:string to character array (going to be cut to tokens later).
+        const __m128i u8 = BgrToU8(b, g, r), v8 = BgrToV8(b, g, r);
 
-        sp->m_is_stdin_pipe     = is_stdin_pipe;
-        sp->m_is_stdout_pipe    = is_stdout_pipe;
-        
-        // Count number of spaces in cmd_args (applies number of arguments).
-        int n_spaces = (int)std::count(cmd_args.begin(), cmd_args.end(), ' ');
+        _mm_storel_epi64((__m128i*)&u[x / 2], _mm_packus_epi16(u8, u8));
+        _mm_storel_epi64((__m128i*)&v[x / 2], _mm_packus_epi16(v8, v8));
+    }
 
-        // Allocate n_spaces + 10, (m_args_list[0] is process name, last one is NULL, and allocate few spares).
-        sp->m_args_list = new const char*[n_spaces + 10];
+    BgrRowsToUv420Scalar(&bgr0[3 * x], &bgr1[3 * x], &u[x / 2], &v[x / 2], width - x);
+}
 
-        // First argument is process name
-        sp->m_args_list[0] = process_name.c_str();
 
-        // Split cmd_args by space.
-        // http://www.cplusplus.com/reference/cstring/strtok/
-        // Build list of pointers to arguments strings (zero terminated characters array).
-        int arg_count = 1;
-        char *pch = strtok(sp->m_args_as_char, " ");
-        while (pch != NULL)
-        {
-            sp->m_args_list[arg_count] = pch;
-            arg_count++;
-            pch = strtok(NULL, " ");
-        }
+// AVX2 kernels: the same arithmetic on 16 lanes of 16 bits (the pixels are deinterleaved with 128 bits pshufb).
+static inline SIMD_TARGET_AVX2 __m256i BgrToY16(const __m256i b, const __m256i g, const __m256i r)
+{
+    __m256i s = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)), _mm256_mullo_epi16(g, _mm256_set1_epi16(129))),
+                                 _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)), _mm256_set1_epi16(128)));
+    return _mm256_add_epi16(_mm256_srli_epi16(s, 8), _mm256_set1_epi16(16));
+}
 
-        // Argument list ends with NULL
-        sp->m_args_list[arg_count] = NULL;
+static inline SIMD_TARGET_AVX2 __m256i BgrToU16(const __m256i b, const __m256i g, const __m256i r)
+{
+    __m256i s = _mm256_add_epi16(_mm256_sub_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(112)), _mm256_mullo_epi16(r, _mm256_set1_epi16(38))),
+                                 _mm256_sub_epi16(_mm256_set1_epi16(128), _mm256_mullo_epi16(g, _mm256_set1_epi16(74))));
+    return _mm256_add_epi16(_mm256_srai_epi16(s, 8), _mm256_set1_epi16(128));
+}
 
-        if (is_stdin_pipe)
-        {
-            // Create a pipe for the child process's STDOUT.
-            // https://linux.die.net/man/2/pipe
-            // int pipe(int pipefd[2]);
-            // pipe() creates a pipe, a unidirectional data channel that can be used for interprocess communication.
-            // The array pipefd is used to return two file descriptors referring to the ends of the pipe.pipefd[0] refers to the read end of the pipe.
-            // pipefd[1] refers to the write end of the pipe.
-            // Data written to the write end of the pipe is buffered by the kernel until it is read from the read end of the pipe
-            // Return Value: On success, zero is returned. On error, -1 is returned, and errno is set appropriately.
-            sts = pipe(sp->m_outpipefd);
+static inline SIMD_TARGET_AVX2 __m256i BgrToV16(const __m256i b, const __m256i g, const __m256i r)
+{
+    __m256i s = _mm256_add_epi16(_mm256_sub_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(112)), _mm256_mullo_epi16(g, _mm256_set1_epi16(94))),
+                                 _mm256_sub_epi16(_mm256_set1_epi16(128), _mm256_mullo_epi16(b, _mm256_set1_epi16(18))));
+    return _mm256_add_epi16(_mm256_srai_epi16(s, 8), _mm256_set1_epi16(128));
+}
 
-            if (sts != 0)
-            {
-                fprintf(stderr, "Error: fail to create pipe for stdout pipe, errno = %d.\n", errno);
-                delete sp;
-                return nullptr; // Returning nullptr  indication for an error.
-            }            
-        }
+// Pack 16 lanes of 16 bits to 16 bytes (saturated).
+static inline SIMD_TARGET_AVX2 __m128i Pack16(const __m256i x)
+{
+    return _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+}
 
-        if (is_stdout_pipe)
-        {
-            // Create a pipe for the child process's STDIN.
-            sts = pipe(sp->m_inpipefd);
+static SIMD_TARGET_AVX2 void BgrRowToYuv444Avx2(const unsigned char *bgr, unsigned char *y, unsigned char *u, unsigned char *v, const int width)
+{
+    int x = 0;
 
-            if (sts != 0)
-            {
-                fprintf(stderr, "Error: fail to create pipe for stdin pipe, errno = %d.\n", errno);
-                delete sp;
-                return nullptr; // Returning nullptr  indication for an error.
-            }
-        }
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i b8, g8, r8;
+        Deinterleave16Bgr(&bgr[3 * x], &b8, &g8, &r8);
 
-        // Create the child process.
-        // https://www.man7.org/linux/man-pages/man2/fork.2.html
-        // fork() creates a new process by duplicating the calling process.
-        // The new process is referred to as the child process.
-        // The calling process is referred to as the parent process.
-        // The child process is an exact duplicate of the parent process except for the following points:
-        // ... (see documentation)
-        // RETURN VALUE:
-        // On success, the PID of the child process is returned in the parent, and 0 is returned in the child.
-        // On failure, -1 is returned in the parent, no child process is created, and errno is set appropriately.       
-        sp->m_pid = fork();
+        const __m256i b = _mm256_cvtepu8_epi16(b8), g = _mm256_cvtepu8_epi16(g8), r = _mm256_cvtepu8_epi16(r8);
 
-        if (sp->m_pid == (-1))
+        _mm_storeu_si128((__m128i*)&y[x], Pack16(BgrToY16(b, g, r)));
+
+        if (u != nullptr)
         {
-            fprintf(stderr, "Error: fork failed, errno = %d.\n", errno);
-            delete sp;
-            return nullptr; // Returning nullptr  indication for an error.
+            _mm_storeu_si128((__m128i*)&u[x], Pack16(BgrToU16(b, g, r)));
+            _mm_storeu_si128((__m128i*)&v[x], Pack16(BgrToV16(b, g, r)));
         }
+    }
 
-        // On success 0 is returned in the child.
-        if (sp->m_pid == 0)
-        {
-            // The following code is executed in the child process
-            //////////////////////////////////////////////////////////////////////////
-            int child_sts;
+    BgrRowToYuv444Scalar(&bgr[3 * x], &y[x], (u != nullptr) ? &u[x] : nullptr, (v != nullptr) ? &v[x] : nullptr, width - x);
+}
 
-            if (is_stdin_pipe)
-            {
-                // https://man7.org/linux/man-pages/man2/dup.2.html
-                // duplicate a file descriptor
-                // The dup() system call creates a copy of the file descriptor oldfd, using the lowest-numbered unused file descriptor for the new descriptor.
-                // After a successful return, the old and new file descriptors may be used interchangeably...
-                // The dup2() system call performs the same task as dup(), but instead of using the lowest-numbered unused file descriptor, it uses the file  descriptor number specified in newfd.
-                //
-                // RETURN VALUE:
-                // On success, these system calls return the new file descriptor.
-                // On error, -1 is returned, and errno is set appropriately.
-                child_sts = dup2(sp->m_outpipefd[0], STDIN_FILENO);
-                if (child_sts == (-1))
-                {
-                    fprintf(stderr, "Error: dup2 STDIN_FILENO failed, errno = %d.\n", errno); exit(-1);
-                }
+static SIMD_TARGET_AVX2 void BgrRowsToUv420Avx2(const unsigned char *bgr0, const unsigned char *bgr1, unsigned char *u, unsigned char *v, const int width)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
 
-                // Close unused ends of pipe (Rotem).
-                child_sts = close(sp->m_outpipefd[1]);
-                if (child_sts == (-1))
-                {
-                    fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed in child process, errno = %d.\n", errno);
-                }
+    for (; x + 32 <= width; x += 32)
+    {
+        __m128i b0[2], g0[2], r0[2], b1[2], g1[2], r1[2];
+
+        for (int h = 0; h < 2; h++)
+        {
+            Deinterleave16Bgr(&bgr0[3 * (x + 16 * h)], &b0[h], &g0[h], &r0[h]);
+            Deinterleave16Bgr(&bgr1[3 * (x + 16 * h)], &b1[h], &g1[h], &r1[h]);
+        }
+
+        // Each 128 bits lane holds 16 pixels (8 chroma samples), so the horizontal pairs don't cross the lanes.
+        #define AVERAGE_2X2_AVX2(c0, c1) _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16( \
+            _mm256_maddubs_epi16(_mm256_inserti128_si256(_mm256_castsi128_si256(c0[0]), c0[1], 1), ones), \
+            _mm256_maddubs_epi16(_mm256_inserti128_si256(_mm256_castsi128_si256(c1[0]), c1[1], 1), ones)), two), 2)
+
+        const __m256i b = AVERAGE_2X2_AVX2(b0, b1), g = AVERAGE_2X2_AVX2(g0, g1), r = AVERAGE_2X2_AVX2(r0, r1);
+
+        #undef AVERAGE_2X2_AVX2
+
+        _mm_storeu_si128((__m128i*)&u[x / 2], Pack16(BgrToU16(b, g, r)));
+        _mm_storeu_si128((__m128i*)&v[x / 2], Pack16(BgrToV16(b, g, r)));
+    }
+
+    BgrRowsToUv420Sse41(&bgr0[3 * x], &bgr1[3 * x], &u[x / 2], &v[x / 2], width - x);
+}
+#elif defined(__ARM_NEON)
+// NEON kernels - vld3q_u8 deinterleaves 16 BGR pixels.
+// Y is computed in unsigned 16 bits lanes, U and V in signed 16 bits lanes (the same values as the scalar kernels).
+static inline uint8x8_t BgrToY8Neon(const uint8x8_t b, const uint8x8_t g, const uint8x8_t r)
+{
+    uint16x8_t s = vmlal_u8(vmlal_u8(vmull_u8(r, vdup_n_u8(66)), g, vdup_n_u8(129)), b, vdup_n_u8(25));
+    return vadd_u8(vshrn_n_u16(vaddq_u16(s, vdupq_n_u16(128)), 8), vdup_n_u8(16));
+}
+
+static inline uint8x8_t BgrToU8Neon(const int16x8_t b, const int16x8_t g, const int16x8_t r)
+{
+    int16x8_t s = vmlaq_n_s16(vmlaq_n_s16(vmlaq_n_s16(vdupq_n_s16(128), r, -38), g, -74), b, 112);
+    return vqmovun_s16(vaddq_s16(vshrq_n_s16(s, 8), vdupq_n_s16(128)));
+}
+
+static inline uint8x8_t BgrToV8Neon(const int16x8_t b, const int16x8_t g, const int16x8_t r)
+{
+    int16x8_t s = vmlaq_n_s16(vmlaq_n_s16(vmlaq_n_s16(vdupq_n_s16(128), r, 112), g, -94), b, -18);
+    return vqmovun_s16(vaddq_s16(vshrq_n_s16(s, 8), vdupq_n_s16(128)));
+}
+
+static inline int16x8_t WidenNeon(const uint8x8_t x)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(x));
+}
+
+static void BgrRowToYuv444Neon(const unsigned char *bgr, unsigned char *y, unsigned char *u, unsigned char *v, const int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        const uint8x16x3_t p = vld3q_u8(&bgr[3 * x]);   // val[0] = B, val[1] = G, val[2] = R
+
+        vst1q_u8(&y[x], vcombine_u8(BgrToY8Neon(vget_low_u8(p.val[0]), vget_low_u8(p.val[1]), vget_low_u8(p.val[2])),
+                                    BgrToY8Neon(vget_high_u8(p.val[0]), vget_high_u8(p.val[1]), vget_high_u8(p.val[2]))));
+
+        if (u != nullptr)
+        {
+            const int16x8_t b_lo = WidenNeon(vget_low_u8(p.val[0])), b_hi = WidenNeon(vget_high_u8(p.val[0]));
+            const int16x8_t g_lo = WidenNeon(vget_low_u8(p.val[1])), g_hi = WidenNeon(vget_high_u8(p.val[1]));
+            const int16x8_t r_lo = WidenNeon(vget_low_u8(p.val[2])), r_hi = WidenNeon(vget_high_u8(p.val[2]));
+
+            vst1q_u8(&u[x], vcombine_u8(BgrToU8Neon(b_lo, g_lo, r_lo), BgrToU8Neon(b_hi, g_hi, r_hi)));
+            vst1q_u8(&v[x], vcombine_u8(BgrToV8Neon(b_lo, g_lo, r_lo), BgrToV8Neon(b_hi, g_hi, r_hi)));
+        }
+    }
+
+    BgrRowToYuv444Scalar(&bgr[3 * x], &y[x], (u != nullptr) ? &u[x] : nullptr, (v != nullptr) ? &v[x] : nullptr, width - x);
+}
+
+static void BgrRowsToUv420Neon(const unsigned char *bgr0, const unsigned char *bgr1, unsigned char *u, unsigned char *v, const int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        const uint8x16x3_t p0 = vld3q_u8(&bgr0[3 * x]);
+        const uint8x16x3_t p1 = vld3q_u8(&bgr1[3 * x]);
+
+        // Sums of horizontal pairs of both rows, and rounding shift: (sum + 2) >> 2.
+        const int16x8_t b = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(p0.val[0]), vpaddlq_u8(p1.val[0])), 2));
+        const int16x8_t g = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(p0.val[1]), vpaddlq_u8(p1.val[1])), 2));
+        const int16x8_t r = vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(p0.val[2]), vpaddlq_u8(p1.val[2])), 2));
+
+        vst1_u8(&u[x / 2], BgrToU8Neon(b, g, r));
+        vst1_u8(&v[x / 2], BgrToV8Neon(b, g, r));
+    }
+
+    BgrRowsToUv420Scalar(&bgr0[3 * x], &bgr1[3 * x], &u[x / 2], &v[x / 2], width - x);
+}
+#endif
+
+
+// Kernels selected for the CPU (x86 kernels are selected by the CPU features at runtime).
+struct CBgrToYuvKernels
+{
+    BgrRowToYuv444Func row_to_yuv444;
+    BgrRowsToUv420Func rows_to_uv420;
+    const char *name;
+};
+
+static CBgrToYuvKernels SelectBgrToYuvKernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return CBgrToYuvKernels{ BgrRowToYuv444Avx2, BgrRowsToUv420Avx2, "AVX2" };
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return CBgrToYuvKernels{ BgrRowToYuv444Sse41, BgrRowsToUv420Sse41, "SSE4.1" };
+    }
+#elif defined(__ARM_NEON)
+    return CBgrToYuvKernels{ BgrRowToYuv444Neon, BgrRowsToUv420Neon, "NEON" };
+#endif
+
+    return CBgrToYuvKernels{ BgrRowToYuv444Scalar, BgrRowsToUv420Scalar, "scalar" };
+}
+
+static const CBgrToYuvKernels *GetBgrToYuvKernels()
+{
+    static const CBgrToYuvKernels kernels = SelectBgrToYuvKernels();    // Thread safe initialization (C++11), selected once.
+
+    return &kernels;
+}
+
+
+// Convert BGR frame (<width>*3 bytes per row) to planar YUV frame in g_raw_pixel_format (Y plane, then U plane, then V plane).
+// The output is RawFrameSize(width, height) bytes - FFmpeg rawvideo input needs no conversion (no swscale).
+static void ConvertBgrToYuv(const unsigned char *bgr, const int width, const int height, unsigned char *yuv)
+{
+    const CBgrToYuvKernels *k = GetBgrToYuvKernels();
+    const int stride = width * 3;
+    unsigned char *y_plane = yuv;
+
+#ifdef DO_CONVERT_TO_YUV420P
+    const int chroma_width = (width + 1) / 2;
+    unsigned char *u_plane = &yuv[width * height];
+    unsigned char *v_plane = &u_plane[chroma_width * ((height + 1) / 2)];
+
+    for (int row = 0; row < height; row += 2)
+    {
+        const int row1 = std::min(row + 1, height - 1);     // The last row is repeated when the height is odd.
+
+        k->row_to_yuv444(&bgr[row * stride], &y_plane[row * width], nullptr, nullptr, width);
+
+        if (row1 != row)
+        {
+            k->row_to_yuv444(&bgr[row1 * stride], &y_plane[row1 * width], nullptr, nullptr, width);
+        }
+
+        k->rows_to_uv420(&bgr[row * stride], &bgr[row1 * stride], &u_plane[(row / 2) * chroma_width], &v_plane[(row / 2) * chroma_width], width);
+    }
+#else
+    unsigned char *u_plane = &yuv[width * height];
+    unsigned char *v_plane = &u_plane[width * height];
+
+    for (int row = 0; row < height; row++)
+    {
+        k->row_to_yuv444(&bgr[row * stride], &y_plane[row * width], &u_plane[row * width], &v_plane[row * width], width);
+    }
+#endif
+}
+#endif
+
+
+// Return BGR sketch buffer for MakeRawFrame (the synthetic frame is drawn in BGR, and converted to YUV) - nullptr if the frames are not converted.
+static unsigned char *NewBgrSketchBuffer(const int width, const int height)
+{
+#ifdef DO_CONVERT_BGR_TO_YUV
+    return new unsigned char[width * height * 3];
+#else
+    (void)width;
+    (void)height;
+    return nullptr;
+#endif
+}
+
+
+// Build synthetic raw frame in g_raw_pixel_format (RawFrameSize bytes) to <raw_frame>.
+// <bgr_sketch> - Buffer returned by NewBgrSketchBuffer (the frame is drawn to <bgr_sketch>, and converted to <raw_frame>).
+static void MakeRawFrame(const int width, const int height, const int i, unsigned char *bgr_sketch, unsigned char *raw_frame)
+{
+#ifdef DO_CONVERT_BGR_TO_YUV
+    MakeRawFrameAsBytes(width, height, i, bgr_sketch);
+    ConvertBgrToYuv(bgr_sketch, width, height, raw_frame);
+#else
+    (void)bgr_sketch;
+    MakeRawFrameAsBytes(width, height, i, raw_frame);
+#endif
+}
+
+
+// Print error message and exits from the application.
+void ErrorExit(const char *error_essage)
+{
+    fprintf(stderr, "%s\n", error_essage);
+    exit(1);
+}
+
+
+// Monotonic clock in nanoseconds (CLOCK_MONOTONIC is not affected by changes of the system time).
+static inline int64_t MonotonicNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+
+// https://stackoverflow.com/questions/6171552/popen-simultaneous-read-and-write
+// As already answered, popen works in one direction.
+// If you need to read and write, You can create a pipe with pipe(), 
+// span a new process by fork() and exec functions and then redirect its input and outputs with dup2().
+
+// Traffic counters of a PIPE (used by the benchmark).
+struct CPipeCounters
+{
+    int64_t n_bytes = 0;
+    int64_t n_syscalls = 0;     // System calls that access the PIPE (read, write, readv, poll, vmsplice).
+
+    void add(const CPipeCounters &other)
+    {
+        n_bytes += other.n_bytes;
+        n_syscalls += other.n_syscalls;
+    }
+};
+
+
+// Single writer counter of the metrics (see CSessionMetrics): updated by one thread, and read by the scrape thread at any time.
+// The update is a relaxed load and store (no locked read-modify-write instruction) - the cost is the same as updating a plain variable.
+class CMetricCounter
+{
+private:
+    std::atomic<int64_t> m_value;
+
+public:
+    CMetricCounter() : m_value(0)
+    {
+    }
+
+    void add(const int64_t n) { m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(const int64_t n) { m_value.store(n, std::memory_order_relaxed); }
+    int64_t get() const { return m_value.load(std::memory_order_relaxed); }
+};
+
+
+// Operational metrics of one FFmpeg session (a CSubprocess with its PIPEs): traffic, frames and blocked time of each PIPE,
+// PIPE fill level, FLV tag sizes and the health of the child process.
+// Each PIPE is updated only by the thread that uses it (per thread counters in separate cache lines - no locks, and no cache line ping-pong),
+// and the counters are aggregated when the metrics are scraped (see CMetricsExporter).
+// The object is owned by CMetricsExporter (it outlives the session - the final values are exported after the child process ends).
+class CSessionMetrics
+{
+public:
+    static const int N_TAG_SIZE_BUCKETS = 8;    // FLV tags up to 1KB, 4KB, 16KB ... 4MB, and larger.
+    static const int FILL_SAMPLE_PERIOD = 16;   // FIONREAD is a system call - the fill level is sampled once per 16 frames (or FLV tags).
+
+    // Counters of one PIPE (updated by a single thread).
+    struct CPipeMetrics
+    {
+        CMetricCounter n_bytes;
+        CMetricCounter n_frames;        // Raw frames written to stdin PIPE, FLV tags read from stdout PIPE.
+        CMetricCounter blocked_ns;      // Time blocked in the system calls (stdin: FFmpeg doesn't keep up, stdout: the parser stalls waiting for FFmpeg).
+        CMetricCounter fill_bytes;      // Bytes in the PIPE at the last sample (FIONREAD).
+        CMetricCounter max_fill_bytes;
+        int n_until_sample = 0;         // Used only by the thread of the PIPE.
+        char padding[64];               // The counters of the other PIPE are in other cache lines.
+    };
+
+private:
+    std::string m_name;
+    CPipeMetrics m_stdin;
+    CPipeMetrics m_stdout;
+    CMetricCounter m_tag_size_buckets[N_TAG_SIZE_BUCKETS];     // Updated by the stdout thread (non cumulative - aggregated on scrape).
+    CMetricCounter m_tag_bytes;
+
+    // Health of the child process - updated by the thread that reaps the child, or by the watchdog thread of the exporter (pidfd readable).
+    std::atomic<int> m_pid;
+    std::atomic<int> m_exit_code;       // Exit code of the child process, 128 + signal number if killed by a signal, -1 while running.
+
+    // The pidfd is replaced when the session respawns the child - the generation identifies the pidfd that the watchdog thread polls
+    // (the number of a closed pidfd may be reused by the pidfd of the next child).
+    std::mutex m_pidfd_lock;
+    int m_pidfd                 = -1;   // -1 if pidfd_open is not supported (Linux 5.3) - the exit is reported when the child is reaped.
+    int64_t m_pidfd_generation  = 0;
+
+    static void SampleFill(CPipeMetrics *metrics, const int fd)
+    {
+        if (--metrics->n_until_sample > 0)
+        {
+            return;
+        }
+
+        metrics->n_until_sample = FILL_SAMPLE_PERIOD;
+        int n_bytes = 0;
+
+        if ((fd >= 0) && (ioctl(fd, FIONREAD, &n_bytes) == 0))
+        {
+            metrics->fill_bytes.set(n_bytes);
+            metrics->max_fill_bytes.set(std::max(metrics->max_fill_bytes.get(), (int64_t)n_bytes));
+        }
+    }
+
+    void appendSample(std::string *text, const char *metric, const char *pipe, const double value) const
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%s{session=\"%s\",pipe=\"%s\"} %.9g\n", metric, m_name.c_str(), pipe, value);
+        *text += line;
+    }
+
+public:
+    explicit CSessionMetrics(const std::string &name) : m_name(name), m_pid(0), m_exit_code(-1)
+    {
+    }
+
+    ~CSessionMetrics()
+    {
+        if (m_pidfd >= 0)
+        {
+            close(m_pidfd);
+        }
+    }
+
+    // Exit code of a wait status (the status of waitpid).
+    static int ExitCodeOfWaitStatus(const int stat_loc)
+    {
+        return WIFEXITED(stat_loc) ? WEXITSTATUS(stat_loc) : (WIFSIGNALED(stat_loc) ? (128 + WTERMSIG(stat_loc)) : 0);
+    }
+
+    // Called by CSubprocess::attachMetrics: the watchdog thread of the exporter polls the pidfd of the child (readable when the child ends),
+    // so a crashed FFmpeg is reported immediately (not when the reader gets end of file, or when the session reaps the child).
+    // Called again for a respawned child (see CEncoderSession::respawn) - the pidfd of the previous child is closed.
+    void onChildStarted(const pid_t pid)
+    {
+        const int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        std::lock_guard<std::mutex> guard(m_pidfd_lock);
+
+        if (m_pidfd >= 0)
+        {
+            close(m_pidfd);
+        }
+
+        m_pidfd = pidfd;
+        m_pidfd_generation++;
+        m_pid.store((int)pid);
+        m_exit_code.store(-1);
+    }
+
+    void onChildExited(const int exit_code)
+    {
+        m_exit_code.store(exit_code);
+    }
+
+    // Stdin thread: <n_bytes> written (<n_frames> is 0 for a partial write of non-blocking PIPE), <blocked_ns> in the system calls.
+    void onStdinWrite(const int fd, const int64_t n_bytes, const int n_frames, const int64_t blocked_ns)
+    {
+        m_stdin.n_bytes.add(n_bytes);
+        m_stdin.n_frames.add(n_frames);
+        m_stdin.blocked_ns.add(blocked_ns);
+
+        if (n_frames > 0)
+        {
+            SampleFill(&m_stdin, fd);
+        }
+    }
+
+    // Stdout thread: <n_bytes> read, <blocked_ns> in the system call.
+    void onStdoutRead(const int64_t n_bytes, const int64_t blocked_ns)
+    {
+        m_stdout.n_bytes.add(n_bytes);
+        m_stdout.blocked_ns.add(blocked_ns);
+    }
+
+    // Stdout thread: FLV tag of <payload_size> bytes (the tag header is read).
+    void onFlvTag(const int fd, const int payload_size)
+    {
+        int k = 0;
+
+        while ((k < N_TAG_SIZE_BUCKETS - 1) && (payload_size > (1024 << (2 * k))))
+        {
+            k++;
+        }
+
+        m_tag_size_buckets[k].add(1);
+        m_tag_bytes.add(payload_size);
+        m_stdout.n_frames.add(1);
+        SampleFill(&m_stdout, fd);
+    }
+
+    const std::string &name() const { return m_name; }
+    bool isChildExited() const { return m_exit_code.load() >= 0; }
+
+    // Return the pidfd of the child (-1 if none), and its <generation> (see onPidFdReadable).
+    int pidFd(int64_t *generation)
+    {
+        std::lock_guard<std::mutex> guard(m_pidfd_lock);
+        *generation = m_pidfd_generation;
+
+        return m_pidfd;
+    }
+
+    // Watchdog thread: the pidfd of <generation> is readable - the child ended (peek the exit status without reaping - the session reaps the child).
+    // Nothing is done if the child was respawned since the pidfd was polled.
+    void onPidFdReadable(const int64_t generation)
+    {
+        std::lock_guard<std::mutex> guard(m_pidfd_lock);
+
+        if ((m_pidfd < 0) || (generation != m_pidfd_generation))
+        {
+            return;
+        }
+
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+
+        // P_PIDFD (Linux 5.4) is 3 - older glibc doesn't define it.
+        if (waitid((idtype_t)3, (id_t)m_pidfd, &info, WEXITED | WNOHANG | WNOWAIT) == 0)
+        {
+            if (info.si_pid == 0)
+            {
+                return;     // The child is still running.
+            }
+
+            const int exit_code = (info.si_code == CLD_EXITED) ? info.si_status : (128 + info.si_status);
+            onChildExited(exit_code);
+
+            if (exit_code != 0)
+            {
+                fprintf(stderr, "Metrics: FFmpeg process %d of session %s ended with exit code %d\n", m_pid.load(), m_name.c_str(), exit_code);
+            }
+        }
+        // else: the session already reaped the child (ECHILD) - the exit was reported by onChildExited.
+
+        close(m_pidfd);
+        m_pidfd = -1;   // The ended child is not polled any more.
+    }
+
+    // Append the samples of the PIPE counter <counter> (both PIPEs) in Prometheus text format.
+    void appendPipeSamples(std::string *text, const char *metric, CMetricCounter CPipeMetrics::*counter, const double scale) const
+    {
+        appendSample(text, metric, "stdin", (double)(m_stdin.*counter).get() * scale);
+        appendSample(text, metric, "stdout", (double)(m_stdout.*counter).get() * scale);
+    }
+
+    void appendTagSizeSamples(std::string *text, const char *metric) const
+    {
+        char line[256];
+        int64_t n_tags = 0;
+
+        for (int k = 0; k < N_TAG_SIZE_BUCKETS; k++)
+        {
+            n_tags += m_tag_size_buckets[k].get();
+
+            if (k < N_TAG_SIZE_BUCKETS - 1)
+            {
+                snprintf(line, sizeof(line), "%s_bucket{session=\"%s\",le=\"%d\"} %lld\n", metric, m_name.c_str(), 1024 << (2 * k), (long long)n_tags);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "%s_bucket{session=\"%s\",le=\"+Inf\"} %lld\n", metric, m_name.c_str(), (long long)n_tags);
+            }
+
+            *text += line;
+        }
+
+        snprintf(line, sizeof(line), "%s_sum{session=\"%s\"} %lld\n%s_count{session=\"%s\"} %lld\n", metric, m_name.c_str(), (long long)m_tag_bytes.get(),
+                 metric, m_name.c_str(), (long long)n_tags);
+        *text += line;
+    }
+
+    // Append the health of the child process: <is_exit_code> - false: 1 while running (up), true: the exit code.
+    void appendChildSample(std::string *text, const char *metric, const bool is_exit_code) const
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%s{session=\"%s\",pid=\"%d\"} %d\n", metric, m_name.c_str(), m_pid.load(),
+                 is_exit_code ? m_exit_code.load() : (isChildExited() ? 0 : 1));
+        *text += line;
+    }
+};
+
+
+// Exporter of the session metrics: HTTP endpoint in Prometheus text format (http://<ip>:<port>/metrics - any path is answered),
+// and the watchdog of the child processes (a pidfd per session).
+// Two background threads: the server thread answers the requests, and the watchdog thread polls the pidfds -
+// a slow (or stuck) scraper doesn't delay the report of a crashed FFmpeg. The sessions never wait for the exporter:
+// the counters are lock free, and the mutex only guards the list of sessions (taken when a session is added, on each scrape, and on each watchdog poll).
+class CMetricsExporter
+{
+private:
+    static const int POLL_TIMEOUT_MS = 100;     // New sessions are polled within 100ms (the pidfd of a polled session wakes the watchdog immediately).
+
+    int m_listen_fd = -1;
+    std::mutex m_lock;                          // Guards m_sessions.
+    std::vector<CSessionMetrics*> m_sessions;
+    std::atomic<bool> m_is_quit;
+    std::atomic<int64_t> m_n_scrapes;
+    std::thread m_server_thread;
+    std::thread m_watchdog_thread;
+
+    CMetricsExporter() : m_is_quit(false), m_n_scrapes(0)
+    {
+    }
+
+    // Answer one HTTP request (the request is not parsed - every request gets the metrics).
+    void serve(const int client_fd)
+    {
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char request[4096];
+
+        if (recv(client_fd, request, sizeof(request), 0) <= 0)
+        {
+            return;
+        }
+
+        m_n_scrapes++;
+        const std::string body = scrape();
+        const std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) +
+                                     "\r\nConnection: close\r\n\r\n" + body;
+        size_t n_sent = 0;
+
+        while (n_sent < response.size())
+        {
+            const ssize_t sts = send(client_fd, response.data() + n_sent, response.size() - n_sent, MSG_NOSIGNAL);
+
+            if (sts <= 0)
+            {
+                if ((sts == (-1)) && (errno == EINTR))
+                {
+                    continue;
+                }
+
+                return;
+            }
+
+            n_sent += (size_t)sts;
+        }
+    }
+
+    static void AppendHeader(std::string *text, const char *metric, const char *type, const char *help)
+    {
+        *text += std::string("# HELP ") + metric + " " + help + "\n# TYPE " + metric + " " + type + "\n";
+    }
+
+    // Append the family of the PIPE counter <counter> (the caller holds m_lock).
+    void appendPipeFamily(std::string *text, const char *metric, const char *type, const char *help,
+                          CMetricCounter CSessionMetrics::CPipeMetrics::*counter, const double scale) const
+    {
+        AppendHeader(text, metric, type, help);
+
+        for (const CSessionMetrics *session : m_sessions)
+        {
+            session->appendPipeSamples(text, metric, counter, scale);
+        }
+    }
+
+    // Answer the requests (one at a time - serve may block for the receive timeout of a slow client).
+    void serverThread()
+    {
+        struct pollfd pfd = { m_listen_fd, POLLIN, 0 };
+
+        while (!m_is_quit.load())
+        {
+            if ((poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0) || ((pfd.revents & POLLIN) == 0))
+            {
+                continue;   // Timeout (or EINTR).
+            }
+
+            const int client_fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+            if (client_fd >= 0)
+            {
+                serve(client_fd);
+                close(client_fd);
+            }
+        }
+    }
+
+    // Poll the pidfds of the running children (the list is rebuilt after each wake up - new sessions, respawned and ended children).
+    void watchdogThread()
+    {
+        std::vector<struct pollfd> pfds;
+        std::vector<CSessionMetrics*> polled;
+        std::vector<int64_t> generations;
+
+        while (!m_is_quit.load())
+        {
+            pfds.clear();
+            polled.clear();
+            generations.clear();
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+
+                for (CSessionMetrics *session : m_sessions)
+                {
+                    int64_t generation = 0;
+                    const int pidfd = session->pidFd(&generation);
+
+                    if (pidfd >= 0)
+                    {
+                        pfds.push_back({ pidfd, POLLIN, 0 });
+                        polled.push_back(session);
+                        generations.push_back(generation);
+                    }
+                }
+            }
+
+            if (pfds.empty())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS));
+                continue;
+            }
+
+            if (poll(pfds.data(), (nfds_t)pfds.size(), POLL_TIMEOUT_MS) <= 0)
+            {
+                continue;   // Timeout (or EINTR).
+            }
+
+            for (size_t k = 0; k < polled.size(); k++)
+            {
+                if (pfds[k].revents != 0)
+                {
+                    polled[k]->onPidFdReadable(generations[k]);     // The sessions are deleted only with the exporter.
+                }
+            }
+        }
+    }
+
+public:
+    static CMetricsExporter *Create(const char *ip, const int port)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+
+        if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+        {
+            fprintf(stderr, "Error: invalid IPv4 address %s\n", ip);
+            return nullptr;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd == (-1))
+        {
+            fprintf(stderr, "Error: socket failed, errno = %d.\n", errno);
+            return nullptr;
+        }
+
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == (-1)) || (listen(fd, 16) == (-1)))
+        {
+            fprintf(stderr, "Error: bind or listen of the metrics endpoint %s:%d failed, errno = %d.\n", ip, port, errno);
+            close(fd);
+            return nullptr;
+        }
+
+        CMetricsExporter *exporter = new CMetricsExporter();
+        exporter->m_listen_fd = fd;
+        exporter->m_server_thread = std::thread(&CMetricsExporter::serverThread, exporter);
+        exporter->m_watchdog_thread = std::thread(&CMetricsExporter::watchdogThread, exporter);
+
+        return exporter;
+    }
+
+    static void DeleteObj(CMetricsExporter *exporter)
+    {
+        exporter->m_is_quit.store(true);
+        exporter->m_server_thread.join();
+        exporter->m_watchdog_thread.join();
+        close(exporter->m_listen_fd);
+
+        for (CSessionMetrics *session : exporter->m_sessions)
+        {
+            delete session;
+        }
+
+        delete exporter;
+    }
+
+    // Add the metrics of a new session (the returned object is owned by the exporter - see CSubprocess::attachMetrics).
+    CSessionMetrics *addSession(const std::string &name)
+    {
+        CSessionMetrics *session = new CSessionMetrics(name);
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_sessions.push_back(session);
+
+        return session;
+    }
+
+    // Aggregate the counters of all the sessions in Prometheus text format.
+    std::string scrape()
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        std::string text;
+
+        appendPipeFamily(&text, "flv2annexb_pipe_bytes_total", "counter", "Bytes written to stdin PIPE, and read from stdout PIPE.",
+                         &CSessionMetrics::CPipeMetrics::n_bytes, 1.0);
+        appendPipeFamily(&text, "flv2annexb_pipe_frames_total", "counter", "Raw frames written to stdin PIPE, and FLV tags read from stdout PIPE.",
+                         &CSessionMetrics::CPipeMetrics::n_frames, 1.0);
+        appendPipeFamily(&text, "flv2annexb_pipe_blocked_seconds_total", "counter", "Time blocked in stdin PIPE writes, and in stdout PIPE reads (parse stalls).",
+                         &CSessionMetrics::CPipeMetrics::blocked_ns, 1e-9);
+        appendPipeFamily(&text, "flv2annexb_pipe_fill_bytes", "gauge", "Bytes in the PIPE (FIONREAD, sampled).",
+                         &CSessionMetrics::CPipeMetrics::fill_bytes, 1.0);
+        appendPipeFamily(&text, "flv2annexb_pipe_fill_max_bytes", "gauge", "Maximum sampled bytes in the PIPE.",
+                         &CSessionMetrics::CPipeMetrics::max_fill_bytes, 1.0);
+
+        AppendHeader(&text, "flv2annexb_flv_tag_size_bytes", "histogram", "FLV tag payload sizes.");
+
+        for (const CSessionMetrics *session : m_sessions)
+        {
+            session->appendTagSizeSamples(&text, "flv2annexb_flv_tag_size_bytes");
+        }
+
+        AppendHeader(&text, "flv2annexb_child_up", "gauge", "1 while the FFmpeg process runs.");
+
+        for (const CSessionMetrics *session : m_sessions)
+        {
+            session->appendChildSample(&text, "flv2annexb_child_up", false);
+        }
+
+        AppendHeader(&text, "flv2annexb_child_exit_code", "gauge", "Exit code of the FFmpeg process (128 + signal number if killed, -1 while running).");
+
+        for (const CSessionMetrics *session : m_sessions)
+        {
+            session->appendChildSample(&text, "flv2annexb_child_exit_code", true);
+        }
+
+        AppendHeader(&text, "flv2annexb_scrapes_total", "counter", "Requests of the metrics endpoint.");
+        text += "flv2annexb_scrapes_total " + std::to_string(m_n_scrapes.load()) + "\n";
+
+        return text;
+    }
+
+    void printStatistics()
+    {
+        fprintf(stderr, "Metrics: %lld scrapes served - final values:\n%s", (long long)m_n_scrapes.load(), scrape().c_str());
+    }
+};
+
+
+// CSubprocess executes a child process with stdin and stdout pipes.
+class CSubprocess
+{
+private:
+    pid_t m_pid = 0;
+    bool m_is_exited = false;       // true if the child process was reaped by hasExited.
+    int m_exit_status = 0;          // Status of the reaped child process (valid if m_is_exited).
+    int m_inpipefd[2] = { 0, 0 };	// m_inpipefd applies stdin pipe of the child process.
+    int m_outpipefd[2] = { 0, 0 };	// m_outpipefd applies stdout pipe of the child process.
+
+    char *m_args_as_char        = nullptr;	// Holds command arguments as charter array (array is modified by strtok function).
+    const char **m_args_list    = nullptr;	// Array of pointers to command arguments (each pointer points different argument).
+    bool m_is_stdin_pipe        = false;	// true if stdin pipe is configured to be opened.
+    bool m_is_stdout_pipe       = false;	// true if stdout pipe is configured to be opened.
+
+    // User space read-ahead buffer of stdout PIPE.
+    // Reading the small FLV headers directly from the PIPE costs a read() system call for each field (and each NAL unit).
+    // Instead, every read() [or readv()] call reads as many bytes as available (up to the buffer size), and the headers are taken from the buffer.
+    unsigned char *m_read_buf   = nullptr;
+    unsigned int m_read_buf_size = 0;
+    unsigned int m_read_pos     = 0;	// Index of the first unconsumed byte in m_read_buf.
+    unsigned int m_read_end     = 0;	// Index after the last valid byte in m_read_buf.
+
+    // Traffic counters of each PIPE (each PIPE is used by a single thread, see stdinCounters).
+    CPipeCounters m_stdin_counters;
+    CPipeCounters m_stdout_counters;
+
+
+    CSessionMetrics *m_metrics = nullptr;           // Operational metrics (nullptr if not exported) - owned by CMetricsExporter.
+
+	// Constructor is private.
+	// Object can only be created by executing Popen (static member function).
+	// Note: using a function that returns an object and returns a pointer is safer (because there is a high probability for the object creation to fail)
+    CSubprocess()
+    {
+    }
+
+    ~CSubprocess()
+    {
+        if (m_args_list != nullptr)
+        {
+            delete[] m_args_list;	// Free allocated memory
+        }
+
+        if (m_args_as_char != nullptr)
+        {
+            delete[] m_args_as_char;	// Free allocated memory
+        }
+
+        if (m_read_buf != nullptr)
+        {
+            delete[] m_read_buf;	// Free allocated memory
+        }
+    }
+
+    // readv from stdout PIPE - same return value as readv (the time blocked in the system call is counted by the metrics).
+    ssize_t pipeReadv(const struct iovec *iov, const int iovcnt)
+    {
+        if (m_metrics == nullptr)
+        {
+            return pipeReadvUntimed(iov, iovcnt);
+        }
+
+        const int64_t t_start_ns = MonotonicNanos();
+        const ssize_t n_bytes_read = pipeReadvUntimed(iov, iovcnt);
+        const int err = errno;     // Keep errno of readv.
+        m_metrics->onStdoutRead((n_bytes_read > 0) ? n_bytes_read : 0, MonotonicNanos() - t_start_ns);
+        errno = err;
+
+        return n_bytes_read;
+    }
+
+    // readv from stdout PIPE - same return value as readv.
+    ssize_t pipeReadvUntimed(const struct iovec *iov, const int iovcnt)
+    {
+        m_stdout_counters.n_syscalls++;
+        ssize_t n_bytes_read = readv(m_inpipefd[0], iov, iovcnt);
+
+        if (n_bytes_read > 0)
+        {
+            m_stdout_counters.n_bytes += n_bytes_read;
+        }
+
+        return n_bytes_read;
+    }
+
+    // Fill the read-ahead buffer until it holds at least <len> unconsumed bytes (len must not exceed m_read_buf_size).
+    bool fillReadBuf(const unsigned int len)
+    {
+        if (m_read_pos + len > m_read_buf_size)
+        {
+            // Move the unconsumed bytes to the beginning of the buffer (only few bytes of a header are moved).
+            memmove(m_read_buf, &m_read_buf[m_read_pos], m_read_end - m_read_pos);
+            m_read_end -= m_read_pos;
+            m_read_pos = 0;
+        }
+
+        while (m_read_end - m_read_pos < len)
+        {
+            // Read as many bytes as available (not just the required <len> bytes).
+            struct iovec iov;
+            iov.iov_base = &m_read_buf[m_read_end];
+            iov.iov_len = m_read_buf_size - m_read_end;
+            ssize_t n_bytes_read = pipeReadv(&iov, 1);
+
+            if (n_bytes_read == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;   // Interrupted by a signal before reading any data - try again.
+                }
+
+                fprintf(stderr, "Error: read(m_inpipefd[0] failed, errno = %d.\n", errno);
+                return false;
+            }
+            else if (n_bytes_read == 0)
+            {
+                fprintf(stderr, "Error: read(m_inpipefd[0], ...) read zero bytes instead of %d.\nThat means that child process is no longer running.\n", (int)(len - (m_read_end - m_read_pos)));
+                return false;
+            }
+
+            m_read_end += (unsigned int)n_bytes_read;
+        }
+
+        return true;
+    }
+
+
+public:
+    // Executes child process with (optional) stdin and stdout pipes.
+	// Return pointer to CSubprocess object in case of success, and nullptr in case of failure.
+    // https://stackoverflow.com/questions/12596839/how-to-call-execl-in-c-with-the-proper-arguments
+    // cmd - may be full path (like "/usr/bin/ffmpeg").
+    // process_name - Process name applies argv[0] (like "ffmpeg").
+    // cmd_args - command arguments separated by spaces (like "-g 10 -pix_fmt yuv444p -crf 10").
+    // read_ahead_size - size of user space read-ahead buffer of stdout PIPE (the buffer must be larger than the largest header).
+	// Note: arguments with spaces (like "my video file.264") are not supported by current implementation.
+    static CSubprocess *Popen(const std::string cmd, 
+                              const std::string process_name,
+                              const std::string cmd_args,
+                              const bool is_stdin_pipe = false, const bool is_stdout_pipe = false, const int buf_size = 0,
+                              const int read_ahead_size = 65536)
+    {
+        CSubprocess *sp = new CSubprocess();	// A CSubprocess object is created.
+
+        int sts;
+
+        sp->m_args_as_char = new char[cmd_args.length() + 1];
+        strcpy(sp->m_args_as_char, cmd_args.c_str());	//Copy cmd_args from std:string to character array (going to be cut to tokens later).
+
+        sp->m_is_stdin_pipe     = is_stdin_pipe;
+        sp->m_is_stdout_pipe    = is_stdout_pipe;
+
+        if (is_stdout_pipe)
+        {
+            sp->m_read_buf_size = (unsigned int)std::max(read_ahead_size, 64);
+            sp->m_read_buf      = new unsigned char[sp->m_read_buf_size];
+        }
+        
+        // Count number of spaces in cmd_args (applies number of arguments).
+        int n_spaces = (int)std::count(cmd_args.begin(), cmd_args.end(), ' ');
+
+        // Allocate n_spaces + 10, (m_args_list[0] is process name, last one is NULL, and allocate few spares).
+        sp->m_args_list = new const char*[n_spaces + 10];
+
+        // First argument is process name
+        sp->m_args_list[0] = process_name.c_str();
+
+        // Split cmd_args by space.
+        // http://www.cplusplus.com/reference/cstring/strtok/
+        // Build list of pointers to arguments strings (zero terminated characters array).
+        int arg_count = 1;
+        char *pch = strtok(sp->m_args_as_char, " ");
+        while (pch != NULL)
+        {
+            sp->m_args_list[arg_count] = pch;
+            arg_count++;
+            pch = strtok(NULL, " ");
+        }
+
+        // Argument list ends with NULL
+        sp->m_args_list[arg_count] = NULL;
+
+        if (is_stdin_pipe)
+        {
+            // Create a pipe for the child process's STDOUT.
+            // https://linux.die.net/man/2/pipe
+            // int pipe(int pipefd[2]);
+            // pipe() creates a pipe, a unidirectional data channel that can be used for interprocess communication.
+            // The array pipefd is used to return two file descriptors referring to the ends of the pipe.pipefd[0] refers to the read end of the pipe.
+            // pipefd[1] refers to the write end of the pipe.
+            // Data written to the write end of the pipe is buffered by the kernel until it is read from the read end of the pipe
+            // Return Value: On success, zero is returned. On error, -1 is returned, and errno is set appropriately.
+            // The pipes are created with O_CLOEXEC - the other children (like idle FFmpeg workers) must not inherit the parent's ends of the pipes
+            // (a child that holds the write end of stdin PIPE prevents the end of file, and FFmpeg never ends).
+            // dup2 (in the child) clears O_CLOEXEC of stdin and stdout of the child.
+            sts = pipe2(sp->m_outpipefd, O_CLOEXEC);
+
+            if (sts != 0)
+            {
+                fprintf(stderr, "Error: fail to create pipe for stdout pipe, errno = %d.\n", errno);
+                delete sp;
+                return nullptr; // Returning nullptr  indication for an error.
+            }            
+        }
+
+        if (is_stdout_pipe)
+        {
+            // Create a pipe for the child process's STDIN.
+            sts = pipe2(sp->m_inpipefd, O_CLOEXEC);
+
+            if (sts != 0)
+            {
+                fprintf(stderr, "Error: fail to create pipe for stdin pipe, errno = %d.\n", errno);
+                delete sp;
+                return nullptr; // Returning nullptr  indication for an error.
+            }
+        }
+
+#ifdef DO_SPAWN_WITH_POSIX_SPAWN
+        // https://man7.org/linux/man-pages/man3/posix_spawn.3.html
+        // glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK) - the child uses the memory of the parent until exec,
+        // so the cost doesn't depend on the size of the parent (fork copies the page tables of the buffer pools, even with copy-on-write).
+        // The file actions duplicate the pipes to stdin and stdout of the child, and the other ends are closed by exec (O_CLOEXEC).
+        // The PIPE buffer sizes are set by the parent (below) - the same pipes, so there is no need to set them in the child.
+        // Note: PR_SET_PDEATHSIG can't be set without fork - when the parent dies, stdin PIPE is closed, and FFmpeg ends (end of the input),
+        // or it gets SIGPIPE when writing to the closed stdout PIPE. A child that is stuck before reading stdin is not killed - that's why fork is the default.
+        // RETURN VALUE:
+        // On success, posix_spawn() returns zero, and the PID of the child is placed in pid.
+        // On failure, the error number is returned (errno is not set) - glibc reports failure of exec as well.
+        posix_spawn_file_actions_t file_actions;
+        posix_spawn_file_actions_init(&file_actions);
+
+        if (is_stdin_pipe)
+        {
+            posix_spawn_file_actions_adddup2(&file_actions, sp->m_outpipefd[0], STDIN_FILENO);
+        }
+
+        if (is_stdout_pipe)
+        {
+            posix_spawn_file_actions_adddup2(&file_actions, sp->m_inpipefd[1], STDOUT_FILENO);
+        }
+
+        sts = posix_spawnp(&sp->m_pid, cmd.c_str(), &file_actions, nullptr, (char* const*)sp->m_args_list, environ);
+        posix_spawn_file_actions_destroy(&file_actions);
+
+        if (sts != 0)
+        {
+            fprintf(stderr, "Error: posix_spawnp failed, error = %d.\n", sts);
+            delete sp;
+            return nullptr; // Returning nullptr  indication for an error.
+        }
+#else
+        // Create the child process.
+        // https://www.man7.org/linux/man-pages/man2/fork.2.html
+        // fork() creates a new process by duplicating the calling process.
+        // The new process is referred to as the child process.
+        // The calling process is referred to as the parent process.
+        // The child process is an exact duplicate of the parent process except for the following points:
+        // ... (see documentation)
+        // RETURN VALUE:
+        // On success, the PID of the child process is returned in the parent, and 0 is returned in the child.
+        // On failure, -1 is returned in the parent, no child process is created, and errno is set appropriately.       
+        sp->m_pid = fork();
+
+        if (sp->m_pid == (-1))
+        {
+            fprintf(stderr, "Error: fork failed, errno = %d.\n", errno);
+            delete sp;
+            return nullptr; // Returning nullptr  indication for an error.
+        }
+
+        // On success 0 is returned in the child.
+        if (sp->m_pid == 0)
+        {
+            // The following code is executed in the child process
+            //////////////////////////////////////////////////////////////////////////
+            int child_sts;
+
+            if (is_stdin_pipe)
+            {
+                // https://man7.org/linux/man-pages/man2/dup.2.html
+                // duplicate a file descriptor
+                // The dup() system call creates a copy of the file descriptor oldfd, using the lowest-numbered unused file descriptor for the new descriptor.
+                // After a successful return, the old and new file descriptors may be used interchangeably...
+                // The dup2() system call performs the same task as dup(), but instead of using the lowest-numbered unused file descriptor, it uses the file  descriptor number specified in newfd.
+                //
+                // RETURN VALUE:
+                // On success, these system calls return the new file descriptor.
+                // On error, -1 is returned, and errno is set appropriately.
+                child_sts = dup2(sp->m_outpipefd[0], STDIN_FILENO);
+                if (child_sts == (-1))
+                {
+                    fprintf(stderr, "Error: dup2 STDIN_FILENO failed, errno = %d.\n", errno); exit(-1);
+                }
+
+                // Close unused ends of pipe (Rotem).
+                child_sts = close(sp->m_outpipefd[1]);
+                if (child_sts == (-1))
+                {
+                    fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed in child process, errno = %d.\n", errno);
+                }
+
+                if (buf_size > 0)
+                {
+                    // Set pipe buffer size (could we do it  before executing dup2 ?).
+                    // https://stackoverflow.com/questions/5218741/set-pipe-buffer-size
+                    // https://man7.org/linux/man-pages/man2/fcntl.2.html
+                    // fcntl - manipulate file descriptor.
+                    // fcntl() performs one of the operations described below on the open file descriptor fd.The operation is determined by cmd.
+                    // int fcntl(int fd, int cmd, ... /* arg */ );
+                    // Changing the capacity of a pipe F_SETPIPE_SZ (int; since Linux 2.6.35)
+                    // Change the capacity of the pipe referred to by fd to be at least arg bytes.  An unprivileged process can adjust the pipe
+                    // capacity to any value between the system page size and the limit defined in /proc/sys/fs/pipe-max-size (see proc(5)).
+                    // Attempts by an unprivileged process to set the pipe capacity above the limit yield the error EPERM; a privileged process (CAP_SYS_RESOURCE) can override the limit.
+                    // The kernel may use a capacity larger than arg...
+                    child_sts = (int)fcntl(sp->m_outpipefd[0], F_SETPIPE_SZ, buf_size);
+                    if (child_sts == (-1))
+                    {
+                        fprintf(stderr, "Error: fcntl(sp->m_outpipefd[0], F_SETPIPE_SZ, buf_size) failed in child process, errno = %d.\n", errno);
+                    }
+                }
+            }
+
+            if (is_stdout_pipe)
+            {
+				//Duplicate the file descriptor of the pipe.
+                child_sts = dup2(sp->m_inpipefd[1], STDOUT_FILENO);
+                if (child_sts == (-1))
+                {
+                    fprintf(stderr, "Error: dup2 STDOUT_FILENO failed, errno = %d.\n", errno); exit(-1);
+                }
+
+                //Close unused ends of pipe (Rotem).
+                child_sts = close(sp->m_inpipefd[0]);
+                if (child_sts == (-1))
+                {
+                    fprintf(stderr, "Error: close(sp->m_inpipefd[0]) failed in child process, errno = %d.\n", errno);
+                }
 
                 if (buf_size > 0)
                 {
-                    // Set pipe buffer size (could we do it  before executing dup2 ?).
-                    // https://stackoverflow.com/questions/5218741/set-pipe-buffer-size
-                    // https://man7.org/linux/man-pages/man2/fcntl.2.html
-                    // fcntl - manipulate file descriptor.
-                    // fcntl() performs one of the operations described below on the open file descriptor fd.The operation is determined by cmd.
-                    // int fcntl(int fd, int cmd, ... /* arg */ );
-                    // Changing the capacity of a pipe F_SETPIPE_SZ (int; since Linux 2.6.35)
-                    // Change the capacity of the pipe referred to by fd to be at least arg bytes.  An unprivileged process can adjust the pipe
-                    // capacity to any value between the system page size and the limit defined in /proc/sys/fs/pipe-max-size (see proc(5)).
-                    // Attempts by an unprivileged process to set the pipe capacity above the limit yield the error EPERM; a privileged process (CAP_SYS_RESOURCE) can override the limit.
-                    // The kernel may use a capacity larger than arg...
-                    child_sts = (int)fcntl(sp->m_outpipefd[0], F_SETPIPE_SZ, buf_size);
-                    if (child_sts == (-1))
-                    {
-                        fprintf(stderr, "Error: fcntl(sp->m_outpipefd[0], F_SETPIPE_SZ, buf_size) failed in child process, errno = %d.\n", errno);
-                    }
+                    //Set pipe buffer size
+                    child_sts = (int)fcntl(sp->m_inpipefd[1], F_SETPIPE_SZ, buf_size);
+                    if (child_sts == (-1))
+                    {
+                        fprintf(stderr, "Error: fcntl(sp->m_inpipefd[1], F_SETPIPE_SZ, buf_size) failed in child process, errno = %d.\n", errno);
+                    }
+                }
+            }
+
+            // Keep stderr unchanged for debugging.
+            //child_sts = dup2(sp->m_inpipefd[1], STDERR_FILENO);
+            //if (child_sts == (-1))
+            //{
+            //    fprintf(stderr, "Error: dup2 STDOUT_FILENO failed, errno = %d.\n", errno); exit(-1);
+            //}
+
+            // Ask kernel to deliver SIGTERM in case the parent dies.
+            // https://man7.org/linux/man-pages/man2/prctl.2.html
+            // prctl() manipulates various aspects of the behavior of the calling thread or process...
+            // On error, -1 is returned, and errno is set appropriately.
+            child_sts = prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (child_sts == (-1))
+            {
+                fprintf(stderr, "Error: prctl failed, errno = %d.\n", errno); exit(-1);
+            }
+
+            // Execute child process (first argument may be full executable path, the second is the process name).
+            // https://linux.die.net/man/3/execl
+            // The exec() family of functions replaces the current process image with a new process image.
+            // ...
+            // The const char *arg and subsequent ellipses in the execl(), execlp(), and execle() functions can be thought of as arg0, arg1, ..., argn.
+            // Together they describe a list of one or more pointers to null - terminated strings that represent the argument list available to the executed program.The first argument, by convention, 
+            // should point to the filename associated with the file being executed.The list of arguments must be terminated by a NULL pointer, and, 
+            // since these are variadic functions, this pointer must be cast(char *) NULL.
+            // The execv(), execvp(), and execvpe() functions provide an array of pointers to null - terminated strings that represent the argument list available to the new program.
+            // The first argument, by convention, should point to the filename associated with the file being executed.The array of pointers must be terminated by a NULL pointer.
+            // Return Value: The exec() functions only return if an error has occurred. The return value is -1, and errno is set to indicate the error.
+            child_sts = execvp(cmd.c_str(), (char* const*)sp->m_args_list);
+        
+            // Nothing below this line should be executed by child process. 
+            // If so, it means that the "execl function" wasn't successful.
+            if (child_sts == (-1))
+            {
+                fprintf(stderr, "Error: execl failed, errno = %d.\n", errno);
+            }
+
+            fprintf(stderr, "Error: child process wasn't successful.\n");
+            exit(1);
+            //////////////////////////////////////////////////////////////////////////
+        }
+#endif
+
+        // https://stackoverflow.com/questions/6171552/popen-simultaneous-read-and-write
+        // The code below will be executed only by parent. You can write and read
+        // from the child using pipefd descriptors, and you can send signals to 
+        // the process using its pid by kill() function. If the child process will
+        // exit unexpectedly, the parent process will obtain SIGCHLD signal that
+        // can be handled (e.g. you can respawn the child process).
+
+        // Close unused pipe ends
+        if (is_stdin_pipe)
+        {
+			// Close the unused end of pipe
+            // https://linux.die.net/man/2/close
+            // close() closes a file descriptor, so that it no longer refers to any file and may be reused...
+            // Return Value: close() returns zero on success. On error, -1 is returned, and errno is set appropriately.
+            sts = close(sp->m_outpipefd[0]);
+
+            if (sts == (-1))
+            {
+                fprintf(stderr, "Error: close(sp->m_outpipefd[0]) failed, errno = %d.\n", errno);
+                delete sp;
+                return nullptr; // Returning nullptr  indication for an error.
+            }
+
+            if (buf_size > 0)
+            {
+                //Set pipe buffer size
+                sts = (int)fcntl(sp->m_outpipefd[1], F_SETPIPE_SZ, buf_size);
+                if (sts == (-1))
+                {
+                    fprintf(stderr, "Error: fcntl(sp->m_outpipefd[1], F_SETPIPE_SZ, buf_size) failed in parent process, errno = %d.\n", errno);
+                }
+            }
+        }
+
+        if (is_stdout_pipe)
+        {
+			// Close the unused end of pipe
+            sts = close(sp->m_inpipefd[1]);
+
+            if (sts == (-1))
+            {
+                fprintf(stderr, "Error: close(sp->m_inpipefd[1]) failed, errno = %d.\n", errno);
+                delete sp;
+                return nullptr; // Returning nullptr  indication for an error.
+            }
+
+            if (buf_size > 0)
+            {
+                //Set pipe buffer size
+                sts = (int)fcntl(sp->m_inpipefd[0], F_SETPIPE_SZ, buf_size);
+                if (sts == (-1))
+                {
+                    fprintf(stderr, "Error: fcntl(sp->m_inpipefd[0], F_SETPIPE_SZ, buf_size) failed in parent process, errno = %d.\n", errno);
+                }
+            }
+        }
+
+		//In case everything went well, return a pointer to the created object.
+        return sp;
+    }
+
+    // Close sdtin PIPE and stdout PIPE, wait for child process to end, and delete sp.
+    static bool ClosePipeAndDeleteObj(CSubprocess *sp)
+    {
+        int sts;
+
+        if (sp != nullptr)
+        {
+            int stat_loc = sp->m_exit_status;
+
+            if (sp->m_is_stdin_pipe)
+            {
+                sts = close(sp->m_outpipefd[1]);
+                if (sts == (-1))
+                {
+                    fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed, errno = %d.\n", errno);
+                }
+            }
+
+            if (sp->m_is_stdout_pipe)
+            {
+                sts = close(sp->m_inpipefd[0]);
+                if (sts == (-1))
+                {
+                    fprintf(stderr, "Error: close(sp->m_inpipefd[0]) failed, errno = %d.\n", errno);
+                }
+            }
+
+            // Remark: we don't need to kill FFmpeg process, killing the process looses the last encoded video frames.
+            // Send SIGKILL signal to the child process
+            // https://man7.org/linux/man-pages/man2/kill.2.html
+            // The kill() system call can be used to send any signal to any process group or process...
+            // On success (at least one signal was sent), zero is returned. On error, -1 is returned, and errno is set appropriately.
+            //sts = kill(sp->m_pid, SIGKILL);
+            //if (sts == (-1))
+            //{
+            //    fprintf(stderr, "Error: kill(sp->m_pid, SIGKILL) failed, errno = %d.\n", errno);
+            //}
+
+            // https://linux.die.net/man/3/waitpid
+            // wait, waitpid - wait for a child process to stop or terminate...
+            // stat_loc shall be 0 if and only if the status returned is from a terminated child process...
+            // Return Value:
+            // If wait() or waitpid() returns because the status of a child process is available,
+            // these functions shall return a value equal to the process ID of the child process for which status is reported.
+            // If wait() or waitpid() returns due to the delivery of a signal to the calling process, -1 shall be returned and errno set to[EINTR].
+            // If waitpid() was invoked with WNOHANG set in options, it has at least one child process specified by pid for which status is not available, 
+            // and status is not available for any process specified by pid, 0 is returned.Otherwise, (pid_t)-1 shall be returned, and errno set to indicate the error.
+            sts = sp->m_is_exited ? sp->m_pid : waitpid(sp->m_pid, &stat_loc, 0);    // The child may be reaped before (see hasExited).
+
+            if (sts == (-1))
+            {
+                fprintf(stderr, "Error: waitpid(sp->m_pid, &stat_loc, 0) sts = %d, stat_loc = %d, errno = %d.\n", sts, stat_loc, errno);
+            }
+            else if (stat_loc != 0)
+            {
+                fprintf(stderr, "Warning: waitpid(sp->m_pid, &stat_loc, 0) stat_loc = %d.\n", stat_loc);    // FFmpeg returned value other than zero.
+            }
+
+            if ((sts != (-1)) && (sp->m_metrics != nullptr))
+            {
+                sp->m_metrics->onChildExited(CSessionMetrics::ExitCodeOfWaitStatus(stat_loc));
+            }
+
+            delete sp;
+        }
+
+        return true;
+    }
+
+    // Kill the child process (SIGKILL), close the PIPEs, and delete sp.
+    // Used for idle FFmpeg workers that didn't get any frame (killing an encoder that got frames looses the last encoded video frames).
+    static void KillAndDeleteObj(CSubprocess *sp)
+    {
+        if (sp == nullptr)
+        {
+            return;
+        }
+
+        if ((!sp->m_is_exited) && (kill(sp->m_pid, SIGKILL) == 0))
+        {
+            while ((waitpid(sp->m_pid, nullptr, 0) == (-1)) && (errno == EINTR))
+            {
+            }
+
+            if (sp->m_metrics != nullptr)
+            {
+                sp->m_metrics->onChildExited(128 + SIGKILL);
+            }
+        }
+
+        if (sp->m_is_stdin_pipe)
+        {
+            close(sp->m_outpipefd[1]);
+        }
+
+        if (sp->m_is_stdout_pipe)
+        {
+            close(sp->m_inpipefd[0]);
+        }
+
+        delete sp;
+    }
+
+    // Return true if the child process ended (the ended child is reaped - the function doesn't block).
+    bool hasExited()
+    {
+        if (!m_is_exited)
+        {
+            int stat_loc = 0;
+
+            if (waitpid(m_pid, &stat_loc, WNOHANG) == m_pid)
+            {
+                m_is_exited = true;
+                m_exit_status = stat_loc;
+
+                if (m_metrics != nullptr)
+                {
+                    m_metrics->onChildExited(CSessionMetrics::ExitCodeOfWaitStatus(stat_loc));
+                }
+            }
+        }
+
+        return m_is_exited;
+    }
+
+    // Write to stdin PIPE (no flush?)
+    bool stdinWrite(const unsigned char *data_bytes, const unsigned int len)
+    {
+        if (m_metrics == nullptr)
+        {
+            return stdinWriteUntimed(data_bytes, len);
+        }
+
+        const int64_t t_start_ns = MonotonicNanos();
+        const bool success = stdinWriteUntimed(data_bytes, len);
+        m_metrics->onStdinWrite(stdinFd(), success ? len : 0, success ? 1 : 0, MonotonicNanos() - t_start_ns);
+
+        return success;
+    }
+
+    bool stdinWriteUntimed(const unsigned char *data_bytes, unsigned int len)
+    {
+        ssize_t sts;
+
+        // https://linux.die.net/man/2/write
+        // ssize_t write(int fd, const void *buf, size_t count);
+        // write() writes up to count bytes from the buffer pointed buf to the file referred to by the file descriptor fd.
+        // The number of bytes written may be less than count if, for example, there is insufficient space...
+        // Keep writing until all the <len> bytes are written (a signal may interrupt a blocking write after writing part of the data).
+        while (len > 0)
+        {
+            m_stdin_counters.n_syscalls++;
+            sts = write(m_outpipefd[1], data_bytes, len);
+
+            if (sts == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;   // Interrupted by a signal before writing any data - try again.
+                }
+
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                    // The PIPE is in non-blocking mode and full - wait until it is writable (stdinWrite is always blocking).
+                    struct pollfd pfd;
+                    pfd.fd = m_outpipefd[1];
+                    pfd.events = POLLOUT;
+                    pfd.revents = 0;
+                    m_stdin_counters.n_syscalls++;
+
+                    if ((poll(&pfd, 1, -1) == (-1)) && (errno != EINTR))
+                    {
+                        fprintf(stderr, "Error: poll(m_outpipefd[1] failed, errno = %d.\n", errno);
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                fprintf(stderr, "Error: write(m_outpipefd[1] failed, errno = %d.\n", errno);
+                return false;
+            }
+
+            data_bytes += sts;
+            len -= (unsigned int)sts;
+            m_stdin_counters.n_bytes += sts;
+        }
+
+        return true;
+    }
+
+    // Read from stdout PIPE
+    // The bytes are taken from the read-ahead buffer first, and the rest is read with readv() directly to <data_bytes>.
+    // The same readv() call also fills the read-ahead buffer with the bytes that follow (usually the next header).
+    bool stdoutRead(const unsigned int len, unsigned char *data_bytes)
+    {
+        ssize_t n_bytes_read;
+
+        // Copy the bytes that are already in the read-ahead buffer.
+        unsigned int n_buffered = std::min(len, m_read_end - m_read_pos);
+        memcpy(data_bytes, &m_read_buf[m_read_pos], n_buffered);
+        m_read_pos += n_buffered;
+
+        // The third argument of read, "count", is the "The maximum number of bytes to be read."
+        // We must use a loop for reading exactly <len> bytes from the pipe.
+        ssize_t remain_len = (ssize_t)(len - n_buffered);
+        unsigned char *data_bytes_ptr = data_bytes + n_buffered;
+
+        if (remain_len == 0)
+        {
+            return true;
+        }
+
+        // The read-ahead buffer is empty at this point.
+        m_read_pos = 0;
+        m_read_end = 0;
+
+        // https://man7.org/linux/man-pages/man2/readv.2.html
+        // ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+        // The readv() system call reads iovcnt buffers from the file associated with the file descriptor fd into the buffers described by iov ("scatter input").
+        // The readv() system call works just like read(2) except that multiple buffers are filled.
+        // Buffers are processed in array order. This means that readv() completely fills iov[0] before proceeding to iov[1], and so on.
+        // RETURN VALUE:
+        // On success, readv() returns the number of bytes read (zero indicates end of file).
+        // On error, -1 is returned, and errno is set appropriately.
+        // Keep reading until finish reading <len> bytes from the PIPE.
+        while (remain_len > 0)
+        {
+            struct iovec iov[2];
+            iov[0].iov_base = data_bytes_ptr;
+            iov[0].iov_len  = (size_t)remain_len;
+            iov[1].iov_base = m_read_buf;
+            iov[1].iov_len  = m_read_buf_size;
+
+            //Try to read remain_len bytes from the PIPE (but may read less, or more - the extra bytes goes to the read-ahead buffer).
+            n_bytes_read = pipeReadv(iov, 2);
+
+            if (n_bytes_read == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;   // Interrupted by a signal before reading any data - try again.
+                }
+
+                fprintf(stderr, "Error: readv(m_inpipefd[0] failed, errno = %d.\n", errno);
+                return false;
+            }
+            else if (n_bytes_read == 0)
+            {
+                fprintf(stderr, "Error: readv(m_inpipefd[0], iov, 2) read zero bytes instead of %d.\nThat means that child process is no longer running.\n", (int)remain_len);
+                return false;
+            }
+
+            if (n_bytes_read > remain_len)
+            {
+                m_read_end = (unsigned int)(n_bytes_read - remain_len);  // The extra bytes are stored in the read-ahead buffer.
+                n_bytes_read = remain_len;
+            }
+
+            remain_len -= n_bytes_read;     // Subtract number of bytes read from remain_len.
+            data_bytes_ptr += n_bytes_read; // Advance pointer by number of bytes read.
+        }
+
+        return true;
+    }
+
+    // Wait until stdout PIPE is readable (return immediately if the read-ahead buffer is not empty).
+    // Return false in case of an error.
+    bool stdoutWaitReadable()
+    {
+        if (m_read_end > m_read_pos)
+        {
+            return true;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = m_inpipefd[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        m_stdout_counters.n_syscalls++;
+
+        while (poll(&pfd, 1, -1) == (-1))
+        {
+            if (errno != EINTR)
+            {
+                fprintf(stderr, "Error: poll(m_inpipefd[0] failed, errno = %d.\n", errno);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Read <len> bytes from stdout PIPE without copying - return a pointer to the data inside the read-ahead buffer.
+    // The returned pointer is valid only until the next stdoutRead/stdoutReadPtr call.
+    // Used for reading small headers (len must not exceed the read-ahead buffer size).
+    // Return nullptr in case of an error.
+    const unsigned char *stdoutReadPtr(const unsigned int len)
+    {
+        if (len > m_read_buf_size)
+        {
+            fprintf(stderr, "Error: stdoutReadPtr len = %d exceeds read-ahead buffer size %d.\n", (int)len, (int)m_read_buf_size);
+            return nullptr;
+        }
+
+        if (!fillReadBuf(len))
+        {
+            return nullptr;
+        }
+
+        const unsigned char *ptr = &m_read_buf[m_read_pos];
+        m_read_pos += len;
+
+        return ptr;
+    }
+
+
+    // Return the capacity of stdin PIPE in bytes (the kernel may use a capacity larger than the buf_size passed to Popen), or -1 in case of an error.
+    int stdinPipeSize() const
+    {
+        int sts = (int)fcntl(m_outpipefd[1], F_GETPIPE_SZ);
+
+        if (sts == (-1))
+        {
+            fprintf(stderr, "Error: fcntl(m_outpipefd[1], F_GETPIPE_SZ) failed, errno = %d.\n", errno);
+        }
+
+        return sts;
+    }
+
+    // Map the pages of <data_bytes> into stdin PIPE (no copy) - blocks until all the <len> bytes are in the PIPE.
+    // https://man7.org/linux/man-pages/man2/vmsplice.2.html
+    // The PIPE references the user pages: the data must not be modified until the reader consumed it.
+    // The PIPE holds at most stdinPipeSize() bytes, so the data is consumed after stdinPipeSize() more bytes are written (see WriterThread).
+    // For best performance, <data_bytes> should be page aligned.
+    bool stdinVmsplice(const unsigned char *data_bytes, unsigned int len)
+    {
+        const int64_t t_start_ns = (m_metrics != nullptr) ? MonotonicNanos() : 0;
+        const unsigned int n_frame_bytes = len;
+
+        while (len > 0)
+        {
+            struct iovec iov;
+            iov.iov_base = (void*)data_bytes;
+            iov.iov_len = len;
+
+            m_stdin_counters.n_syscalls++;
+            ssize_t sts = vmsplice(m_outpipefd[1], &iov, 1, 0);
+
+            if (sts == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "Error: vmsplice(m_outpipefd[1] failed, errno = %d.\n", errno);
+                return false;
+            }
+
+            // vmsplice may return after mapping part of the pages (when the PIPE is full).
+            data_bytes += sts;
+            len -= (unsigned int)sts;
+            m_stdin_counters.n_bytes += sts;
+        }
+
+        if (m_metrics != nullptr)
+        {
+            m_metrics->onStdinWrite(stdinFd(), n_frame_bytes, 1, MonotonicNanos() - t_start_ns);
+        }
+
+        return true;
+    }
+
+    // Close stdin PIPE
+    bool stdinClose()
+    {
+        int sts;
+
+        if (m_is_stdin_pipe)
+        {
+            sts = close(m_outpipefd[1]);
+
+            if (sts == (-1))
+            {
+                fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed, errno = %d.\n", errno);
+            }
+
+            m_is_stdin_pipe = false;
+        }
+
+        return true;
+    }
+
+
+    // Export the operational metrics of the session to <metrics> (see CMetricsExporter::addSession) - must be attached before starting the threads.
+    void attachMetrics(CSessionMetrics *metrics)
+    {
+        m_metrics = metrics;
+        m_metrics->onChildStarted(m_pid);
+    }
+
+    CSessionMetrics *metrics() const { return m_metrics; }
+
+    pid_t pid() const { return m_pid; }
+
+    // File descriptors of the PIPEs (parent side) - used for registering the PIPEs in epoll.
+    int stdinFd() const { return m_is_stdin_pipe ? m_outpipefd[1] : (-1); }
+    int stdoutFd() const { return m_is_stdout_pipe ? m_inpipefd[0] : (-1); }
+
+    // Traffic counters of stdin and stdout PIPEs.
+    // Each counter is updated by the thread that uses the PIPE - read the counters after the threads are joined.
+    CPipeCounters stdinCounters() const { return m_stdin_counters; }
+    CPipeCounters stdoutCounters() const { return m_stdout_counters; }
+
+    // Set the parent side of stdin and stdout PIPEs to non-blocking mode (O_NONBLOCK).
+    // In non-blocking mode, use stdinWriteSome and stdoutReadSome (stdinWrite and stdoutRead assume blocking PIPEs).
+    bool setNonBlocking()
+    {
+        int fds[2] = { stdinFd(), stdoutFd() };
+
+        for (int k = 0; k < 2; k++)
+        {
+            if (fds[k] < 0)
+            {
+                continue;
+            }
+
+            int flags = fcntl(fds[k], F_GETFL);
+
+            if ((flags == (-1)) || (fcntl(fds[k], F_SETFL, flags | O_NONBLOCK) == (-1)))
+            {
+                fprintf(stderr, "Error: fcntl(fd, F_SETFL, O_NONBLOCK) failed, errno = %d.\n", errno);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Write up to <len> bytes to non-blocking stdin PIPE.
+    // Return number of bytes written (0 if the PIPE is full), or -1 in case of an error.
+    int stdinWriteSome(const unsigned char *data_bytes, const unsigned int len)
+    {
+        while (true)
+        {
+            m_stdin_counters.n_syscalls++;
+            ssize_t sts = write(m_outpipefd[1], data_bytes, len);
+
+            if (sts >= 0)
+            {
+                m_stdin_counters.n_bytes += sts;
+
+                if (m_metrics != nullptr)
+                {
+                    m_metrics->onStdinWrite(stdinFd(), sts, 0, 0);  // Non-blocking PIPE - no blocked time, and the frames are not known.
+                }
+
+                return (int)sts;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                return 0;   // The PIPE is full.
+            }
+
+            fprintf(stderr, "Error: write(m_outpipefd[1] failed, errno = %d.\n", errno);
+            return -1;
+        }
+    }
+
+    // Read from non-blocking stdout PIPE to the buffers described by <iov> (bypass the read-ahead buffer - must not be mixed with stdoutRead).
+    // Using two buffers allows reading the rest of a payload directly to its buffer, and the bytes that follow to a sketch buffer (single system call).
+    // Return number of bytes read (0 if the PIPE is empty), or -1 in case of an error.
+    // <is_eof> - Output: set to true if the child process closed its stdout (end of stream).
+    int stdoutReadSome(const struct iovec *iov, const int iovcnt, bool *is_eof)
+    {
+        *is_eof = false;
+
+        while (true)
+        {
+            m_stdout_counters.n_syscalls++;
+            ssize_t n_bytes_read = readv(m_inpipefd[0], iov, iovcnt);
+
+            if (n_bytes_read > 0)
+            {
+                m_stdout_counters.n_bytes += n_bytes_read;
+
+                if (m_metrics != nullptr)
+                {
+                    m_metrics->onStdoutRead(n_bytes_read, 0);
+                }
+
+                return (int)n_bytes_read;
+            }
+
+            if (n_bytes_read == 0)
+            {
+                *is_eof = true;
+                return 0;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                return 0;   // The PIPE is empty.
+            }
+
+            fprintf(stderr, "Error: readv(m_inpipefd[0] failed, errno = %d.\n", errno);
+            return -1;
+        }
+    }
+};
+
+
+
+// Read header of FLV packet and return FLV payload size
+// The header is taken from the read-ahead buffer of ffmpeg_process (no copy, and usually no system call).
+// <timestamp_ms> - Optional output: the FLV timestamp of the packet.
+// Return -1 in case of an error.
+// Return flv_payload_size if success.
+static int ReadFlvPacketHeader(CSubprocess *ffmpeg_process, int *timestamp_ms = nullptr)
+{
+    // Read size_of_previous_packet, packet_type, flv_payload_size, timestamp_lower, timestamp_upper, stream_id
+    const unsigned char *buf = ffmpeg_process->stdoutReadPtr(FLV_PACKET_HEADER_SIZE);
+
+    if (buf == nullptr)
+    {
+        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPacketHeader\n");
+        return -1;
+    }
+
+    if (timestamp_ms != nullptr)
+    {
+        *timestamp_ms = ParseFlvTimestamp(buf);
+    }
+
+    const int flv_payload_size = ParseFlvPacketHeader(buf);
+
+    if ((ffmpeg_process->metrics() != nullptr) && (flv_payload_size >= 0))
+    {
+        ffmpeg_process->metrics()->onFlvTag(ffmpeg_process->stdoutFd(), flv_payload_size);
+    }
+
+    return flv_payload_size;
+}
+
+
+// FLV files start with a standard header (9 bytes).
+// After the header comes the first payload - the AVC sequence header (AVCDecoderConfigurationRecord with the SPS and PPS).
+// The function reads the header and the first payload data.
+// <buf> - Pointer to sketch buffer of <buf_size> bytes (the first payload is small - the size is checked).
+// <cfg> - Output: the parsed AVC decoder configuration (or HEVC decoder configuration - the Enhanced FLV sequence start of CHevcCodec).
+template <class Codec = CVideoCodec>
+static bool ReadFlvFileHeaderAndFirstPayload(CSubprocess *ffmpeg_process, unsigned char *buf, const int buf_size, CAvcDecoderConfig *cfg)
+{
+    // Read FLV signature, version, flag byte and 4 bytes "used to skip a newer expanded header".
+    const unsigned char *hdr = ffmpeg_process->stdoutReadPtr(FLV_FILE_HEADER_SIZE);
+
+    if (hdr == nullptr)
+    {
+        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
+        return false;
+    }
+
+    if (!ParseFlvFileHeader(hdr))
+    {
+        return false;
+    }
+    
+    // Read first packet(and ignore it).
+    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process);
+
+    if (flv_payload_size < 0)
+    {
+        fprintf(stderr, "Error: ReadFlvPacketHeader (in ReadFlvFileHeaderAndFirstPayload) returned negative value (marking an error)\n");
+        return false;
+    }
+
+    if (flv_payload_size > buf_size)
+    {
+        fprintf(stderr, "Error: first FLV payload size %d exceeds buffer size %d\n", flv_payload_size, buf_size);
+        return false;
+    }
+
+    // Read "frame_type and _codec_id" byte and "AVC packet type" and payload data.
+    bool success = ffmpeg_process->stdoutRead(flv_payload_size, buf);
+
+    if (!success)
+    {
+        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
+        return false;
+    }
+    
+    int packet_type = 0;
+    int composition_time = 0;
+    bool is_keyframe = false;
+    const int header_size = (flv_payload_size > 0) ? Codec::VideoHeaderSize(buf[0]) : 0;
+
+    if ((flv_payload_size < std::max(header_size, AVC_PACKET_HEADER_SIZE)) || !Codec::ParseVideoHeader(buf, &packet_type, &composition_time, &is_keyframe))
+    {
+        return false;
+    }
+
+    if (packet_type != FLV_PACKET_TYPE_SEQUENCE_START)
+    {
+        fprintf(stderr, "Bad packet type: first FLV payload packet type = %d instead of 0 (sequence header)\n", packet_type);
+        return false;
+    }
+
+    // Keep the SPS and PPS (injected before IDR frames), and the size of the NAL units length field (the stream is of the encoder of g_encoder_profile).
+    cfg->start_codes = g_encoder_profile->start_codes;
+
+    return Codec::ParseDecoderConfig(&buf[header_size], flv_payload_size - header_size, cfg);
+}
+
+
+// Read the FLV video packet header (the 5 bytes AVC packet header, or the Enhanced FLV header of CHevcCodec - up to 8 bytes).
+// The header is taken from the read-ahead buffer of ffmpeg_process (no copy, and usually no system call).
+// <composition_time> - Optional output: the composition time of the packet.
+// <is_keyframe> - Optional output: true if the FLV frame_type is keyframe (IDR frame).
+// Return -1 in case of an error (or if the packet is not coded frames).
+// Return the size of the header if success.
+template <class Codec = CVideoCodec>
+static int ReadVideoPacketHeader(CSubprocess *ffmpeg_process, int *composition_time = nullptr, bool *is_keyframe = nullptr)
+{
+    unsigned char header[FLV_MAX_VIDEO_HEADER_SIZE];
+    const unsigned char *buf = ffmpeg_process->stdoutReadPtr(AVC_PACKET_HEADER_SIZE);
+
+    if (buf == nullptr)
+    {
+        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadVideoPacketHeader\n");
+        return -1;
+    }
+
+    const int header_size = Codec::VideoHeaderSize(buf[0]);
+
+    if (header_size > AVC_PACKET_HEADER_SIZE)
+    {
+        // The pointer is valid only until the next stdoutReadPtr call - copy the first 5 bytes.
+        memcpy(header, buf, AVC_PACKET_HEADER_SIZE);
+        buf = ffmpeg_process->stdoutReadPtr(header_size - AVC_PACKET_HEADER_SIZE);
+
+        if (buf == nullptr)
+        {
+            fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadVideoPacketHeader\n");
+            return -1;
+        }
+
+        memcpy(&header[AVC_PACKET_HEADER_SIZE], buf, header_size - AVC_PACKET_HEADER_SIZE);
+        buf = header;
+    }
+
+    int packet_type = 0;
+    int ct = 0;
+    bool is_key = false;
+
+    if (!Codec::ParseVideoHeader(buf, &packet_type, &ct, &is_key))
+    {
+        return -1;
+    }
+
+    if (packet_type != FLV_PACKET_TYPE_CODED_FRAMES)
+    {
+        fprintf(stderr, "Bad packet type: packet_type = %d instead of 1\n", packet_type);
+        return -1;
+    }
+
+    if (composition_time != nullptr)
+    {
+        *composition_time = ct;
+    }
+
+    if (is_keyframe != nullptr)
+    {
+        *is_keyframe = is_key;
+    }
+
+    return header_size;
+}
+
+
+// Read FLV tag header and the video packet header (5 bytes AVC packet header, or the Enhanced FLV header of CHevcCodec).
+// Return -1 in case of an error.
+// <pts_ms> - Optional output: presentation timestamp of the access unit (FLV timestamp + composition time) - identifies the source frame.
+// <dts_ms> - Optional output: decoding timestamp of the access unit (FLV timestamp).
+// <is_keyframe> - Optional output: true if the access unit is a keyframe (IDR frame).
+// Return the size of the NAL units data that follows (FLV payload size without the video packet header) if success.
+template <class Codec = CVideoCodec>
+static int ReadFlvVideoTagHeader(CSubprocess *ffmpeg_process, int *pts_ms = nullptr, int *dts_ms = nullptr, bool *is_keyframe = nullptr)
+{
+    int timestamp_ms = 0;
+    int composition_time = 0;
+    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process, &timestamp_ms);
+
+    if (flv_payload_size < 0)
+    {
+        fprintf(stderr, "Error: ReadFlvPacketHeader returned negative value (marking an error)\n");
+        return -1;
+    }
+
+    int header_size = ReadVideoPacketHeader<Codec>(ffmpeg_process, &composition_time, is_keyframe);
+
+    if (header_size < 0)
+    {
+        fprintf(stderr, "Error: ReadVideoPacketHeader failed\n");
+        return -1;
+    }
+
+    flv_payload_size -= header_size;    // After reading the video packet header, remaining size is header_size bytes less
+
+    if (flv_payload_size < 0)
+    {
+        fprintf(stderr, "Error: FLV payload size is smaller than the video packet header\n");
+        return -1;
+    }
+
+    if (pts_ms != nullptr)
+    {
+        *pts_ms = timestamp_ms + composition_time;
+    }
+
+    if (dts_ms != nullptr)
+    {
+        *dts_ms = timestamp_ms;
+    }
+
+    return flv_payload_size;
+}
+
+
+// Read <flv_payload_size> bytes of NAL units data to <flv_payload_buf> (all the NAL units at once), and build a list of Annex B NAL units views (without copying the data).
+// Must follow ReadFlvVideoTagHeader (<flv_payload_size> is the value returned by ReadFlvVideoTagHeader).
+// The views point <flv_payload_buf>, so the list is valid as long as the buffer is not modified.
+// <flv_payload_buf> - Pointer to buffer that receives the FLV payload (AVCC format) - <flv_payload_buf_size> bytes (the size is checked).
+// <nal_list> - Output: list of NAL units views.
+// <nal_length_size> - Size of the AVCC length field (see CAvcDecoderConfig).
+// <start_codes> - Start codes convention of the encoder (see CAvcDecoderConfig).
+// Return -1 in case of an error.
+// Return Annex B payload size if success.
+template <class Codec = CVideoCodec>
+static int ReadFlvNalUnits(CSubprocess *ffmpeg_process, const int flv_payload_size, unsigned char *flv_payload_buf, const int flv_payload_buf_size, CNalList *nal_list,
+                           const int nal_length_size = 4, const EStartCodeConvention start_codes = START_CODES_LIBX264)
+{
+    if (flv_payload_size > flv_payload_buf_size)
+    {
+        fprintf(stderr, "Error: FLV payload size %d doesn't fit buffer size %d\n", flv_payload_size, flv_payload_buf_size);
+        return -1;
+    }
+
+    // Read all the NAL units (in AVCC format) at once.
+    bool success = ffmpeg_process->stdoutRead(flv_payload_size, flv_payload_buf);
+
+    if (!success)
+    {
+        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvNalUnits\n");
+        return -1;
+    }
+
+    return ParseAvccNalUnits<Codec>(flv_payload_buf, flv_payload_size, nal_list, nal_length_size, start_codes);
+}
+
+
+// Read FLV payload to <flv_payload_buf>, and build a list of Annex B NAL units views (ReadFlvVideoTagHeader followed by ReadFlvNalUnits).
+// <flv_payload_buf> - Pointer to buffer that receives the FLV payload (AVCC format) - <flv_payload_buf_size> bytes (the size is checked).
+// <nal_list> - Output: list of NAL units views.
+// Return -1 in case of an error.
+// Return Annex B payload size if success.
+static int ReadFlvPayloadAsNalList(CSubprocess *ffmpeg_process, unsigned char *flv_payload_buf, const int flv_payload_buf_size, CNalList *nal_list)
+{
+    int flv_payload_size = ReadFlvVideoTagHeader(ffmpeg_process);
+
+    if (flv_payload_size < 0)
+    {
+        return -1;
+    }
+
+    return ReadFlvNalUnits(ffmpeg_process, flv_payload_size, flv_payload_buf, flv_payload_buf_size, nal_list, 4, g_encoder_profile->start_codes);
+}
+
+
+// Fill <iov> with the NAL units of <nal_list> - two entries per NAL unit: [start code][NAL unit].
+// The result may be passed directly to writev / sendmsg (no contiguous Annex B copy is needed).
+// <max_iov> - number of elements in <iov> (2*MAX_NALS_PER_ACCESS_UNIT is always enough).
+// Return number of used <iov> elements, or -1 if <max_iov> is too small.
+static inline int NalListToIovec(const CNalList *nal_list, struct iovec *iov, const int max_iov)
+{
+    if (2 * nal_list->n_nals > max_iov)
+    {
+        return -1;
+    }
+
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        iov[2*k].iov_base       = (void*)nal_list->nals[k].start_code;
+        iov[2*k].iov_len        = (size_t)nal_list->nals[k].start_code_len;
+        iov[2*k + 1].iov_base   = (void*)nal_list->nals[k].nal;
+        iov[2*k + 1].iov_len    = (size_t)nal_list->nals[k].nal_len;
+    }
+
+    return 2 * nal_list->n_nals;
+}
+
+
+// Read FLV payload, and convert it to AVC Annex B format.
+// Return Annex B data as bytes array(return None if end of file).
+// The FLV payload may contain several AVC NAL units(in AVCC format).
+// https://yumichan.net/video-processing/video-compression/introduction-to-h264-nal-unit/ """
+// Convenience wrapper of ReadFlvPayloadAsNalList - the NAL units are copied to one contiguous Annex B buffer.
+// <buf> - Pointer to sketch buffer of <buf_size> bytes (receives the FLV payload - the size is checked).
+// <annexb_payload_buf> - Pointer to output buffer (Annex B payload) of <annexb_payload_buf_size> bytes (the size is checked).
+// The Annex B payload may be larger than the FLV payload (3 or 4 bytes start codes replace 1 or 2 bytes length fields).
+// Return -1 in case of an error.
+// Return Annex B payload size if success.
+static inline int ReadFlvPayloadAndConvertToAnnexB(CSubprocess *ffmpeg_process, unsigned char *buf, const int buf_size, unsigned char *annexb_payload_buf, const int annexb_payload_buf_size)
+{
+    CNalList nal_list;
+
+    int annexb_payload_len = ReadFlvPayloadAsNalList(ffmpeg_process, buf, buf_size, &nal_list);
+
+    if (annexb_payload_len < 0)
+    {
+        return -1;
+    }
+
+    if (annexb_payload_len > annexb_payload_buf_size)
+    {
+        fprintf(stderr, "Error: Annex B payload size %d exceeds buffer size %d\n", annexb_payload_len, annexb_payload_buf_size);
+        return -1;
+    }
+
+    return CopyNalListToAnnexB(&nal_list, annexb_payload_buf);
+}
+
+
+// Read FLV payload directly to the output buffer, and convert it from AVCC to Annex B format "in place" (no sketch buffer, and no copy of the NAL units data).
+// Convenience wrapper of ReadFlvPayloadAsNalList and ConvertNalListToAnnexBInPlace.
+// <annexb_payload_buf> - Pointer to output buffer (receives the FLV payload) - <annexb_payload_buf_size> bytes (the size is checked).
+// <annexb_payload_offset> - Output: offset of the first Annex B byte in <annexb_payload_buf>.
+// Return -1 in case of an error.
+// Return Annex B payload size if success (the Annex B payload starts at annexb_payload_buf + *annexb_payload_offset).
+static inline int ReadFlvPayloadAndConvertToAnnexBInPlace(CSubprocess *ffmpeg_process, unsigned char *annexb_payload_buf, const int annexb_payload_buf_size, int *annexb_payload_offset)
+{
+    CNalList nal_list;
+
+    int annexb_payload_len = ReadFlvPayloadAsNalList(ffmpeg_process, annexb_payload_buf, annexb_payload_buf_size, &nal_list);
+
+    if (annexb_payload_len < 0)
+    {
+        return -1;
+    }
+
+    return ConvertNalListToAnnexBInPlace(&nal_list, annexb_payload_buf, annexb_payload_offset);
+}
+
+
+// Bounded lock-free single-producer/single-consumer ring (used for passing access units from the reader thread to the output).
+// All the slots are allocated in the constructor (no memory allocation after construction).
+// The producer fills the slot returned by frontForWrite() "in place", and publishes it by calling push().
+// The consumer uses the slot returned by frontForRead() "in place", and releases it by calling pop().
+// Only one thread may call the producer functions, and only one (other) thread may call the consumer functions.
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue (the SPSC case is much simpler).
+template <typename T>
+class CSpscRing
+{
+private:
+    T *m_slots = nullptr;
+    const size_t m_capacity;
+
+    // m_head and m_tail are "running counters" (slot index is counter % m_capacity).
+    // The counters are placed in different cache lines for avoiding "false sharing" between the producer and the consumer.
+    alignas(64) std::atomic<size_t> m_head; // Number of popped slots (modified only by the consumer).
+    alignas(64) std::atomic<size_t> m_tail; // Number of pushed slots (modified only by the producer).
+
+public:
+    CSpscRing(const size_t capacity) : m_capacity(capacity), m_head(0), m_tail(0)
+    {
+        m_slots = new T[capacity];
+    }
+
+    ~CSpscRing()
+    {
+        delete[] m_slots;
+    }
+
+    CSpscRing(const CSpscRing&) = delete;
+    CSpscRing &operator=(const CSpscRing&) = delete;
+
+    size_t capacity() const { return m_capacity; }
+
+    // Direct access to slot <i> - used only for initializing the slots (before the producer and consumer threads start).
+    T &at(const size_t i) { return m_slots[i]; }
+
+    // Producer: return pointer to the next free slot, or nullptr if the ring is full.
+    T *frontForWrite()
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+        {
+            return nullptr;    // Ring is full
+        }
+
+        return &m_slots[tail % m_capacity];
+    }
+
+    // Producer: publish the slot returned by frontForWrite().
+    void push()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: return pointer to the oldest published slot, or nullptr if the ring is empty.
+    T *frontForRead()
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return nullptr;    // Ring is empty
+        }
+
+        return &m_slots[head % m_capacity];
+    }
+
+    // Consumer: release the slot returned by frontForRead() (the slot may be reused by the producer).
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+
+// CPU time (user + system) of the calling thread in nanoseconds - the time the thread is blocked is not counted.
+static inline int64_t ThreadCpuNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+
+// Pool of pre-spawned FFmpeg worker processes with the same arguments (used when the encoding parameters are known in advance).
+// Starting FFmpeg costs the process creation, loading the executable and the shared libraries, parsing the arguments and opening the input -
+// an idle worker is done with all that, and it's blocked on reading the first raw frame from stdin PIPE when a session leases it.
+// Note: FFmpeg initializes the encoder when the first frame arrives (the encoder initialization is not saved).
+// FFmpeg process encodes one stream, so a leased worker doesn't return to the pool - the session closes it (ClosePipeAndDeleteObj),
+// and the pool spawns a replacement in a background thread (warm restart - the next session doesn't wait for the process creation).
+// An idle worker that ended (killed, or failed to start) is discarded when leased.
+class CFfmpegWorkerPool
+{
+private:
+    // Arguments of CSubprocess::Popen (the same for all the workers).
+    std::string m_cmd;
+    std::string m_process_name;
+    std::string m_cmd_args;
+    int m_buf_size              = 0;
+    int m_read_ahead_size       = 0;
+    int m_n_workers             = 0;        // Number of idle workers the pool keeps.
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;           // Notified when a worker is leased (and when quitting).
+    std::deque<CSubprocess*> m_idle;
+    bool m_is_quit              = false;
+    std::thread m_spawner;
+
+    // Statistics (guarded by m_lock).
+    int m_n_spawned             = 0;
+    int m_n_warm_leases         = 0;
+    int m_n_cold_leases         = 0;
+    int m_n_discarded           = 0;
+    int64_t m_spawn_ns          = 0;        // Total time of spawning the pre-spawned workers.
+
+    CFfmpegWorkerPool()
+    {
+    }
+
+    CSubprocess *spawn()
+    {
+        return CSubprocess::Popen(m_cmd, m_process_name, m_cmd_args, true, true, m_buf_size, m_read_ahead_size);
+    }
+
+    // Add a new idle worker (return false if spawning failed).
+    bool spawnIdle(std::unique_lock<std::mutex> &guard)
+    {
+        guard.unlock();     // Don't block the leases while spawning.
+        const int64_t t_start_ns = MonotonicNanos();
+        CSubprocess *worker = spawn();
+        const int64_t spawn_ns = MonotonicNanos() - t_start_ns;
+        guard.lock();
+
+        if (worker == nullptr)
+        {
+            return false;
+        }
+
+        m_idle.push_back(worker);
+        m_n_spawned++;
+        m_spawn_ns += spawn_ns;
+
+        return true;
+    }
+
+    // Background thread: replace the leased workers (keep m_n_workers idle workers).
+    void spawnerThread()
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+
+        while (true)
+        {
+            m_cv.wait(guard, [this] { return m_is_quit || ((int)m_idle.size() < m_n_workers); });
+
+            if (m_is_quit)
+            {
+                break;
+            }
+
+            if (!spawnIdle(guard))
+            {
+                // Don't spin when the process creation fails (a lease from an empty pool spawns a worker directly, and reports the error).
+                m_cv.wait_for(guard, std::chrono::milliseconds(500), [this] { return m_is_quit; });
+            }
+        }
+    }
+
+public:
+    // Create pool of <n_workers> idle workers executed by CSubprocess::Popen(cmd, process_name, cmd_args, true, true, buf_size, read_ahead_size).
+    // The first workers are spawned before returning (the background thread replaces the leased workers).
+    // Return nullptr in case of an error.
+    static CFfmpegWorkerPool *Create(const std::string &cmd,
+                                     const std::string &process_name,
+                                     const std::string &cmd_args,
+                                     const int n_workers, const int buf_size = 0, const int read_ahead_size = 65536)
+    {
+        if (n_workers <= 0)
+        {
+            fprintf(stderr, "Error: invalid number of FFmpeg workers %d\n", n_workers);
+            return nullptr;
+        }
+
+        CFfmpegWorkerPool *pool = new CFfmpegWorkerPool();
+        pool->m_cmd = cmd;
+        pool->m_process_name = process_name;
+        pool->m_cmd_args = cmd_args;
+        pool->m_buf_size = buf_size;
+        pool->m_read_ahead_size = read_ahead_size;
+        pool->m_n_workers = n_workers;
+
+        {
+            std::unique_lock<std::mutex> guard(pool->m_lock);
+
+            for (int k = 0; k < n_workers; k++)
+            {
+                if (!pool->spawnIdle(guard))
+                {
+                    fprintf(stderr, "Error: failed to spawn FFmpeg worker %d\n", k);
+                    guard.unlock();
+                    DeleteObj(pool);
+                    return nullptr;
+                }
+            }
+        }
+
+        pool->m_spawner = std::thread(&CFfmpegWorkerPool::spawnerThread, pool);
+
+        return pool;
+    }
+
+    // Stop the background thread, and kill the idle workers (they didn't get any frame - nothing is lost).
+    static void DeleteObj(CFfmpegWorkerPool *pool)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pool->m_lock);
+            pool->m_is_quit = true;
+        }
+
+        pool->m_cv.notify_all();
+
+        if (pool->m_spawner.joinable())
+        {
+            pool->m_spawner.join();
+        }
+
+        for (CSubprocess *worker : pool->m_idle)
+        {
+            CSubprocess::KillAndDeleteObj(worker);
+        }
+
+        delete pool;
+    }
+
+    // Return true if the workers are executed with <cmd_args> and <buf_size> (a session with other arguments executes FFmpeg directly).
+    bool isMatching(const std::string &cmd_args, const int buf_size) const
+    {
+        return (cmd_args == m_cmd_args) && (buf_size == m_buf_size);
+    }
+
+    // Lease an idle worker - the caller owns the worker (and closes it by ClosePipeAndDeleteObj).
+    // When there is no idle worker (all leased, or ended), a worker is spawned directly (cold start).
+    // <is_warm> - Optional output: true if the worker was pre-spawned.
+    // Return nullptr in case of an error.
+    CSubprocess *lease(bool *is_warm = nullptr)
+    {
+        CSubprocess *worker = nullptr;
+        std::vector<CSubprocess*> ended;
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            while ((worker == nullptr) && (!m_idle.empty()))
+            {
+                CSubprocess *w = m_idle.front();
+                m_idle.pop_front();
+
+                if (w->hasExited())
+                {
+                    ended.push_back(w);
+                }
+                else
+                {
+                    worker = w;
+                }
+            }
+
+            m_n_discarded += (int)ended.size();
+
+            if (worker != nullptr)
+            {
+                m_n_warm_leases++;
+            }
+            else
+            {
+                m_n_cold_leases++;
+            }
+        }
+
+        m_cv.notify_one();
+
+        for (CSubprocess *w : ended)
+        {
+            CSubprocess::KillAndDeleteObj(w);
+        }
+
+        if (is_warm != nullptr)
+        {
+            *is_warm = (worker != nullptr);
+        }
+
+        return (worker != nullptr) ? worker : spawn();
+    }
+
+    void printStatistics()
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+
+        fprintf(stderr, "FFmpeg worker pool: %d workers spawned (%.1f ms average spawn time), %d warm leases, %d cold leases, %d ended idle workers discarded\n",
+                m_n_spawned, (m_n_spawned > 0) ? (double)m_spawn_ns / (1e6 * m_n_spawned) : 0.0, m_n_warm_leases, m_n_cold_leases, m_n_discarded);
+    }
+};
+
+
+// CPU time of the pipeline stages (used by the benchmark) - each stage is measured by the single thread that executes it.
+struct CStageCpuTimes
+{
+    int64_t gen_ns = 0;         // Making the raw frames (drawing, and conversion to YUV).
+    int64_t write_ns = 0;       // Writing the raw frames to stdin PIPE.
+    int64_t parse_ns = 0;       // Reading stdout PIPE, FLV parsing, and conversion to Annex B.
+    int64_t output_ns = 0;      // Writing the Annex B stream to the output.
+
+    void add(const CStageCpuTimes &other)
+    {
+        gen_ns += other.gen_ns;
+        write_ns += other.write_ns;
+        parse_ns += other.parse_ns;
+        output_ns += other.output_ns;
+    }
+};
+
+
+// Counters and CPU times of an encoding run (used by the benchmark).
+struct CPipelineStats
+{
+    CStageCpuTimes cpu;
+    CPipeCounters stdin_counters;
+    CPipeCounters stdout_counters;
+    int64_t n_access_units = 0;
+
+    void add(const CPipelineStats &other)
+    {
+        cpu.add(other.cpu);
+        stdin_counters.add(other.stdin_counters);
+        stdout_counters.add(other.stdout_counters);
+        n_access_units += other.n_access_units;
+    }
+};
+
+
+// Histogram of latency values in microseconds (log-linear buckets: 8 buckets per power of two, so the relative error is at most 12.5%).
+// Recording is a few integer operations (no allocation, no lock) - each histogram must be recorded by a single thread.
+class CLatencyHistogram
+{
+private:
+    static const int N_LINEAR = 16;             // Values 0..15 have a bucket each.
+    static const int SUB_BUCKETS = 8;           // Buckets per power of two (above N_LINEAR).
+    static const int MAX_EXPONENT = 40;         // 2^40 microseconds is more than enough...
+    static const int N_BUCKETS = N_LINEAR + (MAX_EXPONENT - 4 + 1) * SUB_BUCKETS;
+
+    uint64_t m_counts[N_BUCKETS];
+    uint64_t m_n_values = 0;
+    int64_t m_max_value = 0;
+
+    static int bucketOf(int64_t v)
+    {
+        if (v < N_LINEAR)
+        {
+            return (int)v;
+        }
+
+        int e = 63 - __builtin_clzll((unsigned long long)v);    // Index of the most significant bit (4 or above).
+        e = std::min(e, MAX_EXPONENT);
+        int sub = (int)((v >> (e - 3)) & (SUB_BUCKETS - 1));
+
+        return N_LINEAR + (e - 4) * SUB_BUCKETS + sub;
+    }
+
+    // The largest value of bucket <b>.
+    static int64_t bucketUpperBound(const int b)
+    {
+        if (b < N_LINEAR)
+        {
+            return b;
+        }
+
+        int e = (b - N_LINEAR) / SUB_BUCKETS + 4;
+        int sub = (b - N_LINEAR) % SUB_BUCKETS;
+
+        return ((int64_t)(SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+    }
+
+public:
+    CLatencyHistogram()
+    {
+        memset(m_counts, 0, sizeof(m_counts));
+    }
+
+    void record(int64_t value_us)
+    {
+        value_us = std::max(value_us, (int64_t)0);
+        m_counts[bucketOf(value_us)]++;
+        m_n_values++;
+        m_max_value = std::max(m_max_value, value_us);
+    }
+
+    uint64_t count() const { return m_n_values; }
+    int64_t maxValue() const { return m_max_value; }
+
+    // Return the value at percentile <p> (0 to 100) - the upper bound of the bucket, but not more than the maximum.
+    int64_t percentile(const double p) const
+    {
+        if (m_n_values == 0)
+        {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)m_n_values + 0.999999);
+        rank = std::max(rank, (uint64_t)1);
+        uint64_t n = 0;
+
+        for (int b = 0; b < N_BUCKETS; b++)
+        {
+            n += m_counts[b];
+
+            if (n >= rank)
+            {
+                return std::min(bucketUpperBound(b), m_max_value);
+            }
+        }
+
+        return m_max_value;
+    }
+
+    void print(const char *name) const
+    {
+        fprintf(stderr, "    %-16s n = %5d   p50 = %8.3f ms   p99 = %8.3f ms   max = %8.3f ms\n", name, (int)m_n_values,
+                (double)percentile(50) / 1000.0, (double)percentile(99) / 1000.0, (double)m_max_value / 1000.0);
+    }
+};
+
+
+// Per frame latency instrumentation.
+// The writer thread records a timestamp when each raw frame is written to stdin PIPE (the frame index is known).
+// The reader thread matches each access unit to its source frame by the presentation timestamp in the FLV stream:
+// FFmpeg timestamps frame i as pts0 + i*1000/fps milliseconds (and B-frames reordering is undone by the composition time).
+// pts0 is the pts of the first access unit (the IDR frame of source frame 0) - it's not 0 with B-frames: the FLV muxer shifts the timestamps
+// so the first dts is 0, and the first frame is presented after the reordering delay (80ms with -bf 3 at 25 fps).
+// Histograms:
+// pipe wait - duration of writing the raw frame to stdin PIPE (blocked while the PIPE is full - FFmpeg falls behind).
+// encode    - from the end of writing the raw frame, until the FLV tag header of the access unit is read from stdout PIPE.
+// parse     - from the FLV tag header, until the Annex B access unit is ready (reading the payload and converting).
+//
+// Encoder pipeline depth (latency in frames) is detected at runtime (instead of guessing it by trial and error):
+// When stdout PIPE becomes readable (poll readiness) with the access unit of source frame k, the writer has written n frames,
+// so the encoder holds n - (k+1) frames (depth 0 means "raw frame in, encoded frame out").
+// The writer is blocked while a raw frame is partly in stdin PIPE, so when the PIPE capacity is smaller than a raw frame (1MB PIPE and 1280x720 BGR),
+// the writer can't be a whole frame ahead of the encoder, and the minimum over the access units is the exact depth
+// (with a larger PIPE, the result may exceed the depth by the number of raw frames the PIPE holds).
+// The access units that arrive after the last frame is written are not counted (closing stdin flushes the encoder).
+#define LATENCY_DEPTH_SLACK    8   // Frames the detected depth may exceed the depth of the encoder by (queued inside FFmpeg).
+
+class CLatencyStats
+{
+private:
+    static const int MAX_DEPTH = 256;
+
+    const int m_n_frames;
+    const int m_fps;
+    std::atomic<int64_t> *m_frame_in_ns = nullptr;  // Written by the writer thread, read by the reader thread.
+    std::atomic<int> m_n_frames_written;            // Written by the writer thread, read by the reader thread.
+    int m_pts0_ms = -1;                             // pts of the first access unit (-1 before the first access unit).
+    int m_n_matched = 0;
+    int m_n_unmatched = 0;
+
+    // Pipeline depth detection (reader thread).
+    int m_n_written_at_readable = 0;    // Number of frames written when stdout PIPE became readable.
+    int m_depth_counts[MAX_DEPTH + 1];
+    int m_min_depth = MAX_DEPTH;
+    int m_max_depth = 0;
+
+public:
+    CLatencyHistogram pipe_wait_hist;   // Recorded by the writer thread.
+    CLatencyHistogram encode_hist;      // Recorded by the reader thread.
+    CLatencyHistogram parse_hist;       // Recorded by the reader thread.
+
+    CLatencyStats(const int n_frames, const int fps) : m_n_frames(n_frames), m_fps(fps), m_n_frames_written(0)
+    {
+        memset(m_depth_counts, 0, sizeof(m_depth_counts));
+        m_frame_in_ns = new std::atomic<int64_t>[n_frames];
+
+        for (int i = 0; i < n_frames; i++)
+        {
+            m_frame_in_ns[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ~CLatencyStats()
+    {
+        delete[] m_frame_in_ns;
+    }
+
+    CLatencyStats(const CLatencyStats&) = delete;
+    CLatencyStats &operator=(const CLatencyStats&) = delete;
+
+    // Writer thread: raw frame <frame_idx> was written to stdin PIPE between <t_start_ns> and <t_end_ns>.
+    void onFrameWritten(const int frame_idx, const int64_t t_start_ns, const int64_t t_end_ns)
+    {
+        pipe_wait_hist.record((t_end_ns - t_start_ns) / 1000);
+
+        if ((frame_idx >= 0) && (frame_idx < m_n_frames))
+        {
+            m_frame_in_ns[frame_idx].store(t_end_ns, std::memory_order_release);
+        }
+
+        m_n_frames_written.fetch_add(1, std::memory_order_release);
+    }
+
+    // Reader thread: stdout PIPE is readable (the next access unit started arriving) - take a snapshot of the number of written frames.
+    void onStdoutReadable()
+    {
+        m_n_written_at_readable = m_n_frames_written.load(std::memory_order_acquire);
+    }
+
+    // Reader thread: the access unit with <pts_ms> arrived at <t_header_ns> (FLV tag header), and was ready at <t_done_ns>.
+    void onAccessUnit(const int pts_ms, const int64_t t_header_ns, const int64_t t_done_ns)
+    {
+        parse_hist.record((t_done_ns - t_header_ns) / 1000);
+
+        if (m_pts0_ms < 0)
+        {
+            m_pts0_ms = pts_ms;     // The first access unit in decoding order is the IDR frame of source frame 0.
+        }
+
+        const int frame_idx = (int)(((int64_t)(pts_ms - m_pts0_ms) * m_fps + 500) / 1000);
+        int64_t t_in_ns = ((frame_idx >= 0) && (frame_idx < m_n_frames)) ? m_frame_in_ns[frame_idx].load(std::memory_order_acquire) : 0;
+
+        if (t_in_ns == 0)
+        {
+            m_n_unmatched++;    // Unexpected timestamp (or the frame is not written yet...).
+            return;
+        }
+
+        m_n_matched++;
+        encode_hist.record((t_header_ns - t_in_ns) / 1000);
+
+        if (m_n_written_at_readable >= m_n_frames)
+        {
+            return;     // All the frames are written - the encoder is flushed by closing stdin (the depth is not observable).
+        }
+
+        int depth = std::min(std::max(m_n_written_at_readable - (frame_idx + 1), 0), (int)MAX_DEPTH);
+        m_depth_counts[depth]++;
+        m_min_depth = std::min(m_min_depth, depth);
+        m_max_depth = std::max(m_max_depth, depth);
+    }
+
+    // Detected encoder pipeline depth in frames (-1 if no access unit is matched).
+    int detectedDepth() const
+    {
+        return (m_min_depth <= m_max_depth) ? m_min_depth : (-1);
+    }
+
+    int matchedCount() const { return m_n_matched; }
+    int unmatchedCount() const { return m_n_unmatched; }
+
+    void print() const
+    {
+        fprintf(stderr, "Latency (%d access units not matched to a source frame):\n", m_n_unmatched);
+        pipe_wait_hist.print("pipe wait");
+        encode_hist.print("encode");
+        parse_hist.print("parse");
+
+        fprintf(stderr, "Encoder pipeline depth: %d frames (observed %d to %d):", detectedDepth(), m_min_depth, m_max_depth);
+
+        for (int d = 0; d <= MAX_DEPTH; d++)
+        {
+            if (m_depth_counts[d] > 0)
+            {
+                fprintf(stderr, " [%d: %d]", d, m_depth_counts[d]);
+            }
+        }
+
+        fprintf(stderr, "\n");
+    }
+};
+
+
+// 64-bit FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/) - incremental: pass the hash of the previous part as <h>.
+// The access units are small compared to the raw frames, so a simple byte-by-byte hash is fast enough.
+#define FNV1A_64_OFFSET_BASIS   0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME          0x100000001b3ULL
+
+static inline uint64_t Fnv1a64(const unsigned char *data, const size_t len, uint64_t h = FNV1A_64_OFFSET_BASIS)
+{
+    for (size_t k = 0; k < len; k++)
+    {
+        h = (h ^ data[k]) * FNV1A_64_PRIME;
+    }
+
+    return h;
+}
+
+
+// Hash of the Annex B access unit described by <nal_list> (start codes and NAL units) - same as Fnv1a64 of the contiguous payload.
+static inline uint64_t HashNalList(const CNalList *nal_list)
+{
+    uint64_t h = FNV1A_64_OFFSET_BASIS;
+
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        h = Fnv1a64(nal_list->nals[k].start_code, nal_list->nals[k].start_code_len, h);
+        h = Fnv1a64(nal_list->nals[k].nal, nal_list->nals[k].nal_len, h);
+    }
+
+    return h;
+}
+
+
+// Bit-exact verifier of the Annex B output: compare each access unit to the reference stream (encoded before by the reference FFmpeg).
+// The reference file (out.264) is split to access units once, and only the size and the hash of each access unit are kept,
+// so there is no need to execute a second FFmpeg process that encodes every frame again in each run.
+// The size of every access unit is compared (free), and the hash of one of each <sample_period> access units (low cost sampled mode).
+// The object is used by one thread (one verifier per stream).
+class CAccessUnitVerifier
+{
+private:
+    // Maximum number of reported mismatches (the rest are only counted).
+    static const int MAX_REPORTED_MISMATCHES = 8;
+
+    struct CReferenceAccessUnit
+    {
+        int size;
+        uint64_t hash;      // 0 if the access unit is not sampled.
+    };
+
+    std::vector<CReferenceAccessUnit> m_reference;
+    int m_sample_period     = 1;
+    int m_n_access_units    = 0;    // Number of verified access units (sampled or not).
+    int m_n_hashed          = 0;
+    int m_n_mismatches      = 0;
+    int m_first_mismatch    = -1;
+
+    CAccessUnitVerifier()
+    {
+    }
+
+    void onMismatch(const char *what, const int au_idx, const int size)
+    {
+        if (m_n_mismatches < MAX_REPORTED_MISMATCHES)
+        {
+            fprintf(stderr, "Verifier: access unit %d %s mismatch (size %d, reference size %d)\n", au_idx, what, size,
+                    (au_idx < (int)m_reference.size()) ? m_reference[au_idx].size : (-1));
+        }
+
+        if (m_first_mismatch < 0)
+        {
+            m_first_mismatch = au_idx;
+        }
+
+        m_n_mismatches++;
+    }
+
+    // Split the Annex B stream <buf> to access units, and hash the sampled access units.
+    void splitReference(const unsigned char *buf, const size_t size)
+    {
+        size_t au_start = 0;
+        bool has_vcl = false;
+        size_t pos = 0;
+
+        while (pos + 3 <= size)
+        {
+            // Find the next 3 bytes start code (a 4 bytes start code is the same with a leading zero).
+            const unsigned char *p = (const unsigned char*)memchr(&buf[pos + 2], 1, size - pos - 2);
+
+            if (p == nullptr)
+            {
+                break;
+            }
+
+            pos = (size_t)(p - buf) - 2;
+
+            if ((buf[pos] != 0) || (buf[pos + 1] != 0))
+            {
+                pos++;
+                continue;
+            }
+
+            const size_t sc_start = ((pos > 0) && (buf[pos - 1] == 0)) ? (pos - 1) : pos;
+            const unsigned char *nal = &buf[pos + 3];
+            const int nal_len = (int)std::min(size - (pos + 3), (size_t)16);    // Only the first bytes of the NAL unit are parsed.
+
+            if (nal_len > 0)
+            {
+                if (has_vcl && CVideoCodec::IsFirstNalOfAccessUnit(nal, nal_len))
+                {
+                    addReference(&buf[au_start], sc_start - au_start);
+                    au_start = sc_start;
+                    has_vcl = false;
+                }
+
+                has_vcl = has_vcl || CVideoCodec::IsVcl(CVideoCodec::NalType(nal));
+            }
+
+            pos += 3;
+        }
+
+        if (has_vcl)
+        {
+            addReference(&buf[au_start], size - au_start);
+        }
+    }
+
+    void addReference(const unsigned char *au, const size_t au_size)
+    {
+        CReferenceAccessUnit ref;
+        ref.size = (int)au_size;
+        ref.hash = isSampled((int)m_reference.size()) ? Fnv1a64(au, au_size) : 0;
+        m_reference.push_back(ref);
+    }
+
+    bool isSampled(const int au_idx) const
+    {
+        return (au_idx % m_sample_period) == 0;
+    }
+
+public:
+    // Create verifier with reference Annex B file <reference_file_name> (out.264 encoded by the reference FFmpeg process).
+    // <sample_period> - hash one of each <sample_period> access units (1 for hashing every access unit).
+    // Return nullptr if the reference file doesn't exist (or has no access units).
+    static CAccessUnitVerifier *Create(const std::string &reference_file_name, const int sample_period)
+    {
+        FILE *f = fopen(reference_file_name.c_str(), "rb");
+
+        if (f == nullptr)
+        {
+            return nullptr;
+        }
+
+        std::vector<unsigned char> buf;
+        unsigned char chunk[65536];
+        size_t n_bytes;
+
+        while ((n_bytes = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        {
+            buf.insert(buf.end(), chunk, chunk + n_bytes);
+        }
+
+        fclose(f);
+
+        CAccessUnitVerifier *verifier = new CAccessUnitVerifier();
+        verifier->m_sample_period = std::max(sample_period, 1);
+        verifier->splitReference(buf.data(), buf.size());
+
+        if (verifier->m_reference.empty())
+        {
+            fprintf(stderr, "Verifier: no access units in %s\n", reference_file_name.c_str());
+            DeleteObj(verifier);
+            return nullptr;
+        }
+
+        return verifier;
+    }
+
+    static void DeleteObj(CAccessUnitVerifier *verifier)
+    {
+        delete verifier;
+    }
+
+    // Verify the next access unit (in output order).
+    // <is_nal_list> - true: the Annex B access unit is described by au->nal_list (DO_WRITE_NAL_UNITS_WITH_WRITEV), false: contiguous payload in au->buffer.
+    void verify(const CAccessUnit *au, const bool is_nal_list)
+    {
+        const int au_idx = m_n_access_units++;
+        const int size = is_nal_list ? au->nal_list.annexb_len : au->annexb_payload_len;
+
+        if ((au_idx >= (int)m_reference.size()) || (size != m_reference[au_idx].size))
+        {
+            onMismatch("size", au_idx, size);
+            return;
+        }
+
+        if (!isSampled(au_idx))
+        {
+            return;
+        }
+
+        const uint64_t h = is_nal_list ? HashNalList(&au->nal_list) : Fnv1a64(&au->buffer->data[au->annexb_payload_offset], (size_t)size);
+        m_n_hashed++;
+
+        if (h != m_reference[au_idx].hash)
+        {
+            onMismatch("hash", au_idx, size);
+        }
+    }
+
+    // Print the result (after the last access unit), and return true if the output is the same as the reference.
+    // Missing (or extra) access units at the end of the stream are counted as a mismatch.
+    bool finish(const int stream_id)
+    {
+        const int n_missing = (int)m_reference.size() - m_n_access_units;
+
+        if ((n_missing > 0) && (m_first_mismatch < 0))
+        {
+            m_first_mismatch = m_n_access_units;
+        }
+
+        const bool is_pass = (m_n_mismatches == 0) && (n_missing == 0);
+
+        fprintf(stderr, "Verifier stream %d: %s - %d access units (%d hashed, 1 of %d), %d mismatches, %d missing",
+                stream_id, is_pass ? "PASS" : "FAIL", m_n_access_units, m_n_hashed, m_sample_period, m_n_mismatches, std::max(n_missing, 0));
+
+        if (!is_pass)
+        {
+            fprintf(stderr, ", first mismatch at access unit %d", m_first_mismatch);
+        }
+
+        fprintf(stderr, "\n");
+
+        return is_pass;
+    }
+};
+
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103     // Linux 4.18 (older glibc headers don't define it).
+#endif
+
+// RTP sender of the access units over UDP (RFC 6184 - RTP payload format for H.264) - the "true purpose" of the pipeline.
+// The packets point the NAL units in the views of au->nal_list (iovec entries), so the NAL units data is not copied -
+// only the RTP headers and the STAP-A / FU-A headers are built (in a small headers storage).
+// Packetization (non-interleaved mode):
+// NAL unit that fits in a packet is sent as "single NAL unit packet", consecutive small NAL units (SPS, PPS, SEI) are aggregated in one STAP-A packet,
+// and NAL unit that doesn't fit is fragmented to FU-A packets of equal sizes (the last fragment may be shorter).
+// The marker bit is set in the last packet of the access unit, and the RTP timestamp is the PTS in 90kHz clock.
+// The packets are sent in batches by sendmmsg (one system call for up to MAX_BATCH_PACKETS packets).
+// With UDP GSO (Linux 4.18), the FU-A fragments of a NAL unit are one message, and the kernel splits it to datagrams (one pass over the network stack).
+// Pacing: each access unit is sent at the time of its FLV timestamp (DTS) relative to the first access unit,
+// and the batches of a large access unit are spread over half of the frame interval (long bursts overflow the buffers of switches and receivers).
+// The object is used by one thread (the consumer of the access units).
+class CRtpSender
+{
+private:
+    static const int RTP_HEADER_SIZE        = 12;
+    static const int RTP_PAYLOAD_TYPE       = 96;   // Dynamic payload type (the receiver maps it to H264/90000 in the SDP).
+    static const int RTP_CLOCK_KHZ          = 90;   // Video RTP clock rate is 90kHz (RFC 6184 section 8.2.1).
+    static const int NAL_TYPE_STAP_A        = 24;
+    static const int NAL_TYPE_FU_A          = 28;
+    static const int MAX_STAP_A_NALS        = 16;
+    static const int MAX_BATCH_PACKETS      = 64;   // Packets per sendmmsg (a GSO message is limited to 64 segments as well).
+    static const int MAX_GSO_BYTES          = 65000;    // A GSO message is one UDP datagram for the kernel (64KB minus IP and UDP headers).
+    static const int MAX_LATENESS_MS        = 500;  // An access unit that is later than that restarts the pacing clock (no burst of the backlog).
+
+    // RTP header and the payload header (STAP-A header and sizes, or FU indicator and FU header) of one packet.
+    static const int MAX_HEADER_BYTES       = RTP_HEADER_SIZE + 1 + 2 * MAX_STAP_A_NALS;
+
+    // [headers][NAL unit] for single NAL unit and FU-A, and [headers][NAL unit]([size][NAL unit])... for STAP-A.
+    static const int MAX_IOV_PER_PACKET     = 2 * MAX_STAP_A_NALS;
+
+    int m_fd = -1;
+    int m_max_payload_size = 0;     // Maximum RTP payload size (maximum packet size without the RTP header).
+    uint16_t m_seq = 0;
+    uint32_t m_ssrc = 0;
+    bool m_is_gso = false;          // Disabled at runtime if the kernel (or the device) doesn't support GSO.
+    bool m_is_paced = false;
+
+    // Batch of packets (sent by flush).
+    unsigned char m_headers[MAX_BATCH_PACKETS][MAX_HEADER_BYTES];
+    struct iovec m_iov[MAX_BATCH_PACKETS * MAX_IOV_PER_PACKET];
+    int m_packet_first_iov[MAX_BATCH_PACKETS + 1];  // The iovec entries of packet p are m_iov[m_packet_first_iov[p]] up to m_iov[m_packet_first_iov[p + 1]].
+    struct mmsghdr m_msgs[MAX_BATCH_PACKETS];
+    int m_msg_first_packet[MAX_BATCH_PACKETS];
+    int m_msg_n_packets[MAX_BATCH_PACKETS];         // More than one packet - GSO message of m_msg_gso_size[] bytes segments.
+    int m_msg_gso_size[MAX_BATCH_PACKETS];
+    int m_msg_bytes[MAX_BATCH_PACKETS];
+    alignas(struct cmsghdr) char m_cmsgs[MAX_BATCH_PACKETS][CMSG_SPACE(sizeof(uint16_t))];  // UDP_SEGMENT control message of each GSO message.
+    int m_n_packets = 0;
+    int m_n_iov = 0;
+    int m_n_msgs = 0;
+    int m_open_gso_size = 0;        // Segment size of the last message if more segments may be appended to it (0 if closed).
+
+    // Pacing state.
+    bool m_is_first_au = true;
+    int64_t m_t0_ns = 0;            // Send time of the access unit with DTS m_dts0_ms.
+    int m_dts0_ms = 0;
+    int m_last_dts_ms = 0;
+    int64_t m_spread_ns = 0;        // Half of the last frame interval.
+    int64_t m_t_au_ns = 0;          // Send time of the current access unit.
+    int m_lateness_ms = 0;          // How late the current access unit was ready, relative to its send time (the backlog of the sink).
+    int m_au_bytes = 0;
+    int m_au_bytes_sent = 0;
+
+    // Statistics.
+    int64_t m_n_sent_packets = 0;
+    int64_t m_n_sent_bytes = 0;
+    int64_t m_n_sendmmsg = 0;
+    int64_t m_n_gso_msgs = 0;
+    int64_t m_n_dropped_packets = 0;   // The send queue was full (EAGAIN, ENOBUFS).
+    int64_t m_n_refused_packets = 0;   // There is no receiver (ECONNREFUSED).
+    int64_t m_n_late_access_units = 0;
+
+    CRtpSender()
+    {
+    }
+
+    static void SleepUntilNanos(const int64_t t_ns)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(t_ns / 1000000000LL);
+        ts.tv_nsec = (long)(t_ns % 1000000000LL);
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        {
+        }
+    }
+
+    // Wait for the send time of the access unit with decoding timestamp <dts_ms> and <au_bytes> bytes.
+    void paceAccessUnit(const int dts_ms, const int au_bytes)
+    {
+        m_au_bytes = std::max(au_bytes, 1);
+        m_au_bytes_sent = 0;
+
+        if (!m_is_paced)
+        {
+            return;
+        }
+
+        const int64_t now_ns = MonotonicNanos();
+
+        if (m_is_first_au || (dts_ms < m_last_dts_ms))
+        {
+            m_t0_ns = now_ns;
+            m_dts0_ms = dts_ms;
+        }
+        else if (dts_ms > m_last_dts_ms)
+        {
+            m_spread_ns = (int64_t)(dts_ms - m_last_dts_ms) * 1000000 / 2;
+        }
+
+        m_is_first_au = false;
+        m_last_dts_ms = dts_ms;
+        m_t_au_ns = m_t0_ns + (int64_t)(dts_ms - m_dts0_ms) * 1000000;
+        m_lateness_ms = (int)(std::max(now_ns - m_t_au_ns, (int64_t)0) / 1000000);
+
+        if (now_ns - m_t_au_ns > (int64_t)MAX_LATENESS_MS * 1000000)
+        {
+            // The encoder (or the output) was stalled - restart the clock, instead of sending the following access units in a burst.
+            m_t0_ns = now_ns;
+            m_dts0_ms = dts_ms;
+            m_t_au_ns = now_ns;
+            m_n_late_access_units++;
+        }
+
+        SleepUntilNanos(m_t_au_ns);
+    }
+
+    // Start new packet in the batch, and return a pointer to the payload header (after the RTP header) - <payload_header_len> bytes are sent.
+    // <gso_size> - size of the FU-A packets of the same NAL unit (the packets may be segments of one GSO message), 0 for other packets.
+    // Return nullptr in case of an error (the batch is full, and the flush failed).
+    unsigned char *beginPacket(const uint32_t rtp_timestamp, const bool is_marker, const int payload_header_len, const int gso_size)
+    {
+        if ((m_n_packets == MAX_BATCH_PACKETS) && !flush())
+        {
+            return nullptr;
+        }
+
+        const int last = m_n_msgs - 1;
+
+        const bool is_segment = m_is_gso && (gso_size > 0) && (last >= 0) && (m_open_gso_size == gso_size) &&
+                                (m_msg_bytes[last] + gso_size <= MAX_GSO_BYTES);
+
+        if (!is_segment)
+        {
+            struct msghdr *mh = &m_msgs[m_n_msgs].msg_hdr;
+            memset(mh, 0, sizeof(struct msghdr));
+            mh->msg_iov = &m_iov[m_n_iov];
+
+            m_msg_first_packet[m_n_msgs] = m_n_packets;
+            m_msg_n_packets[m_n_msgs] = 0;
+            m_msg_gso_size[m_n_msgs] = gso_size;
+            m_msg_bytes[m_n_msgs] = 0;
+            m_open_gso_size = m_is_gso ? gso_size : 0;
+            m_n_msgs++;
+        }
+
+        m_msg_n_packets[m_n_msgs - 1]++;
+        m_packet_first_iov[m_n_packets] = m_n_iov;
+
+        // RTP header (RFC 3550 section 5.1): version 2, no padding, no extension, no CSRC.
+        unsigned char *h = m_headers[m_n_packets];
+        h[0] = 0x80;
+        h[1] = (unsigned char)((is_marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE);
+        h[2] = (unsigned char)(m_seq >> 8);
+        h[3] = (unsigned char)m_seq;
+        h[4] = (unsigned char)(rtp_timestamp >> 24);
+        h[5] = (unsigned char)(rtp_timestamp >> 16);
+        h[6] = (unsigned char)(rtp_timestamp >> 8);
+        h[7] = (unsigned char)rtp_timestamp;
+        h[8] = (unsigned char)(m_ssrc >> 24);
+        h[9] = (unsigned char)(m_ssrc >> 16);
+        h[10] = (unsigned char)(m_ssrc >> 8);
+        h[11] = (unsigned char)m_ssrc;
+
+        m_seq++;
+        m_n_packets++;
+
+        addPayload(h, RTP_HEADER_SIZE + payload_header_len);
+
+        return &h[RTP_HEADER_SIZE];
+    }
+
+    // Append <len> bytes at <data> to the current packet (no copy - the data must be valid until the flush).
+    void addPayload(const void *data, const int len)
+    {
+        m_iov[m_n_iov].iov_base = (void*)data;
+        m_iov[m_n_iov].iov_len = (size_t)len;
+        m_n_iov++;
+
+        m_msgs[m_n_msgs - 1].msg_hdr.msg_iovlen++;
+        m_msg_bytes[m_n_msgs - 1] += len;
+    }
+
+    // Close the current packet (<packet_size> bytes including the RTP header).
+    void endPacket(const int packet_size)
+    {
+        // Only the last segment of a GSO message may be shorter than the segment size.
+        if (packet_size < m_open_gso_size)
+        {
+            m_open_gso_size = 0;
+        }
+    }
+
+    static void WriteSize16(unsigned char *p, const int size)
+    {
+        p[0] = (unsigned char)(size >> 8);
+        p[1] = (unsigned char)size;
+    }
+
+    bool addSingleNalPacket(const CNalView *v, const uint32_t rtp_timestamp, const bool is_marker)
+    {
+        if (beginPacket(rtp_timestamp, is_marker, 0, 0) == nullptr)
+        {
+            return false;
+        }
+
+        addPayload(v->nal, v->nal_len);
+        endPacket(RTP_HEADER_SIZE + v->nal_len);
+
+        return true;
+    }
+
+    // STAP-A packet (RFC 6184 section 5.7.1): [STAP-A NAL header]([16 bits NAL unit size][NAL unit])...
+    bool addStapAPacket(const CNalView *nals, const int n_nals, const uint32_t rtp_timestamp, const bool is_marker)
+    {
+        // The F bit is the OR of the F bits, and the NRI is the maximum NRI of the aggregated NAL units.
+        int f = 0;
+        int nri = 0;
+
+        for (int k = 0; k < n_nals; k++)
+        {
+            f |= nals[k].nal[0] & 0x80;
+            nri = std::max(nri, nals[k].nal[0] & 0x60);
+        }
+
+        unsigned char *h = beginPacket(rtp_timestamp, is_marker, 3, 0);
+
+        if (h == nullptr)
+        {
+            return false;
+        }
+
+        h[0] = (unsigned char)(f | nri | NAL_TYPE_STAP_A);
+        WriteSize16(&h[1], nals[0].nal_len);
+        addPayload(nals[0].nal, nals[0].nal_len);
+
+        int packet_size = RTP_HEADER_SIZE + 3 + nals[0].nal_len;
+
+        for (int k = 1; k < n_nals; k++)
+        {
+            unsigned char *size_field = &h[3 + 2 * (k - 1)];    // The sizes are stored after the STAP-A header.
+            WriteSize16(size_field, nals[k].nal_len);
+            addPayload(size_field, 2);
+            addPayload(nals[k].nal, nals[k].nal_len);
+            packet_size += 2 + nals[k].nal_len;
+        }
+
+        endPacket(packet_size);
+
+        return true;
+    }
+
+    // FU-A packets (RFC 6184 section 5.8): [FU indicator][FU header][fragment] - the NAL header byte is not sent (restored from the FU headers).
+    bool addFuAPackets(const CNalView *v, const uint32_t rtp_timestamp, const bool is_marker)
+    {
+        const unsigned char *data = &v->nal[1];
+        const int data_len = v->nal_len - 1;
+
+        // Fragments of equal sizes (the last fragment may be shorter) - all the packets except the last one are GSO segments of the same size.
+        const int max_fragment_size = m_max_payload_size - 2;
+        const int n_fragments = (data_len + max_fragment_size - 1) / max_fragment_size;
+        const int fragment_size = (data_len + n_fragments - 1) / n_fragments;
+        const int gso_size = RTP_HEADER_SIZE + 2 + fragment_size;
+
+        const unsigned char fu_indicator = (unsigned char)((v->nal[0] & 0xE0) | NAL_TYPE_FU_A);
+        const unsigned char nal_type = (unsigned char)(v->nal[0] & 0x1F);
+
+        for (int idx = 0; idx < data_len; idx += fragment_size)
+        {
+            const int len = std::min(fragment_size, data_len - idx);
+            const bool is_start = (idx == 0);
+            const bool is_end = (idx + len == data_len);
+
+            unsigned char *h = beginPacket(rtp_timestamp, is_marker && is_end, 2, gso_size);
+
+            if (h == nullptr)
+            {
+                return false;
+            }
+
+            h[0] = fu_indicator;
+            h[1] = (unsigned char)((is_start ? 0x80 : 0) | (is_end ? 0x40 : 0) | nal_type);
+            addPayload(&data[idx], len);
+            endPacket(RTP_HEADER_SIZE + 2 + len);
+        }
+
+        return true;
+    }
+
+    // Send the packets of message <msg_idx> one by one (used when the GSO message is rejected).
+    bool sendPacketsOfMessage(const int msg_idx)
+    {
+        const int first = m_msg_first_packet[msg_idx];
+
+        for (int p = first; p < first + m_msg_n_packets[msg_idx]; p++)
+        {
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = &m_iov[m_packet_first_iov[p]];
+            mh.msg_iovlen = (size_t)(m_packet_first_iov[p + 1] - m_packet_first_iov[p]);
+
+            ssize_t n_bytes;
+
+            do
+            {
+                n_bytes = sendmsg(m_fd, &mh, 0);
+            } while ((n_bytes == (-1)) && (errno == EINTR));
+
+            if (n_bytes == (-1))
+            {
+                if ((errno == EAGAIN) || (errno == ENOBUFS))
+                {
+                    m_n_dropped_packets++;
+                    continue;
+                }
+
+                if (errno == ECONNREFUSED)
+                {
+                    m_n_refused_packets++;
+                    continue;
+                }
+
+                fprintf(stderr, "Error: sendmsg failed, errno = %d.\n", errno);
+                return false;
+            }
+
+            m_n_sent_packets++;
+            m_n_sent_bytes += n_bytes;
+        }
+
+        return true;
+    }
+
+public:
+    // Create UDP socket connected to <dest_ip>:<dest_port> (IPv4 address string).
+    // <max_packet_size> - maximum RTP packet size (UDP payload).
+    // <is_gso> - send the FU-A fragments of each NAL unit as UDP GSO message (if the kernel supports it).
+    // <is_paced> - send each access unit at the time of its FLV timestamp (false for sending as fast as possible).
+    // Return nullptr in case of an error.
+    static CRtpSender *Create(const char *dest_ip, const int dest_port, const int max_packet_size, const bool is_gso, const bool is_paced)
+    {
+        if ((max_packet_size < RTP_HEADER_SIZE + 64) || (max_packet_size > MAX_GSO_BYTES))
+        {
+            fprintf(stderr, "Error: invalid RTP packet size %d\n", max_packet_size);
+            return nullptr;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)dest_port);
+
+        if (inet_pton(AF_INET, dest_ip, &addr.sin_addr) != 1)
+        {
+            fprintf(stderr, "Error: invalid IPv4 address %s\n", dest_ip);
+            return nullptr;
+        }
+
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+        if (fd == (-1))
+        {
+            fprintf(stderr, "Error: socket failed, errno = %d.\n", errno);
+            return nullptr;
+        }
+
+        // Large send buffer for the bursts of IDR frames (the kernel limits the size to net.core.wmem_max - failure is not an error).
+        int sndbuf_size = 4 * 1048576;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf_size, sizeof(sndbuf_size));
+
+        // Connected socket - sendmmsg doesn't need the address of each message (and the route is resolved once).
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == (-1))
+        {
+            fprintf(stderr, "Error: connect failed, errno = %d.\n", errno);
+            close(fd);
+            return nullptr;
+        }
+
+        CRtpSender *sender = new CRtpSender();
+        sender->m_fd = fd;
+        sender->m_max_payload_size = max_packet_size - RTP_HEADER_SIZE;
+        sender->m_is_paced = is_paced;
+
+        if (is_gso)
+        {
+            // The option exists if the kernel supports UDP GSO (Linux 4.18).
+            int gso_size = 0;
+            socklen_t opt_len = sizeof(gso_size);
+            sender->m_is_gso = (getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size, &opt_len) == 0);
+
+            if (!sender->m_is_gso)
+            {
+                fprintf(stderr, "Warning: UDP GSO is not supported (sending one message per RTP packet).\n");
+            }
+        }
+
+        // Random initial sequence number and SSRC (RFC 3550) - a mix of the time and the process id is good enough here.
+        uint64_t seed = (uint64_t)MonotonicNanos() ^ ((uint64_t)getpid() << 32);
+        seed ^= seed >> 33;
+        seed *= 0xFF51AFD7ED558CCDULL;
+        seed ^= seed >> 33;
+        sender->m_seq = (uint16_t)seed;
+        sender->m_ssrc = (uint32_t)(seed >> 32);
+
+        fprintf(stderr, "RTP sender: udp://%s:%d, payload type %d (H264/90000), packet size %d bytes, GSO %s, %s\n", dest_ip, dest_port,
+                RTP_PAYLOAD_TYPE, max_packet_size, sender->m_is_gso ? "on" : "off", is_paced ? "paced" : "not paced");
+
+        return sender;
+    }
+
+    static void DeleteObj(CRtpSender *sender)
+    {
+        if (sender->m_fd != (-1))
+        {
+            close(sender->m_fd);
+        }
+
+        delete sender;
+    }
+
+    // Packetize the access unit <au> (described by au->nal_list), and send the packets.
+    // The function returns after all the packets are sent, so au->buffer may be released right after it.
+    // Return false in case of an error.
+    bool sendAccessUnit(const CAccessUnit *au)
+    {
+        const CNalList *nal_list = &au->nal_list;
+        const uint32_t rtp_timestamp = (uint32_t)((int64_t)au->pts_ms * RTP_CLOCK_KHZ);
+
+        paceAccessUnit(au->dts_ms, nal_list->annexb_len);
+
+        int k = 0;
+
+        while (k < nal_list->n_nals)
+        {
+            const CNalView *v = &nal_list->nals[k];
+
+            if (v->nal_len > m_max_payload_size)
+            {
+                if (!addFuAPackets(v, rtp_timestamp, k == nal_list->n_nals - 1))
+                {
+                    return false;
+                }
+
+                k++;
+                continue;
+            }
+
+            // Aggregate the following NAL units that fit in the same packet.
+            int n = 1;
+            int stap_a_size = 1 + 2 + v->nal_len;
+
+            while ((k + n < nal_list->n_nals) && (n < MAX_STAP_A_NALS) && (stap_a_size + 2 + v[n].nal_len <= m_max_payload_size))
+            {
+                stap_a_size += 2 + v[n].nal_len;
+                n++;
+            }
+
+            const bool is_marker = (k + n == nal_list->n_nals);
+            const bool is_ok = (n == 1) ? addSingleNalPacket(v, rtp_timestamp, is_marker) : addStapAPacket(v, n, rtp_timestamp, is_marker);
+
+            if (!is_ok)
+            {
+                return false;
+            }
+
+            k += n;
+        }
+
+        return flush();
+    }
+
+    // Send the packets of the batch (one sendmmsg call, unless it returns before sending all the messages).
+    // Return false in case of an error.
+    bool flush()
+    {
+        if (m_n_msgs == 0)
+        {
+            return true;
+        }
+
+        if (m_is_paced && (m_au_bytes_sent > 0))
+        {
+            // Spread the batches of the access unit over half of the frame interval (by the number of bytes sent before).
+            SleepUntilNanos(m_t_au_ns + m_spread_ns * std::min(m_au_bytes_sent, m_au_bytes) / m_au_bytes);
+        }
+
+        m_packet_first_iov[m_n_packets] = m_n_iov;
+
+        for (int i = 0; i < m_n_msgs; i++)
+        {
+            if (m_msg_n_packets[i] > 1)
+            {
+                // GSO message: the kernel splits the message to datagrams of m_msg_gso_size[i] bytes.
+                struct msghdr *mh = &m_msgs[i].msg_hdr;
+                mh->msg_control = m_cmsgs[i];
+                mh->msg_controllen = sizeof(m_cmsgs[i]);
+
+                struct cmsghdr *cm = CMSG_FIRSTHDR(mh);
+                cm->cmsg_level = IPPROTO_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment_size = (uint16_t)m_msg_gso_size[i];
+                memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+                m_n_gso_msgs++;
+            }
+        }
+
+        bool is_ok = true;
+        int idx = 0;
+
+        while (idx < m_n_msgs)
+        {
+            int n_msgs_sent = sendmmsg(m_fd, &m_msgs[idx], (unsigned int)(m_n_msgs - idx), 0);
+            m_n_sendmmsg++;
+
+            if (n_msgs_sent == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                if ((errno == EAGAIN) || (errno == ENOBUFS))
+                {
+                    // The send queue (of the socket or the device) is full - the message is dropped, and the rate controller steps down.
+                    m_n_dropped_packets += m_msg_n_packets[idx];
+                    idx++;
+                    continue;
+                }
+
+                if (errno == ECONNREFUSED)
+                {
+                    // ICMP "port unreachable" of a previous datagram (there is no receiver yet) - the message is dropped, and the stream goes on.
+                    // Not a congestion of the link - counted separately (the bitrate is not reduced).
+                    m_n_refused_packets += m_msg_n_packets[idx];
+                    idx++;
+                    continue;
+                }
+
+                if (((errno == EIO) || (errno == EINVAL)) && (m_msg_n_packets[idx] > 1))
+                {
+                    // The device doesn't support GSO (checksum offload is needed) - send the packets one by one, and don't use GSO any more.
+                    fprintf(stderr, "Warning: UDP GSO message failed, errno = %d (sending one message per RTP packet).\n", errno);
+                    m_is_gso = false;
+
+                    if (!sendPacketsOfMessage(idx))
+                    {
+                        is_ok = false;
+                        break;
+                    }
+
+                    idx++;
+                    continue;
+                }
+
+                fprintf(stderr, "Error: sendmmsg failed, errno = %d.\n", errno);
+                is_ok = false;
+                break;
+            }
+
+            for (int i = idx; i < idx + n_msgs_sent; i++)
+            {
+                m_n_sent_packets += m_msg_n_packets[i];
+                m_n_sent_bytes += m_msg_bytes[i];
+            }
+
+            idx += n_msgs_sent;
+        }
+
+        for (int i = 0; i < m_n_msgs; i++)
+        {
+            m_au_bytes_sent += m_msg_bytes[i];
+        }
+
+        m_n_packets = 0;
+        m_n_iov = 0;
+        m_n_msgs = 0;
+        m_open_gso_size = 0;
+
+        return is_ok;
+    }
+
+    // Lateness of the last access unit relative to the pacing clock, in milliseconds (0 if not paced) - grows when the link can't keep up.
+    int latenessMs() const { return m_lateness_ms; }
+
+    // Packets dropped because the send queue was full (EAGAIN, or ENOBUFS of the device queue).
+    // The socket is blocking, so a full socket buffer usually blocks the send instead - the backlog shows in latenessMs.
+    int64_t droppedPacketsCount() const { return m_n_dropped_packets; }
+
+    // Packets dropped because there is no receiver (ECONNREFUSED - ICMP "port unreachable" of a previous datagram).
+    int64_t refusedPacketsCount() const { return m_n_refused_packets; }
+
+    void printStatistics() const
+    {
+        fprintf(stderr, "RTP sender: %lld packets (%lld bytes) in %lld sendmmsg calls (%.1f packets per call), %lld GSO messages, %lld dropped packets, %lld refused packets, %lld late access units\n",
+                (long long)m_n_sent_packets, (long long)m_n_sent_bytes, (long long)m_n_sendmmsg,
+                (m_n_sendmmsg > 0) ? (double)m_n_sent_packets / (double)m_n_sendmmsg : 0.0,
+                (long long)m_n_gso_msgs, (long long)m_n_dropped_packets, (long long)m_n_refused_packets, (long long)m_n_late_access_units);
+    }
+};
+
+
+// Per frame user metadata (timestamps, sensor pose, frame IDs...) attached to the raw frames, and emitted with the matching access units.
+// The writer thread attaches the metadata of frame i right before frame i is written to stdin PIPE,
+// and the consumer of the access units splices SEI NAL unit (user_data_unregistered) with the metadata to the NAL units views of the access unit.
+// Only the metadata is copied - the SEI NAL unit is one more view, and the NAL units in the pooled buffer are not copied (the output is written by writev).
+// The access unit is matched to the frame by the PTS relative to the first access unit (FFmpeg timestamps frame i as pts0 + i*1000/fps milliseconds,
+// and B-frames reordering is undone - pts0 is the reordering delay, see CLatencyStats).
+// The slots are indexed by the frame index modulo the number of slots (the number of slots must exceed the number of frames in the pipeline).
+class CFrameMetadataQueue
+{
+public:
+    static const int MAX_METADATA_SIZE = 256;
+
+private:
+    struct CSlot
+    {
+        std::mutex lock;        // Uncontended in practice - the writer and the consumer access the same slot n_slots frames apart.
+        int frame_idx = -1;     // Frame of the metadata in the slot (-1 if empty).
+        int len = 0;
+        unsigned char data[MAX_METADATA_SIZE];
+    };
+
+    CSlot *m_slots = nullptr;
+    int m_n_slots = 0;
+    int m_fps = 0;
+    int m_pts0_ms = -1;         // pts of the first access unit (-1 before the first access unit).
+    unsigned char m_uuid[16];
+
+    // pts of the spliced access units in output order (for VerifyFrameMetadataSei).
+    std::vector<int> m_pts_log;
+
+    // SEI NAL unit of the current access unit (valid until the next access unit is spliced).
+    std::vector<unsigned char> m_sei_nal;
+
+    int64_t m_n_attached = 0;   // Used by the writer thread.
+    int64_t m_n_spliced = 0;    // Used by the consumer.
+    int64_t m_n_missing = 0;
+
+    CFrameMetadataQueue()
+    {
+    }
+
+public:
+    // <uuid> - 16 bytes UUID of the user_data_unregistered SEI (identifies the format of the metadata for the receiver).
+    // <fps> - Frame rate of the encoded video (used for matching the PTS of an access unit to the index of the frame).
+    // <n_slots> - Maximum number of frames in the pipeline (between the write to stdin PIPE and the output of the access unit).
+    // Return nullptr in case of an error.
+    static CFrameMetadataQueue *Create(const unsigned char *uuid, const int fps, const int n_slots)
+    {
+        if ((fps <= 0) || (n_slots <= 0))
+        {
+            fprintf(stderr, "Error: invalid frame metadata queue arguments\n");
+            return nullptr;
+        }
+
+        CFrameMetadataQueue *queue = new CFrameMetadataQueue();
+        queue->m_slots = new CSlot[n_slots];
+        queue->m_n_slots = n_slots;
+        queue->m_fps = fps;
+        memcpy(queue->m_uuid, uuid, 16);
+        queue->m_sei_nal.resize(MaxSeiNalSize(MAX_METADATA_SIZE));
+
+        return queue;
+    }
+
+    static void DeleteObj(CFrameMetadataQueue *queue)
+    {
+        delete[] queue->m_slots;
+        delete queue;
+    }
+
+    // Writer thread: attach <len> bytes of metadata at <data> to frame <frame_idx> (call before writing the frame to stdin PIPE).
+    // Metadata of a frame that is not emitted yet after n_slots frames is replaced (counted as missing by the consumer).
+    // Return false if the metadata is too large.
+    bool attach(const int frame_idx, const void *data, const int len)
+    {
+        if ((len < 0) || (len > MAX_METADATA_SIZE))
+        {
+            fprintf(stderr, "Error: frame metadata of %d bytes is too large\n", len);
+            return false;
+        }
+
+        CSlot *slot = &m_slots[frame_idx % m_n_slots];
+
+        std::lock_guard<std::mutex> guard(slot->lock);
+        slot->frame_idx = frame_idx;
+        slot->len = len;
+        memcpy(slot->data, data, len);
+        m_n_attached++;
+
+        return true;
+    }
+
+    // Consumer: splice SEI NAL unit with the metadata of the frame of <au> to au->nal_list (before the coded slice).
+    // The SEI NAL unit is valid until the next call (write the access unit before splicing the next one).
+    // An access unit without metadata is left as is (counted as missing).
+    // Return false in case of an error.
+    bool splice(CAccessUnit *au)
+    {
+        if (m_pts0_ms < 0)
+        {
+            m_pts0_ms = au->pts_ms;     // The first access unit in decoding order is the IDR frame of frame 0.
+        }
+
+        m_pts_log.push_back(au->pts_ms);
+
+        const int frame_idx = (int)(((int64_t)(au->pts_ms - m_pts0_ms) * m_fps + 500) / 1000);
+        CSlot *slot = &m_slots[frame_idx % m_n_slots];
+        int sei_nal_len = 0;
+
+        {
+            std::lock_guard<std::mutex> guard(slot->lock);
+
+            if (slot->frame_idx != frame_idx)
+            {
+                m_n_missing++;
+                return true;
+            }
+
+            sei_nal_len = BuildSeiUserDataUnregistered(m_uuid, slot->data, slot->len, m_sei_nal.data(), (int)m_sei_nal.size());
+            slot->frame_idx = -1;   // Each metadata is emitted once.
+        }
+
+        if ((sei_nal_len < 0) || !InsertNalViewBeforeSlices<CVideoCodec>(&au->nal_list, m_sei_nal.data(), sei_nal_len, g_encoder_profile->start_codes))
+        {
+            return false;
+        }
+
+        m_n_spliced++;
+
+        return true;
+    }
+
+    // pts of the access units passed to splice, in output order.
+    const std::vector<int> &ptsLog() const { return m_pts_log; }
+
+    // Print the counters (after the threads are joined).
+    void printStatistics() const
+    {
+        fprintf(stderr, "Frame metadata: %lld attached, %lld spliced as SEI, %lld access units without metadata\n",
+                (long long)m_n_attached, (long long)m_n_spliced, (long long)m_n_missing);
+    }
+};
+
+
+// UUID of the SEI user_data_unregistered messages of the frame metadata (random UUID generated for this application).
+static const unsigned char g_frame_metadata_uuid[16] = { 0x3f, 0x6c, 0x1e, 0x92, 0xa4, 0x5b, 0x4d, 0x0e, 0x9c, 0x71, 0x28, 0xd3, 0x5e, 0x0a, 0xb6, 0x47 };
+
+
+// Build the metadata of frame <frame_idx> for testing: frame index (32 bits) and capture time (64 bits - microseconds since the Epoch), big endian.
+// A real application attaches the metadata of the source (camera timestamp, sensor pose...).
+// Return the metadata size in bytes.
+static int MakeFrameMetadata(const int frame_idx, unsigned char *metadata)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t capture_time_us = (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)(ts.tv_nsec / 1000);
+
+    for (int k = 0; k < 4; k++)
+    {
+        metadata[k] = (unsigned char)((uint32_t)frame_idx >> (24 - 8 * k));
+    }
+
+    for (int k = 0; k < 8; k++)
+    {
+        metadata[4 + k] = (unsigned char)(capture_time_us >> (56 - 8 * k));
+    }
+
+    return 12;
+}
+
+
+// Wait "politely" when the ring is full (or empty) - yield first, and sleep if the wait takes longer.
+// The ring is lock-free, so there is no condition variable to wait on (in practice the waiting is short).
+static void WaitForRing(int &n_waits)
+{
+    if (n_waits < 100)
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    n_waits++;
+}
+
+
+// Write the <n_iov> elements of <iov> to file descriptor <fd> using writev (more than IOV_MAX elements are written in chunks).
+// <iov> is modified (the elements are advanced while writing).
+// Return false in case of an error.
+static inline bool WriteIovec(const int fd, struct iovec *iov, int n_iov)
+{
+    struct iovec *iov_ptr = iov;
+
+    // https://man7.org/linux/man-pages/man2/writev.2.html
+    // writev() may write less than requested (like write) - keep writing the remaining part.
+    while (n_iov > 0)
+    {
+        ssize_t n_bytes_written = writev(fd, iov_ptr, std::min(n_iov, IOV_MAX));
+
+        if (n_bytes_written == (-1))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            fprintf(stderr, "Error: writev failed, errno = %d.\n", errno);
+            return false;
+        }
+
+        // Skip the fully written elements, and advance the partially written element.
+        while ((n_iov > 0) && ((size_t)n_bytes_written >= iov_ptr->iov_len))
+        {
+            n_bytes_written -= (ssize_t)iov_ptr->iov_len;
+            iov_ptr++;
+            n_iov--;
+        }
+
+        if (n_iov > 0)
+        {
+            iov_ptr->iov_base = (unsigned char*)iov_ptr->iov_base + n_bytes_written;
+            iov_ptr->iov_len -= (size_t)n_bytes_written;
+        }
+    }
+
+    return true;
+}
+
+
+// Write the NAL units of <nal_list> to file descriptor <fd> using writev (gather output - [start code][NAL unit] pairs).
+// The same iovec list may be used with sendmsg or sendmmsg for sending the access unit over the network.
+// Return false in case of an error.
+static inline bool WriteNalList(const int fd, const CNalList *nal_list)
+{
+    struct iovec iov[2 * MAX_NALS_PER_ACCESS_UNIT];
+    int n_iov = NalListToIovec(nal_list, iov, 2 * MAX_NALS_PER_ACCESS_UNIT);
+
+    return WriteIovec(fd, iov, n_iov);
+}
+
+
+// Bounded in-memory cache of the last GOPs of the encoded stream, indexed by keyframe (FLV frame_type 1) and timestamp.
+// Network consumers that connect mid-stream start from the most recent IDR frame (instead of waiting up to a GOP for the next one).
+// The cache holds references to the pooled buffers of the access units (no copy) - the consumer pushes each access unit,
+// and the oldest GOP is evicted when there are more than <max_gops> GOPs, or when the buffers exceed <max_bytes>.
+// Each access unit has a sequence number (0 for the first pushed access unit): a subscriber joins at the sequence of a keyframe (joinSequence),
+// and reads the access units by sequence (read) - the cached GOPs first, and then the live access units as they are pushed.
+// A subscriber that falls behind the cache (its next access unit was evicted) joins again at the latest keyframe.
+// The access units are cached before the frame metadata is spliced (the SEI views don't point the pooled buffer).
+// Thread safety: push and close are called by the consumer thread, the subscribers may be any threads.
+class CGopCache
+{
+private:
+    struct CKeyframe
+    {
+        int64_t seq;
+        int pts_ms;
+    };
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;               // Notified when an access unit is pushed (or the stream ends).
+    std::deque<CAccessUnit> m_aus;              // The cached access units (each holds a reference to its buffer).
+    std::deque<CKeyframe> m_keyframes;          // The keyframes of the cached access units (the first is m_aus.front()).
+    int64_t m_first_seq         = 0;            // Sequence of m_aus.front().
+    int64_t m_n_pushed          = 0;            // Sequence of the next pushed access unit.
+    int m_max_gops              = 0;
+    size_t m_max_bytes          = 0;
+    size_t m_n_bytes            = 0;            // Capacity of the cached buffers.
+    bool m_is_closed            = false;
+
+    // SPS and PPS of the latest keyframe in Annex B format (for subscribers that need the parameter sets out of band, like SDP).
+    unsigned char m_param_sets[MAX_PARAM_SETS_SIZE];
+    int m_param_sets_len        = 0;
+
+    int64_t m_n_evicted_gops    = 0;
+    int64_t m_n_joins           = 0;
+    int64_t m_n_rejoins         = 0;            // Subscribers that fell behind the cache.
+
+    CGopCache()
+    {
+    }
+
+    // Evict the oldest GOP (must be called with m_mutex locked).
+    // The last GOP ends at m_n_pushed (the pushed access unit is already counted).
+    void evictOldestGop()
+    {
+        const int64_t end_seq = (m_keyframes.size() > 1) ? m_keyframes[1].seq : m_n_pushed;
+
+        while (m_first_seq < end_seq)
+        {
+            m_n_bytes -= (size_t)m_aus.front().buffer->capacity;
+            m_aus.front().buffer->release();
+            m_aus.pop_front();
+            m_first_seq++;
+        }
+
+        m_keyframes.pop_front();
+        m_n_evicted_gops++;
+    }
+
+public:
+    // Create cache of the last <max_gops> GOPs, holding up to <max_bytes> of access units buffers.
+    // The buffers are pooled - the pool of the access units must be larger than <max_bytes> (see EncodeSingleStream).
+    static CGopCache *Create(const int max_gops, const size_t max_bytes)
+    {
+        if (max_gops < 1)
+        {
+            fprintf(stderr, "CGopCache: max_gops = %d must be at least 1\n", max_gops);
+            return nullptr;
+        }
+
+        CGopCache *cache = new CGopCache();
+        cache->m_max_gops = max_gops;
+        cache->m_max_bytes = max_bytes;
+
+        return cache;
+    }
+
+    // Release the cached buffers, and delete the cache (after the subscribers are done).
+    static void DeleteObj(CGopCache *cache)
+    {
+        while (!cache->m_keyframes.empty())
+        {
+            cache->evictOldestGop();
+        }
+
+        delete cache;
+    }
+
+    size_t maxBytes() const { return m_max_bytes; }
+
+    // Add access unit <au> to the cache (adds a reference to au->buffer) - the access units before the first keyframe are not cached.
+    void push(const CAccessUnit *au)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            // The access unit is counted before the eviction (evicting the only GOP evicts the pushed access unit too).
+            const int64_t seq = m_n_pushed;
+            m_n_pushed++;
+
+            if (au->is_keyframe)
+            {
+                m_keyframes.push_back({ seq, au->pts_ms });
+
+                // Keep the parameter sets of the keyframe (FFmpeg doesn't repeat them, but InjectParameterSets does).
+                int len = 0;
+
+                for (int k = 0; k < au->nal_list.n_nals; k++)
+                {
+                    const CNalView *v = &au->nal_list.nals[k];
+                    if (CVideoCodec::IsParameterSet(CVideoCodec::NalType(v->nal)) && (len + 4 + v->nal_len <= MAX_PARAM_SETS_SIZE))
+                    {
+                        memcpy(&m_param_sets[len], g_start_code, 4);
+                        memcpy(&m_param_sets[len + 4], v->nal, v->nal_len);
+                        len += 4 + v->nal_len;
+                    }
+                }
+
+                m_param_sets_len = (len > 0) ? len : m_param_sets_len;
+            }
+
+            if (m_keyframes.empty())
+            {
+                m_first_seq = m_n_pushed;   // No GOP start yet.
+            }
+            else
+            {
+                au->buffer->addRef();
+                m_aus.push_back(*au);
+                m_n_bytes += (size_t)au->buffer->capacity;
+
+                // Evict the oldest GOPs - a single GOP that exceeds max_bytes is evicted too (nothing is cached until the next keyframe).
+                while ((!m_keyframes.empty()) && (((int)m_keyframes.size() > m_max_gops) || (m_n_bytes > m_max_bytes)))
+                {
+                    evictOldestGop();
+                }
+
+                if (m_keyframes.empty())
+                {
+                    m_first_seq = m_n_pushed;
+                }
+            }
+
+            // m_aus holds the access units m_first_seq ... m_n_pushed - 1 (read indexes m_aus by the sequence).
+            assert(m_first_seq + (int64_t)m_aus.size() == m_n_pushed);
+        }
+
+        m_cv.notify_all();
+    }
+
+    // Mark the end of the stream (the subscribers read the cached access units, and then read returns 0).
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_is_closed = true;
+        }
+
+        m_cv.notify_all();
+    }
+
+    // Return the sequence of the latest cached keyframe with pts <= <at_pts_ms> (the latest keyframe by default), or -1 if there is none.
+    int64_t joinSequence(const int at_pts_ms = INT_MAX)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (size_t k = m_keyframes.size(); k > 0; k--)
+        {
+            if (m_keyframes[k - 1].pts_ms <= at_pts_ms)
+            {
+                m_n_joins++;
+                return m_keyframes[k - 1].seq;
+            }
+        }
+
+        return -1;
+    }
+
+    // Wait for the access unit of sequence <*seq>, and return a copy of it in <au> (with a reference to the buffer - the caller releases it).
+    // If the access unit was evicted, <*seq> is moved to the latest keyframe (the subscriber skips to the live GOP).
+    // <timeout_ms> - maximum time to wait for the access unit to be pushed.
+    // Return 1 if an access unit is returned (and *seq is incremented), 0 at the end of the stream, and -1 if the timeout expired.
+    int read(int64_t *seq, CAccessUnit *au, const int timeout_ms)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (!m_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return (*seq < m_n_pushed) || m_is_closed; }))
+        {
+            return -1;
+        }
+
+        if (*seq >= m_n_pushed)
+        {
+            return 0;   // Closed, and all the access units were read.
+        }
+
+        if (*seq < m_first_seq)
+        {
+            // Evicted - join the latest GOP (or wait for the next keyframe if nothing is cached).
+            m_n_rejoins++;
+            *seq = m_keyframes.empty() ? m_n_pushed : m_keyframes.back().seq;
+
+            if (*seq >= m_n_pushed)
+            {
+                return -1;
+            }
+        }
+
+        *au = m_aus[(size_t)(*seq - m_first_seq)];
+        au->buffer->addRef();
+        (*seq)++;
+
+        return 1;
+    }
+
+    // Copy the SPS and PPS of the latest keyframe (Annex B format) to <buf> of <buf_size> bytes.
+    // Return the size of the parameter sets, 0 if no keyframe was pushed, or -1 if <buf_size> is too small.
+    int copyParameterSets(unsigned char *buf, const int buf_size) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_param_sets_len > buf_size)
+        {
+            return -1;
+        }
+
+        memcpy(buf, m_param_sets, m_param_sets_len);
+
+        return m_param_sets_len;
+    }
+
+    // Wait until <n> access units are pushed, or the stream ends.
+    // Return false if the stream ended before <n> access units.
+    bool waitForPushed(const int64_t n)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return (m_n_pushed >= n) || m_is_closed; });
+
+        return m_n_pushed >= n;
+    }
+
+    // Number of access units pushed.
+    int64_t pushedCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_n_pushed;
+    }
+
+    void printStatistics() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        fprintf(stderr, "GOP cache: %d GOPs (%d access units, %.1f KB) cached, %lld GOPs evicted, %lld joins, %lld subscribers fell behind\n",
+                (int)m_keyframes.size(), (int)m_aus.size(), (double)m_n_bytes / 1024.0, (long long)m_n_evicted_gops, (long long)m_n_joins, (long long)m_n_rejoins);
+    }
+};
+
+
+// Test the eviction of CGopCache with synthetic access units (tagged by pts = sequence): 4 GOPs of 8, 3, 3 and 3 access units,
+// cached up to 2 GOPs and 7 buffers - the first GOP alone exceeds the bytes bound (it's evicted together with the access unit being pushed).
+// Each access unit read from the cache must be the one pushed with the same sequence.
+// <pool> - Pool of the synthetic access units buffers.
+// Return false if the cache returns another access unit.
+static inline bool GopCacheEvictionTest(CBufferPool *pool)
+{
+    CPooledBuffer *probe = pool->acquire(1);
+
+    if (probe == nullptr)
+    {
+        return false;
+    }
+
+    const int buffer_size = probe->capacity;  // The bound is counted by the capacity of the buffers.
+    probe->release();
+
+    const int n_gops = 4;
+    const int gop_sizes[n_gops] = { 8, 3, 3, 3 };
+    CGopCache *cache = CGopCache::Create(2, (size_t)(7 * buffer_size));
+    int64_t seq = 0;
+    bool success = true;
+
+    for (int g = 0; (g < n_gops) && success; g++)
+    {
+        for (int k = 0; (k < gop_sizes[g]) && success; k++)
+        {
+            CAccessUnit au;
+            au.buffer = pool->acquire(1);
+            au.pts_ms = (int)seq;
+            au.is_keyframe = (k == 0);
+
+            if (au.buffer == nullptr)
+            {
+                success = false;
+                break;
+            }
+
+            cache->push(&au);
+            au.buffer->release();
+
+            // The pushed access unit is readable by its sequence (unless nothing is cached - the first GOP after it's evicted).
+            int64_t read_seq = seq;
+            CAccessUnit cached;
+
+            if (cache->read(&read_seq, &cached, 0) == 1)
+            {
+                success = (cached.pts_ms == (int)seq);
+                cached.buffer->release();
+            }
+
+            seq++;
+        }
+    }
+
+    // The cache holds the last 2 GOPs (sequence 11 to 16) - a subscriber at an evicted sequence joins the latest GOP (sequence 14).
+    int64_t evicted_seq = 8;
+    CAccessUnit cached;
+
+    if (success && (cache->joinSequence() == 14) && (cache->read(&evicted_seq, &cached, 0) == 1))
+    {
+        success = (cached.pts_ms == 14) && cached.is_keyframe;
+        cached.buffer->release();
+    }
+    else
+    {
+        success = false;
+    }
+
+    CGopCache::DeleteObj(cache);
+
+    fprintf(stderr, "GOP cache eviction test: %s\n", success ? "passed" : "failed");
+
+    return success;
+}
+
+
+// Late subscriber for testing CGopCache: wait until <join_after_n> access units are pushed (mid-GOP), join at the latest keyframe,
+// and write the access units to <out_file_name> until the end of the stream.
+// The output is the end of the converted stream, starting at an IDR frame (with the SPS and PPS) - it's decodable from the first frame.
+// <joined_seq> - Output: the sequence of the first access unit written (or -1 in case of an error).
+static inline void LateSubscriberThread(CGopCache *gop_cache, const int join_after_n, const std::string out_file_name, int64_t *joined_seq)
+{
+    *joined_seq = -1;
+
+    if (!gop_cache->waitForPushed(join_after_n))
+    {
+        fprintf(stderr, "Late subscriber: the stream ended after %lld of %d access units\n", (long long)gop_cache->pushedCount(), join_after_n);
+        return;
+    }
+
+    int64_t seq = gop_cache->joinSequence();
+
+    if (seq < 0)
+    {
+        fprintf(stderr, "Late subscriber: no keyframe is cached\n");
+        return;
+    }
+
+    int fd = open(out_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Late subscriber: can't create %s, errno = %d\n", out_file_name.c_str(), errno);
+        return;
+    }
+
+    *joined_seq = seq;
+
+    CAccessUnit au;
+    int res;
+
+    // The timeout is only for not waiting forever if the stream stalls.
+    while ((res = gop_cache->read(&seq, &au, 10000)) == 1)
+    {
+        const bool success = WriteNalList(fd, &au.nal_list);
+        au.buffer->release();
+
+        if (!success)
+        {
+            *joined_seq = -1;
+            break;
+        }
+    }
+
+    if (res < 0)
+    {
+        fprintf(stderr, "Late subscriber: timeout\n");
+        *joined_seq = -1;
+    }
+
+    close(fd);
+}
+
+
+// Read-only mapping of a whole file (FLV recording): the parser reads the tags directly from the page cache (no read system calls, no copies).
+class CMappedFile
+{
+private:
+    const unsigned char *m_data = nullptr;
+    size_t m_size = 0;
+
+    CMappedFile()
+    {
+    }
+
+public:
+    // Map <file_name> (the file may be closed after mapping - the mapping holds a reference to the file).
+    // Return nullptr in case of failure.
+    static CMappedFile *Create(const std::string &file_name)
+    {
+        int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1)
+        {
+            fprintf(stderr, "Error: can't open %s, errno = %d\n", file_name.c_str(), errno);
+            return nullptr;
+        }
+
+        struct stat st;
+
+        if ((fstat(fd, &st) != 0) || (st.st_size <= 0))
+        {
+            fprintf(stderr, "Error: %s is empty, or fstat failed\n", file_name.c_str());
+            close(fd);
+            return nullptr;
+        }
+
+        void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: mmap of %s failed, errno = %d\n", file_name.c_str(), errno);
+            return nullptr;
+        }
+
+        // The file is parsed once from start to end: aggressive read-ahead, and the pages may be dropped soon after they are read.
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+        CMappedFile *mapped_file = new CMappedFile();
+        mapped_file->m_data = (const unsigned char*)data;
+        mapped_file->m_size = (size_t)st.st_size;
+
+        return mapped_file;
+    }
+
+    static void DeleteObj(CMappedFile *mapped_file)
+    {
+        munmap((void*)mapped_file->m_data, mapped_file->m_size);
+        delete mapped_file;
+    }
+
+    const unsigned char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+
+// Verify the start codes convention of g_encoder_profile against the Annex B stream <annexb_file_name> of the encoder (out.264 of the reference process):
+// the length of the start code (3 or 4 bytes) before each NAL unit must be the length that the convention gives for the NAL unit.
+// Return false if any NAL unit doesn't match (the converted stream is not going to be bit exact), or if the file can't be read.
+static bool VerifyStartCodeConvention(const std::string &annexb_file_name)
+{
+    // Maximum number of reported NAL units (the rest are only counted).
+    const int max_reported = 8;
+
+    CMappedFile *annexb_file = CMappedFile::Create(annexb_file_name);
+
+    if (annexb_file == nullptr)
+    {
+        return false;
+    }
+
+    const unsigned char *buf = annexb_file->data();
+    const size_t size = annexb_file->size();
+    int n_nals = 0;
+    int n_mismatches = 0;
+    int nal_index = 0;      // Index of the NAL unit in the access unit.
+    bool has_vcl = false;
+    size_t pos = 0;
+
+    while (pos + 3 < size)
+    {
+        // Find the next 3 bytes start code (a 4 bytes start code is the same with a leading zero) - like CAccessUnitVerifier::splitReference.
+        const unsigned char *p = (const unsigned char*)memchr(&buf[pos + 2], 1, size - pos - 3);
+
+        if (p == nullptr)
+        {
+            break;
+        }
+
+        pos = (size_t)(p - buf) - 2;
+
+        if ((buf[pos] != 0) || (buf[pos + 1] != 0))
+        {
+            pos++;
+            continue;
+        }
+
+        const int start_code_len = ((pos > 0) && (buf[pos - 1] == 0)) ? 4 : 3;
+        const unsigned char *nal = &buf[pos + 3];
+        const int nal_len = (int)std::min(size - (pos + 3), (size_t)16);    // Only the first bytes of the NAL unit are parsed.
+
+        if (has_vcl && CVideoCodec::IsFirstNalOfAccessUnit(nal, nal_len))
+        {
+            nal_index = 0;
+            has_vcl = false;
+        }
+
+        const int expected_len = CVideoCodec::StartCodeLen(nal, nal_index, g_encoder_profile->start_codes);
+
+        if (start_code_len != expected_len)
+        {
+            if (n_mismatches < max_reported)
+            {
+                fprintf(stderr, "Start codes: NAL unit %d (type %d) of %s begins with %d bytes start code - the convention of %s is %d bytes\n",
+                        n_nals, CVideoCodec::NalType(nal), annexb_file_name.c_str(), start_code_len, g_encoder_profile->codec, expected_len);
+            }
+
+            n_mismatches++;
+        }
+
+        has_vcl = has_vcl || CVideoCodec::IsVcl(CVideoCodec::NalType(nal));
+        nal_index++;
+        n_nals++;
+        pos += 3;
+    }
+
+    CMappedFile::DeleteObj(annexb_file);
+
+    fprintf(stderr, "Start codes: %d NAL units of %s, %d don't match the convention of %s\n", n_nals, annexb_file_name.c_str(), n_mismatches, g_encoder_profile->codec);
+
+    return (n_nals > 0) && (n_mismatches == 0);
+}
+
+
+// Verify the frame metadata SEI of the Annex B output <annexb_file_name> (DO_ATTACH_FRAME_METADATA): the frame index in the metadata SEI of each
+// access unit must be the presentation index of the access unit - the rank of its pts among the pts of all the access units (<pts_log>, in output order).
+// The check doesn't depend on the frame rate, or on the timestamp of the first frame (it fails if splice matches the access units to the wrong frames).
+// Return false if any access unit has no metadata SEI or the wrong frame index, or if the file can't be read.
+static bool VerifyFrameMetadataSei(const std::string &annexb_file_name, const std::vector<int> &pts_log)
+{
+    // Maximum number of reported access units (the rest are only counted).
+    const int max_reported = 8;
+
+    CMappedFile *annexb_file = CMappedFile::Create(annexb_file_name);
+
+    if (annexb_file == nullptr)
+    {
+        return false;
+    }
+
+    // Frame indices of the metadata SEI NAL units, in output order.
+    std::vector<int> sei_frames;
+    const unsigned char *buf = annexb_file->data();
+    const size_t size = annexb_file->size();
+    size_t nal_pos = 0;     // Position of the current NAL unit (after the start code), 0 before the first start code.
+    size_t pos = 0;
+
+    while (nal_pos < size)
+    {
+        // Find the next 3 bytes start code (the end of the current NAL unit) - like VerifyStartCodeConvention.
+        const unsigned char *p = (pos + 3 < size) ? (const unsigned char*)memchr(&buf[pos + 2], 1, size - pos - 3) : nullptr;
+
+        if ((p != nullptr) && ((p[-1] != 0) || (p[-2] != 0)))
+        {
+            pos = (size_t)(p - buf) - 1;
+            continue;
+        }
+
+        size_t nal_end = (p == nullptr) ? size : ((size_t)(p - buf) - 2);
+
+        if (p != nullptr)
+        {
+            nal_end -= ((nal_end > nal_pos) && (buf[nal_end - 1] == 0)) ? 1 : 0;    // Leading zero of 4 bytes start code.
+        }
+
+        if (nal_pos > 0)
+        {
+            unsigned char metadata[CFrameMetadataQueue::MAX_METADATA_SIZE];
+            const int metadata_len = ParseSeiUserDataUnregistered(&buf[nal_pos], (int)(nal_end - nal_pos), g_frame_metadata_uuid, metadata, (int)sizeof(metadata));
+
+            if (metadata_len >= 4)
+            {
+                // The frame index is the first 32 bits of the metadata (see MakeFrameMetadata).
+                sei_frames.push_back((int)(((uint32_t)metadata[0] << 24) | ((uint32_t)metadata[1] << 16) | ((uint32_t)metadata[2] << 8) | (uint32_t)metadata[3]));
+            }
+        }
+
+        if (p == nullptr)
+        {
+            break;
+        }
+
+        nal_pos = (size_t)(p - buf) + 1;
+        pos = nal_pos;
+    }
+
+    CMappedFile::DeleteObj(annexb_file);
+
+    // Presentation index of each access unit: the rank of its pts.
+    std::vector<int> sorted_pts(pts_log);
+    std::sort(sorted_pts.begin(), sorted_pts.end());
+    int n_mismatches = 0;
+
+    for (size_t k = 0; k < pts_log.size(); k++)
+    {
+        const int presentation_idx = (int)(std::lower_bound(sorted_pts.begin(), sorted_pts.end(), pts_log[k]) - sorted_pts.begin());
+        const int sei_frame = (k < sei_frames.size()) ? sei_frames[k] : (-1);
+
+        if (sei_frame != presentation_idx)
+        {
+            if (n_mismatches < max_reported)
+            {
+                fprintf(stderr, "Frame metadata: access unit %d (pts %d ms) is presented as frame %d - the metadata SEI is of frame %d\n",
+                        (int)k, pts_log[k], presentation_idx, sei_frame);
+            }
+
+            n_mismatches++;
+        }
+    }
+
+    fprintf(stderr, "Frame metadata: %d metadata SEI NAL units in %s for %d access units, %d don't match the presentation index\n",
+            (int)sei_frames.size(), annexb_file_name.c_str(), (int)pts_log.size(), n_mismatches);
+
+    return (!pts_log.empty()) && (sei_frames.size() == pts_log.size()) && (n_mismatches == 0);
+}
+
+
+// Convert the mapped FLV recording <flv_file> to Annex B file <out_file_name>.
+// The NAL units are never copied in user space: the views of CFlvMemoryParser point the mapping,
+// and the views of many access units are gathered to one writev (fewer system calls than one write per access unit).
+// <n_access_units>, <n_output_bytes> - Output: number of converted access units, and size of the Annex B stream.
+// Return false in case of an error.
+static bool ConvertFlvFile(const CMappedFile *flv_file, const std::string &out_file_name, int *n_access_units, int64_t *n_output_bytes)
+{
+    // 4 access units of the maximum number of NAL units (usually few hundreds of P frames - two elements per NAL unit).
+    const int max_iov = 4 * 2 * MAX_NALS_PER_ACCESS_UNIT;
+
+    int fd = open(out_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: can't create %s, errno = %d\n", out_file_name.c_str(), errno);
+        return false;
+    }
+
+    CFlvMemoryParser<CVideoCodec> parser(flv_file->data(), flv_file->size(), g_encoder_profile->start_codes);
+    CAccessUnit au;
+    struct iovec iov[max_iov];
+    int n_iov = 0;
+    int res = 0;
+    bool success = true;
+
+    *n_output_bytes = 0;
+
+    while (success && ((res = parser.nextAccessUnit(&au)) == 1))
+    {
+        if (n_iov + 2 * au.nal_list.n_nals > max_iov)
+        {
+            success = WriteIovec(fd, iov, n_iov);
+            n_iov = 0;
+        }
+
+        n_iov += NalListToIovec(&au.nal_list, &iov[n_iov], max_iov - n_iov);
+        *n_output_bytes += au.annexb_payload_len;
+    }
+
+    // The views of the last access units point the mapping (and the parser configuration), so they are written before the parser is destroyed.
+    success = success && (res == 0) && WriteIovec(fd, iov, n_iov);
+    success = (close(fd) == 0) && success;
+
+    *n_access_units = parser.accessUnitsCount();
+
+    if (!success)
+    {
+        fprintf(stderr, "Error: conversion of FLV to %s failed (after %d access units)\n", out_file_name.c_str(), parser.accessUnitsCount());
+    }
+
+    return success;
+}
+
+
+// Convert FLV files <in_file_names> to Annex B files <out_file_names> by <n_threads> threads (n_threads = 0 uses one thread per CPU core).
+// Each thread takes the next file that is not converted yet, so large and small files are balanced between the threads.
+// Return false if any of the conversions failed.
+static bool ConvertFlvFiles(const std::vector<std::string> &in_file_names, const std::vector<std::string> &out_file_names, int n_threads)
+{
+    if (n_threads <= 0)
+    {
+        n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    n_threads = std::min(n_threads, std::max(1, (int)in_file_names.size()));
+
+    std::atomic<int> next_file(0);
+    std::atomic<int> n_failed(0);
+    std::atomic<int> n_access_units(0);
+    std::atomic<int64_t> n_input_bytes(0);
+    std::atomic<int64_t> n_output_bytes(0);
+
+    const int64_t t_start_ns = MonotonicNanos();
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            for (int k = next_file.fetch_add(1); k < (int)in_file_names.size(); k = next_file.fetch_add(1))
+            {
+                CMappedFile *flv_file = CMappedFile::Create(in_file_names[k]);
+                int file_n_access_units = 0;
+                int64_t file_n_output_bytes = 0;
+
+                if ((flv_file == nullptr) || (!ConvertFlvFile(flv_file, out_file_names[k], &file_n_access_units, &file_n_output_bytes)))
+                {
+                    n_failed++;
+                }
+
+                if (flv_file != nullptr)
+                {
+                    n_input_bytes += (int64_t)flv_file->size();
+                    CMappedFile::DeleteObj(flv_file);
+                }
+
+                n_access_units += file_n_access_units;
+                n_output_bytes += file_n_output_bytes;
+            }
+        }));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    const double elapsed_s = (double)(MonotonicNanos() - t_start_ns) * 1e-9;
+
+    fprintf(stderr, "Converted %d FLV files by %d threads: %.1f MB in, %.1f MB out, %d access units, %.1f ms (%.2f GB/s)\n",
+            (int)in_file_names.size() - n_failed.load(), n_threads, (double)n_input_bytes.load() / 1e6, (double)n_output_bytes.load() / 1e6,
+            n_access_units.load(), elapsed_s * 1e3, (elapsed_s > 0) ? ((double)n_input_bytes.load() / 1e9 / elapsed_s) : 0.0);
+
+    return n_failed.load() == 0;
+}
+
+
+// Writer thread: build synthetic raw video frames, and write them to stdin PIPE of FFmpeg (and of the "test process").
+// Closing stdin when done "pushes" all the remaining frames from the encoder to stdout (FFmpeg feature).
+// <raw_img_buf> - Raw frame buffer (the frames are built in it, and written from it).
+// <raw_frame_pool> - Pool of page aligned raw frame buffers (used only with DO_WRITE_RAW_FRAMES_WITH_VMSPLICE, nullptr otherwise).
+// <ffmpeg_test_process> - Reference FFmpeg process fed with the same raw frames (nullptr for no reference).
+// <latency_stats> - Latency instrumentation (nullptr if not measured).
+// <stage_times> - CPU time of making the frames, and of writing them (nullptr if not measured).
+// <metadata_queue> - The metadata of each frame is attached before the frame is written (nullptr for no metadata).
+static void WriterThread(CSubprocess *ffmpeg_process,
+                         CSubprocess *ffmpeg_test_process,
+                         unsigned char *raw_img_buf,
+                         CBufferPool *raw_frame_pool,
+                         int width, int height, int n_frames,
+                         CLatencyStats *latency_stats,
+                         CStageCpuTimes *stage_times,
+                         CFrameMetadataQueue *metadata_queue,
+                         std::atomic<bool> *was_broken_by_error)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+    unsigned char *bgr_sketch = NewBgrSketchBuffer(width, height);
+
+#ifdef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE
+    (void)raw_img_buf;      // The frames are built in the buffers of raw_frame_pool.
+
+    // The PIPE references the pages of the frames mapped by vmsplice - a frame buffer is released (and reused) only after FFmpeg consumed it.
+    // The PIPE holds at most pipe_size bytes, so all the frames that end pipe_size bytes before the last written byte are consumed.
+    const int64_t pipe_size = (int64_t)ffmpeg_process->stdinPipeSize();
+    const int max_pending = 16;
+    CPooledBuffer *pending[max_pending];
+    int64_t pending_end[max_pending];   // Offset of the end of each pending frame in the stream.
+    int n_pending = 0;
+    int64_t n_bytes_written = 0;
+
+    if (pipe_size <= 0)
+    {
+        was_broken_by_error->store(true);
+    }
+#endif
+
+    for (int i = 0; (i < n_frames) && (!was_broken_by_error->load()); i++)
+    {
+        if (metadata_queue != nullptr)
+        {
+            // Attach the metadata before the frame enters the PIPE (the access unit may be ready right after the write).
+            unsigned char metadata[CFrameMetadataQueue::MAX_METADATA_SIZE];
+            const int metadata_len = MakeFrameMetadata(i, metadata);
+
+            if (!metadata_queue->attach(i, metadata, metadata_len))
+            {
+                was_broken_by_error->store(true);
+                break;
+            }
+        }
+
+#ifdef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE
+        CPooledBuffer *raw_buffer = raw_frame_pool->acquire(raw_image_size_in_bytes);
+
+        if ((raw_buffer == nullptr) || (n_pending == max_pending))
+        {
+            fprintf(stderr, "Raw frame pool is too small for the PIPE size (%d bytes)\n", (int)pipe_size);
+
+            if (raw_buffer != nullptr)
+            {
+                raw_buffer->release();
+            }
+
+            was_broken_by_error->store(true);
+            break;
+        }
+
+        unsigned char *raw_img_bytes = raw_buffer->data;
+
+        const int64_t t_gen_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+        MakeRawFrame(width, height, i, bgr_sketch, raw_img_bytes);
+        const int64_t t_write_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+
+        const int64_t t_start_ns = (latency_stats != nullptr) ? MonotonicNanos() : 0;
+
+        bool success = ffmpeg_process->stdinVmsplice(raw_img_bytes, raw_image_size_in_bytes);
+
+        n_bytes_written += raw_image_size_in_bytes;
+        pending[n_pending] = raw_buffer;
+        pending_end[n_pending] = n_bytes_written;
+        n_pending++;
+
+        // Release the frames that are no longer referenced by the PIPE (the oldest frames are first).
+        int n_consumed = 0;
+
+        while ((n_consumed < n_pending) && (n_bytes_written - pending_end[n_consumed] >= pipe_size))
+        {
+            pending[n_consumed]->release();
+            n_consumed++;
+        }
+
+        memmove(pending, &pending[n_consumed], (n_pending - n_consumed) * sizeof(CPooledBuffer*));
+        memmove(pending_end, &pending_end[n_consumed], (n_pending - n_consumed) * sizeof(int64_t));
+        n_pending -= n_consumed;
+#else
+        unsigned char *raw_img_bytes = raw_img_buf;
+
+        const int64_t t_gen_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+        MakeRawFrame(width, height, i, bgr_sketch, raw_img_bytes);
+        const int64_t t_write_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+
+        const int64_t t_start_ns = (latency_stats != nullptr) ? MonotonicNanos() : 0;
+
+        bool success = ffmpeg_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
+#endif
+
+        if (latency_stats != nullptr)
+        {
+            latency_stats->onFrameWritten(i, t_start_ns, MonotonicNanos());
+        }
+
+        if (!success)
+        {
+            fprintf(stderr, "Unsuccessful ffmpeg_process write to PIPE\n");
+            was_broken_by_error->store(true);
+            break;
+        }
+
+        // For testing
+        if (ffmpeg_test_process != nullptr)
+        {
+            success = ffmpeg_test_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
+
+            if (!success)
+            {
+                fprintf(stderr, "Unsuccessful ffmpeg_test_process write to PIPE\n");
+                was_broken_by_error->store(true);
+                break;
+            }
+        }
+
+        if (stage_times != nullptr)
+        {
+            const int64_t t_end_ns = ThreadCpuNanos();
+            stage_times->gen_ns += t_write_ns - t_gen_ns;
+            stage_times->write_ns += t_end_ns - t_write_ns;
+        }
+    }
+
+    // Close stdin even in case of an error (FFmpeg ends, and the reader thread is not going to be blocked forever).
+    ffmpeg_process->stdinClose();
+
+    if (ffmpeg_test_process != nullptr)
+    {
+        ffmpeg_test_process->stdinClose();
+    }
+
+    delete[] bgr_sketch;
+
+#ifdef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE
+    // The writer is the only thread that acquires raw frames, and the pool is deleted after FFmpeg ends (the PIPE is no longer referencing the pages).
+    for (int k = 0; k < n_pending; k++)
+    {
+        pending[k]->release();
+    }
+#else
+    (void)raw_frame_pool;
+#endif
+}
+
+
+// Maximum time AcquireBufferWait waits without any buffer released to the pool (the consumer is stuck, or the buffers are held by others).
+#define ACQUIRE_BUFFER_TIMEOUT_MS   2000
+
+// Acquire a buffer of at least <size> bytes from <pool> - wait until a buffer is released, if all the memory of the pool is held.
+// The wait fails if no buffer is released for ACQUIRE_BUFFER_TIMEOUT_MS (instead of waiting for a release that never comes).
+// Return nullptr in case of an error (or if <was_broken_by_error> is set while waiting).
+static CPooledBuffer *AcquireBufferWait(CBufferPool *pool, const int size, std::atomic<bool> *was_broken_by_error)
+{
+    if (size > pool->maxBufferSize())
+    {
+        fprintf(stderr, "Error: FLV payload size %d exceeds the largest pooled buffer %d\n", size, pool->maxBufferSize());
+        return nullptr;
+    }
+
+    CPooledBuffer *buffer = pool->acquire(size);
+    int n_waits = 0;
+    uint64_t n_put_back = pool->putBackCount();
+    int64_t t_progress_ns = MonotonicNanos();
+
+    while ((buffer == nullptr) && (!was_broken_by_error->load()))
+    {
+        // A released buffer may be of a class that doesn't fit, or of a slab that is not idle - wait while the buffers are released at all.
+        if (pool->putBackCount() != n_put_back)
+        {
+            n_put_back = pool->putBackCount();
+            t_progress_ns = MonotonicNanos();
+        }
+        else if (MonotonicNanos() - t_progress_ns > (int64_t)ACQUIRE_BUFFER_TIMEOUT_MS * 1000000)
+        {
+            fprintf(stderr, "Error: no pooled buffer of %d bytes is released in %d ms (all the memory of the pool is held)\n", size, ACQUIRE_BUFFER_TIMEOUT_MS);
+            pool->printStatistics();
+            return nullptr;
+        }
+
+        WaitForRing(n_waits);
+        buffer = pool->acquire(size);
+    }
+
+    return buffer;
+}
+
+
+// Test CBufferPool at its memory bound (256KB): the 4KB buffers take all the memory, and then buffers of other size classes are acquired:
+// 1. While all the 4KB buffers are held, a 6KB buffer can't be acquired, and AcquireBufferWait fails after ACQUIRE_BUFFER_TIMEOUT_MS (doesn't spin).
+// 2. After all the 4KB buffers but one are released, a 6KB buffer is acquired (the idle 4KB slabs are reclaimed).
+// 3. While the 4KB class is exhausted again, a 4KB request gets a free 6KB buffer (the smallest larger class).
+// Return 0 if all the steps pass, and 1 if any fails.
+static inline int BufferPoolTest()
+{
+    CBufferPool *pool = CBufferPool::Create(65536, 262144);
+
+    if (pool == nullptr)
+    {
+        return 1;
+    }
+
+    std::vector<CPooledBuffer*> held;
+    CPooledBuffer *b = nullptr;
+
+    while ((b = pool->acquire(4096)) != nullptr)
+    {
+        held.push_back(b);
+    }
+
+    // 1. All the memory is held.
+    std::atomic<bool> was_broken_by_error(false);
+    const int64_t t_start_ns = MonotonicNanos();
+    CPooledBuffer *b6 = AcquireBufferWait(pool, 6144, &was_broken_by_error);
+    const int64_t wait_ms = (MonotonicNanos() - t_start_ns) / 1000000;
+    const bool is_step1_ok = (held.size() == 64) && (b6 == nullptr) && (wait_ms >= ACQUIRE_BUFFER_TIMEOUT_MS);
+
+    fprintf(stderr, "Buffer pool test: %d buffers of 4KB fill the bound, 6KB buffer is refused after %lld ms: %s\n",
+            (int)held.size(), (long long)wait_ms, is_step1_ok ? "PASS" : "FAIL");
+
+    // 2. Release all the 4KB buffers but the first (its slab is not idle).
+    for (size_t k = 1; k < held.size(); k++)
+    {
+        held[k]->release();
+    }
+
+    held.resize(1);
+    b6 = pool->acquire(6144);
+    const bool is_step2_ok = (b6 != nullptr) && (b6->capacity == 6144);
+
+    fprintf(stderr, "Buffer pool test: 6KB buffer is acquired after the 4KB buffers are released: %s\n", is_step2_ok ? "PASS" : "FAIL");
+
+    // 3. Exhaust the 4KB class under the bound (the remaining 4KB slabs are full, and there is no room for another slab).
+    if (b6 != nullptr)
+    {
+        b6->release();
+        b6 = pool->acquire(6144);   // Hold one 6KB buffer - the 6KB slab is not idle, so it's not reclaimed.
+    }
+
+    CPooledBuffer *fallback = nullptr;
+
+    while ((b = pool->acquire(4096)) != nullptr)
+    {
+        if (b->capacity > 4096)
+        {
+            fallback = b;
+            break;
+        }
+
+        held.push_back(b);
+    }
+
+    const bool is_step3_ok = (b6 != nullptr) && (fallback != nullptr) && (fallback->capacity == 6144);
+
+    fprintf(stderr, "Buffer pool test: 4KB request gets a 6KB buffer when the 4KB class is exhausted (%d buffers of 4KB held): %s\n",
+            (int)held.size(), is_step3_ok ? "PASS" : "FAIL");
+
+    pool->printStatistics();
+
+    for (size_t k = 0; k < held.size(); k++)
+    {
+        held[k]->release();
+    }
+
+    if (b6 != nullptr)
+    {
+        b6->release();
+    }
+
+    if (fallback != nullptr)
+    {
+        fallback->release();
+    }
+
+    CBufferPool::DeleteObj(pool);
+
+    return (is_step1_ok && is_step2_ok && is_step3_ok) ? 0 : 1;
+}
+
+
+// Read the next FLV video tag from stdout PIPE of FFmpeg to <au>: the payload is read to a buffer acquired from <pool>, and converted to Annex B
+// (after <headroom> bytes for the injected SPS and PPS - see AccessUnitHeadroom).
+// <latency_stats> - Latency instrumentation (nullptr if not measured).
+// Return false in case of an error (no buffer is left acquired).
+static bool ReadAccessUnit(CSubprocess *ffmpeg_process,
+                           const CAvcDecoderConfig *avc_config,
+                           const int headroom,
+                           CBufferPool *pool,
+                           CAccessUnit *au,
+                           CLatencyStats *latency_stats,
+                           std::atomic<bool> *was_broken_by_error)
+{
+    if (latency_stats != nullptr)
+    {
+        // Wait for the next access unit (poll readiness) before taking the snapshot of the number of written frames.
+        ffmpeg_process->stdoutWaitReadable();
+        latency_stats->onStdoutReadable();
+    }
+
+    int flv_payload_size = ReadFlvVideoTagHeader(ffmpeg_process, &au->pts_ms, &au->dts_ms, &au->is_keyframe);
+
+    if (flv_payload_size < 0)
+    {
+        fprintf(stderr, "ReadFlvVideoTagHeader failed\n");
+        return false;
+    }
+
+    const int64_t t_header_ns = (latency_stats != nullptr) ? MonotonicNanos() : 0;
+
+    CPooledBuffer *buffer = AcquireBufferWait(pool, headroom + flv_payload_size, was_broken_by_error);
+
+    if (buffer == nullptr)
+    {
+        return false;
+    }
+
+    // Read FLV payload data and convert the AVC NAL unit / units from AVCC format to Annex B format (directly into the pooled buffer).
+    au->annexb_payload_offset = headroom;
+    au->annexb_payload_len = ReadFlvNalUnits(ffmpeg_process, flv_payload_size, buffer->data + headroom, buffer->capacity - headroom, &au->nal_list,
+                                             avc_config->nal_length_size, avc_config->start_codes);
+
+    if (au->annexb_payload_len < 0)
+    {
+        fprintf(stderr, "ReadFlvNalUnits failed\n");
+        buffer->release();
+        return false;
+    }
+
+#if defined(DO_CONVERT_ANNEXB_IN_PLACE) && !defined(DO_WRITE_NAL_UNITS_WITH_WRITEV)
+    int annexb_offset = 0;
+    ConvertNalListToAnnexBInPlace(&au->nal_list, buffer->data + headroom, &annexb_offset);
+    au->annexb_payload_offset = headroom + annexb_offset;
+#endif
+
+    // Inject SPS and PPS before IDR frames (in the headroom, right before the Annex B payload).
+    au->annexb_payload_len = InjectParameterSets<CVideoCodec>(avc_config, &au->nal_list, buffer->data, &au->annexb_payload_offset);
+
+    if (au->annexb_payload_len < 0)
+    {
+        buffer->release();
+        return false;
+    }
+
+#if defined(DO_WRITE_NAL_UNITS_WITH_WRITEV)
+    // Keep the NAL units views (there is no contiguous Annex B payload).
+#elif defined(DO_CONVERT_ANNEXB_IN_PLACE)
+    // The Annex B payload is at buffer->data + au->annexb_payload_offset.
+#else
+    // Copy the NAL units to a second buffer (the first buffer is used as a sketch buffer).
+    au->annexb_payload_offset = 0;
+    CPooledBuffer *annexb_buffer = AcquireBufferWait(pool, au->annexb_payload_len, was_broken_by_error);
+
+    if (annexb_buffer == nullptr)
+    {
+        buffer->release();
+        return false;
+    }
+
+    CopyNalListToAnnexB(&au->nal_list, annexb_buffer->data);
+    RebaseNalList(&au->nal_list, annexb_buffer->data);  // The views must not point the released buffer.
+    buffer->release();
+    buffer = annexb_buffer;
+#endif
+
+    au->buffer = buffer;    // The consumer releases the buffer.
+
+    if (latency_stats != nullptr)
+    {
+        latency_stats->onAccessUnit(au->pts_ms, t_header_ns, MonotonicNanos());
+    }
+
+    return true;
+}
+
+
+// Reader thread: read FLV stream from stdout PIPE of FFmpeg, convert the payloads to Annex B, and push them to <au_ring>.
+// Each raw video frame is encoded to one "access unit", so expect exactly <n_frames> FLV payloads.
+// There is no need to know the latency of the encoder - the reader is blocked until the next encoded frame is ready.
+// The FLV payload is read to a buffer acquired from <pool> (right-sized - the payload size is known after reading the FLV tag header).
+// <flv_bytes> - Pointer to small sketch buffer of <flv_bytes_size> bytes (used for the first payload).
+// <stage_times> - CPU time of reading and parsing (nullptr if not measured).
+static void ReaderThread(CSubprocess *ffmpeg_process,
+                         CSpscRing<CAccessUnit> *au_ring,
+                         CBufferPool *pool,
+                         unsigned char *flv_bytes,
+                         int flv_bytes_size,
+                         int n_frames,
+                         CLatencyStats *latency_stats,
+                         CStageCpuTimes *stage_times,
+                         std::atomic<bool> *was_broken_by_error,
+                         std::atomic<bool> *is_reader_done)
+{
+    // The reader thread does nothing but reading and parsing, so all its CPU time is the "parse" stage.
+    const int64_t t_start_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+
+    // Read FLV header, and the AVC sequence header (SPS, PPS and the size of the AVCC length fields).
+    CAvcDecoderConfig avc_config;
+    bool success = ReadFlvFileHeaderAndFirstPayload(ffmpeg_process, flv_bytes, flv_bytes_size, &avc_config);
+
+    if (!success)
+    {
+        fprintf(stderr, "ReadFlvFileHeaderAndFirstPayload failed\n");
+        was_broken_by_error->store(true);
+    }
+
+    // The NAL units data is read after a headroom for the injected SPS and PPS (and for growing the payload in case of short length fields).
+    const int headroom = AccessUnitHeadroom(&avc_config);
+
+    for (int i = 0; (i < n_frames) && (!was_broken_by_error->load()); i++)
+    {
+        // Wait for a free slot (the output is slower than the encoder).
+        CAccessUnit *au = au_ring->frontForWrite();
+        int n_waits = 0;
+
+        while ((au == nullptr) && (!was_broken_by_error->load()))
+        {
+            WaitForRing(n_waits);
+            au = au_ring->frontForWrite();
+        }
+
+        if (au == nullptr)
+        {
+            break;
+        }
+
+        if (!ReadAccessUnit(ffmpeg_process, &avc_config, headroom, pool, au, latency_stats, was_broken_by_error))
+        {
+            was_broken_by_error->store(true);
+            break;
+        }
+
+        au_ring->push();
+    }
+
+    if (!was_broken_by_error->load())
+    {
+        // Read extra trailing 4 bytes (FFmpeg puts the 4 bytes as a footer [instead of a header of the next frame]).
+        success = ffmpeg_process->stdoutRead(4, flv_bytes);
+
+        if (!success)
+        {
+            fprintf(stderr, "Failed reading extra 4 footer bytes from sdtin???\n");
+        }
+    }
+    else
+    {
+        // In case of an error, keep reading (and ignoring) the stdout PIPE until FFmpeg ends.
+        // If we stop reading, FFmpeg may be blocked on a full stdout PIPE, and the writer thread may be blocked on a full stdin PIPE.
+        while (ffmpeg_process->stdoutRead(flv_bytes_size, flv_bytes)) {}
+    }
+
+    if (stage_times != nullptr)
+    {
+        stage_times->parse_ns += ThreadCpuNanos() - t_start_ns;
+    }
+
+    is_reader_done->store(true, std::memory_order_release);
+}
+
+
+// Policy of CRawFrameQueue when the queue is full (FFmpeg falls behind).
+enum EQueuePolicy
+{
+    QUEUE_BLOCK,        // Don't accept the frame (the source waits - no frame is lost, but the latency may grow).
+    QUEUE_DROP_OLDEST,  // Drop the oldest frame that is not being written (for live feeds - keep the latest frames).
+    QUEUE_DROP_NEWEST   // Drop the new frame.
+};
+
+
+// Bounded queue of raw video frames pending to be written to a non-blocking stdin PIPE.
+// The frames are pooled buffers (the queue is the owner of the frames it holds).
+// The frame at the front may be partially written (the PIPE accepts part of a frame) - a partially written frame is never dropped,
+// because dropping it would corrupt the raw video stream (FFmpeg splits the stream to frames by counting bytes).
+class CRawFrameQueue
+{
+private:
+    CPooledBuffer **m_frames  = nullptr;
+    int m_capacity            = 0;
+    int m_head                = 0;      // Index of the front frame.
+    int m_count               = 0;
+    int m_frame_size          = 0;
+    int m_write_pos           = 0;      // Number of bytes of the front frame already written.
+    EQueuePolicy m_policy     = QUEUE_BLOCK;
+    int m_n_dropped           = 0;
+
+    // Remove the frame at index <k> (relative to the front) and release it.
+    void removeAt(const int k)
+    {
+        m_frames[(m_head + k) % m_capacity]->release();
+
+        for (int j = k; j < m_count - 1; j++)
+        {
+            m_frames[(m_head + j) % m_capacity] = m_frames[(m_head + j + 1) % m_capacity];
+        }
+
+        m_count--;
+    }
+
+public:
+    // <capacity> - maximum number of pending frames (at least 2, so DROP_OLDEST can drop a frame while the front frame is being written).
+    CRawFrameQueue(const int capacity, const int frame_size, const EQueuePolicy policy) :
+        m_capacity(std::max(capacity, 2)), m_frame_size(frame_size), m_policy(policy)
+    {
+        m_frames = new CPooledBuffer*[m_capacity];
+    }
+
+    ~CRawFrameQueue()
+    {
+        while (m_count > 0)
+        {
+            removeAt(0);
+        }
+
+        delete[] m_frames;
+    }
+
+    CRawFrameQueue(const CRawFrameQueue&) = delete;
+    CRawFrameQueue &operator=(const CRawFrameQueue&) = delete;
+
+    bool isEmpty() const { return m_count == 0; }
+    bool isFull() const { return m_count == m_capacity; }
+    int count() const { return m_count; }
+    int capacity() const { return m_capacity; }
+    int droppedCount() const { return m_n_dropped; }
+
+    // Write the partially written front frame again from the start (to a new FFmpeg process).
+    void rewind() { m_write_pos = 0; }
+
+    // Move all the frames to the back of <frames> (the caller becomes the owner of the frames).
+    void moveTo(std::deque<CPooledBuffer*> *frames)
+    {
+        while (m_count > 0)
+        {
+            frames->push_back(m_frames[m_head]);
+            m_head = (m_head + 1) % m_capacity;
+            m_count--;
+        }
+
+        m_write_pos = 0;
+    }
+
+    // Push a frame at the back of the queue (the queue becomes the owner of the frame, unless false is returned).
+    // Return false if the queue is full and the policy is QUEUE_BLOCK (the caller keeps the frame and tries again later).
+    bool push(CPooledBuffer *frame)
+    {
+        if (isFull())
+        {
+            if (m_policy == QUEUE_BLOCK)
+            {
+                return false;
+            }
+
+            m_n_dropped++;
+
+            if (m_policy == QUEUE_DROP_NEWEST)
+            {
+                frame->release();
+                return true;
+            }
+
+            // QUEUE_DROP_OLDEST - the front frame is skipped if it is partially written.
+            removeAt((m_write_pos > 0) ? 1 : 0);
+        }
+
+        m_frames[(m_head + m_count) % m_capacity] = frame;
+        m_count++;
+
+        return true;
+    }
+
+    // Write the pending frames to non-blocking stdin PIPE of <process>, until the PIPE is full (or the queue is empty).
+    // <written> - Optional: the completely written frames are moved to the back of <written> instead of being released (see CEncoderSession::enableRecovery).
+    // Return the number of completely written frames, or -1 in case of an error.
+    int writeSome(CSubprocess *process, std::deque<CPooledBuffer*> *written = nullptr)
+    {
+        int n_frames_written = 0;
+
+        while (m_count > 0)
+        {
+            CPooledBuffer *frame = m_frames[m_head];
+            int n = process->stdinWriteSome(&frame->data[m_write_pos], (unsigned int)(m_frame_size - m_write_pos));
+
+            if (n < 0)
+            {
+                return -1;
+            }
+
+            if (n == 0)
+            {
+                break;  // The PIPE is full.
+            }
+
+            m_write_pos += n;
+
+            if (m_write_pos == m_frame_size)
+            {
+                // The frame is written - pop it.
+                if (written != nullptr)
+                {
+                    written->push_back(frame);
+                }
+                else
+                {
+                    frame->release();
+                }
+
+                m_head = (m_head + 1) % m_capacity;
+                m_count--;
+                m_write_pos = 0;
+                n_frames_written++;
+            }
+        }
+
+        return n_frames_written;
+    }
+};
+
+
+// Encoding session of the multi-stream farm: one FFmpeg child process with non-blocking stdin and stdout PIPEs.
+// The session writes raw video frames to stdin when the PIPE is writable, and feeds CFlvParser with the bytes read when stdout is readable.
+// A read may return any number of bytes (part of a header, part of a payload, or few FLV tags) - the parser keeps the state across reads.
+// The raw frames are queued in CRawFrameQueue - the source of the frames is either:
+// - Offline source (live_fps = 0): a new frame is made whenever the queue has room (the encoder sets the pace - nothing is dropped).
+// - Live source (live_fps > 0): a new frame arrives every 1/fps second (timerfd) - when FFmpeg falls behind, the queue policy applies.
+// EPOLLOUT is registered only while the queue is not empty (level triggered EPOLLOUT of an empty queue would spin the loop).
+// With crash recovery (see enableRecovery), a FFmpeg process that ends unexpectedly is replaced, and the frames it didn't output are replayed to the new process.
+// All the functions of a session are executed by the event loop thread that owns the session.
+class CEncoderSession : public CFlvParserListener
+{
+private:
+    enum EHandleType
+    {
+        HANDLE_STDIN,
+        HANDLE_STDOUT,
+        HANDLE_TIMER
+    };
+
+    // Identifies the file descriptor in epoll events (epoll_event.data.ptr points one of the handles).
+    struct CEpollHandle
+    {
+        CEncoderSession *session;
+        EHandleType type;
+    };
+
+    int m_id                    = 0;
+    int m_epfd                  = -1;       // epoll instance of the event loop that owns the session.
+    CSubprocess *m_process      = nullptr;
+    CBufferPool *m_pool         = nullptr;  // FLV payload buffers.
+    CFlvParser<CVideoCodec> *m_parser = nullptr;
+    FILE *m_out_f               = nullptr;
+
+    // Input (raw video frames).
+    int m_width                 = 0;
+    int m_height                = 0;
+    int m_n_frames              = 0;
+    int m_raw_frame_size        = 0;
+    unsigned char *m_bgr_sketch = nullptr;  // See NewBgrSketchBuffer (nullptr if the frames are not converted to YUV).
+    CBufferPool *m_raw_pool     = nullptr;  // Raw frame buffers (queue capacity + 1 frames).
+    CRawFrameQueue *m_queue     = nullptr;
+    int m_n_produced            = 0;        // Number of frames the source made (including dropped frames).
+    int m_n_sent                = 0;        // Number of frames completely written to stdin PIPE.
+    int m_live_fps              = 0;
+    int m_timer_fd              = -1;
+    int m_n_ticks_owed          = 0;        // Live source with QUEUE_BLOCK policy: frames that arrived when the queue was full.
+    bool m_is_stdin_armed       = false;    // true if EPOLLOUT of stdin is registered.
+
+    CEpollHandle m_stdin_handle;
+    CEpollHandle m_stdout_handle;
+    CEpollHandle m_timer_handle;
+    bool m_is_stdin_done        = false;
+    bool m_is_stdout_done       = false;
+    bool m_is_failed            = false;
+
+    // Benchmark instrumentation (see enableStageTimes).
+    bool m_is_stage_timed       = false;
+    CStageCpuTimes m_stage_times;
+
+    CAccessUnitVerifier *m_verifier = nullptr;  // See attachVerifier (nullptr if the output is not verified).
+
+    // Startup latency: executing FFmpeg (or leasing a worker), and the time from the first write to stdin until the first access unit.
+    int64_t m_spawn_ns          = 0;
+    int64_t m_t_first_write_ns  = 0;
+    int64_t m_t_first_au_ns     = 0;
+    bool m_is_warm_worker       = false;    // true if the FFmpeg process is a pre-spawned worker (CFfmpegWorkerPool).
+
+    // Crash recovery (see enableRecovery) - the frames are numbered in the order the source made them (the dropped frames are not numbered).
+    std::string m_ffmpeg_arg;
+    int m_pipe_buf_size         = 0;
+    CFfmpegWorkerPool *m_worker_pool = nullptr;
+    CSessionMetrics *m_metrics  = nullptr;  // Owned by the exporter (nullptr if the metrics are not exported) - attached to each FFmpeg process of the session.
+    int m_max_respawns          = 0;        // 0 - recovery is disabled (FFmpeg that ends unexpectedly fails the session).
+    int m_n_respawns            = 0;
+    int m_fps                   = 25;       // Maps the FLV timestamps to frames.
+    int m_max_history           = 0;
+    std::deque<CPooledBuffer*> m_history;   // Frames written to the current FFmpeg process that may have no access unit yet (the last one is frame m_n_sent - 1).
+    CRawFrameQueue *m_replay    = nullptr;  // Frames replayed to the new FFmpeg process (written before the frames of m_queue).
+    bool m_is_child_broken      = false;    // true after write to stdin failed (the process is replaced when stdout reaches end of stream).
+    int m_segment_first         = 0;        // The first frame written to the current FFmpeg process.
+    int m_segment_pts0_ms       = -1;       // pts of the first access unit of the current process (-1 before the first access unit).
+    int m_stream_pts0_ms        = -1;       // pts of the first access unit of the first process (the timestamps are continuous across the processes).
+    int m_next_frame            = 0;        // The frame after the latest frame that has an access unit.
+    int m_n_gap_frames          = 0;        // Frames that were written to an ended process, and have no access unit.
+    int m_n_prev_access_units   = 0;        // Access units of the ended processes.
+    int m_crash_frame           = -1;       // Test hook (see injectCrash).
+
+    CEncoderSession()
+    {
+    }
+
+    // Execute FFmpeg with <ffmpeg_arg>, or lease a pre-spawned worker from <worker_pool> (if the pool workers are executed with the same arguments).
+    // Return nullptr in case of an error.
+    static CSubprocess *SpawnFfmpeg(const std::string &ffmpeg_arg, const int pipe_buf_size, CFfmpegWorkerPool *worker_pool, bool *is_warm)
+    {
+        *is_warm = false;
+
+        // The read-ahead buffer of CSubprocess is not used (the session reads with stdoutReadSome).
+        if ((worker_pool != nullptr) && worker_pool->isMatching(ffmpeg_arg, pipe_buf_size))
+        {
+            return worker_pool->lease(is_warm);
+        }
+
+        return CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_arg, true, true, pipe_buf_size, 64);
+    }
+
+    // Crash recovery: map the access unit to its frame, make the timestamps continuous across the processes,
+    // and release the frames of the history that are not going to be replayed.
+    void trackAccessUnit(CAccessUnit *au)
+    {
+        if (m_segment_pts0_ms < 0)
+        {
+            // The first access unit (in decoding order) is the IDR frame of the first frame written to the process.
+            m_segment_pts0_ms = au->pts_ms;
+
+            if (m_stream_pts0_ms < 0)
+            {
+                m_stream_pts0_ms = au->pts_ms;
+            }
+        }
+
+        const int frame = m_segment_first + (int)(((int64_t)(au->pts_ms - m_segment_pts0_ms) * m_fps + 500) / 1000);
+        const int offset_ms = m_stream_pts0_ms + (int)((int64_t)m_segment_first * 1000 / m_fps) - m_segment_pts0_ms;
+
+        au->pts_ms += offset_ms;
+        au->dts_ms += offset_ms;
+
+        m_next_frame = std::max(m_next_frame, frame + 1);
+
+        // A new process starts from m_next_frame - the frames before it are not replayed (a B frame among them that has no access unit yet is lost).
+        while ((!m_history.empty()) && (m_n_sent - (int)m_history.size() < m_next_frame))
+        {
+            m_history.front()->release();
+            m_history.pop_front();
+        }
+
+        if ((m_crash_frame >= 0) && (frame >= m_crash_frame))
+        {
+            fprintf(stderr, "Session %d: killing FFmpeg process %d after the access unit of frame %d (test)\n", m_id, (int)m_process->pid(), frame);
+            kill(m_process->pid(), SIGKILL);
+            m_crash_frame = -1;
+        }
+    }
+
+    // Crash recovery: replace the FFmpeg process that ended unexpectedly (stdout reached end of stream), and replay the frames that have no access unit.
+    // The new process starts from the frame after the latest frame that has an access unit (encoded as IDR frame, with SPS and PPS),
+    // so the output continues at the IDR frame - the frames that the ended process didn't output before that frame are the gap.
+    // Return false in case of an error.
+    bool respawn()
+    {
+        armStdin(false);
+
+        // The frames of the replay queue that are not written yet follow the history (the process may end while the frames are replayed).
+        const int replay_first = m_n_sent - (int)m_history.size();
+        m_replay->moveTo(&m_history);
+        m_queue->rewind();  // The partially written front frame is written again from the start.
+
+        m_n_gap_frames += (replay_first - m_segment_first) - m_parser->accessUnitsCount();
+        m_n_prev_access_units += m_parser->accessUnitsCount();
+
+        const int n_replayed = (int)m_history.size();
+
+        while (!m_history.empty())
+        {
+            m_replay->push(m_history.front());  // The replay capacity is the maximum size of the history (see enableRecovery).
+            m_history.pop_front();
+        }
+
+        m_n_sent = replay_first;
+        m_segment_first = replay_first;
+        m_segment_pts0_ms = -1;
+        m_next_frame = replay_first;
+
+        // Reap the ended process, and start the new one - the new FLV stream begins with FLV header and sequence header (a new parser).
+        CSubprocess::KillAndDeleteObj(m_process);
+        delete m_parser;
+        m_parser = new CFlvParser<CVideoCodec>(m_pool, this, g_encoder_profile->start_codes);
+
+        m_process = SpawnFfmpeg(m_ffmpeg_arg, m_pipe_buf_size, m_worker_pool, &m_is_warm_worker);
+
+        if ((m_process == nullptr) || (!m_process->setNonBlocking()))
+        {
+            fprintf(stderr, "Session %d: failed to execute FFmpeg\n", m_id);
+            return false;
+        }
+
+        if (m_metrics != nullptr)
+        {
+            m_process->attachMetrics(m_metrics);    // The pidfd of the killed process is replaced.
+        }
+
+        m_n_respawns++;
+        fprintf(stderr, "Session %d: FFmpeg respawned (%s) - replaying %d frames from frame %d\n", m_id,
+                m_is_warm_worker ? "pre-spawned FFmpeg worker" : "FFmpeg executed by the session", n_replayed, replay_first);
+
+        struct epoll_event ev_in;
+        ev_in.events = EPOLLIN;
+        ev_in.data.ptr = &m_stdout_handle;
+
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_process->stdoutFd(), &ev_in) == (-1))
+        {
+            fprintf(stderr, "Session %d: epoll_ctl failed, errno = %d.\n", m_id, errno);
+            return false;
+        }
+
+        m_is_stdout_done = false;
+        m_is_stdin_done = false;
+        m_is_stdin_armed = false;
+        m_is_child_broken = false;
+        armStdin(true);     // The frames are written (or stdin is closed, if there is nothing to write) when the PIPE is writable.
+
+        return !m_is_failed;
+    }
+
+    // Return true if there is no frame to write (neither replayed frames nor queued frames).
+    bool isQueueEmpty() const
+    {
+        return m_queue->isEmpty() && ((m_replay == nullptr) || m_replay->isEmpty());
+    }
+
+    // Write the Annex B access unit to the output file.
+    bool onAccessUnit(CAccessUnit *au) override
+    {
+        const int64_t t_output_ns = m_is_stage_timed ? ThreadCpuNanos() : 0;
+
+        if (m_t_first_au_ns == 0)
+        {
+            m_t_first_au_ns = MonotonicNanos();
+        }
+
+        if (m_max_respawns > 0)
+        {
+            trackAccessUnit(au);
+        }
+
+        fwrite(&au->buffer->data[au->annexb_payload_offset], 1, au->annexb_payload_len, m_out_f);
+
+        if (m_verifier != nullptr)
+        {
+            m_verifier->verify(au, false);  // CFlvParser always makes a contiguous Annex B payload.
+        }
+
+        au->buffer->release();
+
+        if (m_is_stage_timed)
+        {
+            m_stage_times.output_ns += ThreadCpuNanos() - t_output_ns;
+        }
+
+        return true;
+    }
+
+    // Register (or unregister) EPOLLOUT of stdin PIPE.
+    void armStdin(const bool is_armed)
+    {
+        if (m_is_stdin_done || (is_armed == m_is_stdin_armed) || (is_armed && m_is_child_broken))
+        {
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.ptr = &m_stdin_handle;
+
+        if (epoll_ctl(m_epfd, is_armed ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, m_process->stdinFd(), &ev) == (-1))
+        {
+            fprintf(stderr, "Session %d: epoll_ctl of stdin failed, errno = %d.\n", m_id, errno);
+            m_is_failed = true;
+            return;
+        }
+
+        m_is_stdin_armed = is_armed;
+    }
+
+    // Close stdin PIPE - closing stdin "pushes" all the remaining frames from the encoder to stdout (FFmpeg feature).
+    void closeStdin()
+    {
+        if (m_is_stdin_done)
+        {
+            return;
+        }
+
+        armStdin(false);
+
+        if (m_timer_fd != (-1))
+        {
+            epoll_ctl(m_epfd, EPOLL_CTL_DEL, m_timer_fd, nullptr);
+        }
+
+        m_process->stdinClose();
+        m_is_stdin_done = true;
+    }
+
+    // The source makes the next frame, and pushes it to the queue.
+    // Return false if the frame is not accepted (QUEUE_BLOCK policy and the queue is full).
+    bool produceFrame()
+    {
+        CPooledBuffer *frame = m_raw_pool->acquire(m_raw_frame_size);
+
+        if (frame == nullptr)
+        {
+            return false;   // All the raw frames are in the queue (QUEUE_BLOCK).
+        }
+
+        const int64_t t_gen_ns = m_is_stage_timed ? ThreadCpuNanos() : 0;
+
+        MakeRawFrame(m_width, m_height, m_n_produced, m_bgr_sketch, frame->data);
+
+        if (m_is_stage_timed)
+        {
+            m_stage_times.gen_ns += ThreadCpuNanos() - t_gen_ns;
+        }
+
+        if (!m_queue->push(frame))
+        {
+            frame->release();
+            return false;
+        }
+
+        m_n_produced++;
+        armStdin(true);
+
+        return true;
+    }
+
+    // Close stdin after the source made all the frames, and the queue is empty.
+    void checkInputDone()
+    {
+        if ((m_n_produced == m_n_frames) && isQueueEmpty())
+        {
+            closeStdin();
+        }
+    }
+
+    // stdin PIPE is writable - write the pending frames until the PIPE is full (or the queue is empty).
+    void onWritable()
+    {
+        if (m_t_first_write_ns == 0)
+        {
+            m_t_first_write_ns = MonotonicNanos();
+        }
+
+        while ((!m_is_stdin_done) && (!m_is_failed))
+        {
+            if (m_live_fps == 0)
+            {
+                // Offline source - keep the queue full.
+                while ((m_n_produced < m_n_frames) && (!m_queue->isFull()) && produceFrame()) {}
+            }
+
+            // The replayed frames (crash recovery) are written before the queued frames.
+            CRawFrameQueue *queue = ((m_replay != nullptr) && (!m_replay->isEmpty())) ? m_replay : m_queue;
+            int n = queue->writeSome(m_process, (m_max_respawns > 0) ? &m_history : nullptr);
+
+            if ((n < 0) && (m_n_respawns < m_max_respawns))
+            {
+                // FFmpeg ended (EPIPE) - stop writing, the process is replaced when stdout reaches end of stream.
+                m_is_child_broken = true;
+                armStdin(false);
+                break;
+            }
+
+            if (n < 0)
+            {
+                fprintf(stderr, "Session %d: write to stdin PIPE failed\n", m_id);
+                m_is_failed = true;
+                break;
+            }
+
+            m_n_sent += n;
+
+            // Crash recovery: keep the newest frames (an encoder latency longer than the history makes a larger gap after a crash).
+            while ((m_replay != nullptr) && ((int)m_history.size() + m_replay->count() > m_max_history))
+            {
+                m_history.front()->release();
+                m_history.pop_front();
+            }
+
+            // Live source with QUEUE_BLOCK policy: the frames that waited for room in the queue.
+            while ((m_n_ticks_owed > 0) && (m_n_produced < m_n_frames) && produceFrame())
+            {
+                m_n_ticks_owed--;
+            }
+
+            checkInputDone();
+
+            // An offline source with frames left refills the queue (FFmpeg may drain the queue while a frame is made, so an empty queue is not the end).
+            if (isQueueEmpty() && ((m_live_fps > 0) || (m_n_produced == m_n_frames)))
+            {
+                armStdin(false);    // Nothing to write until the next frame arrives.
+                break;
+            }
+
+            if ((n == 0) || (m_live_fps > 0))
+            {
+                break;  // The PIPE is full - wait for next EPOLLOUT event.
+            }
+        }
+
+        if (m_is_failed)
+        {
+            // Close stdin, so FFmpeg ends (and stdout of the session reaches end of stream).
+            closeStdin();
+        }
+    }
+
+    // Live source timer expired - the next frame (or frames) arrived.
+    void onTimer()
+    {
+        uint64_t n_expirations = 0;
+
+        if (read(m_timer_fd, &n_expirations, sizeof(n_expirations)) != (ssize_t)sizeof(n_expirations))
+        {
+            return;     // EAGAIN (the timer is non-blocking).
+        }
+
+        for (uint64_t k = 0; (k < n_expirations) && (m_n_produced < m_n_frames) && (!m_is_stdin_done); k++)
+        {
+            if ((m_n_ticks_owed > 0) || (!produceFrame()))
+            {
+                m_n_ticks_owed++;   // QUEUE_BLOCK - the source waits for room in the queue.
+            }
+        }
+
+        checkInputDone();
+    }
+
+    // stdout PIPE is readable - read and parse all the available bytes.
+    // The rest of the current payload is read directly to the payload buffer of the parser, and the bytes that follow are read to <scratch>.
+    void onReadable(unsigned char *scratch, const int scratch_size)
+    {
+        while (!m_is_stdout_done)
+        {
+            struct iovec iov[2];
+            int iovcnt = 0;
+            int payload_remain = 0;
+            unsigned char *payload_ptr = m_is_failed ? nullptr : m_parser->directWritePtr(&payload_remain);
+
+            if (payload_ptr != nullptr)
+            {
+                iov[0].iov_base = payload_ptr;
+                iov[0].iov_len = (size_t)payload_remain;
+                iovcnt++;
+            }
+
+            iov[iovcnt].iov_base = scratch;
+            iov[iovcnt].iov_len = (size_t)scratch_size;
+            iovcnt++;
+
+            bool is_eof = false;
+            int n = m_process->stdoutReadSome(iov, iovcnt, &is_eof);
+
+            if (n < 0)
+            {
+                m_is_failed = true;
+                is_eof = true;
+            }
+
+            if (is_eof)
+            {
+                bool is_respawn_needed = false;
+
+                // End of stream is valid only after all the frames sent (and the trailing 4 bytes of last "previous packet size").
+                if ((!m_is_failed) && ((!m_parser->isAtValidEnd()) || (!m_is_stdin_done) || (m_parser->accessUnitsCount() != m_n_sent - m_segment_first)))
+                {
+                    fprintf(stderr, "Session %d: unexpected end of stream (%d of %d access units)\n", m_id, m_parser->accessUnitsCount(), m_n_sent - m_segment_first);
+                    is_respawn_needed = (m_n_respawns < m_max_respawns);
+                    m_is_failed = !is_respawn_needed;
+                }
+
+                epoll_ctl(m_epfd, EPOLL_CTL_DEL, m_process->stdoutFd(), nullptr);
+                m_is_stdout_done = true;
+
+                if (is_respawn_needed && (!respawn()))
+                {
+                    m_is_failed = true;
+                }
+
+                break;
+            }
+
+            if (n == 0)
+            {
+                break;  // The PIPE is empty - wait for next EPOLLIN event.
+            }
+
+            if (m_is_failed)
+            {
+                continue;   // Keep reading (and ignoring) the stdout PIPE until FFmpeg ends.
+            }
+
+            int n_payload = std::min(n, payload_remain);
+
+            if ((!m_parser->commitDirectWrite(n_payload)) || (!m_parser->feed(scratch, n - n_payload)))
+            {
+                fprintf(stderr, "Session %d: FLV parsing failed\n", m_id);
+                m_is_failed = true;
+            }
+        }
+
+        if (m_is_failed)
+        {
+            closeStdin();
+        }
+    }
+
+public:
+    // Create encoding session - execute FFmpeg with <ffmpeg_arg>, and set the PIPEs to non-blocking mode.
+    // The session encodes <n_frames> synthetic frames of <width>x<height>, and writes the Annex B stream to <out_file_name>.
+    // <live_fps> - 0 for offline source, or the frame rate of a live source.
+    // <queue_depth>, <policy> - capacity of the pending raw frames queue, and the policy when the queue is full.
+    // <pipe_buf_size> - Size of stdin and stdout PIPEs (the buf_size passed to Popen).
+    // <worker_pool> - Pool of pre-spawned FFmpeg workers (nullptr, or a pool with other arguments - FFmpeg is executed by the session).
+    // <metrics_exporter> - The metrics of the session are exported as <out_file_name> (nullptr - the metrics are not exported).
+    // Return pointer to CEncoderSession object in case of success, and nullptr in case of failure.
+    static CEncoderSession *Create(const int id, const std::string ffmpeg_arg, const int width, const int height, const int n_frames, const std::string out_file_name,
+                                   const int live_fps = 0, const int queue_depth = 2, const EQueuePolicy policy = QUEUE_BLOCK,
+                                   const int pipe_buf_size = 1048576, CFfmpegWorkerPool *worker_pool = nullptr,
+                                   CMetricsExporter *metrics_exporter = nullptr)
+    {
+        CEncoderSession *session = new CEncoderSession();
+
+        session->m_id = id;
+        session->m_width = width;
+        session->m_height = height;
+        session->m_n_frames = n_frames;
+        session->m_raw_frame_size = RawFrameSize(width, height);
+        session->m_bgr_sketch = NewBgrSketchBuffer(width, height);
+        session->m_live_fps = live_fps;
+        session->m_stdin_handle.session = session;
+        session->m_stdin_handle.type = HANDLE_STDIN;
+        session->m_stdout_handle.session = session;
+        session->m_stdout_handle.type = HANDLE_STDOUT;
+        session->m_timer_handle.session = session;
+        session->m_timer_handle.type = HANDLE_TIMER;
+
+        session->m_ffmpeg_arg = ffmpeg_arg;
+        session->m_pipe_buf_size = pipe_buf_size;
+        session->m_worker_pool = worker_pool;
+
+        const int64_t t_spawn_ns = MonotonicNanos();
+        session->m_process = SpawnFfmpeg(ffmpeg_arg, pipe_buf_size, worker_pool, &session->m_is_warm_worker);
+        session->m_spawn_ns = MonotonicNanos() - t_spawn_ns;
+
+        if ((session->m_process == nullptr) || (!session->m_process->setNonBlocking()))
+        {
+            fprintf(stderr, "Session %d: failed to execute FFmpeg\n", id);
+            DeleteObj(session);
+            return nullptr;
+        }
+
+        if (metrics_exporter != nullptr)
+        {
+            session->m_metrics = metrics_exporter->addSession(out_file_name);
+            session->m_process->attachMetrics(session->m_metrics);
+        }
+
+        session->m_queue = new CRawFrameQueue(queue_depth, session->m_raw_frame_size, policy);
+
+        // One more raw frame than the queue capacity (DROP_NEWEST policy acquires the new frame before dropping it).
+        const size_t raw_frame_stride = session->m_raw_frame_size + 65536;
+        session->m_raw_pool = CBufferPool::Create(session->m_raw_frame_size, (size_t)(std::max(queue_depth, 2) + 1) * raw_frame_stride);
+        session->m_pool = CBufferPool::Create(session->m_raw_frame_size, 8 * 1048576);
+
+        if (session->m_pool != nullptr)
+        {
+            session->m_parser = new CFlvParser<CVideoCodec>(session->m_pool, session, g_encoder_profile->start_codes);
+        }
+
+        session->m_out_f = fopen(out_file_name.c_str(), "wb");
+
+        if ((session->m_pool == nullptr) || (session->m_raw_pool == nullptr) || (session->m_out_f == nullptr))
+        {
+            fprintf(stderr, "Session %d: failed to create buffer pool or output file %s\n", id, out_file_name.c_str());
+            DeleteObj(session);
+            return nullptr;
+        }
+
+        if (live_fps > 0)
+        {
+            // https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+            session->m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            struct itimerspec its;
+            its.it_interval.tv_sec = 0;
+            its.it_interval.tv_nsec = 1000000000L / live_fps;
+            its.it_value = its.it_interval;
+
+            if ((session->m_timer_fd == (-1)) || (timerfd_settime(session->m_timer_fd, 0, &its, nullptr) == (-1)))
+            {
+                fprintf(stderr, "Session %d: timerfd failed, errno = %d.\n", id, errno);
+                DeleteObj(session);
+                return nullptr;
+            }
+        }
+
+        return session;
+    }
+
+    // Wait for FFmpeg to end, close the output file and delete the session.
+    static bool DeleteObj(CEncoderSession *session)
+    {
+        bool success = true;
+
+        if (session->m_process != nullptr)
+        {
+            session->m_process->stdinClose();
+            success = CSubprocess::ClosePipeAndDeleteObj(session->m_process);
+        }
+
+        if (session->m_timer_fd != (-1))
+        {
+            close(session->m_timer_fd);
+        }
+
+        // Delete the parser and the queues before the pools (the parser and the queues may hold pooled buffers).
+        delete session->m_parser;
+        delete session->m_queue;
+        delete session->m_replay;
+
+        for (CPooledBuffer *frame : session->m_history)
+        {
+            frame->release();
+        }
+
+        if (session->m_pool != nullptr)
+        {
+            CBufferPool::DeleteObj(session->m_pool);
+        }
+
+        if (session->m_raw_pool != nullptr)
+        {
+            CBufferPool::DeleteObj(session->m_raw_pool);
+        }
+
+        if (session->m_out_f != nullptr)
+        {
+            fclose(session->m_out_f);
+        }
+
+        if (session->m_verifier != nullptr)
+        {
+            CAccessUnitVerifier::DeleteObj(session->m_verifier);
+        }
+
+        delete[] session->m_bgr_sketch;
+        delete session;
+
+        return success;
+    }
+
+    int id() const { return m_id; }
+    bool isDone() const { return m_is_stdin_done && m_is_stdout_done; }
+    bool isFailed() const { return m_is_failed; }
+    int droppedCount() const { return m_queue->droppedCount(); }
+    bool isWarmWorker() const { return m_is_warm_worker; }
+    int respawnCount() const { return m_n_respawns; }
+    int gapFrames() const { return m_n_gap_frames; }
+    int accessUnitsCount() const { return m_n_prev_access_units + m_parser->accessUnitsCount(); }
+
+    // Startup latency in milliseconds: executing FFmpeg (or leasing a worker), and the time from the first write until the first access unit (-1 if none).
+    double startupMs() const
+    {
+        return (m_t_first_au_ns > 0) ? (double)(m_spawn_ns + m_t_first_au_ns - m_t_first_write_ns) / 1e6 : (-1.0);
+    }
+
+    // Measure the CPU time of the stages (making the frames, writing, parsing and output) - must be executed before the farm runs.
+    void enableStageTimes() { m_is_stage_timed = true; }
+
+    // Verify each access unit by <verifier> (the session is the owner of the verifier) - must be executed before the farm runs.
+    void attachVerifier(CAccessUnitVerifier *verifier) { m_verifier = verifier; }
+
+    // Replace FFmpeg (up to <max_respawns> times) when it ends unexpectedly - must be executed before the farm runs.
+    // The written frames that may have no access unit yet are kept (up to <max_replay_frames> - more than the encoder latency), and replayed to the new process.
+    // <fps> - frame rate of the FLV timestamps (maps the access units to frames).
+    // Return false if the raw frames pool can't be resized.
+    bool enableRecovery(const int max_respawns, const int fps, const int max_replay_frames)
+    {
+        // The history frames are taken from the raw frames pool - the pool is replaced (it's empty before the farm runs).
+        const size_t raw_frame_stride = m_raw_frame_size + 65536;
+        CBufferPool::DeleteObj(m_raw_pool);
+        m_raw_pool = CBufferPool::Create(m_raw_frame_size, (size_t)(m_queue->capacity() + 1 + max_replay_frames) * raw_frame_stride);
+
+        if (m_raw_pool == nullptr)
+        {
+            fprintf(stderr, "Session %d: failed to create buffer pool\n", m_id);
+            return false;
+        }
+
+        m_max_respawns = max_respawns;
+        m_fps = fps;
+        m_max_history = max_replay_frames;
+        m_replay = new CRawFrameQueue(max_replay_frames, m_raw_frame_size, QUEUE_BLOCK);
+
+        return true;
+    }
+
+    // Test hook: kill FFmpeg (SIGKILL) after the access unit of frame <frame> is output (requires enableRecovery).
+    void injectCrash(const int frame) { m_crash_frame = frame; }
+
+    // Print the verification result (after the farm runs) - return false if the output is not the same as the reference.
+    bool finishVerification()
+    {
+        return (m_verifier == nullptr) || m_verifier->finish(m_id);
+    }
+
+    // Add the counters and CPU times of the session to <stats> (after the farm runs).
+    void addStatistics(CPipelineStats *stats) const
+    {
+        stats->cpu.add(m_stage_times);
+        stats->stdin_counters.add(m_process->stdinCounters());
+        stats->stdout_counters.add(m_process->stdoutCounters());
+        stats->n_access_units += accessUnitsCount();
+    }
+
+    // Register the PIPEs (and the timer of a live source) of the session in epoll instance <epfd> (level triggered).
+    bool registerInEpoll(const int epfd)
+    {
+        m_epfd = epfd;
+
+        struct epoll_event ev_in;
+        ev_in.events = EPOLLIN;
+        ev_in.data.ptr = &m_stdout_handle;
+
+        struct epoll_event ev_timer;
+        ev_timer.events = EPOLLIN;
+        ev_timer.data.ptr = &m_timer_handle;
+
+        if ((epoll_ctl(epfd, EPOLL_CTL_ADD, m_process->stdoutFd(), &ev_in) == (-1)) ||
+            ((m_timer_fd != (-1)) && (epoll_ctl(epfd, EPOLL_CTL_ADD, m_timer_fd, &ev_timer) == (-1))))
+        {
+            fprintf(stderr, "Session %d: epoll_ctl failed, errno = %d.\n", m_id, errno);
+            return false;
+        }
+
+        if (m_live_fps == 0)
+        {
+            armStdin(true);     // Offline source - the first frames are made when stdin is writable.
+        }
+
+        return !m_is_failed;
+    }
+
+    // Handle epoll event of one of the session file descriptors (<ptr> is epoll_event.data.ptr).
+    // <scratch> - sketch buffer of the event loop thread (shared by all the sessions of the loop).
+    static void HandleEvent(void *ptr, unsigned char *scratch, const int scratch_size)
+    {
+        CEpollHandle *handle = (CEpollHandle*)ptr;
+        CEncoderSession *session = handle->session;
+
+        // The time of making frames (and of output) is measured inside the handlers - the rest is counted as write (or parse) time.
+        const int64_t t_start_ns = session->m_is_stage_timed ? ThreadCpuNanos() : 0;
+        const int64_t inner_start_ns = session->m_stage_times.gen_ns + session->m_stage_times.output_ns;
+
+        switch (handle->type)
+        {
+        case HANDLE_STDIN:
+            session->onWritable();
+            break;
+
+        case HANDLE_STDOUT:
+            session->onReadable(scratch, scratch_size);
+            break;
+
+        case HANDLE_TIMER:
+            session->onTimer();
+            break;
+        }
+
+        if (session->m_is_stage_timed)
+        {
+            const int64_t inner_ns = session->m_stage_times.gen_ns + session->m_stage_times.output_ns - inner_start_ns;
+            const int64_t elapsed_ns = ThreadCpuNanos() - t_start_ns - inner_ns;
+
+            if (handle->type == HANDLE_STDOUT)
+            {
+                session->m_stage_times.parse_ns += elapsed_ns;
+            }
+            else
+            {
+                session->m_stage_times.write_ns += elapsed_ns;
+            }
+        }
+    }
+};
+
+
+// Multi-stream encoder farm: many encoding sessions, multiplexed by a small number of epoll event loops.
+// Each event loop runs in its own thread, pinned to a CPU core, and owns a subset of the sessions (sessions are assigned round robin).
+// The number of threads scales with the number of cores, and not with the number of streams.
+class CEncoderFarm
+{
+private:
+    std::vector<CEncoderSession*> m_sessions;
+    int m_n_loops = 1;
+
+    CEncoderFarm()
+    {
+    }
+
+    // Event loop thread: handle all the PIPEs of the sessions owned by loop <loop_idx>, until all the sessions are done.
+    static void LoopThread(CEncoderFarm *farm, const int loop_idx, std::atomic<bool> *is_failed)
+    {
+        // https://man7.org/linux/man-pages/man7/epoll.7.html
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+        if (epfd == (-1))
+        {
+            fprintf(stderr, "Error: epoll_create1 failed, errno = %d.\n", errno);
+            is_failed->store(true);
+            return;
+        }
+
+        std::vector<CEncoderSession*> sessions;
+
+        for (size_t k = loop_idx; k < farm->m_sessions.size(); k += farm->m_n_loops)
+        {
+            if (farm->m_sessions[k]->registerInEpoll(epfd))
+            {
+                sessions.push_back(farm->m_sessions[k]);
+            }
+            else
+            {
+                is_failed->store(true);
+            }
+        }
+
+        const int scratch_size = 65536;
+        unsigned char *scratch = new unsigned char[scratch_size];
+        const int max_events = 64;
+        struct epoll_event events[max_events];
+
+        while (true)
+        {
+            bool is_all_done = true;
+
+            for (size_t k = 0; k < sessions.size(); k++)
+            {
+                is_all_done = is_all_done && sessions[k]->isDone();
+            }
+
+            if (is_all_done)
+            {
+                break;
+            }
+
+            int n_events = epoll_wait(epfd, events, max_events, -1);
+
+            if (n_events == (-1))
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "Error: epoll_wait failed, errno = %d.\n", errno);
+                is_failed->store(true);
+                break;
+            }
+
+            for (int k = 0; k < n_events; k++)
+            {
+                CEncoderSession::HandleEvent(events[k].data.ptr, scratch, scratch_size);
+            }
+        }
+
+        delete[] scratch;
+        close(epfd);
+    }
+
+public:
+    // Create encoder farm with <n_loops> event loops (n_loops = 0 uses one loop per CPU core).
+    static CEncoderFarm *Create(int n_loops)
+    {
+        CEncoderFarm *farm = new CEncoderFarm();
+
+        if (n_loops <= 0)
+        {
+            n_loops = std::max(1, (int)std::thread::hardware_concurrency());
+        }
+
+        farm->m_n_loops = n_loops;
+
+        return farm;
+    }
+
+    // Delete all the sessions (wait for the FFmpeg child processes to end), and delete the farm.
+    static bool DeleteObj(CEncoderFarm *farm)
+    {
+        bool success = true;
+
+        for (size_t k = 0; k < farm->m_sessions.size(); k++)
+        {
+            success = CEncoderSession::DeleteObj(farm->m_sessions[k]) && success;
+        }
+
+        delete farm;
+
+        return success;
+    }
+
+    // Add session to the farm (the farm is the owner of the session).
+    void addSession(CEncoderSession *session)
+    {
+        m_sessions.push_back(session);
+    }
+
+    // Add the counters and CPU times of all the sessions to <stats> (after run).
+    void addStatistics(CPipelineStats *stats) const
+    {
+        for (size_t k = 0; k < m_sessions.size(); k++)
+        {
+            m_sessions[k]->addStatistics(stats);
+        }
+    }
+
+    // Run all the sessions until done.
+    // Return true if all the sessions completed successfully.
+    bool run()
+    {
+        // A child process that ends unexpectedly must not kill the whole farm (write to broken PIPE returns EPIPE instead).
+        signal(SIGPIPE, SIG_IGN);
+
+        const int n_loops = std::min(m_n_loops, std::max(1, (int)m_sessions.size()));
+        const int n_cores = std::max(1, (int)std::thread::hardware_concurrency());
+        std::atomic<bool> is_failed(false);
+        int save_n_loops = m_n_loops;
+        m_n_loops = n_loops;
+
+        std::vector<std::thread> threads;
+
+        for (int k = 0; k < n_loops; k++)
+        {
+            threads.push_back(std::thread(LoopThread, this, k, &is_failed));
+
+            // Pin the event loop thread to a core (https://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html).
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(k % n_cores, &cpuset);
+
+            if (pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), &cpuset) != 0)
+            {
+                fprintf(stderr, "Warning: pthread_setaffinity_np failed (event loop %d is not pinned).\n", k);
+            }
+        }
+
+        for (size_t k = 0; k < threads.size(); k++)
+        {
+            threads[k].join();
+        }
+
+        m_n_loops = save_n_loops;
+
+        bool success = !is_failed.load();
+
+        for (size_t k = 0; k < m_sessions.size(); k++)
+        {
+            fprintf(stderr, "Session %d: startup %.1f ms (%s)\n", m_sessions[k]->id(), m_sessions[k]->startupMs(),
+                    m_sessions[k]->isWarmWorker() ? "pre-spawned FFmpeg worker" : "FFmpeg executed by the session");
+
+            if (m_sessions[k]->droppedCount() > 0)
+            {
+                fprintf(stderr, "Session %d dropped %d raw frames\n", m_sessions[k]->id(), m_sessions[k]->droppedCount());
+            }
+
+            if (m_sessions[k]->respawnCount() > 0)
+            {
+                fprintf(stderr, "Session %d: FFmpeg respawned %d times - gap of %d frames\n", m_sessions[k]->id(), m_sessions[k]->respawnCount(), m_sessions[k]->gapFrames());
+            }
+
+            if (m_sessions[k]->isFailed())
+            {
+                fprintf(stderr, "Session %d failed\n", m_sessions[k]->id());
+                success = false;
+            }
+
+            success = m_sessions[k]->finishVerification() && success;
+        }
+
+        return success;
+    }
+};
+
+
+// Create the metrics exporter of the sessions on http://METRICS_IP:METRICS_PORT/metrics (nullptr without DO_EXPORT_METRICS).
+static CMetricsExporter *CreateMetricsExporter()
+{
+#ifdef DO_EXPORT_METRICS
+    // Scrape while the streams are encoded: curl http://127.0.0.1:9464/metrics
+    CMetricsExporter *metrics_exporter = CMetricsExporter::Create(METRICS_IP, METRICS_PORT);
+
+    if (metrics_exporter == nullptr)
+    {
+        ErrorExit("CMetricsExporter::Create failed");
+    }
+
+    return metrics_exporter;
+#else
+    return nullptr;
+#endif
+}
+
+
+// Encode <n_frames> synthetic frames by the reference FFmpeg process (<ffmpeg_test_arg> writes the Annex B stream to out.264, or the FLV recording to out.flv).
+static void EncodeReferenceFile(const std::string &ffmpeg_test_arg, const int width, const int height, const int n_frames)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+
+    CSubprocess *ffmpeg_test_process = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_test_arg, true, false, 1048576);
+
+    if (ffmpeg_test_process == nullptr)
+    {
+        ErrorExit("CreateProcess ffmpeg_test_process");
+    }
+
+    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
+    unsigned char *bgr_sketch = NewBgrSketchBuffer(width, height);
+
+    for (int i = 0; i < n_frames; i++)
+    {
+        MakeRawFrame(width, height, i, bgr_sketch, raw_img_bytes);
+
+        if (!ffmpeg_test_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes))
+        {
+            ErrorExit("Unsuccessful ffmpeg_test_process write to PIPE");
+        }
+    }
+
+    delete[] raw_img_bytes;
+    delete[] bgr_sketch;
+    ffmpeg_test_process->stdinClose();
+    CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process);
+}
+
+
+// Test the multi-stream encoder farm: encode the same synthetic video in <n_streams> concurrent FFmpeg processes.
+// The reference (out.264) is encoded first by <ffmpeg_test_arg> FFmpeg process, and each stream is written to out_avcc_<k>.264.
+// All the output files should be the same as out.264 (unless a live source drops frames).
+// With DO_VERIFY_ACCESS_UNITS, the reference is encoded only if out.264 doesn't exist, and each stream is verified in process.
+// <live_fps>, <queue_depth>, <policy> - see CEncoderSession::Create.
+static inline int MultiStreamFarmTest(const int n_streams, const int n_loops, const int width, const int height, const int n_frames,
+                                      const std::string ffmpeg_arg, const std::string ffmpeg_test_arg,
+                                      const int live_fps = 0, const int queue_depth = 2, const EQueuePolicy policy = QUEUE_BLOCK)
+{
+#ifdef DO_VERIFY_ACCESS_UNITS
+    const bool is_reference_needed = (access("out.264", R_OK) != 0);
+#else
+    const bool is_reference_needed = true;
+#endif
+
+#ifdef DO_USE_FFMPEG_WORKER_POOL
+    // The parameters of the streams are known in advance - the workers are spawned before encoding the reference (they are warm when leased).
+    // The sessions read-ahead size (64) and PIPE size (1MB) must match CEncoderSession::Create defaults.
+    CFfmpegWorkerPool *worker_pool = CFfmpegWorkerPool::Create("./ffmpeg", "ffmpeg", ffmpeg_arg, n_streams, 1048576, 64);
+
+    if (worker_pool == nullptr)
+    {
+        ErrorExit("CFfmpegWorkerPool::Create failed");
+    }
+#else
+    CFfmpegWorkerPool *worker_pool = nullptr;
+#endif
+
+    if (is_reference_needed)
+    {
+        EncodeReferenceFile(ffmpeg_test_arg, width, height, n_frames);
+    }
+
+    CMetricsExporter *metrics_exporter = CreateMetricsExporter();
+    CEncoderFarm *farm = CEncoderFarm::Create(n_loops);
+
+    for (int k = 0; k < n_streams; k++)
+    {
+        CEncoderSession *session = CEncoderSession::Create(k, ffmpeg_arg, width, height, n_frames, "out_avcc_" + std::to_string(k) + ".264",
+                                                           live_fps, queue_depth, policy, 1048576, worker_pool, metrics_exporter);
+
+        if (session == nullptr)
+        {
+            CEncoderFarm::DeleteObj(farm);
+            ErrorExit("CEncoderSession::Create failed");
+        }
+
+#ifdef DO_VERIFY_ACCESS_UNITS
+        // Hash every access unit (the reference is split and hashed once per stream).
+        session->attachVerifier(CAccessUnitVerifier::Create("out.264", 1));
+#endif
+
+        farm->addSession(session);
+    }
+
+    bool success = farm->run();
+
+    CEncoderFarm::DeleteObj(farm);
+
+    if (worker_pool != nullptr)
+    {
+        worker_pool->printStatistics();
+        CFfmpegWorkerPool::DeleteObj(worker_pool);
+    }
+
+    // The exit codes of the FFmpeg processes of the sessions (of the respawned processes with crash recovery).
+    if (metrics_exporter != nullptr)
+    {
+        metrics_exporter->printStatistics();
+        CMetricsExporter::DeleteObj(metrics_exporter);
+    }
+
+    fprintf(stderr, "Multi-stream farm: %d streams %s\n", n_streams, success ? "completed" : "failed");
+
+    return success ? 0 : 1;
+}
+
+
+// Test crash recovery of the farm sessions: FFmpeg of session k is killed (SIGKILL) after the access unit of frame 10 + 25 * k.
+// Each session respawns FFmpeg (a pre-spawned worker when the pool has one), replays the frames that have no access unit, and continues writing out_recovered_<k>.264.
+// The output is not compared to out.264 (the new process starts with an IDR frame) - every frame must be either output or counted in the gap.
+static inline int CrashRecoveryTest(const int n_streams, const int n_loops, const int width, const int height, const int n_frames, const int fps,
+                                    const std::string ffmpeg_arg)
+{
+#ifdef DO_USE_FFMPEG_WORKER_POOL
+    // The pool replaces each leased worker - the respawned sessions lease warm workers.
+    CFfmpegWorkerPool *worker_pool = CFfmpegWorkerPool::Create("./ffmpeg", "ffmpeg", ffmpeg_arg, n_streams, 1048576, 64);
+
+    if (worker_pool == nullptr)
+    {
+        ErrorExit("CFfmpegWorkerPool::Create failed");
+    }
+#else
+    CFfmpegWorkerPool *worker_pool = nullptr;
+#endif
+
+    CMetricsExporter *metrics_exporter = CreateMetricsExporter();
+    CEncoderFarm *farm = CEncoderFarm::Create(n_loops);
+    std::vector<CEncoderSession*> sessions;
+
+    for (int k = 0; k < n_streams; k++)
+    {
+        CEncoderSession *session = CEncoderSession::Create(k, ffmpeg_arg, width, height, n_frames, "out_recovered_" + std::to_string(k) + ".264",
+                                                           0, 2, QUEUE_BLOCK, 1048576, worker_pool, metrics_exporter);
+
+        // 64 frames are more than the latency of the default x264 settings (rc-lookahead of 40 frames, and the B frames).
+        if ((session == nullptr) || (!session->enableRecovery(2, fps, 64)))
+        {
+            if (session != nullptr)
+            {
+                CEncoderSession::DeleteObj(session);
+            }
+
+            CEncoderFarm::DeleteObj(farm);
+            ErrorExit("CEncoderSession::Create failed");
+        }
+
+        session->injectCrash(10 + 25 * k);
+        farm->addSession(session);
+        sessions.push_back(session);
+    }
+
+    bool success = farm->run();
+
+    // The sessions are deleted with the farm.
+    for (CEncoderSession *session : sessions)
+    {
+        const int n_access_units = session->accessUnitsCount();
+
+        fprintf(stderr, "Session %d: %d respawns, %d access units, gap of %d frames\n", session->id(), session->respawnCount(), n_access_units, session->gapFrames());
+
+        if ((session->respawnCount() != 1) || (n_access_units + session->gapFrames() != n_frames))
+        {
+            fprintf(stderr, "Session %d: %d of %d frames are not accounted for\n", session->id(), n_frames - n_access_units - session->gapFrames(), n_frames);
+            success = false;
+        }
+    }
+
+    CEncoderFarm::DeleteObj(farm);
+
+    if (worker_pool != nullptr)
+    {
+        worker_pool->printStatistics();
+        CFfmpegWorkerPool::DeleteObj(worker_pool);
+    }
+
+    // The exit codes of the FFmpeg processes of the sessions (of the respawned processes with crash recovery).
+    if (metrics_exporter != nullptr)
+    {
+        metrics_exporter->printStatistics();
+        CMetricsExporter::DeleteObj(metrics_exporter);
+    }
+
+    fprintf(stderr, "Crash recovery: %d streams %s\n", n_streams, success ? "completed" : "failed");
+
+    return success ? 0 : 1;
+}
+
+
+// Test the file mode: the synthetic video is recorded once by FFmpeg to out.flv (the same FLV arguments, but to a file instead of stdout PIPE),
+// and <n_files> mapped copies of the recording are converted in parallel to out_flv_<k>.264 (see ConvertFlvFiles).
+// The reference (out.264) is encoded first by <ffmpeg_test_arg> FFmpeg process (with DO_VERIFY_ACCESS_UNITS, only if out.264 doesn't exist).
+// All the output files are compared to out.264.
+static inline int ConvertFlvFilesTest(const int n_files, const int n_threads, const int width, const int height, const int n_frames,
+                                      const std::string ffmpeg_arg, const std::string ffmpeg_test_arg)
+{
+#ifdef DO_VERIFY_ACCESS_UNITS
+    const bool is_reference_needed = (access("out.264", R_OK) != 0);
+#else
+    const bool is_reference_needed = true;
+#endif
+
+    if (is_reference_needed)
+    {
+        EncodeReferenceFile(ffmpeg_test_arg, width, height, n_frames);
+    }
+
+    // Replace the output PIPE (the last argument) by out.flv.
+    EncodeReferenceFile("-y " + ffmpeg_arg.substr(0, ffmpeg_arg.rfind("pipe:")) + "out.flv", width, height, n_frames);
+
+    std::vector<std::string> in_file_names;
+    std::vector<std::string> out_file_names;
+
+    for (int k = 0; k < n_files; k++)
+    {
+        in_file_names.push_back("out.flv");
+        out_file_names.push_back("out_flv_" + std::to_string(k) + ".264");
+    }
+
+    bool success = ConvertFlvFiles(in_file_names, out_file_names, n_threads);
+
+    CMappedFile *reference = CMappedFile::Create("out.264");
+    int n_mismatches = 0;
+
+    for (int k = 0; (k < n_files) && (reference != nullptr); k++)
+    {
+        CMappedFile *out_file = CMappedFile::Create(out_file_names[k]);
+
+        if ((out_file == nullptr) || (out_file->size() != reference->size()) || (memcmp(out_file->data(), reference->data(), reference->size()) != 0))
+        {
+            fprintf(stderr, "%s doesn't match out.264\n", out_file_names[k].c_str());
+            n_mismatches++;
+        }
+
+        if (out_file != nullptr)
+        {
+            CMappedFile::DeleteObj(out_file);
+        }
+    }
+
+    success = success && (reference != nullptr) && (n_mismatches == 0);
+
+    if (reference != nullptr)
+    {
+        CMappedFile::DeleteObj(reference);
+    }
+
+    fprintf(stderr, "FLV files conversion: %d files %s\n", n_files, success ? "match out.264" : "failed");
+
+    return success ? 0 : 1;
+}
+
+
+// xorshift64 pseudo random numbers (https://www.jstatsoft.org/article/view/v008i14) - the mutations of the fuzzing harness are reproducible.
+// <state> must not be 0.
+static inline uint64_t NextRandom(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+
+// Listener of the parser benchmark and of the fuzzing harness: counts the NAL units and the Annex B bytes of the access units (nothing is written).
+// The counters of the CFlvMemoryParser passes are kept in the same object.
+// With <is_checked>, the Annex B payload must be inside the pooled buffer, and every NAL unit view must be inside the Annex B payload.
+// The first and last bytes of each view are read, so a view that points outside the buffer is caught by AddressSanitizer as well.
+class CParserBenchListener : public CFlvParserListener
+{
+public:
+    bool is_checked         = false;
+    int64_t n_nals          = 0;
+    int64_t n_annexb_bytes  = 0;
+    int n_bound_violations  = 0;
+    unsigned int checksum   = 0;
+
+    bool onAccessUnit(CAccessUnit *au) override
+    {
+        n_nals += au->nal_list.n_nals;
+        n_annexb_bytes += au->annexb_payload_len;
+
+        if (is_checked)
+        {
+            if ((au->annexb_payload_offset < 0) || (au->annexb_payload_len < 0) ||
+                (au->annexb_payload_offset + au->annexb_payload_len > au->buffer->capacity))
+            {
+                n_bound_violations++;
+            }
+            else
+            {
+                checkViews(&au->nal_list, &au->buffer->data[au->annexb_payload_offset], au->annexb_payload_len);
+            }
+        }
+
+        au->buffer->release();
+
+        return true;
+    }
+
+    // Count the views of <nal_list> that are not inside the <len> bytes of <annexb> (or that don't follow their start codes).
+    void checkViews(const CNalList *nal_list, const unsigned char *annexb, const int len)
+    {
+        for (int k = 0; k < nal_list->n_nals; k++)
+        {
+            const CNalView *v = &nal_list->nals[k];
+
+            if ((v->start_code < annexb) || (v->nal_len < 1) || (v->start_code + v->start_code_len != v->nal) ||
+                (v->nal + v->nal_len > annexb + len))
+            {
+                n_bound_violations++;
+                continue;
+            }
+
+            checksum += v->start_code[0] + v->nal[0] + v->nal[v->nal_len - 1];
+        }
+    }
+};
+
+
+// Parse the FLV stream <data> by the push parser of the farm (CFlvParser), in reads of <chunk_size> bytes (like the stdout PIPE reads of CEncoderSession):
+// the rest of the current payload is copied directly to the payload buffer of the parser, and the bytes that follow are fed to the parser.
+// <rng> - Optional: random read sizes of 1 to <chunk_size> bytes (the fuzzing harness) - nullptr for reads of <chunk_size> bytes.
+// Return true if the stream is valid (complete FLV tags, and the trailing "previous packet size").
+static bool ParseFlvBytesInPlace(const unsigned char *data, const size_t size, const int chunk_size, CBufferPool *pool, CParserBenchListener *listener,
+                                 uint64_t *rng = nullptr)
+{
+    CFlvParser<CVideoCodec> parser(pool, listener, g_encoder_profile->start_codes);
+    size_t pos = 0;
+
+    while ((pos < size) && (!parser.isFailed()))
+    {
+        const size_t read_size = (rng != nullptr) ? (size_t)(1 + NextRandom(rng) % (uint64_t)chunk_size) : (size_t)chunk_size;
+        const int n = (int)std::min(read_size, size - pos);
+        int payload_remain = 0;
+        unsigned char *payload_ptr = parser.directWritePtr(&payload_remain);
+        const int n_payload = std::min(n, payload_remain);
+
+        if (n_payload > 0)
+        {
+            memcpy(payload_ptr, &data[pos], (size_t)n_payload);
+        }
+
+        if ((!parser.commitDirectWrite(n_payload)) || (!parser.feed(&data[pos + n_payload], n - n_payload)))
+        {
+            break;
+        }
+
+        pos += n;
+    }
+
+    return (pos == size) && parser.isAtValidEnd();
+}
+
+
+// Parse the FLV stream <data> by the zero copy parser of the file mode (CFlvMemoryParser).
+// <annexb_buf> - Optional: each access unit is copied to <annexb_buf> of <annexb_buf_size> bytes (the conversion of ReadFlvPayloadAndConvertToAnnexB),
+//                or nullptr for only making the views.
+// Return true if the stream is valid.
+static bool ParseFlvBytesToViews(const unsigned char *data, const size_t size, unsigned char *annexb_buf, const int annexb_buf_size, CParserBenchListener *listener)
+{
+    CFlvMemoryParser<CVideoCodec> parser(data, size, g_encoder_profile->start_codes);
+    CAccessUnit au;
+    int res = 0;
+
+    while ((res = parser.nextAccessUnit(&au)) == 1)
+    {
+        if (annexb_buf != nullptr)
+        {
+            if (au.annexb_payload_len > annexb_buf_size)
+            {
+                fprintf(stderr, "Error: Annex B payload size %d exceeds buffer size %d\n", au.annexb_payload_len, annexb_buf_size);
+                return false;
+            }
+
+            CopyNalListToAnnexB(&au.nal_list, annexb_buf);
+
+            if (listener->is_checked)
+            {
+                RebaseNalList(&au.nal_list, annexb_buf);
+                listener->checkViews(&au.nal_list, annexb_buf, au.annexb_payload_len);
+            }
+        }
+
+        listener->n_nals += au.nal_list.n_nals;
+        listener->n_annexb_bytes += au.annexb_payload_len;
+    }
+
+    return res == 0;
+}
+
+
+// Size of the buffers of the parser benchmark for FLV stream of <size> bytes: the largest FLV payload (24 bits size field),
+// the injected SPS and PPS, and the start codes that are longer than the NAL units length fields.
+static inline int ParserBenchBufferSize(const size_t size)
+{
+    return (int)std::min(size, (size_t)0xFFFFFF) + MAX_PARAM_SETS_SIZE + 4 * MAX_NALS_PER_ACCESS_UNIT;
+}
+
+
+enum EParserBenchMode
+{
+    PARSER_BENCH_IN_PLACE,  // CFlvParser: the reads are copied to the payload buffers, converted in place, and the SPS and PPS are injected.
+    PARSER_BENCH_COPY,      // CFlvMemoryParser views copied to a contiguous Annex B buffer (ReadFlvPayloadAndConvertToAnnexB).
+    PARSER_BENCH_VIEWS      // CFlvMemoryParser views only (zero copy).
+};
+
+
+// Parser benchmark thread: parse the FLV stream <data> by <mode> repeatedly, for at least <min_ms> milliseconds.
+// <listener> - Output: the counters (of all the passes), <n_passes> - Output: number of passes, <is_valid> - Output: false if a pass failed.
+static void ParserBenchThread(const EParserBenchMode mode, const unsigned char *data, const size_t size, const int min_ms,
+                              CParserBenchListener *listener, int *n_passes, bool *is_valid)
+{
+    // Each thread has its own pool (CBufferPool::acquire is single threaded).
+    const int buf_size = ParserBenchBufferSize(size);
+    CBufferPool *pool = (mode == PARSER_BENCH_IN_PLACE) ? CBufferPool::Create(buf_size, 4 * (size_t)buf_size) : nullptr;
+    unsigned char *annexb_buf = (mode == PARSER_BENCH_COPY) ? new unsigned char[buf_size] : nullptr;
+    const int64_t t_start_ns = MonotonicNanos();
+
+    *n_passes = 0;
+    *is_valid = (mode != PARSER_BENCH_IN_PLACE) || (pool != nullptr);
+
+    while (*is_valid && (MonotonicNanos() - t_start_ns < (int64_t)min_ms * 1000000))
+    {
+        if (mode == PARSER_BENCH_IN_PLACE)
+        {
+            *is_valid = ParseFlvBytesInPlace(data, size, 65536, pool, listener);
+        }
+        else
+        {
+            *is_valid = ParseFlvBytesToViews(data, size, annexb_buf, buf_size, listener);
+        }
+
+        (*n_passes)++;
+    }
+
+    delete[] annexb_buf;
+
+    if (pool != nullptr)
+    {
+        CBufferPool::DeleteObj(pool);
+    }
+}
+
+
+// Measure parser <mode> with <n_threads> threads (all the threads parse the same read-only stream in memory).
+// The throughput is the FLV bytes of all the threads per second, and the time per NAL unit is the CPU (thread) time: elapsed time * n_threads / NAL units.
+// <annexb_bytes_per_pass> - Output: Annex B bytes of one pass (compared between the modes).
+// Return false if a pass failed.
+static bool MeasureParser(const EParserBenchMode mode, const char *mode_name, const unsigned char *data, const size_t size, const int n_threads, const int min_ms,
+                          int64_t *annexb_bytes_per_pass)
+{
+    std::vector<CParserBenchListener> listeners(n_threads);
+    std::vector<int> n_passes(n_threads, 0);
+    std::unique_ptr<bool[]> is_valid(new bool[n_threads]);
+    std::vector<std::thread> threads;
+
+    const int64_t t_start_ns = MonotonicNanos();
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        threads.push_back(std::thread(ParserBenchThread, mode, data, size, min_ms, &listeners[t], &n_passes[t], &is_valid[t]));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    const int64_t elapsed_ns = MonotonicNanos() - t_start_ns;
+
+    bool success = true;
+    int64_t total_passes = 0;
+    int64_t total_nals = 0;
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        success = success && is_valid[t] && (n_passes[t] > 0);
+        total_passes += n_passes[t];
+        total_nals += listeners[t].n_nals;
+    }
+
+    if (!success)
+    {
+        fprintf(stderr, "Parser benchmark: %s parsing of out.flv failed\n", mode_name);
+        return false;
+    }
+
+    *annexb_bytes_per_pass = listeners[0].n_annexb_bytes / n_passes[0];
+
+    fprintf(stderr, "Parser benchmark: %-8s %3d threads: %7.2f GB/s, %6.1f ns per NAL unit (%lld passes of %zu bytes)\n", mode_name, n_threads,
+            (double)total_passes * (double)size / (double)elapsed_ns, (double)elapsed_ns * n_threads / (double)std::max(total_nals, (int64_t)1),
+            (long long)total_passes, size);
+
+    return true;
+}
+
+
+// Mutate a copy of the FLV stream <data> to <out> (<tag_offsets> - offsets of the FLV packet headers of <data>).
+// Most of the mutations target the fields that the bounds checks depend on: the FLV payload sizes, the AVCC NAL units lengths,
+// the AVC packet headers and the AVC sequence header (length size, parameter sets counts and lengths).
+// The rest are random bytes, bit flips, and a truncated stream.
+static void MutateFlvBytes(const unsigned char *data, const size_t size, const std::vector<size_t> &tag_offsets, uint64_t *rng, std::vector<unsigned char> *out)
+{
+    out->assign(data, data + size);
+
+    // Write <n_bytes> big-endian bytes of <value> at <pos> (if the bytes are inside the stream).
+    auto put = [out](const size_t pos, const uint64_t value, const int n_bytes)
+    {
+        for (int b = 0; (b < n_bytes) && (pos + n_bytes <= out->size()); b++)
+        {
+            (*out)[pos + b] = (unsigned char)(value >> (8 * (n_bytes - 1 - b)));
+        }
+    };
+
+    const int n_mutations = 1 + (int)(NextRandom(rng) % 4);
+
+    for (int k = 0; k < n_mutations; k++)
+    {
+        const size_t tag = tag_offsets[NextRandom(rng) % tag_offsets.size()];
+        const size_t payload = tag + FLV_PACKET_HEADER_SIZE;
+        const uint64_t r = NextRandom(rng);
+
+        // Small values, off by one values and large values of the size fields are the interesting ones.
+        const uint64_t value = ((r & 3) == 0) ? (r >> 8) : ((r & 3) == 1) ? ((r >> 8) & 7) : (uint64_t)(ParseFlvPacketHeader(&data[tag]) + (int)((r >> 8) % 9) - 4);
+
+        switch (NextRandom(rng) % 7)
+        {
+        case 0:
+            put(tag + 5, value, 3);     // FLV payload size.
+            break;
+
+        case 1:
+            put(payload + AVC_PACKET_HEADER_SIZE, value, 4);    // AVCC length of the first NAL unit.
+            break;
+
+        case 2:
+            put(payload + AVC_PACKET_HEADER_SIZE + (size_t)(NextRandom(rng) % 64), value, 2);   // A length inside the NAL units (or inside the sequence header).
+            break;
+
+        case 3:
+            put(payload + (size_t)(NextRandom(rng) % AVC_PACKET_HEADER_SIZE), r >> 8, 1);     // Frame type, codec, packet type or composition time.
+            break;
+
+        case 4:
+            put(tag_offsets[0] + FLV_PACKET_HEADER_SIZE + AVC_PACKET_HEADER_SIZE + 4 + (size_t)(NextRandom(rng) % 6), r >> 8, 1);   // Length size, SPS count and length.
+            break;
+
+        case 5:
+            put((size_t)(NextRandom(rng) % size), r >> 8, 1);
+            break;
+
+        default:
+            put((size_t)(NextRandom(rng) % size), (*out)[r % size] ^ (1 << ((r >> 8) % 8)), 1);
+            break;
+        }
+    }
+
+    if (NextRandom(rng) % 8 == 0)
+    {
+        out->resize((size_t)(NextRandom(rng) % size));
+    }
+}
+
+
+// Fuzzing thread: parse the mutations <first>, <first> + <step> ... (below <n_iterations>) of <data> by CFlvParser and by CFlvMemoryParser.
+// The mutation of iteration k is deterministic (a failure is reproduced by its iteration number).
+// <n_accepted>, <n_rejected>, <n_bound_violations> - Output: counters of the parser runs.
+static void FuzzThread(const unsigned char *data, const size_t size, const std::vector<size_t> *tag_offsets, const int first, const int step, const int n_iterations,
+                       int *n_accepted, int *n_rejected, int *n_bound_violations)
+{
+    // The payload buffers are bounded by the pool (a mutated FLV payload size may be up to 16MB).
+    const int buf_size = ParserBenchBufferSize(size);
+    CBufferPool *pool = CBufferPool::Create(std::max(buf_size, 0xFFFFFF + 65536), 64 * 1048576);
+    unsigned char *annexb_buf = new unsigned char[buf_size];
+    std::vector<unsigned char> input;
+
+    for (int k = first; (k < n_iterations) && (pool != nullptr); k += step)
+    {
+        uint64_t rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(k + 1);
+        MutateFlvBytes(data, size, *tag_offsets, &rng, &input);
+
+        CParserBenchListener listener;
+        listener.is_checked = true;
+
+        const bool is_push_valid = ParseFlvBytesInPlace(input.data(), input.size(), 65536, pool, &listener, &rng);
+        const bool is_memory_valid = ParseFlvBytesToViews(input.data(), input.size(), annexb_buf, buf_size, &listener);
+
+        *n_accepted += (int)is_push_valid + (int)is_memory_valid;
+        *n_rejected += (int)(!is_push_valid) + (int)(!is_memory_valid);
+
+        if (listener.n_bound_violations > 0)
+        {
+            fprintf(stdout, "Fuzz: iteration %d - %d views outside of the buffers\n", k, listener.n_bound_violations);
+            *n_bound_violations += listener.n_bound_violations;
+        }
+    }
+
+    delete[] annexb_buf;
+
+    if (pool != nullptr)
+    {
+        CBufferPool::DeleteObj(pool);
+    }
+}
+
+
+// Test the FLV parsers in isolation: the FLV stream out.flv is parsed from memory (no FFmpeg process, and no PIPE).
+// The stream is recorded by FFmpeg (the FLV arguments of <ffmpeg_arg>) only if out.flv doesn't exist - any captured FLV stream of the encoder may be used.
+// Each parser is measured with one thread and with <n_threads> threads (n_threads = 0 uses one thread per CPU core), for at least <min_ms> milliseconds.
+// Then <n_fuzz_iterations> mutations of the stream are parsed by <n_threads> threads: a mutation may be rejected, but a view outside of the buffers fails the test
+// (with -fsanitize=address, any out of bounds access is reported).
+static inline int ParserBenchmarkTest(int n_threads, const int min_ms, const int n_fuzz_iterations, const int width, const int height, const int n_frames,
+                                      const std::string ffmpeg_arg)
+{
+    if (n_threads <= 0)
+    {
+        n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    if (access("out.flv", R_OK) != 0)
+    {
+        // Replace the output PIPE (the last argument) by out.flv.
+        EncodeReferenceFile("-y " + ffmpeg_arg.substr(0, ffmpeg_arg.rfind("pipe:")) + "out.flv", width, height, n_frames);
+    }
+
+    // The stream is copied from the mapping, so the page faults of the mapping are not measured.
+    CMappedFile *flv_file = CMappedFile::Create("out.flv");
+
+    if (flv_file == nullptr)
+    {
+        ErrorExit("CMappedFile::Create failed");
+    }
+
+    const std::vector<unsigned char> stream(flv_file->data(), flv_file->data() + flv_file->size());
+    CMappedFile::DeleteObj(flv_file);
+
+    const unsigned char *data = stream.data();
+    const size_t size = stream.size();
+
+    const EParserBenchMode modes[3] = { PARSER_BENCH_IN_PLACE, PARSER_BENCH_COPY, PARSER_BENCH_VIEWS };
+    const char *mode_names[3] = { "in-place", "copy", "views" };
+    int64_t annexb_bytes[3] = { 0, 0, 0 };
+    bool success = true;
+
+    for (int m = 0; m < 3; m++)
+    {
+        success = MeasureParser(modes[m], mode_names[m], data, size, 1, min_ms, &annexb_bytes[m]) && success;
+
+        if (n_threads > 1)
+        {
+            success = MeasureParser(modes[m], mode_names[m], data, size, n_threads, min_ms, &annexb_bytes[m]) && success;
+        }
+    }
+
+    if ((annexb_bytes[0] != annexb_bytes[1]) || (annexb_bytes[0] != annexb_bytes[2]))
+    {
+        fprintf(stderr, "Parser benchmark: the parsers don't agree on the Annex B size (%lld, %lld and %lld bytes)\n",
+                (long long)annexb_bytes[0], (long long)annexb_bytes[1], (long long)annexb_bytes[2]);
+        success = false;
+    }
+
+    // Offsets of the FLV packet headers (the targets of the mutations).
+    std::vector<size_t> tag_offsets;
+
+    for (size_t pos = FLV_FILE_HEADER_SIZE; pos + FLV_PACKET_HEADER_SIZE <= size; pos += FLV_PACKET_HEADER_SIZE + (size_t)ParseFlvPacketHeader(&data[pos]))
+    {
+        tag_offsets.push_back(pos);
+    }
+
+    // The parsers report each rejected mutation - stderr is redirected to /dev/null while fuzzing (the fuzzing results are printed to stdout).
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if ((saved_stderr != (-1)) && (null_fd != (-1)))
+    {
+        dup2(null_fd, STDERR_FILENO);
+    }
+
+    std::vector<int> n_accepted(n_threads, 0);
+    std::vector<int> n_rejected(n_threads, 0);
+    std::vector<int> n_bound_violations(n_threads, 0);
+    std::vector<std::thread> threads;
+    const int64_t t_start_ns = MonotonicNanos();
+
+    for (int t = 0; (t < n_threads) && (!tag_offsets.empty()); t++)
+    {
+        threads.push_back(std::thread(FuzzThread, data, size, &tag_offsets, t, n_threads, n_fuzz_iterations, &n_accepted[t], &n_rejected[t], &n_bound_violations[t]));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    const int64_t elapsed_ns = MonotonicNanos() - t_start_ns;
+
+    if ((saved_stderr != (-1)) && (null_fd != (-1)))
+    {
+        dup2(saved_stderr, STDERR_FILENO);
+    }
+
+    if (saved_stderr != (-1))
+    {
+        close(saved_stderr);
+    }
+
+    if (null_fd != (-1))
+    {
+        close(null_fd);
+    }
+
+    int total_accepted = 0;
+    int total_rejected = 0;
+    int total_violations = 0;
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        total_accepted += n_accepted[t];
+        total_rejected += n_rejected[t];
+        total_violations += n_bound_violations[t];
+    }
+
+    fprintf(stderr, "Fuzz: %d mutations of out.flv in %.1f ms: %d parser runs accepted, %d rejected, %d views outside of the buffers\n",
+            n_fuzz_iterations, (double)elapsed_ns / 1e6, total_accepted, total_rejected, total_violations);
+
+    success = success && (!tag_offsets.empty()) && (total_violations == 0);
+
+    fprintf(stderr, "Parser benchmark and fuzzing: %s\n", success ? "passed" : "failed");
+
+    return success ? 0 : 1;
+}
+
+
+// Number of frames of each GOP ("-g" argument of the encoder) - IDR frame every g_gop_size frames (or earlier, at a scene cut).
+#ifdef DO_TEST_ZERO_LATENCY
+static const int g_gop_size = 10;
+#else
+static const int g_gop_size = 25;
+#endif
+
+
+// Build the FFmpeg arguments for encoding synthetic <width>x<height> raw video frames (in g_raw_pixel_format) from stdin PIPE.
+// The encoder and its tuning are of g_encoder_profile.
+// <is_flv_pipe> - true: FLV container to stdout PIPE (the encoder process), false: Annex B stream to out.264 file (the reference "test process").
+// <is_fixed_gop> - true: no scene cut detection - IDR frame every g_gop_size frames exactly (the GOPs of the shards of EncodeShardedStream must be aligned).
+// <crf> - Quality level: constant rate factor of x264, or the QP of the hardware encoders (the levels of the rate control ladder of EncodeAdaptiveStream).
+static std::string FfmpegEncoderArg(const int width, const int height, const int fps, const bool is_flv_pipe, const bool is_fixed_gop = false, const int crf = 10)
+{
+    const CEncoderProfile *profile = g_encoder_profile;
+
+    const std::string input_arg = std::string(profile->device_arg) +
+        "-threads 1 -framerate " + std::to_string(fps) +
+        " -video_size " + std::to_string(width) + "x" + std::to_string(height) +
+        " -pixel_format " + g_raw_pixel_format + " -f rawvideo -an -sn -dn -i pipe: " + profile->filter_arg + "-threads 1 -vcodec " + profile->codec + " ";
+
+    const char *pixel_format = (profile->pixel_format != nullptr) ? profile->pixel_format : g_encoded_pixel_format;
+
+    char quality_arg[64];
+    snprintf(quality_arg, sizeof(quality_arg), profile->quality_arg, crf);
+
+#ifdef DO_TEST_ZERO_LATENCY
+    const char *tuning_arg = profile->low_latency_arg;
+#else
+    // Using the following setting results latency of many frames (the reader thread doesn't need to know how many).
+    const char *tuning_arg = profile->default_arg;
+#endif
+
+    const std::string encoder_arg = std::string(tuning_arg) + "-g " + std::to_string(g_gop_size) + " " +
+                                    ((pixel_format[0] != '\0') ? "-pix_fmt " + std::string(pixel_format) + " " : "") + quality_arg +
+                                    (is_fixed_gop ? profile->fixed_gop_arg : "");
+
+    if (is_flv_pipe)
+    {
+        // FFmpeg subprocess with input PIPE (raw video frames) and output PIPE (H.264 or HEVC encoded stream in FLV container).
+        return "-hide_banner " + input_arg + encoder_arg + "-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -an -sn -dn pipe:";
+    }
+
+    // FFmpeg subprocess with same arguments, but without FLV container, and save output to a file (instead of stdout PIPE) for testing.
+    return "-y -hide_banner " + input_arg + encoder_arg + "-f " + profile->annexb_format + " -an -sn -dn out.264";
+}
+
+
+// Encode <n_frames> synthetic frames with a single FFmpeg process, and write the Annex B stream to <out_file_name>.
+// The writer thread writes the raw frames to stdin PIPE, the reader thread reads the FLV stream from stdout PIPE,
+// and the calling thread is the consumer of the access units (writes the encoded frames to the output file).
+// <ffmpeg_test_arg> - Arguments of the reference FFmpeg process (fed with the same raw frames), or empty string for no reference.
+// <pipe_buf_size> - Size of stdin and stdout PIPEs (the buf_size passed to Popen).
+// <latency_stats> - Latency instrumentation (nullptr if not measured).
+// <verifier> - Compares each access unit to the reference stream (nullptr if not verified) - the caller prints the result.
+// <rtp_sender> - Sends each access unit over UDP (nullptr for no network output).
+// <metadata_queue> - Attaches metadata to each frame, and splices it as SEI to the access unit (nullptr for no metadata).
+// <gop_cache> - Keeps the last GOPs for late subscribers (nullptr for no cache) - closed when the stream ends.
+// <stats> - Output: counters and CPU times of the pipeline stages (nullptr if not measured).
+// Return true in case of success, and false in case of failure (including the failures of the setup - the application is not ended).
+static bool EncodeSingleStream(const std::string &ffmpeg_arg, const std::string &ffmpeg_test_arg,
+                               const int width, const int height, const int n_frames, const int pipe_buf_size,
+                               const std::string &out_file_name, CLatencyStats *latency_stats, CAccessUnitVerifier *verifier,
+                               CRtpSender *rtp_sender, CFrameMetadataQueue *metadata_queue, CGopCache *gop_cache, CMetricsExporter *metrics_exporter,
+                               CPipelineStats *stats)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);	// raw video frame size in bytes (3 bytes per pixel for BGR and yuv444p, 1.5 for yuv420p).
+
+    // Number of encoded frames the reader thread may be ahead of the output (the ring capacity).
+    // The ring slots don't hold the data (the data is in pooled buffers), so the ring is cheap.
+    const int n_ring_slots = 32;
+
+    // Memory bound of the access units buffers (the encoded frames are much smaller than raw frames, so 8MB is more than enough).
+    // The buffers held by the GOP cache are on top of that (the reader is never starved by the cache).
+    const size_t pool_max_total_bytes = 8 * 1048576 + ((gop_cache != nullptr) ? gop_cache->maxBytes() : 0);
+
+    // Sketch buffer for the first FLV payload (AVC sequence header is just few bytes).
+    const int flv_bytes_size = 65536;
+
+    bool success;
+
+    FILE *out_f = nullptr;
+    CSubprocess *ffmpeg_process = nullptr;
+    CSubprocess *ffmpeg_test_process = nullptr;
+    CBufferPool *raw_frame_pool = nullptr;
+
+    unsigned char *flv_bytes = new unsigned char[flv_bytes_size];
+
+    // Raw video frame buffer of the writer thread.
+    unsigned char *raw_img_buf = new unsigned char[raw_image_size_in_bytes];
+
+    CSpscRing<CAccessUnit> au_ring(n_ring_slots);
+
+    // Encoded frame is never larger than the raw frame (raw_image_size_in_bytes is the largest buffer).
+    CBufferPool *pool = CBufferPool::Create(raw_image_size_in_bytes, pool_max_total_bytes);
+
+    // Release what was created before the threads are started, and return false - a failed stream doesn't end the application
+    // (RunBenchmark records the configuration as failed, and continues with the next one).
+    auto fail_setup = [&](const std::string &error_message) -> bool
+    {
+        fprintf(stderr, "%s\n", error_message.c_str());
+
+        if (out_f != nullptr)
+        {
+            fclose(out_f);
+        }
+
+        // Nothing was written to the FFmpeg processes - closing the PIPEs ends them (the results are not checked).
+        CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process);
+        CSubprocess::ClosePipeAndDeleteObj(ffmpeg_process);
+
+        if (raw_frame_pool != nullptr)
+        {
+            CBufferPool::DeleteObj(raw_frame_pool);
+        }
+
+        if (pool != nullptr)
+        {
+            CBufferPool::DeleteObj(pool);
+        }
+
+        delete[] flv_bytes;
+        delete[] raw_img_buf;
+
+        return false;
+    };
+
+    if (pool == nullptr)
+    {
+        return fail_setup("CBufferPool::Create failed");
+    }
+
+    // Create subprocess with stdin PIPE and stdout PIPE (first argument may be full path like "/usr/bin/ffmpeg", the second is the process name).
+    // FFmpeg Static Builds for Linux: https://johnvansickle.com/ffmpeg/
+    // The default PIPE buffer size is 1MB (1MB is the [default] maximum buffer size of unprivileged process in Ubuntu 18.04 64 bit)
+    ffmpeg_process = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_arg, true, true, pipe_buf_size);
+
+    if (ffmpeg_process == nullptr)
+    {
+        return fail_setup("CreateProcess ffmpeg_process");
+    }
+
+    // The metrics of the session are labeled by the output name (the exporter keeps them after the session ends).
+    if (metrics_exporter != nullptr)
+    {
+        ffmpeg_process->attachMetrics(metrics_exporter->addSession(out_file_name));
+    }
+
+    // Create subprocess with stdin PIPE (used for testing).
+    // Warning: output file name containing spaces in not supported by current implementation.
+    if (!ffmpeg_test_arg.empty())
+    {
+        ffmpeg_test_process = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_test_arg, true, false, pipe_buf_size);
+
+        if (ffmpeg_test_process == nullptr)
+        {
+            return fail_setup("CreateProcess ffmpeg_test_process");
+        }
+    }
+
+#ifdef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE
+    // Page aligned raw frame buffers for vmsplice.
+    // The number of frames referenced by stdin PIPE depends on the PIPE capacity (1MB is less than a frame, so 2 or 3 buffers are used).
+    const int max_frames_in_pipe = ffmpeg_process->stdinPipeSize() / raw_image_size_in_bytes + 3;
+    raw_frame_pool = CBufferPool::Create(raw_image_size_in_bytes, (size_t)max_frames_in_pipe * (raw_image_size_in_bytes + 65536), true);
+
+    if (raw_frame_pool == nullptr)
+    {
+        return fail_setup("CBufferPool::Create raw_frame_pool failed");
+    }
+#endif
+
+    // Open output file (Annex B stream format)
+    // out_avcc.264 file is used for testing - used for comparing the FLV converted output to out.264 (output of ffmpeg_test_process).
+    out_f = fopen(out_file_name.c_str(), "wb");
+
+    if (out_f == nullptr)
+    {
+        return fail_setup("Error: failed to open file " + out_file_name + " for writing");
+    }
+
+    std::atomic<bool> was_broken_by_error(false);
+    std::atomic<bool> is_reader_done(false);
+
+    CStageCpuTimes *stage_times = (stats != nullptr) ? &stats->cpu : nullptr;
+
+    // One thread writes raw video frames to stdin PIPE, and one thread reads the FLV encoded stream from stdout PIPE.
+    // The writer is never blocked by the reader (and the reader is never blocked by the writer),
+    // so there is no need to guess the latency of the encoder (wrong guess results a deadlock or an extra latency).
+    std::thread writer_thread(WriterThread, ffmpeg_process, ffmpeg_test_process, raw_img_buf, raw_frame_pool, width, height, n_frames, latency_stats, stage_times, metadata_queue, &was_broken_by_error);
+    std::thread reader_thread(ReaderThread, ffmpeg_process, &au_ring, pool, flv_bytes, flv_bytes_size, n_frames, latency_stats, stage_times, &was_broken_by_error, &is_reader_done);
+
+    // The calling thread is the consumer of the access units ring (write the encoded frames to the output file).
+    int n_waits = 0;
+    int64_t n_access_units = 0;
+
+    while (true)
+    {
+        CAccessUnit *au = au_ring.frontForRead();
+
+        if (au == nullptr)
+        {
+            if (is_reader_done.load(std::memory_order_acquire))
+            {
+                // The reader is done - the last access unit may be pushed right before marking "done".
+                au = au_ring.frontForRead();
+
+                if (au == nullptr)
+                {
+                    break;
                 }
             }
+            else
+            {
+                WaitForRing(n_waits);
+                continue;
+            }
+        }
+
+        n_waits = 0;
+
+        const int64_t t_output_ns = (stage_times != nullptr) ? ThreadCpuNanos() : 0;
+
+        // The encoded stream is verified before the metadata is spliced (the reference has no metadata).
+        if (verifier != nullptr)
+        {
+#ifdef DO_WRITE_NAL_UNITS_WITH_WRITEV
+            verifier->verify(au, true);
+#else
+            verifier->verify(au, false);
+#endif
+        }
+
+        // Cache the access unit for late subscribers (before the metadata is spliced - the SEI view doesn't point the pooled buffer).
+        if (gop_cache != nullptr)
+        {
+            gop_cache->push(au);
+        }
+
+        if ((metadata_queue != nullptr) && !metadata_queue->splice(au))
+        {
+            fprintf(stderr, "Frame metadata splice failed\n");
+            was_broken_by_error.store(true);
+        }
+
+        // Write encoded frame to output file.
+        // Note: "encoded frame" may contain few NAL units, but each FLV payload applies one "encoded frame" (one "access unit").
+        // The spliced SEI is a separate view (au->buffer doesn't hold a contiguous access unit), so the views are written by writev.
+#ifdef DO_WRITE_NAL_UNITS_WITH_WRITEV
+        const bool is_nal_list_output = true;
+#else
+        const bool is_nal_list_output = (metadata_queue != nullptr);
+#endif
+
+        if (is_nal_list_output)
+        {
+            success = WriteNalList(fileno(out_f), &au->nal_list);  // Write to file for testing (out_f is not used by fwrite in this mode).
+
+            if (!success)
+            {
+                fprintf(stderr, "WriteNalList failed\n");
+                was_broken_by_error.store(true);
+            }
+        }
+        else
+        {
+            fwrite(&au->buffer->data[au->annexb_payload_offset], 1, au->annexb_payload_len, out_f);  // Write to file for testing.
+        }
 
-            if (is_stdout_pipe)
+        if (rtp_sender != nullptr)
+        {
+            // The packets point the NAL units in au->buffer - sendAccessUnit returns after sending all the packets (before the buffer is released).
+            if (!rtp_sender->sendAccessUnit(au))
             {
-				//Duplicate the file descriptor of the pipe.
-                child_sts = dup2(sp->m_inpipefd[1], STDOUT_FILENO);
-                if (child_sts == (-1))
-                {
-                    fprintf(stderr, "Error: dup2 STDOUT_FILENO failed, errno = %d.\n", errno); exit(-1);
-                }
+                fprintf(stderr, "sendAccessUnit failed\n");
+                was_broken_by_error.store(true);
+            }
+        }
 
-                //Close unused ends of pipe (Rotem).
-                child_sts = close(sp->m_inpipefd[0]);
-                if (child_sts == (-1))
-                {
-                    fprintf(stderr, "Error: close(sp->m_inpipefd[0]) failed in child process, errno = %d.\n", errno);
-                }
+        // The buffer returns to the pool (a network sender that keeps the buffer calls addRef before, and release when done).
+        au->buffer->release();
+        au->buffer = nullptr;
 
-                if (buf_size > 0)
+        au_ring.pop();
+        n_access_units++;
+
+        if (stage_times != nullptr)
+        {
+            stage_times->output_ns += ThreadCpuNanos() - t_output_ns;
+        }
+    }
+
+    writer_thread.join();
+    reader_thread.join();
+
+    if (gop_cache != nullptr)
+    {
+        gop_cache->close();
+    }
+
+    bool is_ok = !was_broken_by_error.load();
+
+    if (ffmpeg_test_process != nullptr)
+    {
+        // Close the "test process" (close the FFmpeg process that writes to out.264 file - used as reference).
+        //////////////////////////////////////////////////////////////////////////
+        success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process);
+
+        if (!success)
+        {
+            fprintf(stderr, "Error: the reference FFmpeg process failed\n");
+            is_ok = false;
+        }
+        //////////////////////////////////////////////////////////////////////////
+    }
+
+    if (out_f != nullptr)
+    {
+        fclose(out_f);	// Close out_avcc.264 file. 
+    }
+
+    delete[] flv_bytes;
+    delete[] raw_img_buf;
+
+    if (stats == nullptr)
+    {
+        pool->printStatistics();    // Not printed for each benchmark run.
+    }
+
+    CBufferPool::DeleteObj(pool);
+
+    if (stats != nullptr)
+    {
+        // The threads are joined, so the counters are not modified any more.
+        stats->stdin_counters.add(ffmpeg_process->stdinCounters());
+        stats->stdout_counters.add(ffmpeg_process->stdoutCounters());
+        stats->n_access_units += n_access_units;
+    }
+
+	//Wait for FFmpeg child process to end, and delete ffmpeg_process object (cleanup).
+    success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_process);
+    
+    if (!success)
+    {
+        fprintf(stderr, "Error: the FFmpeg process failed\n");
+        is_ok = false;
+    }
+
+    if (raw_frame_pool != nullptr)
+    {
+        // Delete the raw frames after FFmpeg ends (with vmsplice, the stdin PIPE may reference the pages until FFmpeg reads them).
+        CBufferPool::DeleteObj(raw_frame_pool);
+    }
+
+    return is_ok;
+}
+
+
+// Return true if the access unit of <nal_list> is an IDR frame (has a coded slice of IDR picture - or of IRAP picture with CHevcCodec).
+static inline bool IsIdrAccessUnit(const CNalList *nal_list)
+{
+    for (int k = 0; k < nal_list->n_nals; k++)
+    {
+        if (CVideoCodec::IsIrap(CVideoCodec::NalType(nal_list->nals[k].nal)))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Timeline of one feed encoded in pieces by several FFmpeg processes (GOPs of EncodeShardedStream, segments of EncodeAdaptiveStream).
+// The timestamps of each process are of its own frames only - the access units of each piece are rebased to the timestamps of the feed
+// (the IDR frame that starts the piece is presented at the time of its feed frame), and the merged stream is checked:
+// each piece starts with an IDR frame, the pts of all the frames appear exactly once, and dts increases.
+class CFeedTimeline
+{
+private:
+    int m_fps = 0;
+    std::vector<bool> m_is_frame_seen;
+    int m_last_dts_ms = INT32_MIN;
+    int m_pts_delta_ms = 0;         // Added to the timestamps of the current piece.
+    int m_n_errors = 0;
+
+public:
+    CFeedTimeline(const int n_frames, const int fps) : m_fps(fps), m_is_frame_seen(n_frames, false)
+    {
+    }
+
+    // Index of the feed frame presented at <pts_ms>.
+    int frameOfPts(const int pts_ms) const
+    {
+        return (int)(((int64_t)pts_ms * m_fps + 500) / 1000);
+    }
+
+    // Begin a piece of the feed: <au> is the first access unit of the piece (in decoding order), and <feed_frame> is the first frame of the piece.
+    void beginPiece(const CAccessUnit *au, const int feed_frame)
+    {
+        m_pts_delta_ms = (int)(((int64_t)feed_frame * 1000 + m_fps / 2) / m_fps) - au->pts_ms;
+
+        if (!IsIdrAccessUnit(&au->nal_list))
+        {
+            fprintf(stderr, "Feed timeline: the piece of frame %d doesn't start with an IDR frame (is the GOP fixed?)\n", feed_frame);
+            m_n_errors++;
+        }
+    }
+
+    // Rebase the timestamps of <au> (an access unit of the current piece), and check that it's a new frame of the feed frames [first_frame, end_frame).
+    void rebase(CAccessUnit *au, const int first_frame, const int end_frame)
+    {
+        au->pts_ms += m_pts_delta_ms;
+        au->dts_ms += m_pts_delta_ms;
+
+        const int feed_frame = frameOfPts(au->pts_ms);
+
+        if ((feed_frame < first_frame) || (feed_frame >= end_frame) || (feed_frame >= (int)m_is_frame_seen.size()) || m_is_frame_seen[feed_frame] ||
+            (au->dts_ms <= m_last_dts_ms))
+        {
+            fprintf(stderr, "Feed timeline: unexpected access unit of pts %d ms (dts %d ms) in frames [%d, %d)\n", au->pts_ms, au->dts_ms, first_frame, end_frame);
+            m_n_errors++;
+        }
+        else
+        {
+            m_is_frame_seen[feed_frame] = true;
+        }
+
+        m_last_dts_ms = au->dts_ms;
+    }
+
+    int errorsCount() const { return m_n_errors; }
+};
+
+
+// Writer thread of one shard (see EncodeShardedStream): write the raw frames of GOPs <shard>, <shard> + <n_shards>, ... to stdin PIPE of the shard.
+// Each shard has its own writer, so a shard that encodes slowly never blocks the input of the other shards.
+// The synthetic frames are made by the writer of the shard (a live feed is fanned out to per-shard queues of whole GOPs instead).
+static void ShardWriterThread(CSubprocess *ffmpeg_process, int width, int height, int n_frames, int gop_size, int n_shards, int shard,
+                              std::atomic<bool> *was_broken_by_error)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
+    unsigned char *bgr_sketch = NewBgrSketchBuffer(width, height);
+
+    for (int gop_start = shard * gop_size; (gop_start < n_frames) && (!was_broken_by_error->load()); gop_start += n_shards * gop_size)
+    {
+        const int gop_end = std::min(gop_start + gop_size, n_frames);
+
+        for (int i = gop_start; (i < gop_end) && (!was_broken_by_error->load()); i++)
+        {
+            MakeRawFrame(width, height, i, bgr_sketch, raw_img_bytes);
+
+            if (!ffmpeg_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes))
+            {
+                fprintf(stderr, "Shard %d: unsuccessful ffmpeg_process write to PIPE\n", shard);
+                was_broken_by_error->store(true);
+            }
+        }
+    }
+
+    // Closing stdin flushes the last GOP of the shard (the encoder delay).
+    ffmpeg_process->stdinClose();
+
+    delete[] raw_img_bytes;
+    delete[] bgr_sketch;
+}
+
+
+// Encode <n_frames> synthetic frames of a single feed by <n_shards> FFmpeg processes, and write the merged Annex B stream to <out_file_name>.
+// The feed is split by closed GOPs of <gop_size> frames: GOP g is encoded by shard g % n_shards, so each shard keeps the single threaded
+// low latency x264 settings, and the shards encode in parallel (multi-core throughput for a high resolution feed).
+// <ffmpeg_shard_arg> must produce an IDR frame every <gop_size> frames exactly (fixed GOP - no scene cut), so the GOPs of each shard are aligned.
+// Each shard has a writer thread and a reader thread (ReaderThread - FLV to Annex B), and the calling thread merges the GOPs in order.
+// The timestamps of each shard are of the shard's frames only - they are rebased to the timestamps of the feed (the output is paced by dts),
+// and the merged stream is checked (see CFeedTimeline).
+// <rtp_sender> - Sends each access unit over UDP (nullptr for no network output).
+// Return true in case of success.
+static bool EncodeShardedStream(const std::string &ffmpeg_shard_arg, const int width, const int height, const int n_frames, const int fps,
+                                const int gop_size, const int n_shards, const int pipe_buf_size, const std::string &out_file_name,
+                                CRtpSender *rtp_sender)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+    const int n_gops = (n_frames + gop_size - 1) / gop_size;
+
+    // The merge waits for the GOP of one shard while the other shards keep encoding their next GOP (ring of two GOPs per shard).
+    const int n_ring_slots = 2 * gop_size + 8;
+
+    // Memory bound of the access units buffers of each shard (two GOPs of intra frames at high quality are still far below 64MB at 720p).
+    const size_t pool_max_total_bytes = 64 * 1048576;
+
+    const int flv_bytes_size = 65536;
+
+    std::atomic<bool> was_broken_by_error(false);
+
+    std::vector<CSubprocess*> processes(n_shards, nullptr);
+    std::vector<CSpscRing<CAccessUnit>*> rings(n_shards, nullptr);
+    std::vector<CBufferPool*> pools(n_shards, nullptr);
+    std::vector<unsigned char*> flv_bytes(n_shards, nullptr);
+    std::vector<std::atomic<bool>> is_reader_done(n_shards);
+    std::vector<std::thread> threads;
+
+    for (int k = 0; k < n_shards; k++)
+    {
+        // One pool per shard (CBufferPool::acquire is called only by one thread - the reader thread of the shard).
+        processes[k] = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_shard_arg, true, true, pipe_buf_size);
+        pools[k] = CBufferPool::Create(raw_image_size_in_bytes, pool_max_total_bytes);
+
+        if ((processes[k] == nullptr) || (pools[k] == nullptr))
+        {
+            ErrorExit("Shard creation failed");
+        }
+
+        // The counters of the ring are aligned to cache lines (operator new of C++11 doesn't support extended alignment).
+        void *ring_mem = AlignedAlloc(alignof(CSpscRing<CAccessUnit>), sizeof(CSpscRing<CAccessUnit>));
+
+        if (ring_mem == nullptr)
+        {
+            ErrorExit("Shard ring allocation failed");
+        }
+
+        rings[k] = new (ring_mem) CSpscRing<CAccessUnit>(n_ring_slots);
+        flv_bytes[k] = new unsigned char[flv_bytes_size];
+        is_reader_done[k].store(false);
+    }
+
+    FILE *out_f = fopen(out_file_name.c_str(), "wb");
+
+    if (out_f == nullptr)
+    {
+        ErrorExit(("Error: failed to open file " + out_file_name + " for writing").c_str());
+    }
+
+    const int64_t t_start_ns = MonotonicNanos();
+
+    for (int k = 0; k < n_shards; k++)
+    {
+        // Number of frames of the GOPs of shard k (the last GOP of the feed may be shorter).
+        int n_shard_frames = 0;
+
+        for (int g = k; g < n_gops; g += n_shards)
+        {
+            n_shard_frames += std::min(gop_size, n_frames - g * gop_size);
+        }
+
+        threads.push_back(std::thread(ShardWriterThread, processes[k], width, height, n_frames, gop_size, n_shards, k, &was_broken_by_error));
+        threads.push_back(std::thread(ReaderThread, processes[k], rings[k], pools[k], flv_bytes[k], flv_bytes_size, n_shard_frames,
+                                      nullptr, nullptr, &was_broken_by_error, &is_reader_done[k]));
+    }
+
+    // Merge: take the access units of GOP g from shard g % n_shards (closed GOPs - the access units of a GOP are contiguous in decoding order).
+    CFeedTimeline timeline(n_frames, fps);
+    int64_t n_access_units = 0;
+    bool success = true;
+
+    for (int g = 0; (g < n_gops) && success; g++)
+    {
+        const int k = g % n_shards;
+        const int gop_len = std::min(gop_size, n_frames - g * gop_size);
+
+        for (int m = 0; m < gop_len; m++)
+        {
+            CAccessUnit *au = rings[k]->frontForRead();
+            int n_waits = 0;
+
+            while ((au == nullptr) && (!was_broken_by_error.load()))
+            {
+                if (is_reader_done[k].load(std::memory_order_acquire))
                 {
-                    //Set pipe buffer size
-                    child_sts = (int)fcntl(sp->m_inpipefd[1], F_SETPIPE_SZ, buf_size);
-                    if (child_sts == (-1))
-                    {
-                        fprintf(stderr, "Error: fcntl(sp->m_inpipefd[1], F_SETPIPE_SZ, buf_size) failed in child process, errno = %d.\n", errno);
-                    }
+                    au = rings[k]->frontForRead();  // The last access unit may be pushed right before marking "done".
+                    break;
                 }
+
+                WaitForRing(n_waits);
+                au = rings[k]->frontForRead();
             }
 
-            // Keep stderr unchanged for debugging.
-            //child_sts = dup2(sp->m_inpipefd[1], STDERR_FILENO);
-            //if (child_sts == (-1))
-            //{
-            //    fprintf(stderr, "Error: dup2 STDOUT_FILENO failed, errno = %d.\n", errno); exit(-1);
-            //}
+            if (au == nullptr)
+            {
+                fprintf(stderr, "Shard %d ended before the end of GOP %d\n", k, g);
+                was_broken_by_error.store(true);
+                success = false;
+                break;
+            }
+
+            if (m == 0)
+            {
+                // Closed GOP - the IDR frame is the first frame of the GOP in presentation order (at the GOP start of the feed).
+                timeline.beginPiece(au, g * gop_size);
+            }
+
+            timeline.rebase(au, g * gop_size, g * gop_size + gop_len);
+
+#ifdef DO_WRITE_NAL_UNITS_WITH_WRITEV
+            if (!WriteNalList(fileno(out_f), &au->nal_list))
+            {
+                fprintf(stderr, "WriteNalList failed\n");
+                was_broken_by_error.store(true);
+            }
+#else
+            fwrite(&au->buffer->data[au->annexb_payload_offset], 1, au->annexb_payload_len, out_f);
+#endif
+
+            if ((rtp_sender != nullptr) && !rtp_sender->sendAccessUnit(au))
+            {
+                fprintf(stderr, "sendAccessUnit failed\n");
+                was_broken_by_error.store(true);
+            }
+
+            au->buffer->release();
+            au->buffer = nullptr;
+
+            rings[k]->pop();
+            n_access_units++;
+        }
+    }
+
+    // After an error, the reader threads don't wait for free slots (they read and ignore the rest of the FLV streams until FFmpeg ends).
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    const double elapsed_ms = (double)(MonotonicNanos() - t_start_ns) * 1e-6;
+
+    fclose(out_f);
+
+    success = success && (!was_broken_by_error.load()) && (timeline.errorsCount() == 0) && (n_access_units == n_frames);
+
+    for (int k = 0; k < n_shards; k++)
+    {
+        // Access units left in the ring after an error.
+        for (CAccessUnit *au = rings[k]->frontForRead(); au != nullptr; au = rings[k]->frontForRead())
+        {
+            au->buffer->release();
+            au->buffer = nullptr;
+            rings[k]->pop();
+        }
+
+        success = CSubprocess::ClosePipeAndDeleteObj(processes[k]) && success;
+        CBufferPool::DeleteObj(pools[k]);
+        rings[k]->~CSpscRing<CAccessUnit>();
+        AlignedFree(rings[k]);
+        delete[] flv_bytes[k];
+    }
+
+    fprintf(stderr, "Sharded encoder: %d shards, %d GOPs of %d frames, %d access units merged in %.1f ms (%.1f fps), %d errors\n",
+            n_shards, n_gops, gop_size, (int)n_access_units, elapsed_ms, (elapsed_ms > 0) ? (double)n_access_units * 1000.0 / elapsed_ms : 0.0, timeline.errorsCount());
+
+    return success;
+}
+
+
+// Test the GOP sharded encoder: the synthetic video is split by GOPs across <n_shards> FFmpeg processes (n_shards = 0 uses one per CPU core),
+// and the merged stream is written to out_sharded.264.
+// The output is not the same as out.264 (the lookahead and the rate control of each shard see only its GOPs), so the merged stream is checked by EncodeShardedStream.
+static inline int ShardedStreamTest(int n_shards, const int width, const int height, const int n_frames, const int fps)
+{
+    if (n_shards <= 0)
+    {
+        n_shards = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    // No more shards than GOPs.
+    n_shards = std::min(n_shards, (n_frames + g_gop_size - 1) / g_gop_size);
+
+    const std::string ffmpeg_shard_arg = FfmpegEncoderArg(width, height, fps, true, true);
+
+    bool success = EncodeShardedStream(ffmpeg_shard_arg, width, height, n_frames, fps, g_gop_size, n_shards, 1048576, "out_sharded.264", nullptr);
+
+    fprintf(stderr, "Sharded encoder test %s\n", success ? "completed" : "failed");
+
+    return success ? 0 : 1;
+}
+
+
+// Rate control ladder of EncodeAdaptiveStream: level 0 is the best quality (the highest bitrate) - the bitrate of x264 is roughly halved every 6-8 CRF steps.
+static const int g_rate_ladder_crf[] = {10, 18, 26, 34};
+static const int g_n_rate_levels = (int)(sizeof(g_rate_ladder_crf) / sizeof(g_rate_ladder_crf[0]));
+
+
+// Rate adaptation control loop: watch the sizes of the encoded access units, and the backlog of the network sink, and request a level of the rate control ladder.
+// The requested level is applied by the writer thread of EncodeAdaptiveStream at the next GOP boundary (the consumer reports the level of each access unit).
+// The link is degraded when the bitrate (sliding window in dts time) exceeds the link budget, or when the sink falls behind (late access units, or dropped packets):
+// step one level down at once. Step one level up only after UP_HOLD_MS of bitrate far below the budget without sink backlog (hysteresis - no oscillation).
+// No decision is made while a swap is pending (the access units of the requested level didn't arrive yet), so a swap is never requested twice.
+// The bitrate is measured in dts time (not wall clock), so the decisions for a given encoded stream are reproducible.
+class CRateController
+{
+private:
+    static const int WINDOW_MS              = 1000;     // Sliding window of the bitrate.
+    static const int MIN_WINDOW_MS          = 500;      // No bitrate decision before the window of the current level is long enough.
+    static const int MAX_BACKLOG_MS         = 150;      // The link is degraded when the sink is later than that.
+    static const int UP_HOLD_MS             = 3000;
+    static const int UP_BITRATE_PERCENT     = 40;       // Step up only if the bitrate is below 40% of the budget (the level above is expected to fit).
+
+    int m_n_levels = 0;
+    int m_budget_kbps = 0;                  // Bitrate budget of the link (0 for no budget - the sink backlog only).
+    std::atomic<int> m_requested_level;     // Read by the writer thread.
+
+    // State of the consumer thread.
+    int m_level = 0;                        // Level of the last access unit.
+    std::deque<std::pair<int, int>> m_window;   // Decoding timestamp and size of the access units in the window.
+    int64_t m_window_bytes = 0;
+    int m_kbps = 0;
+    bool m_is_calm = false;                 // The bitrate is low enough for stepping up since m_calm_since_dts_ms.
+    int m_calm_since_dts_ms = 0;
+    int m_sink_lateness_ms = 0;
+    int64_t m_n_dropped_packets = 0;
+    bool m_is_new_drop = false;
+
+    // Statistics.
+    int m_n_steps_down = 0;
+    int m_n_steps_up = 0;
+    int m_peak_kbps = 0;
+
+    void request(const int level)
+    {
+        m_requested_level.store(level, std::memory_order_release);
+        m_is_calm = false;
+    }
+
+public:
+    // <n_levels> - Number of levels of the ladder (the first access units are of level 0).
+    // <budget_kbps> - Bitrate budget of the link in kbit/s (0 for adapting to the sink backlog only).
+    CRateController(const int n_levels, const int budget_kbps) : m_n_levels(n_levels), m_budget_kbps(budget_kbps), m_requested_level(0)
+    {
+    }
+
+    // Level requested for the next GOP.
+    int requestedLevel() const { return m_requested_level.load(std::memory_order_acquire); }
+
+    int bitrateKbps() const { return m_kbps; }
+
+    // Report the state of the sink after sending an access unit: <lateness_ms> - how late the access unit was sent (see CRtpSender::latenessMs),
+    // <n_dropped_packets> - total number of packets dropped because the send queue was full (see CRtpSender::droppedPacketsCount).
+    void onSinkState(const int lateness_ms, const int64_t n_dropped_packets)
+    {
+        m_sink_lateness_ms = lateness_ms;
+        m_is_new_drop = m_is_new_drop || (n_dropped_packets > m_n_dropped_packets);
+        m_n_dropped_packets = n_dropped_packets;
+    }
+
+    // Report an access unit of <au_bytes> bytes with decoding timestamp <dts_ms>, encoded at <level> (called in decoding order).
+    void onAccessUnit(const int dts_ms, const int au_bytes, const int level)
+    {
+        if (level != m_level)
+        {
+            // The swap is done - measure the new level from scratch.
+            m_level = level;
+            m_window.clear();
+            m_window_bytes = 0;
+            m_is_calm = false;
+        }
+
+        m_window.push_back(std::make_pair(dts_ms, au_bytes));
+        m_window_bytes += au_bytes;
+
+        while (dts_ms - m_window.front().first >= WINDOW_MS)
+        {
+            m_window_bytes -= m_window.front().second;
+            m_window.pop_front();
+        }
+
+        // The window covers the dts span of its access units, plus the duration of the last one (the average frame interval).
+        const int n = (int)m_window.size();
+        const int span_ms = dts_ms - m_window.front().first;
+        const bool is_window_full = (span_ms >= MIN_WINDOW_MS);
+
+        if (is_window_full)
+        {
+            const int64_t duration_ms = span_ms + span_ms / std::max(n - 1, 1);
+            m_kbps = (int)(m_window_bytes * 8 / std::max(duration_ms, (int64_t)1));     // bytes * 8 / ms = kbit/s
+            m_peak_kbps = std::max(m_peak_kbps, m_kbps);
+        }
+
+        const bool is_sink_late = (m_sink_lateness_ms > MAX_BACKLOG_MS) || m_is_new_drop;
+        m_is_new_drop = false;
 
-            // Ask kernel to deliver SIGTERM in case the parent dies.
-            // https://man7.org/linux/man-pages/man2/prctl.2.html
-            // prctl() manipulates various aspects of the behavior of the calling thread or process...
-            // On error, -1 is returned, and errno is set appropriately.
-            child_sts = prctl(PR_SET_PDEATHSIG, SIGTERM);
-            if (child_sts == (-1))
-            {
-                fprintf(stderr, "Error: prctl failed, errno = %d.\n", errno); exit(-1);
-            }
+        if (level != m_requested_level.load(std::memory_order_relaxed))
+        {
+            return;     // Swap pending.
+        }
 
-            // Execute child process (first argument may be full executable path, the second is the process name).
-            // https://linux.die.net/man/3/execl
-            // The exec() family of functions replaces the current process image with a new process image.
-            // ...
-            // The const char *arg and subsequent ellipses in the execl(), execlp(), and execle() functions can be thought of as arg0, arg1, ..., argn.
-            // Together they describe a list of one or more pointers to null - terminated strings that represent the argument list available to the executed program.The first argument, by convention, 
-            // should point to the filename associated with the file being executed.The list of arguments must be terminated by a NULL pointer, and, 
-            // since these are variadic functions, this pointer must be cast(char *) NULL.
-            // The execv(), execvp(), and execvpe() functions provide an array of pointers to null - terminated strings that represent the argument list available to the new program.
-            // The first argument, by convention, should point to the filename associated with the file being executed.The array of pointers must be terminated by a NULL pointer.
-            // Return Value: The exec() functions only return if an error has occurred. The return value is -1, and errno is set to indicate the error.
-            child_sts = execvp(cmd.c_str(), (char* const*)sp->m_args_list);
-        
-            // Nothing below this line should be executed by child process. 
-            // If so, it means that the "execl function" wasn't successful.
-            if (child_sts == (-1))
+        const bool is_over_budget = is_window_full && (m_budget_kbps > 0) && (m_kbps > m_budget_kbps);
+
+        if (is_sink_late || is_over_budget)
+        {
+            if (m_level < m_n_levels - 1)
             {
-                fprintf(stderr, "Error: execl failed, errno = %d.\n", errno);
+                request(m_level + 1);
+                m_n_steps_down++;
             }
 
-            fprintf(stderr, "Error: child process wasn't successful.\n");
-            exit(1);
-            //////////////////////////////////////////////////////////////////////////
+            m_is_calm = false;
+            return;
         }
 
-        // https://stackoverflow.com/questions/6171552/popen-simultaneous-read-and-write
-        // The code below will be executed only by parent. You can write and read
-        // from the child using pipefd descriptors, and you can send signals to 
-        // the process using its pid by kill() function. If the child process will
-        // exit unexpectedly, the parent process will obtain SIGCHLD signal that
-        // can be handled (e.g. you can respawn the child process).
+        const bool is_low = is_window_full && ((m_budget_kbps == 0) || ((int64_t)m_kbps * 100 < (int64_t)m_budget_kbps * UP_BITRATE_PERCENT));
 
-        // Close unused pipe ends
-        if (is_stdin_pipe)
+        if ((!is_low) || (m_level == 0))
         {
-			// Close the unused end of pipe
-            // https://linux.die.net/man/2/close
-            // close() closes a file descriptor, so that it no longer refers to any file and may be reused...
-            // Return Value: close() returns zero on success. On error, -1 is returned, and errno is set appropriately.
-            sts = close(sp->m_outpipefd[0]);
+            m_is_calm = false;
+            return;
+        }
 
-            if (sts == (-1))
+        if (!m_is_calm)
+        {
+            m_is_calm = true;
+            m_calm_since_dts_ms = dts_ms;
+        }
+        else if (dts_ms - m_calm_since_dts_ms >= UP_HOLD_MS)
+        {
+            request(m_level - 1);
+            m_n_steps_up++;
+        }
+    }
+
+    void printStatistics() const
+    {
+        fprintf(stderr, "Rate controller: level %d (crf %d) at %d kbps (peak %d kbps, budget %d kbps), %d steps down, %d steps up\n",
+                m_level, g_rate_ladder_crf[m_level], m_kbps, m_peak_kbps, m_budget_kbps, m_n_steps_down, m_n_steps_up);
+    }
+};
+
+
+// Part of the feed encoded by one leased FFmpeg worker (see EncodeAdaptiveStream) - published by the writer thread, read by the reader thread.
+struct CEncoderSegment
+{
+    CSubprocess *process = nullptr;
+    int level = 0;                          // Level of the rate control ladder.
+    int first_frame = 0;                    // Feed frame of the IDR frame that starts the segment.
+    std::atomic<int> n_written{0};          // Frames written to stdin PIPE.
+    std::atomic<bool> is_closed{false};     // stdin PIPE is closed (n_written is final).
+};
+
+
+// Writer thread of EncodeAdaptiveStream: write <n_frames> synthetic frames at <fps> (a live feed) to the worker of the current segment.
+// At each GOP boundary, if the rate controller requests another level, close stdin of the current worker (it flushes the last GOP),
+// and continue with a worker leased from the pool of the requested level - pre-spawned, so the swap doesn't wait for FFmpeg startup.
+// The segments are published in <segments> (*<n_segments> of them).
+static void AdaptiveWriterThread(std::vector<CFfmpegWorkerPool*> *pools, CRateController *controller, std::vector<CEncoderSegment> *segments,
+                                 std::atomic<int> *n_segments, int width, int height, int n_frames, int fps, int gop_size,
+                                 std::atomic<bool> *is_writer_done, std::atomic<bool> *was_broken_by_error)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
+    unsigned char *bgr_sketch = NewBgrSketchBuffer(width, height);
+    CEncoderSegment *segment = nullptr;
+    int s = 0;
+    const int64_t t_start_ns = MonotonicNanos();
+
+    for (int i = 0; (i < n_frames) && (!was_broken_by_error->load()); i++)
+    {
+        const int level = controller->requestedLevel();
+
+        if ((i % gop_size == 0) && ((segment == nullptr) || (level != segment->level)))
+        {
+            CSubprocess *worker = (*pools)[level]->lease();
+
+            if (worker == nullptr)
             {
-                fprintf(stderr, "Error: close(sp->m_outpipefd[0]) failed, errno = %d.\n", errno);
-                delete sp;
-                return nullptr; // Returning nullptr  indication for an error.
+                fprintf(stderr, "Failed to lease FFmpeg worker of level %d\n", level);
+                was_broken_by_error->store(true);
+                break;
             }
 
-            if (buf_size > 0)
+            if (segment != nullptr)
             {
-                //Set pipe buffer size
-                sts = (int)fcntl(sp->m_outpipefd[1], F_SETPIPE_SZ, buf_size);
-                if (sts == (-1))
-                {
-                    fprintf(stderr, "Error: fcntl(sp->m_outpipefd[1], F_SETPIPE_SZ, buf_size) failed in parent process, errno = %d.\n", errno);
-                }
+                // Closing stdin flushes the last GOP of the segment (the encoder delay).
+                segment->process->stdinClose();
+                segment->is_closed.store(true, std::memory_order_release);
             }
+
+            segment = &(*segments)[s];
+            segment->process = worker;
+            segment->level = level;
+            segment->first_frame = i;
+            n_segments->store(++s, std::memory_order_release);
         }
 
-        if (is_stdout_pipe)
+        // Live feed - frame i is captured at t_start_ns + i / fps.
+        const int64_t wait_ns = t_start_ns + (int64_t)i * 1000000000LL / fps - MonotonicNanos();
+
+        if (wait_ns > 0)
         {
-			// Close the unused end of pipe
-            sts = close(sp->m_inpipefd[1]);
+            std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+        }
 
-            if (sts == (-1))
-            {
-                fprintf(stderr, "Error: close(sp->m_inpipefd[1]) failed, errno = %d.\n", errno);
-                delete sp;
-                return nullptr; // Returning nullptr  indication for an error.
-            }
+        MakeRawFrame(width, height, i, bgr_sketch, raw_img_bytes);
 
-            if (buf_size > 0)
-            {
-                //Set pipe buffer size
-                sts = (int)fcntl(sp->m_inpipefd[0], F_SETPIPE_SZ, buf_size);
-                if (sts == (-1))
-                {
-                    fprintf(stderr, "Error: fcntl(sp->m_inpipefd[0], F_SETPIPE_SZ, buf_size) failed in parent process, errno = %d.\n", errno);
-                }
-            }
+        if (!segment->process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes))
+        {
+            fprintf(stderr, "Unsuccessful ffmpeg_process write to PIPE (segment %d)\n", s - 1);
+            was_broken_by_error->store(true);
+            break;
         }
 
-		//In case everything went well, return a pointer to the created object.
-        return sp;
+        segment->n_written.store(i - segment->first_frame + 1, std::memory_order_release);
     }
 
-    // Close sdtin PIPE and stdout PIPE, wait for child process to end, and delete sp.
-    static bool ClosePipeAndDeleteObj(CSubprocess *sp)
+    if (segment != nullptr)
     {
-        int sts;
+        segment->process->stdinClose();
+        segment->is_closed.store(true, std::memory_order_release);
+    }
 
-        if (sp != nullptr)
+    is_writer_done->store(true, std::memory_order_release);
+
+    delete[] raw_img_bytes;
+    delete[] bgr_sketch;
+}
+
+
+// Reader thread of EncodeAdaptiveStream: read the FLV streams of the segments one after the other, and push the access units to <au_ring>.
+// Each segment starts with its own FLV header and AVC sequence header (the SPS and PPS of each worker are injected before its IDR frames),
+// and the timestamps of each segment are rebased to the feed by <timeline> - the Annex B output is continuous across the swaps.
+// A segment ends after the access units of all its frames (the writer closed stdin) - the reader closes the worker.
+static void AdaptiveReaderThread(std::vector<CEncoderSegment> *segments, std::atomic<int> *n_segments, std::atomic<bool> *is_writer_done,
+                                 CSpscRing<CAccessUnit> *au_ring, CBufferPool *pool, unsigned char *flv_bytes, int flv_bytes_size, CFeedTimeline *timeline,
+                                 std::atomic<bool> *was_broken_by_error, std::atomic<bool> *is_reader_done)
+{
+    int s = 0;
+
+    for (; !was_broken_by_error->load(); s++)
+    {
+        int n_waits = 0;
+
+        while ((s >= n_segments->load(std::memory_order_acquire)) && (!is_writer_done->load(std::memory_order_acquire)) && (!was_broken_by_error->load()))
         {
-            int stat_loc = 0;
+            WaitForRing(n_waits);
+        }
 
-            if (sp->m_is_stdin_pipe)
+        if (s >= n_segments->load(std::memory_order_acquire))
+        {
+            break;  // The writer is done (or broken).
+        }
+
+        CEncoderSegment *segment = &(*segments)[s];
+        CAvcDecoderConfig avc_config;
+
+        if (!ReadFlvFileHeaderAndFirstPayload(segment->process, flv_bytes, flv_bytes_size, &avc_config))
+        {
+            fprintf(stderr, "ReadFlvFileHeaderAndFirstPayload failed (segment %d)\n", s);
+            was_broken_by_error->store(true);
+            break;
+        }
+
+        const int headroom = AccessUnitHeadroom(&avc_config);
+
+        for (int r = 0; !was_broken_by_error->load(); r++)
+        {
+            // The access unit of frame r comes after the encoder delay - read it only if the frame was written (or else the segment may be ended).
+            n_waits = 0;
+
+            while ((segment->n_written.load(std::memory_order_acquire) <= r) && (!segment->is_closed.load(std::memory_order_acquire)) &&
+                   (!was_broken_by_error->load()))
             {
-                sts = close(sp->m_outpipefd[1]);
-                if (sts == (-1))
-                {
-                    fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed, errno = %d.\n", errno);
-                }
+                WaitForRing(n_waits);
             }
 
-            if (sp->m_is_stdout_pipe)
+            const int n_written = segment->n_written.load(std::memory_order_acquire);
+
+            if (r >= n_written)
             {
-                sts = close(sp->m_inpipefd[0]);
-                if (sts == (-1))
-                {
-                    fprintf(stderr, "Error: close(sp->m_inpipefd[0]) failed, errno = %d.\n", errno);
-                }
+                break;  // End of the segment (n_written is final once closed), or an error.
             }
 
-            // Remark: we don't need to kill FFmpeg process, killing the process looses the last encoded video frames.
-            // Send SIGKILL signal to the child process
-            // https://man7.org/linux/man-pages/man2/kill.2.html
-            // The kill() system call can be used to send any signal to any process group or process...
-            // On success (at least one signal was sent), zero is returned. On error, -1 is returned, and errno is set appropriately.
-            //sts = kill(sp->m_pid, SIGKILL);
-            //if (sts == (-1))
-            //{
-            //    fprintf(stderr, "Error: kill(sp->m_pid, SIGKILL) failed, errno = %d.\n", errno);
-            //}
+            CAccessUnit *au = au_ring->frontForWrite();
 
-            // https://linux.die.net/man/3/waitpid
-            // wait, waitpid - wait for a child process to stop or terminate...
-            // stat_loc shall be 0 if and only if the status returned is from a terminated child process...
-            // Return Value:
-            // If wait() or waitpid() returns because the status of a child process is available,
-            // these functions shall return a value equal to the process ID of the child process for which status is reported.
-            // If wait() or waitpid() returns due to the delivery of a signal to the calling process, -1 shall be returned and errno set to[EINTR].
-            // If waitpid() was invoked with WNOHANG set in options, it has at least one child process specified by pid for which status is not available, 
-            // and status is not available for any process specified by pid, 0 is returned.Otherwise, (pid_t)-1 shall be returned, and errno set to indicate the error.
-            sts = waitpid(sp->m_pid, &stat_loc, 0);
+            while ((au == nullptr) && (!was_broken_by_error->load()))
+            {
+                WaitForRing(n_waits);
+                au = au_ring->frontForWrite();
+            }
 
-            if (sts == (-1))
+            if ((au == nullptr) || !ReadAccessUnit(segment->process, &avc_config, headroom, pool, au, nullptr, was_broken_by_error))
             {
-                fprintf(stderr, "Error: waitpid(sp->m_pid, &stat_loc, 0) sts = %d, stat_loc = %d, errno = %d.\n", sts, stat_loc, errno);
+                was_broken_by_error->store(true);
+                break;
             }
-            else if (stat_loc != 0)
+
+            if (r == 0)
             {
-                fprintf(stderr, "Warning: waitpid(sp->m_pid, &stat_loc, 0) stat_loc = %d.\n", stat_loc);    // FFmpeg returned value other than zero.
+                timeline->beginPiece(au, segment->first_frame);
             }
 
-            delete sp;
+            // The encoder can't output a frame that wasn't written yet.
+            timeline->rebase(au, segment->first_frame, segment->first_frame + n_written);
+
+            au_ring->push();
         }
 
-        return true;
+        if (was_broken_by_error->load())
+        {
+            break;
+        }
+
+        // Read extra trailing 4 bytes (FFmpeg puts the 4 bytes as a footer), and wait for the worker to end.
+        bool success = segment->process->stdoutRead(4, flv_bytes);
+
+        if (!CSubprocess::ClosePipeAndDeleteObj(segment->process) || !success)
+        {
+            fprintf(stderr, "FFmpeg worker of segment %d failed\n", s);
+            was_broken_by_error->store(true);
+        }
+
+        segment->process = nullptr;
     }
 
-    // Write to stdin PIPE (no flush?)
-    bool stdinWrite(const unsigned char *data_bytes, const unsigned int len)
+    // In case of an error, keep reading (and ignoring) the stdout PIPEs of the remaining segments until the workers end
+    // (the writer closes stdin of the current worker after the error - it's never blocked on a full stdin PIPE).
+    for (; ; s++)
     {
-        ssize_t sts;
-
-        // https://linux.die.net/man/2/write
-        // ssize_t write(int fd, const void *buf, size_t count);
-        // write() writes up to count bytes from the buffer pointed buf to the file referred to by the file descriptor fd.
-        // The number of bytes written may be less than count if, for example, there is insufficient space...
-        // Remark: the case of "Number of bytes written may be less than count" is not handled by the following implementation.
-        sts = write(m_outpipefd[1], data_bytes, len);
+        int n_waits = 0;
 
-        if (sts == (-1))
+        while ((s >= n_segments->load(std::memory_order_acquire)) && (!is_writer_done->load(std::memory_order_acquire)))
         {
-            fprintf(stderr, "Error: write(m_outpipefd[1] failed, errno = %d.\n", errno);
-            return false;
+            WaitForRing(n_waits);
         }
 
-        if ((unsigned int)sts != len)
+        if (s >= n_segments->load(std::memory_order_acquire))
         {
-			//Never enters...
-			//In case it does, the code should be modified: using a loop for writing all the data to the pipe.
-            fprintf(stderr, "Oops... the number of bytes written is less than count.\n");
+            break;
         }
 
-        return true;
+        CSubprocess *process = (*segments)[s].process;
+
+        while ((process != nullptr) && process->stdoutRead(flv_bytes_size, flv_bytes)) {}
     }
 
-    // Read from stdout PIPE
-    bool stdoutRead(const unsigned int len, unsigned char *data_bytes)
-    {
-        ssize_t n_bytes_read;
+    is_reader_done->store(true, std::memory_order_release);
+}
 
-        // The third argument of read, "count", is the "The maximum number of bytes to be read."
-        // We must use a loop for reading exactly <len> bytes from the pipe.
-        ssize_t remain_len = (ssize_t)len;
-        unsigned char *data_bytes_ptr = data_bytes;
 
-        // https://man7.org/linux/man-pages/man2/read.2.html
-        // ssize_t read(int fd, void *buf, size_t count);
-        // read() attempts to read up to count bytes from file descriptor fd into the buffer starting at buf.
-        // RETURN VALUE:
-        // On success, the number of bytes read is returned (zero indicates end of file), and the file position is advanced by this number.
-        // It is not an error if this number is smaller than the number of bytes requested;
-        // this may happen for example because fewer bytes are actually available right now (maybe because we were close to end - of - file, or because we are reading from a pipe, or from a terminal), 
-        // or because read() was interrupted by a signal.See also NOTES.
-        // On error, -1 is returned, and errno is set appropriately. In this case, it is left unspecified whether the file position (if any) changes.
-        // Keep reading until finish reading <len> bytes from the PIPE.
-        while (remain_len > 0)
-        {
-			//Try to read remain_len bytes from the PIPE (but may read less).
-            n_bytes_read = read(m_inpipefd[0], data_bytes_ptr, remain_len);
+// Encode <n_frames> synthetic frames of a live feed with rate adaptation, and write the Annex B stream to <out_file_name>.
+// <pools> - Pre-spawned FFmpeg workers of each level of the ladder (the workers of pool k encode with crf g_rate_ladder_crf[k]).
+// <controller> - Watches the output (the access unit sizes, and the backlog of <rtp_sender>), and requests the level of the next GOP.
+// The encodings are switched at GOP boundaries only: the new worker starts with an IDR frame (with its own SPS and PPS),
+// and its timestamps are rebased to the feed, so the Annex B stream stays continuous (see CFeedTimeline).
+// <rtp_sender> - Sends each access unit over UDP (nullptr for no network output).
+// Return true in case of success.
+static bool EncodeAdaptiveStream(std::vector<CFfmpegWorkerPool*> &pools, CRateController *controller, const int width, const int height,
+                                 const int n_frames, const int fps, const int gop_size, const std::string &out_file_name, CRtpSender *rtp_sender)
+{
+    const int raw_image_size_in_bytes = RawFrameSize(width, height);
+    const int n_gops = (n_frames + gop_size - 1) / gop_size;
+    const int n_ring_slots = 64;
+    const size_t pool_max_total_bytes = 64 * 1048576;
+    const int flv_bytes_size = 65536;
+
+    std::atomic<bool> was_broken_by_error(false);
+    std::atomic<bool> is_writer_done(false);
+    std::atomic<bool> is_reader_done(false);
+    std::vector<CEncoderSegment> segments(n_gops);  // At most one segment per GOP.
+    std::atomic<int> n_segments(0);
+    CFeedTimeline timeline(n_frames, fps);
+
+    CBufferPool *pool = CBufferPool::Create(raw_image_size_in_bytes, pool_max_total_bytes);
+    void *ring_mem = AlignedAlloc(alignof(CSpscRing<CAccessUnit>), sizeof(CSpscRing<CAccessUnit>));
+
+    if ((pool == nullptr) || (ring_mem == nullptr))
+    {
+        ErrorExit("Adaptive encoder allocation failed");
+    }
 
-            if (n_bytes_read == (-1))
-            {
-                fprintf(stderr, "Error: read(m_inpipefd[0] failed, errno = %d.\n", errno);
-                return false;
-            }
-            else if (n_bytes_read == 0)
-            {
-                fprintf(stderr, "Error: read(m_inpipefd[0], data_bytes_ptr, remain_len) read zero bytes instead of %d.\nThat means that child process is no longer running.\n", (int)n_bytes_read);
-                return false;
-            }
+    CSpscRing<CAccessUnit> *au_ring = new (ring_mem) CSpscRing<CAccessUnit>(n_ring_slots);
+    unsigned char *flv_bytes = new unsigned char[flv_bytes_size];
 
-            remain_len -= n_bytes_read;     // Subtract number of bytes read from remain_len.
-            data_bytes_ptr += n_bytes_read; // Advance pointer by number of bytes read.
-        }
+    FILE *out_f = fopen(out_file_name.c_str(), "wb");
 
-        return true;
+    if (out_f == nullptr)
+    {
+        ErrorExit(("Error: failed to open file " + out_file_name + " for writing").c_str());
     }
 
+    const int64_t t_start_ns = MonotonicNanos();
 
-    // Close stdin PIPE
-    bool stdinClose()
+    std::thread writer(AdaptiveWriterThread, &pools, controller, &segments, &n_segments, width, height, n_frames, fps, gop_size,
+                       &is_writer_done, &was_broken_by_error);
+    std::thread reader(AdaptiveReaderThread, &segments, &n_segments, &is_writer_done, au_ring, pool, flv_bytes, flv_bytes_size, &timeline,
+                       &was_broken_by_error, &is_reader_done);
+
+    // The access units are in order of the segments - the level of each access unit is of the segment it belongs to.
+    int64_t n_access_units = 0;
+    int s = 0;
+    int n_segment_aus = 0;
+
+    while (!was_broken_by_error.load())
     {
-        int sts;
+        CAccessUnit *au = au_ring->frontForRead();
+        int n_waits = 0;
 
-        if (m_is_stdin_pipe)
+        while ((au == nullptr) && (!was_broken_by_error.load()))
         {
-            sts = close(m_outpipefd[1]);
-
-            if (sts == (-1))
+            if (is_reader_done.load(std::memory_order_acquire))
             {
-                fprintf(stderr, "Error: close(sp->m_outpipefd[1]) failed, errno = %d.\n", errno);
+                au = au_ring->frontForRead();  // The last access unit may be pushed right before marking "done".
+                break;
             }
 
-            m_is_stdin_pipe = false;
+            WaitForRing(n_waits);
+            au = au_ring->frontForRead();
         }
 
-        return true;
-    }
-};
+        if (au == nullptr)
+        {
+            break;
+        }
+
+        // All the access units of a segment are read before the first access unit of the next segment (the segment is closed by then).
+        while (segments[s].is_closed.load(std::memory_order_acquire) && (n_segment_aus == segments[s].n_written.load(std::memory_order_acquire)))
+        {
+            s++;
+            n_segment_aus = 0;
+            fprintf(stderr, "Adaptive encoder: frame %d switches to level %d (crf %d) at %d kbps\n",
+                    segments[s].first_frame, segments[s].level, g_rate_ladder_crf[segments[s].level], controller->bitrateKbps());
+        }
+
+        n_segment_aus++;
+
+#ifdef DO_WRITE_NAL_UNITS_WITH_WRITEV
+        if (!WriteNalList(fileno(out_f), &au->nal_list))
+        {
+            fprintf(stderr, "WriteNalList failed\n");
+            was_broken_by_error.store(true);
+        }
+#else
+        fwrite(&au->buffer->data[au->annexb_payload_offset], 1, au->annexb_payload_len, out_f);
+#endif
+
+        if (rtp_sender != nullptr)
+        {
+            if (!rtp_sender->sendAccessUnit(au))
+            {
+                fprintf(stderr, "sendAccessUnit failed\n");
+                was_broken_by_error.store(true);
+            }
 
+            controller->onSinkState(rtp_sender->latenessMs(), rtp_sender->droppedPacketsCount());
+        }
 
+        controller->onAccessUnit(au->dts_ms, au->nal_list.annexb_len, segments[s].level);
 
-// Read header of FLV packet and return FLV payload size
-// After the header, the file is split into packets called "FLV tags",
-// which have 15 - byte packet headers.
-// The first four bytes denote the size of the previous packet / tag
-// (including the header without the first field), and aid in seeking backward
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return flv_payload_size if success.
-static int ReadFlvPacketHeader(CSubprocess *ffmpeg_process, unsigned char *buf)
-{
-    // Read size_of_previous_packet, packet_type, flv_payload_size, timestamp_lower, timestamp_upper, stream_id
-    bool success = ffmpeg_process->stdoutRead(4 + 1 + 3 + 3 + 1 + 3, buf);
+        au->buffer->release();
+        au->buffer = nullptr;
 
-    if (!success)
-    {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPacketHeader\n");
-        return -1;
+        au_ring->pop();
+        n_access_units++;
     }
 
-    //size_of_previous_packet = f.read(4)  # For first packet set to NULL(uint32 big - endian)
-    //packet_type = f.read(1)  # For first packet set to AMF Metadata
-    //flv_payload_size = f.read(3)  # For first packet set to AMF Metadata(uint24 big - endian)
-    //timestamp_lower = f.read(3)  # For first packet set to NULL(uint24 big - endian)
-    //timestamp_upper = f.read(1)  # Extension to create a uint32_be value(0)
-    //stream_id = f.read(3)  # For first stream of same type set to NULL(uint24 big - endian)
-    //if len(flv_payload_size) < 3: return 0  # End of file.
-
-    int flv_payload_size = ((int)buf[5] << 16) + ((int)buf[6] << 8) + (int)buf[7];
+    // After an error, the reader thread doesn't wait for free slots (it reads and ignores the rest of the FLV streams until the workers end).
+    writer.join();
+    reader.join();
 
-    // Convert uint24 big - endian to integer value
-    return flv_payload_size;
-}
+    const double elapsed_ms = (double)(MonotonicNanos() - t_start_ns) * 1e-6;
 
+    fclose(out_f);
 
-// FLV files start with a standard header (9 bytes).
-// After the header comes the first payload, which contains irrelevant data.
-// The function reads the header and the first payload data.
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-static bool ReadFlvFileHeaderAndFirstPayload(CSubprocess *ffmpeg_process, unsigned char *buf)
-{
-    // https ://en.wikipedia.org/wiki/Flash_Video
-    // Read FLV signature, version, flag byte and 4 bytes "used to skip a newer expanded header".
-    bool success = ffmpeg_process->stdoutRead(5+4, buf);
+    bool success = (!was_broken_by_error.load()) && (timeline.errorsCount() == 0) && (n_access_units == n_frames);
 
-    if (!success)
+    // Access units left in the ring after an error.
+    for (CAccessUnit *au = au_ring->frontForRead(); au != nullptr; au = au_ring->frontForRead())
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
-        return false;
+        au->buffer->release();
+        au->buffer = nullptr;
+        au_ring->pop();
     }
 
-    if (((char)buf[0] != 'F') || ((char)buf[1] != 'L') || ((char)buf[2] != 'V'))
+    // Workers left after an error (the reader closes the workers of the completed segments).
+    for (int k = 0; k < n_segments.load(); k++)
     {
-        // FLV file must start with "FLV" letters.
-        fprintf(stderr, "Bad signature: FLV stream doesn't start with FLV letters\n");
-        return false;
+        if (segments[k].process != nullptr)
+        {
+            CSubprocess::ClosePipeAndDeleteObj(segments[k].process);
+            success = false;
+        }
     }
 
-    unsigned char version_byte = buf[3];
+    CBufferPool::DeleteObj(pool);
+    au_ring->~CSpscRing<CAccessUnit>();
+    AlignedFree(au_ring);
+    delete[] flv_bytes;
 
-    if (version_byte != 1)
-    {
-        // Version byte must be 1
-        fprintf(stderr, "Bad version: FLV version is not 1\n");
-        return false;
-    }
+    fprintf(stderr, "Adaptive encoder: %d segments, %d access units in %.1f ms, %d errors\n",
+            n_segments.load(), (int)n_access_units, elapsed_ms, timeline.errorsCount());
 
-    unsigned char flags_byte = buf[4];
+    controller->printStatistics();
 
-    if (flags_byte != 1)
-    {
-        fprintf(stderr, "Bad flag byte: flags_byte = %d ... Bitmask: 0x04 is audio, 0x01 is video (so 0x05 is audio+video), but we expect video only\n", (int)flags_byte);
-        return false;
-    }
-    
-    // Read first packet(and ignore it).
-    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process, buf);
+    return success;
+}
 
-    if (flv_payload_size < 0)
-    {
-        fprintf(stderr, "Error: ReadFlvPacketHeader (in ReadFlvFileHeaderAndFirstPayload) returned negative value (marking an error)\n");
-        return false;
-    }
 
-    // Read "frame_type and _codec_id" byte and "AVC packet type" and payload data.
-    success = ffmpeg_process->stdoutRead(flv_payload_size, buf);
+// Test the rate adaptive encoder: a link budget of <budget_kbps> below the bitrate of the best level (crf 10 of the synthetic video) makes the controller
+// step down the ladder - the workers are swapped at the GOP boundaries, and the continuous stream is written to out_adaptive.264.
+// One pre-spawned worker per level (the pool replaces a leased worker in the background, so the ladder can be walked back up as well).
+static inline int AdaptiveStreamTest(const int budget_kbps, const int width, const int height, const int n_frames, const int fps)
+{
+    std::vector<CFfmpegWorkerPool*> pools(g_n_rate_levels, nullptr);
 
-    if (!success)
+    for (int k = 0; k < g_n_rate_levels; k++)
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
-        return false;
+        pools[k] = CFfmpegWorkerPool::Create("./ffmpeg", "ffmpeg", FfmpegEncoderArg(width, height, fps, true, false, g_rate_ladder_crf[k]), 1, 1048576);
+
+        if (pools[k] == nullptr)
+        {
+            ErrorExit("CFfmpegWorkerPool::Create failed");
+        }
     }
-    
-    int codec_id = (int)buf[0] & 0xF;
-    //int frame_type = (int)buf[0] >> 4;  // 1 - keyframe, 2 - inter frame
 
-    if (codec_id != 7)
+    CRateController controller(g_n_rate_levels, budget_kbps);
+
+    bool success = EncodeAdaptiveStream(pools, &controller, width, height, n_frames, fps, g_gop_size, "out_adaptive.264", nullptr);
+
+    for (int k = 0; k < g_n_rate_levels; k++)
     {
-        fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", (int)codec_id);
-        return false;
+        pools[k]->printStatistics();
+        CFfmpegWorkerPool::DeleteObj(pools[k]);
     }
 
-    // Read AVC packet type for testing
-    //int avc_packet_type = (int)buf[1]  // 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
-
-    // Ignore the data of the first payload (the first payload is just "meta data").
+    fprintf(stderr, "Rate adaptation test %s\n", success ? "completed" : "failed");
 
-    return true;
+    return success ? 0 : 1;
 }
 
 
-// Read the 5 bytes of FLV packet header, and return codec_id
-// https://www.adobe.com/content/dam/acom/en/devnet/flv/video_file_format_spec_v10.pdf
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// <annexb_payload_buf> - Pointer to output buffer (Annex B payload) - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return Codec ID if success.
-static int ReadPacket5BytesHeader(CSubprocess *ffmpeg_process, unsigned char *buf)
+// Ways of reading the FLV streams (and writing the raw frames) swept by the benchmark.
+enum EReadStrategy
 {
-    // Read "frame_type and _codec_id" byte and avc_packet_type and composition_time.
-    // According to video_file_format_spec_v10.pdf, if codec_id = 7, next comes AVCVIDEOPACKET
-    bool success = ffmpeg_process->stdoutRead(5, buf);
+    READ_THREADS,       // Writer thread and reader thread per stream (blocking PIPEs, see EncodeSingleStream).
+    READ_EPOLL_FARM     // Non-blocking PIPEs of all the streams multiplexed by epoll event loops (CEncoderFarm).
+};
 
-    if (!success)
-    {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadPacket5BytesHeader\n");
-        return -1;
-    }
 
-    int codec_id = (int)buf[0] & 0xF;
-    //int frame_type = (int)buf[0] >> 4;  // 1 - keyframe, 2 - inter frame
+// Parameters of one benchmark run.
+struct CBenchmarkConfig
+{
+    int width;
+    int height;
+    int n_frames;
+    int n_streams;
+    int pipe_buf_size;
+    EReadStrategy read_strategy;
+};
 
-    if (codec_id != 7)
-    {
-        fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", (int)codec_id);
-        return -1;
-    }
-    
-    unsigned char avc_packet_type = buf[1]; //# 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
 
-    if (avc_packet_type != 1)
+// Return process CPU time (user + system) in nanoseconds - RUSAGE_SELF, or RUSAGE_CHILDREN (the FFmpeg processes that ended and were waited for).
+static int64_t ProcessCpuNanos(const int who)
+{
+    struct rusage usage;
+
+    if (getrusage(who, &usage) != 0)
     {
-        fprintf(stderr, "Bad packet type: avc_packet_type = %d instead of 1\n", (int)codec_id);
-        return -1;
+        return 0;
     }
 
-    return codec_id;
+    return ((int64_t)usage.ru_utime.tv_sec + (int64_t)usage.ru_stime.tv_sec) * 1000000000LL +
+           ((int64_t)usage.ru_utime.tv_usec + (int64_t)usage.ru_stime.tv_usec) * 1000LL;
 }
 
 
-// Read FLV payload, and convert it to AVC Annex B format.
-// Return Annex B data as bytes array(return None if end of file).
-// The FLV payload may contain several AVC NAL units(in AVCC format).
-// https://yumichan.net/video-processing/video-compression/introduction-to-h264-nal-unit/ """
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// <annexb_payload_buf> - Pointer to output buffer (Annex B payload) - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return Annex B payload size if success.
-static int ReadFlvPayloadAndConvertToAnnexB(CSubprocess *ffmpeg_process, unsigned char *buf, unsigned char *annexb_payload_buf)
+// Execute one benchmark run, and print the results as a single JSON line to stdout (machine readable, one line per run).
+// The encoded streams are written to /dev/null (the output stage measures the cost of the write, not the cost of a disk).
+// Return true in case of success.
+static bool RunBenchmark(const CBenchmarkConfig &cfg, const int fps)
 {
-    int annexb_payload_idx = 0; // Index in annexb_payload_buf
+    const std::string ffmpeg_arg = FfmpegEncoderArg(cfg.width, cfg.height, fps, true);
+    CPipelineStats stats;
+    bool success = true;
 
-    // Read first packet(and ignore it).
-    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process, buf);  
+    const int64_t self_cpu_start_ns = ProcessCpuNanos(RUSAGE_SELF);
+    const int64_t children_cpu_start_ns = ProcessCpuNanos(RUSAGE_CHILDREN);
+    const int64_t t_start_ns = MonotonicNanos();
 
-    if (flv_payload_size < 0)
+    if (cfg.read_strategy == READ_THREADS)
     {
-        fprintf(stderr, "Error: ReadFlvPacketHeader returned negative value (marking an error)\n");
-        return -1;
-    }
-
-    int codec_id = ReadPacket5BytesHeader(ffmpeg_process, buf);
+        // Each stream has its own writer, reader and consumer threads.
+        std::vector<std::thread> threads;
+        std::vector<CPipelineStats> stream_stats(cfg.n_streams);
+        std::atomic<int> n_failed(0);
 
-    if (codec_id < 0)
-    {
-        fprintf(stderr, "Error: ReadPacket5BytesHeader failed\n");
-        return -1;
-    }
+        for (int k = 0; k < cfg.n_streams; k++)
+        {
+            threads.push_back(std::thread([&cfg, &ffmpeg_arg, &stream_stats, &n_failed, k]()
+            {
+                if (!EncodeSingleStream(ffmpeg_arg, "", cfg.width, cfg.height, cfg.n_frames, cfg.pipe_buf_size, "/dev/null", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &stream_stats[k]))
+                {
+                    n_failed++;
+                }
+            }));
+        }
 
-    flv_payload_size -= 5;  // After reading the "5 Bytes Header", remaining size is 5 bytes less
+        for (int k = 0; k < cfg.n_streams; k++)
+        {
+            threads[k].join();
+            stats.add(stream_stats[k]);
+        }
 
-    // Keep reading AVC NAL units, until flv_payload_size is zero (flv_payload_size holds the remaining size).
-    while (flv_payload_size > 0)
+        success = (n_failed.load() == 0);
+    }
+    else
     {
-        bool success = ffmpeg_process->stdoutRead(4, buf);  // Read NAL unit size(uin32, big endian).
+        CEncoderFarm *farm = CEncoderFarm::Create(0);
 
-        if (!success)
+        for (int k = 0; (k < cfg.n_streams) && success; k++)
         {
-            fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPayloadAndConvertToAnnexB\n");
-            return -1;
+            CEncoderSession *session = CEncoderSession::Create(k, ffmpeg_arg, cfg.width, cfg.height, cfg.n_frames, "/dev/null",
+                                                               0, 2, QUEUE_BLOCK, cfg.pipe_buf_size);
+
+            if (session == nullptr)
+            {
+                success = false;
+                break;
+            }
+
+            session->enableStageTimes();
+            farm->addSession(session);
         }
 
-        flv_payload_size -= 4;  // Remaining size is 4 bytes less
+        success = success && farm->run();
+        farm->addStatistics(&stats);
+        success = CEncoderFarm::DeleteObj(farm) && success;     // Waits for the FFmpeg processes to end.
+    }
 
+    const double wall_s = (double)(MonotonicNanos() - t_start_ns) * 1e-9;
+    const double self_cpu_ms = (double)(ProcessCpuNanos(RUSAGE_SELF) - self_cpu_start_ns) * 1e-6;
+    const double ffmpeg_cpu_ms = (double)(ProcessCpuNanos(RUSAGE_CHILDREN) - children_cpu_start_ns) * 1e-6;
+    const double n_total_frames = (double)cfg.n_frames * cfg.n_streams;
 
-        // Convert uint32 big - endian to integer value
-        int nal_size = ((int)buf[0] << 24) + ((int)buf[1] << 16) + ((int)buf[2] << 8) + (int)buf[3];
+#if defined(DO_WRITE_NAL_UNITS_WITH_WRITEV)
+    const char *annexb_mode = "writev";
+#elif defined(DO_CONVERT_ANNEXB_IN_PLACE)
+    const char *annexb_mode = "in_place";
+#else
+    const char *annexb_mode = "copy";
+#endif
 
-        success = ffmpeg_process->stdoutRead(nal_size, buf);    //Read NAL unit data
+#ifdef DO_WRITE_RAW_FRAMES_WITH_VMSPLICE
+    const bool is_vmsplice = (cfg.read_strategy == READ_THREADS);
+#else
+    const bool is_vmsplice = false;
+#endif
 
-        if (!success)
-        {
-            fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPayloadAndConvertToAnnexB\n");
-            return -1;
-        }
+    printf("{\"width\": %d, \"height\": %d, \"frames\": %d, \"streams\": %d, \"pipe_buf_size\": %d, \"read_strategy\": \"%s\", "
+           "\"pixel_format\": \"%s\", \"annexb_mode\": \"%s\", \"vmsplice\": %s, \"success\": %s, "
+           "\"wall_s\": %.3f, \"fps\": %.1f, \"stdin_mb_s\": %.1f, \"stdout_mb_s\": %.2f, "
+           "\"stdin_syscalls_per_frame\": %.2f, \"stdout_syscalls_per_frame\": %.2f, "
+           "\"cpu_ms\": {\"gen\": %.1f, \"write\": %.1f, \"parse\": %.1f, \"output\": %.1f, \"process\": %.1f, \"ffmpeg\": %.1f}}\n",
+           cfg.width, cfg.height, cfg.n_frames, cfg.n_streams, cfg.pipe_buf_size, (cfg.read_strategy == READ_THREADS) ? "threads" : "epoll_farm",
+           g_raw_pixel_format, annexb_mode, is_vmsplice ? "true" : "false", success ? "true" : "false",
+           wall_s, n_total_frames / wall_s, (double)stats.stdin_counters.n_bytes / wall_s / 1e6, (double)stats.stdout_counters.n_bytes / wall_s / 1e6,
+           (double)stats.stdin_counters.n_syscalls / n_total_frames, (double)stats.stdout_counters.n_syscalls / n_total_frames,
+           (double)stats.cpu.gen_ns * 1e-6, (double)stats.cpu.write_ns * 1e-6, (double)stats.cpu.parse_ns * 1e-6, (double)stats.cpu.output_ns * 1e-6,
+           self_cpu_ms, ffmpeg_cpu_ms);
+    fflush(stdout);
+
+    if (stats.n_access_units != (int64_t)cfg.n_frames * cfg.n_streams)
+    {
+        fprintf(stderr, "Benchmark: %d x %d, %d streams - %d access units instead of %d\n",
+                cfg.width, cfg.height, cfg.n_streams, (int)stats.n_access_units, cfg.n_frames * cfg.n_streams);
+        success = false;
+    }
 
-        flv_payload_size -= nal_size;  // Remaining size is nal_size bytes less
+    return success;
+}
 
-        // The number of leading zeros(2 or 3) has minor differences between encoders(the implementation tries to match the selected encoder).
-        // if do_use_intel_quick_sync if ((nal_data[0] & 0xF) == 5) or (nal_data[0] & 0xF == 1)... See Python code sample...       
-        if (((buf[0] & 0xF) == 5) || ((buf[0] & 0xF) == 6))
-        {
-            // Coded slice of an IDR picture(for some reason begins with only 2 zeros when encoding with libx264)
-            // SEI NAL unit(nal_data[0] == 6) is also begin with only 2 zeros.
-            // annexb_payload_head = b'\x00\x00\x01'  # Concatenate[0, 0, 1] to end of annexb_payload, and then NAL data
-            annexb_payload_buf[annexb_payload_idx]      = 0;
-            annexb_payload_buf[annexb_payload_idx+1]    = 0;
-            annexb_payload_buf[annexb_payload_idx+2]    = 1;
-            annexb_payload_idx += 3;    // Advance index by 3 (3 bytes were inserted).
-        }
-        else
+
+// Benchmark sweep: every combination of the resolutions, frame counts, numbers of concurrent streams, PIPE sizes and read strategies.
+// Redirect stdout to a file (like "./app > bench.jsonl") for keeping the results, and compare the results of two builds for tracking regressions.
+// Return 0 if all the runs succeeded.
+static inline int BenchmarkSweep(const int fps)
+{
+    static const int resolutions[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+    static const int frame_counts[] = { 100 };
+    static const int stream_counts[] = { 1, 4 };
+    static const int pipe_buf_sizes[] = { 65536, 1048576 };
+    static const EReadStrategy read_strategies[] = { READ_THREADS, READ_EPOLL_FARM };
+
+    int n_failed = 0;
+
+    for (const auto &resolution : resolutions)
+    {
+        for (const int n_frames : frame_counts)
         {
-            // Other NAL units begins with 0 0 0 0 1 (for matching FFmpeg Annex B encoded stream)
-            // annexb_payload_head = b'\x00\x00\x00\x01'  # Concatenate[0, 0, 0, 1] to end of annexb_payload, and then NAL data
-            annexb_payload_buf[annexb_payload_idx]      = 0;
-            annexb_payload_buf[annexb_payload_idx + 1]  = 0;
-            annexb_payload_buf[annexb_payload_idx + 2]  = 0;
-            annexb_payload_buf[annexb_payload_idx + 3]  = 1;
-            annexb_payload_idx += 4;    // Advance index by 4 (4 bytes were inserted).
-        }
+            for (const int n_streams : stream_counts)
+            {
+                for (const int pipe_buf_size : pipe_buf_sizes)
+                {
+                    for (const EReadStrategy read_strategy : read_strategies)
+                    {
+                        const CBenchmarkConfig cfg = { resolution[0], resolution[1], n_frames, n_streams, pipe_buf_size, read_strategy };
 
-        // Concatenate NAL data in Annex B format to annexb_payload
-        // Copy NAL unit data from buf to annexb_payload_buf (not most efficient solution, but probably negligible).
-        memcpy(&annexb_payload_buf[annexb_payload_idx], buf, nal_size);
-        annexb_payload_idx += nal_size; // Advance index by nal_size bytes.
+                        if (!RunBenchmark(cfg, fps))
+                        {
+                            n_failed++;
+                        }
+                    }
+                }
+            }
+        }
     }
 
-    // The value of annexb_payload_idx equals the number of bytes copied to annexb_payload_buf.
-    return annexb_payload_idx;
+    fprintf(stderr, "Benchmark: %d runs failed\n", n_failed);
+
+    return (n_failed == 0) ? 0 : 1;
 }
 
+
 int main()
 {
     fprintf(stderr, "Start execution...\n");
@@ -938,227 +8980,255 @@ int main()
     const int n_frames = 100;
     const int fps = 25;
 
-    const int raw_image_size_in_bytes = width * height * 3;	// raw video frame size in bytes (3 bytes per pixel).
+#ifdef DO_RUN_BENCHMARK
+    return BenchmarkSweep(fps);
+#endif
 
-    bool success;
-    int annexb_payload_len;
+    const std::string ffmpeg_arg = FfmpegEncoderArg(width, height, fps, true);
+    const std::string ffmpeg_test_arg = FfmpegEncoderArg(width, height, fps, false);
 
-    FILE *out_f = nullptr;
+#ifdef DO_TEST_MULTI_STREAM_FARM
+    // 8 streams, and one event loop per CPU core (but no more loops than streams).
+    return MultiStreamFarmTest(8, 0, width, height, n_frames, ffmpeg_arg, ffmpeg_test_arg);
+#endif
 
-    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
-    unsigned char *flv_bytes = new unsigned char[raw_image_size_in_bytes];  // Allocate much larger buffer than necessary.
-    unsigned char *annexb_payload_buf = new unsigned char[raw_image_size_in_bytes];  // Allocate much larger buffer than necessary.
+#ifdef DO_TEST_CRASH_RECOVERY
+    // 3 streams - the streams crash at frames 10, 35 and 60.
+    return CrashRecoveryTest(3, 0, width, height, n_frames, fps, ffmpeg_arg);
+#endif
 
-    if ((raw_img_bytes == nullptr) || (flv_bytes == nullptr) || (annexb_payload_buf == nullptr))
-    {
-        ErrorExit("Memory allocation error???");
-    }
+#ifdef DO_TEST_BUFFER_POOL
+    return BufferPoolTest();
+#endif
 
-#ifdef DO_TEST_ZERO_LATENCY
-    const int n_frames_latency = 0; // Latency of zero frames
+#ifdef DO_TEST_PARSER_BENCHMARK
+    // One thread per CPU core, at least 500 ms per measurement, and 4096 mutations.
+    return ParserBenchmarkTest(0, 500, 4096, width, height, n_frames, ffmpeg_arg);
+#endif
 
-    // FFmpeg subprocess with input PIPE (raw BGR video frames) and output PIPE (H.264 encoded stream in FLV container).
-    const std::string ffmpeg_arg =
-        "-hide_banner -threads 1 -framerate " + std::to_string(fps) +
-        " -video_size " + std::to_string(width) + "x" + std::to_string(height) +
-        " -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
-        "-x264-params bframes=0:force-cfr=1:no-mbtree=1:sync-lookahead=0:sliced-threads=1:rc-lookahead=0 " +
-        "-g 10 -pix_fmt yuv444p -crf 10 " +
-        "-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -bsf:v dump_extra -an -sn -dn pipe:";
+#ifdef DO_TEST_CONVERT_FLV_FILES
+    // 64 mapped copies of the recording, and one conversion thread per CPU core.
+    return ConvertFlvFilesTest(64, 0, width, height, n_frames, ffmpeg_arg, ffmpeg_test_arg);
+#endif
 
+#ifdef DO_TEST_SHARDED_ENCODER
+    // 4 shards (the synthetic video is 4 GOPs).
+    return ShardedStreamTest(4, width, height, n_frames, fps);
+#endif
 
-    // FFmpeg subprocess with same arguments, but without FLV container, and save output to a file (instead of stdout PIPE) for testing.
-    const std::string ffmpeg_test_arg =
-        "-y -hide_banner -threads 1 -framerate " + std::to_string(fps) +
-        " -video_size " + std::to_string(width) + "x" + std::to_string(height) +
-        " -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
-        "-x264-params bframes=0:force-cfr=1:no-mbtree=1:sync-lookahead=0:sliced-threads=1:rc-lookahead=0 " +
-        "-g 10 -pix_fmt yuv444p -crf 10 -f h264 -an -sn -dn out.264";
+#ifdef DO_TEST_RATE_ADAPTATION
+    // 500 kbit/s link budget.
+    return AdaptiveStreamTest(500, width, height, n_frames, fps);
+#endif
+
+#ifdef DO_MEASURE_LATENCY
+    CLatencyStats latency_stats_obj(n_frames, fps);
+    CLatencyStats *latency_stats = &latency_stats_obj;
 #else
-    // Using the following setting results latency of many frames
-    const int n_frames_latency = 26;  // The exact value was found by trial and error
+    CLatencyStats *latency_stats = nullptr;
+#endif
 
-    // FFmpeg subprocess with input PIPE (raw BGR video frames) and output PIPE (H.264 encoded stream in FLV container).
-    const std::string ffmpeg_arg =
-        "-hide_banner -threads 1 -framerate " + std::to_string(fps) +
-        " -video_size " + std::to_string(width) + "x" + std::to_string(height) +
-        " -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
-        "-g 25 -bf 3 -pix_fmt yuv444p -crf 10 " +
-        "-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -bsf:v dump_extra -an -sn -dn pipe:";
+#ifdef DO_VERIFY_ACCESS_UNITS
+    // Hash every access unit (a production canary may hash one of N access units - the size of every access unit is still compared).
+    const int verify_sample_period = 1;
 
+    // The reference (out.264) is encoded only when it doesn't exist (first run) - the next runs verify the output in process.
+    // Note: out.264 must be deleted after changing the encoder arguments (or the resolution, or the number of frames).
+    CAccessUnitVerifier *verifier = CAccessUnitVerifier::Create("out.264", verify_sample_period);
 
-    // FFmpeg subprocess with same arguments, but without FLV container, and save output to a file (instead of stdout PIPE) for testing.
-    const std::string ffmpeg_test_arg =
-        "-y -hide_banner -threads 1 -framerate " + std::to_string(fps) +
-        " -video_size " + std::to_string(width) + "x" + std::to_string(height) +
-        " -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
-        "-g 25 -bf 3 -pix_fmt yuv444p -crf 10 -f h264 -an -sn -dn out.264";
+    if (verifier == nullptr)
+    {
+        fprintf(stderr, "Verifier: reference out.264 is not found - encoding the reference by the test process\n");
+    }
+#else
+    CAccessUnitVerifier *verifier = nullptr;
+#endif
 
+#ifdef DO_SEND_RTP
+    // The stream may be played by FFplay with SDP file (the SPS and PPS are sent in band, before each IDR frame):
+    // v=0 / o=- 0 0 IN IP4 127.0.0.1 / s=pipe_flv2annexb / c=IN IP4 127.0.0.1 / t=0 0 / m=video 5004 RTP/AVP 96 / a=rtpmap:96 H264/90000 / a=fmtp:96 packetization-mode=1
+    // ffplay -protocol_whitelist file,udp,rtp stream.sdp
+#ifdef DO_USE_UDP_GSO
+    CRtpSender *rtp_sender = CRtpSender::Create(RTP_DEST_IP, RTP_DEST_PORT, RTP_MAX_PACKET_SIZE, true, true);
+#else
+    CRtpSender *rtp_sender = CRtpSender::Create(RTP_DEST_IP, RTP_DEST_PORT, RTP_MAX_PACKET_SIZE, false, true);
 #endif
 
-    // Create subprocess with stdin PIPE and stdout PIPE (first argument may be full path like "/usr/bin/ffmpeg", the second is the process name).
-    // FFmpeg Static Builds for Linux: https://johnvansickle.com/ffmpeg/
-    // Set PIPE buffer size to 1MB (1MB is the [default] maximum buffer size of unprivileged process in Ubuntu 18.04 64 bit)
-    CSubprocess *ffmpeg_process = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_arg, true, true, 1048576);
+    if (rtp_sender == nullptr)
+    {
+        ErrorExit("CRtpSender::Create failed");
+    }
+#else
+    CRtpSender *rtp_sender = nullptr;
+#endif
 
-    if (ffmpeg_process == nullptr)
+#ifdef DO_ATTACH_FRAME_METADATA
+    // The frames in the pipeline: stdin PIPE, the encoder delay, stdout PIPE and the access units ring (256 frames are much more than needed).
+    CFrameMetadataQueue *metadata_queue = CFrameMetadataQueue::Create(g_frame_metadata_uuid, fps, 256);
+
+    if (metadata_queue == nullptr)
     {
-        ErrorExit("CreateProcess ffmpeg_process");
+        ErrorExit("CFrameMetadataQueue::Create failed");
     }
+#else
+    CFrameMetadataQueue *metadata_queue = nullptr;
+#endif
 
-    // Create subprocess with stdin PIPE (used for testing).
-    // Warning: output file name containing spaces in not supported by current implementation.
-    CSubprocess *ffmpeg_test_process = CSubprocess::Popen("./ffmpeg", "ffmpeg", ffmpeg_test_arg, true, false, 1048576);
+    int exit_code = 0;
 
-    if (ffmpeg_test_process == nullptr)
+#ifdef DO_TEST_LATE_SUBSCRIBER
+    // The eviction is tested first with synthetic access units (the stream of the test never has a GOP larger than the cache).
+    CBufferPool *eviction_test_pool = CBufferPool::Create(4096, 1048576);
+
+    if ((eviction_test_pool == nullptr) || (!GopCacheEvictionTest(eviction_test_pool)))
     {
-        ErrorExit("CreateProcess ffmpeg_test_process");
+        exit_code = 1;
     }
 
-    bool was_broken_by_error = false;
+    if (eviction_test_pool != nullptr)
+    {
+        CBufferPool::DeleteObj(eviction_test_pool);
+    }
 
-    for (int i = 0; i < n_frames; i++)
+    // Cache the last 2 GOPs (up to 16MB), and join after 60 access units (in the middle of the third GOP - the subscriber starts at frame 50).
+    CGopCache *gop_cache = CGopCache::Create(2, 16 * 1048576);
+
+    if (gop_cache == nullptr)
     {
-        MakeRawFrameAsBytes(width, height, i, raw_img_bytes);
+        ErrorExit("CGopCache::Create failed");
+    }
 
-        success = ffmpeg_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
+    int64_t late_joined_seq = -1;
+    std::thread late_subscriber_thread(LateSubscriberThread, gop_cache, 60, "out_late.264", &late_joined_seq);
+#else
+    CGopCache *gop_cache = nullptr;
+#endif
 
-        if (!success)
-        {
-            fprintf(stderr, "Unsuccessful ffmpeg_process write to PIPE\n");
-            was_broken_by_error = true;
-            break;
-        }
+    CMetricsExporter *metrics_exporter = CreateMetricsExporter();
 
-        // For testing
-        success = ffmpeg_test_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
+    // Set PIPE buffer size to 1MB (1MB is the [default] maximum buffer size of unprivileged process in Ubuntu 18.04 64 bit)
+    // out_avcc.264 file is used for testing - used for comparing the FLV converted output to out.264 (output of ffmpeg_test_process).
+    if (!EncodeSingleStream(ffmpeg_arg, (verifier == nullptr) ? ffmpeg_test_arg : "", width, height, n_frames, 1048576, "out_avcc.264",
+                            latency_stats, verifier, rtp_sender, metadata_queue, gop_cache, metrics_exporter, nullptr))
+    {
+        fprintf(stderr, "Encoding failed\n");
+        exit_code = 1;
+    }
 
-        if (!success)
-        {
-            fprintf(stderr, "Unsuccessful ffmpeg_test_process write to PIPE\n");
-            was_broken_by_error = true;
-            break;
-        }
+    // The start codes of the encoder are verified against its own Annex B stream (the hardware encoders conventions are not verified otherwise).
+    if (!VerifyStartCodeConvention("out.264"))
+    {
+        exit_code = 1;
+    }
 
-        if (i == 0)
-        {
-            // Read FLV header that should be ignored.
-            success = ReadFlvFileHeaderAndFirstPayload(ffmpeg_process, flv_bytes);
+#ifdef DO_TEST_LATE_SUBSCRIBER
+    late_subscriber_thread.join();
+    gop_cache->printStatistics();
+    CGopCache::DeleteObj(gop_cache);
 
-            if (!success)
-            {
-                fprintf(stderr, "ReadFlvFileHeaderAndFirstPayload failed\n");
-                was_broken_by_error = true;
-                break;
-            }
+    if (metadata_queue == nullptr)
+    {
+        // The late subscriber output is the end of out_avcc.264 (the cache has no metadata SEI, so there is nothing to compare with metadata).
+        CMappedFile *late_file = CMappedFile::Create("out_late.264");
+        CMappedFile *full_file = CMappedFile::Create("out_avcc.264");
+        const bool is_match = (late_joined_seq >= 0) && (late_file != nullptr) && (full_file != nullptr) && (late_file->size() <= full_file->size()) &&
+                              (memcmp(late_file->data(), full_file->data() + (full_file->size() - late_file->size()), late_file->size()) == 0);
 
-            // Open output file (Annex B stream format)
-			// out_avcc.264 file is used for testing - used for comparing the FLV converted output to out.264 (output of ffmpeg_test_process).
-            out_f = fopen("out_avcc.264", "wb");
+        fprintf(stderr, "Late subscriber: joined at access unit %lld - out_late.264 %s the end of out_avcc.264\n",
+                (long long)late_joined_seq, is_match ? "matches" : "doesn't match");
 
-            if (out_f == nullptr)
-            {
-                fprintf(stderr, "Error: failed to open file out_avcc.264 for writing\n");
-                was_broken_by_error = true;
-                break;
-            }
+        if (!is_match)
+        {
+            exit_code = 1;
         }
 
-        // Assume <n_frames_latency> frames latency
-        // Note: the reading process is supposed to be in a separate thread (performed here for simplicity).
-        if (i >= n_frames_latency)
+        if (late_file != nullptr)
         {
-            // Read FLV payload data and convert the AVC NAL unit / units from AVCC format to Annex B format.
-            annexb_payload_len = ReadFlvPayloadAndConvertToAnnexB(ffmpeg_process, flv_bytes, annexb_payload_buf);
-
-            if (annexb_payload_len < 0)
-            {
-                fprintf(stderr, "ReadFlvPayloadAndConvertToAnnexB failed\n");
-                was_broken_by_error = true;
-                break;
-            }
+            CMappedFile::DeleteObj(late_file);
+        }
 
-            // Write encoded frame to output file.
-            // Note: "encoded frame" may contain few NAL units, but each FLV payload applies one "encoded frame" (one "access unit").
-            fwrite(annexb_payload_buf, 1, annexb_payload_len, out_f);  // Write to file for testing.
+        if (full_file != nullptr)
+        {
+            CMappedFile::DeleteObj(full_file);
         }
     }
+#endif
 
-    // Close the "test process" (close the FFmpeg process that writes to out.264 file - used as reference).
-    //////////////////////////////////////////////////////////////////////////
-    success = ffmpeg_test_process->stdinClose();
-
-    if (!success)
+    if (metadata_queue != nullptr)
     {
-        ErrorExit("ffmpeg_test_process->stdinClose");
-    }
+        metadata_queue->printStatistics();
+
+        // The metadata SEI of each access unit must carry the frame index of the access unit (the SEI are decoded from the output file).
+        if (!VerifyFrameMetadataSei("out_avcc.264", metadata_queue->ptsLog()))
+        {
+            exit_code = 1;
+        }
 
-    success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process);
+        CFrameMetadataQueue::DeleteObj(metadata_queue);
+    }
 
-    if (!success)
+    if (metrics_exporter != nullptr)
     {
-        ErrorExit("StdInWr CloseHandle");
+        metrics_exporter->printStatistics();
+        CMetricsExporter::DeleteObj(metrics_exporter);
     }
-    //////////////////////////////////////////////////////////////////////////
-
 
-
-    if (!was_broken_by_error)
+    if (rtp_sender != nullptr)
     {
-        // Closing stdin "pushes" all the remaining frames from the encoder to stdout (FFmpeg feature).
-        success = ffmpeg_process->stdinClose();
+        rtp_sender->printStatistics();
+        CRtpSender::DeleteObj(rtp_sender);
+    }
 
-        if (!success)
+    if (verifier != nullptr)
+    {
+        // A mismatch of the output and the reference fails the execution (for scripts and CI).
+        if (!verifier->finish(0))
         {
-            ErrorExit("ffmpeg_process->stdinClose");
+            exit_code = 1;
         }
 
-        // Handle the last(delayed) "encoded frames".
-        for (int i = 0; i < n_frames_latency; i++)
-        {
-            // Read FLV payload data and convert the AVC NAL unit / units from AVCC format to Annex B format.
-            annexb_payload_len = ReadFlvPayloadAndConvertToAnnexB(ffmpeg_process, flv_bytes, annexb_payload_buf);
-
-            if (annexb_payload_len < 0)
-            {
-                fprintf(stderr, "ReadFlvPayloadAndConvertToAnnexB failed\n");
-                was_broken_by_error = true;
-                break;
-            }
-
-            fwrite(annexb_payload_buf, 1, annexb_payload_len, out_f);  // Write to file for testing.
-        }
+        CAccessUnitVerifier::DeleteObj(verifier);
     }
 
-    if (out_f != nullptr)
+    if (latency_stats != nullptr)
     {
-        fclose(out_f);	// Close out_avcc.264 file. 
-    }
+        latency_stats->print();
 
-    if (!was_broken_by_error)
-    {
-        // Read extra trailing 4 bytes (FFmpeg puts the 4 bytes as a footer [instead of a header of the next frame]).
-        success = ffmpeg_process->stdoutRead(4, flv_bytes);
+        // Each access unit must be matched to its source frame (the timestamps are relative to the first access unit - they are shifted with B-frames).
+        const bool is_all_matched = (latency_stats->unmatchedCount() == 0) && (latency_stats->matchedCount() == n_frames);
 
-        if (!success)
+        fprintf(stderr, "Latency: %d of %d access units matched to a source frame: %s\n", latency_stats->matchedCount(), n_frames, is_all_matched ? "PASS" : "FAIL");
+
+        if (!is_all_matched)
         {
-            fprintf(stderr, "Failed reading extra 4 footer bytes from sdtin???\n");
+            exit_code = 1;
         }
-    }
 
-    delete[] raw_img_bytes;
-    delete[] flv_bytes;
-    delete[] annexb_payload_buf;
+#ifdef DO_TEST_ZERO_LATENCY
+        // Check that the x264 parameters really achieve zero frames latency.
+        fprintf(stderr, "Zero frames latency: %s\n", (latency_stats->detectedDepth() == 0) ? "PASS" : "FAIL");
+#else
+        // Check the depth of the default tuning: the frames the encoder holds (lookahead, minus the lead of the B-frames anchors) - one less
+        // when FFmpeg reads the last frame before the writer thread counts it, and at most LATENCY_DEPTH_SLACK more
+        // (frames queued inside FFmpeg between the demuxer and the encoder, the VFR input frame of x264).
+        if (g_encoder_profile->default_depth >= 0)
+        {
+            const int depth = latency_stats->detectedDepth();
+            const int min_depth = std::max(g_encoder_profile->default_depth - 1, 0);
+            const int max_depth = g_encoder_profile->default_depth + LATENCY_DEPTH_SLACK;
+            const bool is_expected_depth = (depth >= min_depth) && (depth <= max_depth);
 
-	//Wait for FFmpeg child process to end, and delete ffmpeg_process object (cleanup).
-    success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_process);
-    
-    if (!success)
-    {
-        ErrorExit("StdInWr CloseHandle");
+            fprintf(stderr, "Encoder pipeline depth: %d frames, expected %d to %d: %s\n", depth, min_depth, max_depth, is_expected_depth ? "PASS" : "FAIL");
+
+            if (!is_expected_depth)
+            {
+                exit_code = 1;
+            }
+        }
+#endif
     }
 
     fprintf(stderr, "Finish execution!\n");
 
-    return 0;
+    return exit_code;
 }
@@ -6,6 +6,10 @@
 // the AVC NAL units are extracted and converted from AVCC to Annex B format.
 // The output is a file containing H.264 elementary stream(in Annex B format).
 // Detailed documentation is included in main_linux.cpp file (the high level of Windows and Linux implementations is the same).
+// The FLV parser is shared with main_linux.cpp (flv_parser.h) - this file implements the Windows I/O layer:
+// The PIPEs are named pipes opened with FILE_FLAG_OVERLAPPED, and the reads and writes of all the streams complete to one I/O completion port.
+// A small pool of worker threads (one per CPU core) serves any number of streams (there is no blocked thread per PIPE).
+// Note: the I/O completion port layer is not verified - it was not built or executed on Windows yet (only the Linux implementation is tested).
 
 #include <string>
 #include <math.h>
@@ -14,8 +18,13 @@
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <strsafe.h>
+#define NOMINMAX            // std::min and std::max (instead of the min and max macros of windows.h)
 #include <windows.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
+#include "flv_parser.h" // FLV parser and AVCC to Annex B conversion (shared with main_linux.cpp)
 
 #include "opencv2/opencv.hpp"
 #include "opencv2/highgui.hpp"
@@ -31,6 +40,10 @@
 //#undef DO_REDIRECT_STDERR_OF_CHILD_PROCESS_TO_STDOUT_OF_CURRENT_PROCESS
 
 
+//#define DO_TEST_MULTI_STREAM_FARM   // Enable for testing multiple concurrent FFmpeg processes, multiplexed by one I/O completion port (CIocpEncoderFarm).
+#undef DO_TEST_MULTI_STREAM_FARM      // Single stream (one session of CIocpEncoderFarm).
+
+
 // Build synthetic "raw BGR" image for testing, image data is stored in <raw_img_bytes> output data buffer.
 static void MakeRawFrameAsBytes(int width, int height, int i, unsigned char raw_img_bytes[])
 {
@@ -79,6 +92,14 @@ void ErrorExit(const TCHAR *lpszFunction)
 }
 
 
+// Subprocess with stdin and stdout PIPEs - the Windows I/O layer.
+// The PIPEs are named pipes with FILE_FLAG_OVERLAPPED (anonymous pipes of CreatePipe don't support overlapped I/O):
+// The parent side is overlapped (the reads and writes may complete to an I/O completion port), the child side is a regular handle
+// (FFmpeg reads stdin and writes stdout with blocking I/O).
+// stdinWrite and stdoutRead are blocking (the overlapped operation is started and waited for) - used when the PIPE is not served by a completion port.
+// Note: the API differs from CSubprocess of main_linux.cpp - Popen takes std::wstring, and there is no timeout (stdinWrite and stdoutRead
+// wait forever), no KillAndDeleteObj / hasExited, no stdoutReadPtr, and no counters or metrics. The non-blocking I/O is overlapped
+// (stdinWriteAsync and stdoutReadAsync complete to the port) instead of stdinWriteSome and stdoutReadSome with epoll.
 class CSubprocess
 {
 private:
@@ -92,6 +113,8 @@ private:
     wchar_t *m_cmd_as_wchar = nullptr;
     bool m_is_stdin_pipe    = false;
     bool m_is_stdout_pipe   = false;
+    HANDLE m_hProcess       = nullptr;  // Kept for waiting for the child process to end.
+    HANDLE m_hIoEvent       = nullptr;  // Event of the blocking (waited) overlapped operations.
 
     CSubprocess()
     {
@@ -103,21 +126,98 @@ private:
         {
             delete[] m_cmd_as_wchar;
         }
+
+        HANDLE handles[] = { m_hChildStd_IN_Rd, m_hChildStd_IN_Wr, m_hChildStd_OUT_Rd, m_hChildStd_OUT_Wr, m_hProcess, m_hIoEvent };
+
+        for (int k = 0; k < (int)(sizeof(handles) / sizeof(handles[0])); k++)
+        {
+            if (handles[k] != nullptr)
+            {
+                CloseHandle(handles[k]);
+            }
+        }
+    }
+
+    // Create a named pipe with unique name: <hServer> is the overlapped parent side (not inherited), <hClient> is the inherited child side.
+    // <is_inbound> - true: the parent reads (stdout of the child), false: the parent writes (stdin of the child).
+    static bool CreateOverlappedPipe(HANDLE *hServer, HANDLE *hClient, const bool is_inbound, SECURITY_ATTRIBUTES *saAttr, const int buf_size)
+    {
+        static std::atomic<int> pipe_serial(0);
+
+        wchar_t pipe_name[128];
+        swprintf_s(pipe_name, 128, L"\\\\.\\pipe\\pipe_flv2annexb.%08x.%08x", (unsigned int)GetCurrentProcessId(), (unsigned int)pipe_serial.fetch_add(1));
+
+        // https://docs.microsoft.com/en-us/windows/win32/api/winbase/nf-winbase-createnamedpipea
+        *hServer = CreateNamedPipeW(pipe_name,
+                                    (is_inbound ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                    PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                    1,                  // One instance
+                                    (DWORD)buf_size,    // Output buffer size
+                                    (DWORD)buf_size,    // Input buffer size
+                                    0,
+                                    NULL);              // The parent side is not inherited
+
+        if (*hServer == INVALID_HANDLE_VALUE)
+        {
+            *hServer = nullptr;
+            return false;
+        }
+
+        // Opening the client side connects the pipe (there is no need to call ConnectNamedPipe).
+        *hClient = CreateFileW(pipe_name, is_inbound ? GENERIC_WRITE : GENERIC_READ, 0, saAttr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (*hClient == INVALID_HANDLE_VALUE)
+        {
+            *hClient = nullptr;
+            CloseHandle(*hServer);
+            *hServer = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Wait for overlapped operation that was started on <h> (<is_started> is the return value of ReadFile/WriteFile).
+    // Return number of transferred bytes, or -1 in case of an error (GetLastError() returns the error).
+    static int WaitOverlapped(HANDLE h, OVERLAPPED *ov, const BOOL is_started)
+    {
+        if ((!is_started) && (GetLastError() != ERROR_IO_PENDING))
+        {
+            return -1;
+        }
+
+        DWORD n_bytes = 0;
+
+        if (!GetOverlappedResult(h, ov, &n_bytes, TRUE))
+        {
+            return -1;
+        }
+
+        return (int)n_bytes;
+    }
+
+    // Prepare OVERLAPPED structure of a blocking operation.
+    void initWaitedOverlapped(OVERLAPPED *ov)
+    {
+        ZeroMemory(ov, sizeof(OVERLAPPED));
+
+        // The low-order bit of hEvent prevents queueing a completion packet (in case the handle is associated with a completion port).
+        ov->hEvent = (HANDLE)((ULONG_PTR)m_hIoEvent | 1);
     }
 
     // Create a child process that uses the previously created pipes for STDIN and STDOUT.
-    bool createChildProcess()        
+    bool createChildProcess()
     {
         // TCHAR szCmdline[] = TEXT("child");
         PROCESS_INFORMATION piProcInfo;
         STARTUPINFO siStartInfo;
         BOOL bSuccess = FALSE;
 
-        // Set up members of the PROCESS_INFORMATION structure. 
+        // Set up members of the PROCESS_INFORMATION structure.
 
         ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
 
-        // Set up members of the STARTUPINFO structure. 
+        // Set up members of the STARTUPINFO structure.
         // This structure specifies the STDIN and STDOUT handles for redirection.
 
         ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
@@ -133,19 +233,21 @@ private:
 #endif
         /*** Rotem ***/
 
-        // Create the child process. 
+        // Create the child process.
+        // Note: all the inheritable handles are inherited - the child processes must be created by one thread
+        //       (the child side handles of a process are closed right after creating it, so the next child doesn't inherit them).
         bSuccess = CreateProcess(NULL,
                                  m_cmd_as_wchar,    // command line
-                                 NULL,              // process security attributes 
-                                 NULL,              // primary thread security attributes 
+                                 NULL,              // process security attributes
+                                 NULL,              // primary thread security attributes
                                  TRUE,              // handles are inherited
-                                 0,                 // creation flags 
-                                 NULL,              // use parent's environment 
-                                 NULL,              // use parent's current directory 
-                                 &siStartInfo,      // STARTUPINFO pointer 
-                                 &piProcInfo);      // receives PROCESS_INFORMATION 
+                                 0,                 // creation flags
+                                 NULL,              // use parent's environment
+                                 NULL,              // use parent's current directory
+                                 &siStartInfo,      // STARTUPINFO pointer
+                                 &piProcInfo);      // receives PROCESS_INFORMATION
 
-        // If an error occurs, exit the application. 
+        // If an error occurs, exit the application.
         if (!bSuccess)
         {
             //ErrorExit(TEXT("CreateProcess"));
@@ -153,16 +255,23 @@ private:
         }
         else
         {
-            // Close handles to the child process and its primary thread.
-            // Some applications might keep these handles to monitor the status
-            // of the child process, for example. 
-            CloseHandle(piProcInfo.hProcess);
+            // Keep the process handle (for waiting for the child process to end), and close the handle to its primary thread.
+            m_hProcess = piProcInfo.hProcess;
             CloseHandle(piProcInfo.hThread);
 
             // Close handles to the stdin and stdout pipes no longer needed by the child process.
             // If they are not explicitly closed, there is no way to recognize that the child process has ended.
-            CloseHandle(m_hChildStd_OUT_Wr);
-            CloseHandle(m_hChildStd_IN_Rd);
+            if (m_hChildStd_OUT_Wr != nullptr)
+            {
+                CloseHandle(m_hChildStd_OUT_Wr);
+                m_hChildStd_OUT_Wr = nullptr;
+            }
+
+            if (m_hChildStd_IN_Rd != nullptr)
+            {
+                CloseHandle(m_hChildStd_IN_Rd);
+                m_hChildStd_IN_Rd = nullptr;
+            }
 
             return true;
         }
@@ -184,34 +293,29 @@ public:
         sp->m_is_stdin_pipe     = is_stdin_pipe;
         sp->m_is_stdout_pipe    = is_stdout_pipe;
 
-        // Set the bInheritHandle flag so pipe handles are inherited. 
+        // Manual reset event of the blocking operations.
+        sp->m_hIoEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        if (sp->m_hIoEvent == nullptr)
+        {
+            fprintf(stderr, "Error: CreateEvent\n");
+            delete sp;
+            return nullptr;
+        }
+
+        // Set the bInheritHandle flag so the child side pipe handles are inherited.
         SECURITY_ATTRIBUTES saAttr;
         saAttr.nLength              = sizeof(SECURITY_ATTRIBUTES);
         saAttr.bInheritHandle       = TRUE;
         saAttr.lpSecurityDescriptor = NULL;
 
-        BOOL success;
-
         if (is_stdout_pipe)
         {
-            // Create a pipe for the child process's STDOUT.
-            success = CreatePipe(&sp->m_hChildStd_OUT_Rd, &sp->m_hChildStd_OUT_Wr, &saAttr, (DWORD)buf_size);
-
-            if (!success)
-            {
-                // ErrorExit(TEXT("StdoutRd CreatePipe"));
-                fprintf(stderr, "Error: StdoutRd CreatePipe\n");
-                delete sp;
-                return nullptr;
-            }
-
-            // Ensure the read handle to the pipe for STDOUT is not inherited.
-            success = SetHandleInformation(sp->m_hChildStd_OUT_Rd, HANDLE_FLAG_INHERIT, 0);
-
-            if (!success)
+            // Create a pipe for the child process's STDOUT (the read handle is not inherited).
+            if (!CreateOverlappedPipe(&sp->m_hChildStd_OUT_Rd, &sp->m_hChildStd_OUT_Wr, true, &saAttr, buf_size))
             {
                 // ErrorExit(TEXT("StdoutRd CreatePipe"));
-                fprintf(stderr, "Error: Stdout SetHandleInformation\n");
+                fprintf(stderr, "Error: StdoutRd CreateNamedPipe, error = %d\n", (int)GetLastError());
                 delete sp;
                 return nullptr;
             }
@@ -219,24 +323,11 @@ public:
 
         if (is_stdin_pipe)
         {
-            // Create a pipe for the child process's STDIN.
-            success = CreatePipe(&sp->m_hChildStd_IN_Rd, &sp->m_hChildStd_IN_Wr, &saAttr, (DWORD)buf_size);
-
-            if (!success)
+            // Create a pipe for the child process's STDIN (the write handle is not inherited).
+            if (!CreateOverlappedPipe(&sp->m_hChildStd_IN_Wr, &sp->m_hChildStd_IN_Rd, false, &saAttr, buf_size))
             {
                 // ErrorExit(TEXT("Stdin CreatePipe"));
-                fprintf(stderr, "Error: Stdin CreatePipe\n");
-                delete sp;
-                return nullptr;
-            }
-              
-            // Ensure the write handle to the pipe for STDIN is not inherited.
-            success = SetHandleInformation(sp->m_hChildStd_IN_Wr, HANDLE_FLAG_INHERIT, 0);
-
-            if (!success)
-            {
-                // ErrorExit(TEXT("Stdin SetHandleInformation"));
-                fprintf(stderr, "Error: Stdin SetHandleInformation\n");
+                fprintf(stderr, "Error: Stdin CreateNamedPipe, error = %d\n", (int)GetLastError());
                 delete sp;
                 return nullptr;
             }
@@ -251,88 +342,136 @@ public:
             delete sp;
             return nullptr;
         }
-        
+
         return sp;
     }
 
-    // Close sdtin PIPE and delete sp.
+    // Close sdtin and stdout PIPEs, wait for the child process to end, and delete sp.
+    // stdout is closed before waiting - a child that is still writing gets "broken pipe" (instead of waiting forever for a reader).
     static bool ClosePipeAndDeleteObj(CSubprocess *sp)
     {
+        bool success = true;
+
         if (sp != nullptr)
         {
-            if (sp->m_hChildStd_IN_Wr != nullptr)
+            success = sp->stdinClose();
+
+            if (sp->m_hChildStd_OUT_Rd != nullptr)
             {
-                BOOL success = CloseHandle(sp->m_hChildStd_IN_Wr);
+                CloseHandle(sp->m_hChildStd_OUT_Rd);
+                sp->m_hChildStd_OUT_Rd = nullptr;
+            }
 
-                if (!success)
-                {
-                    return false;
-                }
+            if (sp->m_hProcess != nullptr)
+            {
+                WaitForSingleObject(sp->m_hProcess, INFINITE);
             }
 
             delete sp;
         }
 
-        return true;
+        return success;
     }
 
-    // Write to stdin PIPE and flush
+    // Write to stdin PIPE (blocking - returns when all the bytes are in the PIPE).
+    // There is no FlushFileBuffers - flushing a PIPE waits until FFmpeg reads the whole frame.
     bool stdinWrite(const unsigned char *data_bytes, const unsigned int len)
     {
-        DWORD dwWritten = 0;
-
-        BOOL success = WriteFile(m_hChildStd_IN_Wr, (LPCVOID)data_bytes, (DWORD)len, &dwWritten, NULL);
+        unsigned int n_written = 0;
 
-        if (!success)
+        // Keep writing until all the <len> bytes are written.
+        while (n_written < len)
         {
-            return false;
-        }
-        else
-        {
-            if (dwWritten != (DWORD)len)
-            {
-                fprintf(stderr, "len = %d, dwWritten = %d  Why???\n", len, (int)dwWritten);
-            }            
-        }
+            OVERLAPPED ov;
+            initWaitedOverlapped(&ov);
 
-        success = FlushFileBuffers(m_hChildStd_IN_Wr);
+            BOOL is_started = WriteFile(m_hChildStd_IN_Wr, (LPCVOID)&data_bytes[n_written], (DWORD)(len - n_written), NULL, &ov);
+            int n = WaitOverlapped(m_hChildStd_IN_Wr, &ov, is_started);
 
-        if (!success)
-        {
-            fprintf(stderr, "FlushFileBuffers failed\n");
-            return false;
+            if (n < 0)
+            {
+                return false;
+            }
+
+            n_written += (unsigned int)n;
         }
 
         return true;
     }
 
-    // Read from stdout PIPE
+    // Read from stdout PIPE (blocking - returns when exactly <len> bytes are read).
     bool stdoutRead(const unsigned int len, unsigned char *data_bytes)
     {
-        DWORD dwRead = 0;
-
         // The third argument of ReadFile is nNumberOfBytesToRead is the "The maximum number of bytes to be read."
         // We must use a loop for reading exactly <len> bytes from the pipe.
-        int remain_len = (int)len;
-        unsigned char *data_bytes_ptr = data_bytes;
-        
-        // Keep reading until finish reading <len> bytes from the PIPE.
-        while (remain_len > 0)
+        unsigned int n_read = 0;
+
+        while (n_read < len)
         {
-            BOOL success = ReadFile(m_hChildStd_OUT_Rd, data_bytes_ptr, (DWORD)remain_len, &dwRead, NULL);
+            OVERLAPPED ov;
+            initWaitedOverlapped(&ov);
 
-            if (!success)
+            BOOL is_started = ReadFile(m_hChildStd_OUT_Rd, &data_bytes[n_read], (DWORD)(len - n_read), NULL, &ov);
+            int n = WaitOverlapped(m_hChildStd_OUT_Rd, &ov, is_started);
+
+            if (n < 0)
             {
                 return false;
             }
 
-            remain_len -= (int)dwRead;  // Subtract number of bytes read from remain_len
-            data_bytes_ptr += dwRead;   // Advance pointer by number of bytes read.
+            n_read += (unsigned int)n;
+        }
+
+        return true;
+    }
+
+    // Associate the PIPEs with I/O completion port <hPort> - the completions of stdinWriteAsync and stdoutReadAsync are queued to the port.
+    bool associateWithCompletionPort(HANDLE hPort, const ULONG_PTR completion_key)
+    {
+        // https://docs.microsoft.com/en-us/windows/win32/fileio/createiocompletionport
+        if ((m_hChildStd_IN_Wr != nullptr) && (CreateIoCompletionPort(m_hChildStd_IN_Wr, hPort, completion_key, 0) == nullptr))
+        {
+            return false;
+        }
+
+        if ((m_hChildStd_OUT_Rd != nullptr) && (CreateIoCompletionPort(m_hChildStd_OUT_Rd, hPort, completion_key, 0) == nullptr))
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Start overlapped write of <len> bytes to stdin PIPE (the completion is queued to the completion port, even if the write completes immediately).
+    // <ov> and <data_bytes> must be kept until the completion.
+    // Return false in case of an error (the write is not started).
+    bool stdinWriteAsync(const unsigned char *data_bytes, const unsigned int len, OVERLAPPED *ov)
+    {
+        ZeroMemory(ov, sizeof(OVERLAPPED));
+
+        if ((!WriteFile(m_hChildStd_IN_Wr, (LPCVOID)data_bytes, (DWORD)len, NULL, ov)) && (GetLastError() != ERROR_IO_PENDING))
+        {
+            return false;
         }
 
         return true;
     }
 
+    // Start overlapped read of up to <len> bytes from stdout PIPE (the completion is queued to the completion port).
+    // <ov> and <data_bytes> must be kept until the completion.
+    // Return 1 if the read is started, 0 if stdout PIPE is closed (the child process ended), and -1 in case of an error.
+    int stdoutReadAsync(unsigned char *data_bytes, const unsigned int len, OVERLAPPED *ov)
+    {
+        ZeroMemory(ov, sizeof(OVERLAPPED));
+
+        if ((!ReadFile(m_hChildStd_OUT_Rd, data_bytes, (DWORD)len, NULL, ov)) && (GetLastError() != ERROR_IO_PENDING))
+        {
+            return ((GetLastError() == ERROR_BROKEN_PIPE) || (GetLastError() == ERROR_HANDLE_EOF)) ? 0 : (-1);
+        }
+
+        return 1;
+    }
+
     // Close stdin PIPE
     // Note: there is some code duplication from ClosePipeAndDeleteObj function (but ClosePipeAndDeleteObj was [kind of] taken from Microsoft code sample, and just kept)
     bool stdinClose()
@@ -354,248 +493,514 @@ public:
 };
 
 
+class CIocpEncoderSession;
+
+// Type of overlapped operation of CIocpEncoderSession.
+enum EIocpOperationType
+{
+    IOCP_WRITE_STDIN,
+    IOCP_READ_STDOUT
+};
 
-// Read header of FLV packet and return FLV payload size
-// After the header, the file is split into packets called "FLV tags",
-// which have 15 - byte packet headers.
-// The first four bytes denote the size of the previous packet / tag
-// (including the header without the first field), and aid in seeking backward
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return flv_payload_size if success.
-static int ReadFlvPacketHeader(CSubprocess *ffmpeg_process, unsigned char *buf)
+// Overlapped operation - the completion port returns pointer to the OVERLAPPED structure (the first member), that identifies the session and the operation.
+struct CIocpOperation
 {
-    // Read size_of_previous_packet, packet_type, flv_payload_size, timestamp_lower, timestamp_upper, stream_id
-    bool success = ffmpeg_process->stdoutRead(4 + 1 + 3 + 3 + 1 + 3, buf);
+    OVERLAPPED ov;
+    CIocpEncoderSession *session;
+    EIocpOperationType type;
+};
 
-    if (!success)
+
+// Encoding session served by I/O completion port: one FFmpeg process, with at most one write and one read in flight.
+// The raw frames are written to stdin PIPE by overlapped writes - the next frame is made (and written) when the previous write completes.
+// The FLV stream is read from stdout PIPE by overlapped reads, and fed to the shared parser (CFlvParser);
+// when the parser is in the middle of a payload, the read goes directly to the payload buffer (no copy).
+// The write path and the read path may run concurrently (in two worker threads), but each path is sequential (one operation in flight),
+// so the state of each path is accessed by one thread at a time.
+class CIocpEncoderSession : public CFlvParserListener
+{
+private:
+    static const int READ_BUF_SIZE = 65536;
+
+    int m_id                    = 0;
+    CSubprocess *m_process      = nullptr;
+    CBufferPool *m_pool         = nullptr;  // FLV payload buffers.
+    CFlvParser<> *m_parser      = nullptr;
+    FILE *m_out_f               = nullptr;
+
+    // Write path (raw video frames).
+    int m_width                 = 0;
+    int m_height                = 0;
+    int m_n_frames              = 0;
+    int m_raw_frame_size        = 0;
+    unsigned char *m_raw_frame  = nullptr;
+    int m_n_sent                = 0;        // Number of frames completely written to stdin PIPE.
+    int m_n_written             = 0;        // Number of bytes of the current frame written so far.
+    CIocpOperation m_write_op;
+
+    // Read path (FLV stream).
+    unsigned char *m_read_buf   = nullptr;
+    bool m_is_direct_read       = false;    // true if the read in flight goes directly to the parser payload buffer.
+    CIocpOperation m_read_op;
+
+    std::atomic<int> m_n_open_paths;        // 2 while writing and reading, the session is done when both paths are done.
+    std::atomic<bool> m_is_failed;
+
+    CIocpEncoderSession() : m_n_open_paths(2), m_is_failed(false)
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPacketHeader\n");
-        return -1;
     }
 
-    //size_of_previous_packet = f.read(4)  # For first packet set to NULL(uint32 big - endian)
-    //packet_type = f.read(1)  # For first packet set to AMF Metadata
-    //flv_payload_size = f.read(3)  # For first packet set to AMF Metadata(uint24 big - endian)
-    //timestamp_lower = f.read(3)  # For first packet set to NULL(uint24 big - endian)
-    //timestamp_upper = f.read(1)  # Extension to create a uint32_be value(0)
-    //stream_id = f.read(3)  # For first stream of same type set to NULL(uint24 big - endian)
-    //if len(flv_payload_size) < 3: return 0  # End of file.
+    // Write the Annex B access unit to the output file.
+    bool onAccessUnit(CAccessUnit *au) override
+    {
+        fwrite(&au->buffer->data[au->annexb_payload_offset], 1, au->annexb_payload_len, m_out_f);
+        au->buffer->release();
 
-    int flv_payload_size = ((int)buf[5] << 16) + ((int)buf[6] << 8) + (int)buf[7];
+        return true;
+    }
 
-    // Convert uint24 big - endian to integer value
-    return flv_payload_size;
-}
+    // Mark one of the paths as done - return true if the session is done (both paths are done).
+    bool pathDone()
+    {
+        return m_n_open_paths.fetch_sub(1) == 1;
+    }
 
+    // Write path is done: close stdin PIPE - closing stdin "pushes" all the remaining frames from the encoder to stdout (FFmpeg feature).
+    bool writeDone()
+    {
+        m_process->stdinClose();
 
-// FLV files start with a standard header (9 bytes).
-// After the header comes the first payload, which contains irrelevant data.
-// The function reads the header and the first payload data.
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-static bool ReadFlvFileHeaderAndFirstPayload(CSubprocess *ffmpeg_process, unsigned char *buf)
-{
-    // https ://en.wikipedia.org/wiki/Flash_Video
-    // Read FLV signature, version, flag byte and 4 bytes "used to skip a newer expanded header".
-    bool success = ffmpeg_process->stdoutRead(5+4, buf);
+        return pathDone();
+    }
 
-    if (!success)
+    // Start writing the rest of the current frame.
+    // Return true if the session is done (the write failed, and the read path is done).
+    bool postWrite()
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
+        if (!m_process->stdinWriteAsync(&m_raw_frame[m_n_written], (unsigned int)(m_raw_frame_size - m_n_written), &m_write_op.ov))
+        {
+            fprintf(stderr, "Session %d: WriteFile failed, error = %d\n", m_id, (int)GetLastError());
+            m_is_failed.store(true);
+            return writeDone();
+        }
+
         return false;
     }
 
-    if (((char)buf[0] != 'F') || ((char)buf[1] != 'L') || ((char)buf[2] != 'V'))
+    // Start reading from stdout PIPE - directly to the payload buffer if the parser is in the middle of a payload.
+    // Return true if the session is done (stdout is closed or the read failed, and the write path is done).
+    bool postRead()
     {
-        // FLV file must start with "FLV" letters.
-        fprintf(stderr, "Bad signature: FLV stream doesn't start with FLV letters\n");
-        return false;
-    }
+        int len = 0;
+        unsigned char *ptr = m_parser->directWritePtr(&len);
 
-    unsigned char version_byte = buf[3];
+        m_is_direct_read = (ptr != nullptr);
 
-    if (version_byte != 1)
-    {
-        // Version byte must be 1
-        fprintf(stderr, "Bad version: FLV version is not 1\n");
-        return false;
-    }
+        if (!m_is_direct_read)
+        {
+            ptr = m_read_buf;
+            len = READ_BUF_SIZE;
+        }
+
+        int status = m_process->stdoutReadAsync(ptr, (unsigned int)len, &m_read_op.ov);
+
+        if (status == 1)
+        {
+            return false;
+        }
+
+        if (status < 0)
+        {
+            fprintf(stderr, "Session %d: ReadFile failed, error = %d\n", m_id, (int)GetLastError());
+            m_is_failed.store(true);
+        }
 
-    unsigned char flags_byte = buf[4];
+        return readDone();
+    }
 
-    if (flags_byte != 1)
+    // Read path is done (stdout PIPE is closed).
+    bool readDone()
     {
-        fprintf(stderr, "Bad flag byte: flags_byte = %d ... Bitmask: 0x04 is audio, 0x01 is video (so 0x05 is audio+video), but we expect video only\n", (int)flags_byte);
-        return false;
+        if ((!m_parser->isFailed()) && ((!m_parser->isAtValidEnd()) || (m_parser->accessUnitsCount() != m_n_frames)))
+        {
+            fprintf(stderr, "Session %d: FLV stream ended after %d access units (%d frames expected)\n", m_id, m_parser->accessUnitsCount(), m_n_frames);
+            m_is_failed.store(true);
+        }
+
+        return pathDone();
     }
-    
-    // Read first packet(and ignore it).
-    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process, buf);
 
-    if (flv_payload_size < 0)
+    // Completion of write operation (<n_bytes> were written).
+    bool onWriteComplete(const DWORD error, const DWORD n_bytes)
     {
-        fprintf(stderr, "Error: ReadFlvPacketHeader (in ReadFlvFileHeaderAndFirstPayload) returned negative value (marking an error)\n");
-        return false;
+        if (error != ERROR_SUCCESS)
+        {
+            fprintf(stderr, "Session %d: write to stdin PIPE failed, error = %d\n", m_id, (int)error);
+            m_is_failed.store(true);
+            return writeDone();
+        }
+
+        m_n_written += (int)n_bytes;
+
+        if (m_n_written < m_raw_frame_size)
+        {
+            return postWrite();     // Partial write - write the rest of the frame.
+        }
+
+        m_n_sent++;
+        m_n_written = 0;
+
+        if (m_n_sent == m_n_frames)
+        {
+            return writeDone();
+        }
+
+        // The frame buffer is free (the write is complete) - make the next frame.
+        MakeRawFrameAsBytes(m_width, m_height, m_n_sent, m_raw_frame);
+
+        return postWrite();
     }
 
-    // Read "frame_type and _codec_id" byte and "AVC packet type" and payload data.
-    success = ffmpeg_process->stdoutRead(flv_payload_size, buf);
+    // Completion of read operation (<n_bytes> were read).
+    bool onReadComplete(const DWORD error, const DWORD n_bytes)
+    {
+        if (error != ERROR_SUCCESS)
+        {
+            if ((error != ERROR_BROKEN_PIPE) && (error != ERROR_HANDLE_EOF))
+            {
+                fprintf(stderr, "Session %d: read from stdout PIPE failed, error = %d\n", m_id, (int)error);
+                m_is_failed.store(true);
+            }
+
+            return readDone();
+        }
+
+        // In case of a parsing error, keep reading (and ignoring) stdout PIPE until FFmpeg ends (the parser ignores the bytes in "failed" state).
+        // If we stop reading, FFmpeg may be blocked on a full stdout PIPE, and never read the rest of stdin.
+        bool success = m_is_direct_read ? m_parser->commitDirectWrite((int)n_bytes) : m_parser->feed(m_read_buf, (int)n_bytes);
+
+        if ((!success) && (!m_is_failed.exchange(true)))
+        {
+            fprintf(stderr, "Session %d: FLV parsing failed\n", m_id);
+        }
+
+        return postRead();
+    }
 
-    if (!success)
+public:
+    // Create encoding session - execute FFmpeg with <ffmpeg_cmd> (overlapped PIPEs of <pipe_buf_size> bytes).
+    // The session encodes <n_frames> synthetic frames of <width>x<height>, and writes the Annex B stream to <out_file_name>.
+    // Return pointer to CIocpEncoderSession object in case of success, and nullptr in case of failure.
+    static CIocpEncoderSession *Create(const int id, const std::wstring ffmpeg_cmd, const int width, const int height, const int n_frames,
+                                       const std::string out_file_name, const int pipe_buf_size)
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvFileHeaderAndFirstPayload\n");
-        return false;
+        CIocpEncoderSession *session = new CIocpEncoderSession();
+
+        session->m_id = id;
+        session->m_width = width;
+        session->m_height = height;
+        session->m_n_frames = n_frames;
+        session->m_raw_frame_size = width * height * 3;
+        session->m_raw_frame = new unsigned char[session->m_raw_frame_size];
+        session->m_read_buf = new unsigned char[READ_BUF_SIZE];
+        session->m_write_op.session = session;
+        session->m_write_op.type = IOCP_WRITE_STDIN;
+        session->m_read_op.session = session;
+        session->m_read_op.type = IOCP_READ_STDOUT;
+
+        session->m_process = CSubprocess::Popen(ffmpeg_cmd, true, true, pipe_buf_size);
+
+        if (session->m_process == nullptr)
+        {
+            fprintf(stderr, "Session %d: failed to execute FFmpeg\n", id);
+            DeleteObj(session);
+            return nullptr;
+        }
+
+        // Encoded frame is never larger than the raw frame (the raw frame size is the largest buffer).
+        session->m_pool = CBufferPool::Create(session->m_raw_frame_size, 8 * 1048576);
+
+        if (session->m_pool != nullptr)
+        {
+            session->m_parser = new CFlvParser<>(session->m_pool, session);
+        }
+
+        fopen_s(&session->m_out_f, out_file_name.c_str(), "wb");
+
+        if ((session->m_pool == nullptr) || (session->m_out_f == nullptr))
+        {
+            fprintf(stderr, "Session %d: failed to create buffer pool or output file %s\n", id, out_file_name.c_str());
+            DeleteObj(session);
+            return nullptr;
+        }
+
+        return session;
     }
-    
-    int codec_id = (int)buf[0] & 0xF;
-    //int frame_type = (int)buf[0] >> 4;  // 1 - keyframe, 2 - inter frame
 
-    if (codec_id != 7)
+    // Wait for FFmpeg to end, close the output file and delete the session.
+    static bool DeleteObj(CIocpEncoderSession *session)
     {
-        fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", (int)codec_id);
-        return false;
+        bool success = true;
+
+        if (session->m_process != nullptr)
+        {
+            success = CSubprocess::ClosePipeAndDeleteObj(session->m_process);
+        }
+
+        // Delete the parser before the pool (the parser may hold a pooled buffer).
+        delete session->m_parser;
+
+        if (session->m_pool != nullptr)
+        {
+            CBufferPool::DeleteObj(session->m_pool);
+        }
+
+        if (session->m_out_f != nullptr)
+        {
+            fclose(session->m_out_f);
+        }
+
+        delete[] session->m_raw_frame;
+        delete[] session->m_read_buf;
+        delete session;
+
+        return success;
     }
 
-    // Read AVC packet type for testing
-    //int avc_packet_type = (int)buf[1]  // 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
+    int id() const { return m_id; }
+    bool isFailed() const { return m_is_failed.load(); }
 
-    // Ignore the data of the first payload (the first payload is just "meta data").
+    // Associate the PIPEs with completion port <hPort>, and start the first write and the first read.
+    // Must be executed before the worker threads start (the completions are queued to the port until then).
+    // Return true if the session is done already (failed to start).
+    bool start(HANDLE hPort)
+    {
+        if (!m_process->associateWithCompletionPort(hPort, 0))
+        {
+            fprintf(stderr, "Session %d: CreateIoCompletionPort failed, error = %d\n", m_id, (int)GetLastError());
+            m_is_failed.store(true);
+            m_process->stdinClose();
+            m_n_open_paths.store(0);
+            return true;
+        }
 
-    return true;
-}
+        MakeRawFrameAsBytes(m_width, m_height, 0, m_raw_frame);
 
+        bool is_done = (m_n_frames == 0) ? writeDone() : postWrite();
 
-// Read the 5 bytes of FLV packet header, and return codec_id
-// https://www.adobe.com/content/dam/acom/en/devnet/flv/video_file_format_spec_v10.pdf
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// <annexb_payload_buf> - Pointer to output buffer (Annex B payload) - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return Codec ID if success.
-static int ReadPacket5BytesHeader(CSubprocess *ffmpeg_process, unsigned char *buf)
-{
-    // Read "frame_type and _codec_id" byte and avc_packet_type and composition_time.
-    // According to video_file_format_spec_v10.pdf, if codec_id = 7, next comes AVCVIDEOPACKET
-    bool success = ffmpeg_process->stdoutRead(5, buf);
+        return postRead() || is_done;
+    }
 
-    if (!success)
+    // Handle completion of operation <op> (<error> is ERROR_SUCCESS if the operation completed successfully).
+    // Return true if the session is done (the last operation of the session completed).
+    static bool HandleCompletion(CIocpOperation *op, const DWORD error, const DWORD n_bytes)
     {
-        fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadPacket5BytesHeader\n");
-        return -1;
+        if (op->type == IOCP_WRITE_STDIN)
+        {
+            return op->session->onWriteComplete(error, n_bytes);
+        }
+
+        return op->session->onReadComplete(error, n_bytes);
     }
+};
 
-    int codec_id = (int)buf[0] & 0xF;
-    //int frame_type = (int)buf[0] >> 4;  // 1 - keyframe, 2 - inter frame
 
-    if (codec_id != 7)
+// Multi-stream encoder farm: many encoding sessions, served by one I/O completion port and a small pool of worker threads.
+// Any worker thread handles any completion (of any session), so the number of threads scales with the number of cores, and not with the number of streams.
+// This is the Windows counterpart of CEncoderFarm (epoll event loops) in main_linux.cpp.
+class CIocpEncoderFarm
+{
+private:
+    std::vector<CIocpEncoderSession*> m_sessions;
+    int m_n_threads         = 1;
+    HANDLE m_hPort          = nullptr;
+    std::atomic<int> m_n_active_sessions;
+
+    CIocpEncoderFarm() : m_n_active_sessions(0)
     {
-        fprintf(stderr, "Bad codec ID: Codec ID is not AVC. codec_id = %d, instead of 7\n", (int)codec_id);
-        return -1;
     }
-    
-    unsigned char avc_packet_type = buf[1]; // 0 - AVC sequence header, 1 - AVC NALU, 2 - AVC end of sequence
 
-    if (avc_packet_type != 1)
+    // Worker thread: dequeue completions until the farm posts a "quit" packet (completion packet with NULL OVERLAPPED pointer).
+    static void WorkerThread(CIocpEncoderFarm *farm, std::atomic<bool> *is_failed)
     {
-        fprintf(stderr, "Bad packet type: avc_packet_type = %d instead of 1\n", (int)codec_id);
-        return -1;
-    }
+        while (true)
+        {
+            DWORD n_bytes = 0;
+            ULONG_PTR completion_key = 0;
+            OVERLAPPED *ov = nullptr;
 
-    return codec_id;
-}
+            // https://docs.microsoft.com/en-us/windows/win32/api/ioapiset/nf-ioapiset-getqueuedcompletionstatus
+            BOOL success = GetQueuedCompletionStatus(farm->m_hPort, &n_bytes, &completion_key, &ov, INFINITE);
+
+            if (ov == nullptr)
+            {
+                if (!success)
+                {
+                    fprintf(stderr, "Error: GetQueuedCompletionStatus failed, error = %d\n", (int)GetLastError());
+                    is_failed->store(true);
+                }
 
+                break;  // "Quit" packet (or the port is closed).
+            }
 
-// Read FLV payload, and convert it to AVC Annex B format.
-// Return Annex B data as bytes array(return None if end of file).
-// The FLV payload may contain several AVC NAL units(in AVCC format).
-// https://yumichan.net/video-processing/video-compression/introduction-to-h264-nal-unit/ """
-// <buf> - Pointer to sketch buffer - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// <annexb_payload_buf> - Pointer to output buffer (Annex B payload) - must be large enough (width*height*3 assumed to be large enough), but there is no size checking.
-// Return -1 in case of an error.
-// Return Annex B payload size if success.
-static int ReadFlvPayloadAndConvertToAnnexB(CSubprocess *ffmpeg_process, unsigned char *buf, unsigned char *annexb_payload_buf)
-{
-    int annexb_payload_idx = 0; // Index in annexb_payload_buf
+            // A failed operation is dequeued with success = FALSE (and non NULL OVERLAPPED) - GetLastError() returns the error of the operation.
+            const DWORD error = success ? ERROR_SUCCESS : GetLastError();
 
-    // Read first packet(and ignore it).
-    int flv_payload_size = ReadFlvPacketHeader(ffmpeg_process, buf);  
+            if (CIocpEncoderSession::HandleCompletion((CIocpOperation*)ov, error, n_bytes))
+            {
+                farm->sessionDone();
+            }
+        }
+    }
 
-    if (flv_payload_size < 0)
+    // Wake all the worker threads when the last session is done.
+    void sessionDone()
     {
-        fprintf(stderr, "Error: ReadFlvPacketHeader returned negative value (marking an error)\n");
-        return -1;
+        if (m_n_active_sessions.fetch_sub(1) == 1)
+        {
+            for (int k = 0; k < m_n_threads; k++)
+            {
+                PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+            }
+        }
     }
 
-    int codec_id = ReadPacket5BytesHeader(ffmpeg_process, buf);
+public:
+    // Create encoder farm with <n_threads> worker threads (n_threads = 0 uses one thread per CPU core).
+    static CIocpEncoderFarm *Create(int n_threads)
+    {
+        CIocpEncoderFarm *farm = new CIocpEncoderFarm();
+
+        if (n_threads <= 0)
+        {
+            n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        }
+
+        farm->m_n_threads = n_threads;
 
-    if (codec_id < 0)
+        return farm;
+    }
+
+    // Delete all the sessions (wait for the FFmpeg child processes to end), and delete the farm.
+    static bool DeleteObj(CIocpEncoderFarm *farm)
     {
-        fprintf(stderr, "Error: ReadPacket5BytesHeader failed\n");
+        bool success = true;
+
+        for (size_t k = 0; k < farm->m_sessions.size(); k++)
+        {
+            success = CIocpEncoderSession::DeleteObj(farm->m_sessions[k]) && success;
+        }
+
+        if (farm->m_hPort != nullptr)
+        {
+            CloseHandle(farm->m_hPort);
+        }
+
+        delete farm;
 
-        return -1;
+        return success;
     }
 
-    flv_payload_size -= 5;  // After reading the "5 Bytes Header", remaining size is 5 bytes less
+    // Add session to the farm (the farm is the owner of the session).
+    void addSession(CIocpEncoderSession *session)
+    {
+        m_sessions.push_back(session);
+    }
 
-    // Keep reading AVC NAL units, until flv_payload_size is zero (flv_payload_size holds the remaining size).
-    while (flv_payload_size > 0)
+    // Run all the sessions until done.
+    // Return true if all the sessions completed successfully.
+    bool run()
     {
-        bool success = ffmpeg_process->stdoutRead(4, buf);  // Read NAL unit size(uin32, big endian).
+        const int n_threads = std::min(m_n_threads, std::max(1, (int)m_sessions.size()));
+
+        // The concurrency value of the port is the number of worker threads.
+        m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, (DWORD)n_threads);
 
-        if (!success)
+        if (m_hPort == nullptr)
         {
-            fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPayloadAndConvertToAnnexB\n");
-            return -1;
+            fprintf(stderr, "Error: CreateIoCompletionPort failed, error = %d\n", (int)GetLastError());
+            return false;
         }
 
-        flv_payload_size -= 4;  // Remaining size is 4 bytes less
+        // Start all the sessions before the worker threads (the session count is final before the first completion is handled).
+        int n_active = 0;
+
+        for (size_t k = 0; k < m_sessions.size(); k++)
+        {
+            n_active += m_sessions[k]->start(m_hPort) ? 0 : 1;
+        }
 
+        m_n_active_sessions.store(n_active);
 
-        // Convert uint32 big - endian to integer value
-        int nal_size = ((int)buf[0] << 24) + ((int)buf[1] << 16) + ((int)buf[2] << 8) + (int)buf[3];
+        std::atomic<bool> is_failed(false);
+        int save_n_threads = m_n_threads;
+        m_n_threads = n_threads;
 
-        success = ffmpeg_process->stdoutRead(nal_size, buf);    // Read NAL unit data
+        std::vector<std::thread> threads;
 
-        if (!success)
+        for (int k = 0; (k < n_threads) && (n_active > 0); k++)
         {
-            fprintf(stderr, "Unsuccessful ffmpeg_process read from PIPE in ReadFlvPayloadAndConvertToAnnexB\n");
-            return -1;
+            threads.push_back(std::thread(WorkerThread, this, &is_failed));
         }
 
-        flv_payload_size -= nal_size;  // Remaining size is nal_size bytes less
-
-        // The number of leading zeros(2 or 3) has minor differences between encoders(the implementation tries to match the selected encoder).
-        // if do_use_intel_quick_sync if ((nal_data[0] & 0xF) == 5) or (nal_data[0] & 0xF == 1)... See Python code sample...       
-        if (((buf[0] & 0xF) == 5) || ((buf[0] & 0xF) == 6))
+        for (size_t k = 0; k < threads.size(); k++)
         {
-            // Coded slice of an IDR picture(for some reason begins with only 2 zeros when encoding with libx264)
-            // SEI NAL unit(nal_data[0] == 6) is also begin with only 2 zeros.
-            // annexb_payload_head = b'\x00\x00\x01'  # Concatenate[0, 0, 1] to end of annexb_payload, and then NAL data
-            annexb_payload_buf[annexb_payload_idx]      = 0;
-            annexb_payload_buf[annexb_payload_idx+1]    = 0;
-            annexb_payload_buf[annexb_payload_idx+2]    = 1;
-            annexb_payload_idx += 3;    // Advance index by 3 (3 bytes were inserted).
+            threads[k].join();
         }
-        else
+
+        m_n_threads = save_n_threads;
+
+        bool success = !is_failed.load();
+
+        for (size_t k = 0; k < m_sessions.size(); k++)
         {
-            // Other NAL units begins with 0 0 0 0 1 (for matching FFmpeg Annex B encoded stream)
-            // annexb_payload_head = b'\x00\x00\x00\x01'  # Concatenate[0, 0, 0, 1] to end of annexb_payload, and then NAL data
-            annexb_payload_buf[annexb_payload_idx]      = 0;
-            annexb_payload_buf[annexb_payload_idx + 1]  = 0;
-            annexb_payload_buf[annexb_payload_idx + 2]  = 0;
-            annexb_payload_buf[annexb_payload_idx + 3]  = 1;
-            annexb_payload_idx += 4;    // Advance index by 4 (4 bytes were inserted).
+            if (m_sessions[k]->isFailed())
+            {
+                fprintf(stderr, "Session %d failed\n", m_sessions[k]->id());
+                success = false;
+            }
         }
 
-        // Concatenate NAL data in Annex B format to annexb_payload
-        // Copy NAL unit data from buf to annexb_payload_buf (not most efficient solution, but probably negligible).
-        memcpy(&annexb_payload_buf[annexb_payload_idx], buf, nal_size);
-        annexb_payload_idx += nal_size; // Advance index by nal_size bytes.
+        return success;
+    }
+};
+
+
+// Encode <n_frames> synthetic frames by the reference FFmpeg process (<ffmpeg_test_cmd> writes the Annex B stream to out.264).
+static void EncodeReferenceFile(const std::wstring ffmpeg_test_cmd, const int width, const int height, const int n_frames)
+{
+    const int raw_image_size_in_bytes = width * height * 3;
+
+    // Create subprocess with stdin PIPE (used for testing).
+    CSubprocess *ffmpeg_test_process = CSubprocess::Popen(ffmpeg_test_cmd, true, false, raw_image_size_in_bytes);
+
+    if (ffmpeg_test_process == nullptr)
+    {
+        ErrorExit(TEXT("CreateProcess ffmpeg_test_process"));
+    }
+
+    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
+
+    for (int i = 0; i < n_frames; i++)
+    {
+        MakeRawFrameAsBytes(width, height, i, raw_img_bytes);
+
+        if (!ffmpeg_test_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes))
+        {
+            ErrorExit(TEXT("Unsuccessful ffmpeg_test_process write to PIPE"));
+        }
     }
 
-    // The value of annexb_payload_idx equals the number of bytes copied to annexb_payload_buf.
-    return annexb_payload_idx;
+    delete[] raw_img_bytes;
+
+    // Close the "test process" (close the FFmpeg process that writes to out.264 file and used as reference).
+    if (!CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process))
+    {
+        ErrorExit(TEXT("StdInWr CloseHandle"));
+    }
 }
 
+
 int main()
 {
     // 100 frames, resolution 1280x720, and 25 fps
@@ -606,23 +1011,9 @@ int main()
 
     const int raw_image_size_in_bytes = width * height * 3;
 
-    bool success;
-    int annexb_payload_len;
-
-    FILE *out_f = nullptr;
-
-    unsigned char *raw_img_bytes = new unsigned char[raw_image_size_in_bytes];
-    unsigned char *flv_bytes = new unsigned char[raw_image_size_in_bytes];  // Allocate much larger buffer than necessary.
-    unsigned char *annexb_payload_buf = new unsigned char[raw_image_size_in_bytes];  // Allocate much larger buffer than necessary.
-
-    if ((raw_img_bytes == nullptr) || (flv_bytes == nullptr) || (annexb_payload_buf == nullptr))
-    {
-        ErrorExit(TEXT("Memory allocation error???"));
-    }
-   
+    // The SPS and PPS are injected by the parser (taken from the AVC sequence header) - no need for "-bsf:v dump_extra".
+    // There is no need to know the latency of the encoder (the reads and the writes are asynchronous).
 #ifdef DO_TEST_ZERO_LATENCY
-    const int n_frames_latency = 0; // Latency of zero frames
-
     // FFmpeg subprocess with input PIPE (raw BGR video frames) and output PIPE (H.264 encoded stream in FLV container).
     const std::wstring ffmpeg_cmd =
         L"ffmpeg.exe -hide_banner -threads 1 -framerate " + std::to_wstring(fps) +
@@ -630,7 +1021,7 @@ int main()
         L" -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
         L"-x264-params bframes=0:force-cfr=1:no-mbtree=1:sync-lookahead=0:sliced-threads=1:rc-lookahead=0 " +
         L"-g 10 -pix_fmt yuv444p -crf 10 " +
-        L"-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -bsf:v dump_extra -an -sn -dn pipe:";
+        L"-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -an -sn -dn pipe:";
 
 
     // FFmpeg subprocess with same arguments, but without FLV container, and save output to a file (instead of stdout PIPE) for testing.
@@ -642,15 +1033,13 @@ int main()
         L"-g 10 -pix_fmt yuv444p -crf 10 -f h264 -an -sn -dn out.264";
 #else
     // Using the following setting results latency of many frames
-    const int n_frames_latency = 26;  // The exact value was found by trial and error
-    
     // FFmpeg subprocess with input PIPE (raw BGR video frames) and output PIPE (H.264 encoded stream in FLV container).
     const std::wstring ffmpeg_cmd =
         L"ffmpeg.exe -hide_banner -threads 1 -framerate " + std::to_wstring(fps) +
         L" -video_size " + std::to_wstring(width) + L"x" + std::to_wstring(height) +
         L" -pixel_format bgr24 -f rawvideo -an -sn -dn -i pipe: -threads 1 -vcodec libx264 " +
         L"-g 25 -bf 3 -pix_fmt yuv444p -crf 10 " +
-        L"-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -bsf:v dump_extra -an -sn -dn pipe:";
+        L"-f flv -flvflags no_sequence_end+no_metadata+no_duration_filesize -an -sn -dn pipe:";
 
 
     // FFmpeg subprocess with same arguments, but without FLV container, and save output to a file (instead of stdout PIPE) for testing.
@@ -661,162 +1050,42 @@ int main()
         L"-g 25  -bf 3 -pix_fmt yuv444p -crf 10 -f h264 -an -sn -dn out.264";
 #endif
 
-    // Create subprocess with stdin PIPE and stdout PIPE
-    CSubprocess *ffmpeg_process = CSubprocess::Popen(ffmpeg_cmd, true, true, raw_image_size_in_bytes);
-
-    if (ffmpeg_process == nullptr)
-    {
-        ErrorExit(TEXT("CreateProcess ffmpeg_process"));
-    }
-
-    // Create subprocess with stdin PIPE (used for testing).
-    CSubprocess *ffmpeg_test_process = CSubprocess::Popen(ffmpeg_test_cmd, true, false, raw_image_size_in_bytes);
+    // Encode the reference file (out.264).
+    EncodeReferenceFile(ffmpeg_test_cmd, width, height, n_frames);
 
-    if (ffmpeg_test_process == nullptr)
-    {
-        ErrorExit(TEXT("CreateProcess ffmpeg_test_process"));
-    }
+#ifdef DO_TEST_MULTI_STREAM_FARM
+    const int n_streams = 8;    // Each stream is written to out_avcc_<k>.264 (all the files should be the same as out.264).
+#else
+    const int n_streams = 1;    // The stream is written to out_avcc.264 (should be the same as out.264).
+#endif
 
-    bool was_broken_by_error = false;
+    // One worker thread per CPU core (but no more threads than streams).
+    CIocpEncoderFarm *farm = CIocpEncoderFarm::Create(0);
 
-    for (int i = 0; i < n_frames; i++)
+    for (int k = 0; k < n_streams; k++)
     {
-        MakeRawFrameAsBytes(width, height, i, raw_img_bytes);
-
-        success = ffmpeg_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
-
-        if (!success)
-        {
-            fprintf(stderr, "Unsuccessful ffmpeg_process write to PIPE\n");
-            was_broken_by_error = true;
-            break;
-        }
-
-        // For testing
-        success = ffmpeg_test_process->stdinWrite(raw_img_bytes, raw_image_size_in_bytes);
-
-        if (!success)
-        {
-            fprintf(stderr, "Unsuccessful ffmpeg_test_process write to PIPE\n");
-            was_broken_by_error = true;
-            break;
-        }
+        const std::string out_file_name = (n_streams == 1) ? "out_avcc.264" : "out_avcc_" + std::to_string(k) + ".264";
 
-        if (i == 0)
-        {
-            // Read FLV header that should be ignored.
-            success = ReadFlvFileHeaderAndFirstPayload(ffmpeg_process, flv_bytes);
-
-            if (!success)
-            {
-                fprintf(stderr, "ReadFlvFileHeaderAndFirstPayload failed\n");
-                was_broken_by_error = true;
-                break;
-            }
-
-            // Open output file(Annex B stream format)
-            fopen_s(&out_f, "out_avcc.264", "wb");
+        // Set PIPE buffer size to the size of one raw frame.
+        CIocpEncoderSession *session = CIocpEncoderSession::Create(k, ffmpeg_cmd, width, height, n_frames, out_file_name, raw_image_size_in_bytes);
 
-            if (out_f == nullptr)
-            {
-                fprintf(stderr, "Error: failed to open file out_avcc.264 for writing\n");
-                was_broken_by_error = true;
-                break;
-            }
-        }
-
-        // Assume <n_frames_latency> frames latency
-        // Note: the reading process is supposed to be in a separate thread (performed here for simplicity).
-        if (i >= n_frames_latency)
+        if (session == nullptr)
         {
-            // Read FLV payload data and convert the AVC NAL unit / units from AVCC format to Annex B format.
-            annexb_payload_len = ReadFlvPayloadAndConvertToAnnexB(ffmpeg_process, flv_bytes, annexb_payload_buf);
-
-            if (annexb_payload_len < 0)
-            {
-                fprintf(stderr, "ReadFlvPayloadAndConvertToAnnexB failed\n");
-                was_broken_by_error = true;
-                break;
-            }
-
-            // Write encoded frame to output file.
-            // Note: "encoded frame" may contain few NAL units, but each FLV payload applies one "encoded frame" (one "access unit").
-            fwrite(annexb_payload_buf, 1, annexb_payload_len, out_f);  // Write to file for testing.
+            CIocpEncoderFarm::DeleteObj(farm);
+            ErrorExit(TEXT("CIocpEncoderSession::Create"));
         }
-    }
 
-    // Close the "test process" (close the FFmpeg process that writes to out.264 file and used as reference).
-    //////////////////////////////////////////////////////////////////////////
-    success = ffmpeg_test_process->stdinClose();
-
-    if (!success)
-    {
-        ErrorExit(TEXT("ffmpeg_test_process->stdinClose"));
+        farm->addSession(session);
     }
 
-    success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_test_process);
+    bool success = farm->run();
 
-    if (!success)
+    if (!CIocpEncoderFarm::DeleteObj(farm))
     {
         ErrorExit(TEXT("StdInWr CloseHandle"));
     }
-    //////////////////////////////////////////////////////////////////////////
-
-
-
-    if (!was_broken_by_error)
-    {
-        // Closing stdin "pushes" all the remaining frames from the encoder to stdout (FFmpeg feature).
-        success = ffmpeg_process->stdinClose();
-
-        if (!success)
-        {
-            ErrorExit(TEXT("ffmpeg_process->stdinClose"));
-        }
-
-        //Handle the last(delayed) "encoded frames".
-        for (int i = 0; i < n_frames_latency; i++)
-        {
-            // Read FLV payload data and convert the AVC NAL unit / units from AVCC format to Annex B format.
-            annexb_payload_len = ReadFlvPayloadAndConvertToAnnexB(ffmpeg_process, flv_bytes, annexb_payload_buf);
-
-            if (annexb_payload_len < 0)
-            {
-                fprintf(stderr, "ReadFlvPayloadAndConvertToAnnexB failed\n");
-                was_broken_by_error = true;
-                break;
-            }
-
-            fwrite(annexb_payload_buf, 1, annexb_payload_len, out_f);  // Write to file for testing.
-        }
-    }
-
-    if (out_f != nullptr)
-    {
-        fclose(out_f);
-    }
 
-    if (!was_broken_by_error)
-    {
-        // Read extra trailing 4 bytes(FFmpeg puts the 4 bytes as a footer [instead of a header of the next frame]).
-        success = ffmpeg_process->stdoutRead(4, flv_bytes);
-
-        if (!success)
-        {
-            fprintf(stderr, "Failed reading extra 4 footer bytes from sdtin???\n");
-        }
-    }
-
-    delete[] raw_img_bytes;
-    delete[] flv_bytes;
-    delete[] annexb_payload_buf;
-
-    success = CSubprocess::ClosePipeAndDeleteObj(ffmpeg_process);
-
-    if (!success)
-    {
-        ErrorExit(TEXT("StdInWr CloseHandle"));
-    }
+    fprintf(stderr, "Encoder farm: %d streams %s\n", n_streams, success ? "completed" : "failed");
 
-    return 0;
+    return success ? 0 : 1;
 }